@@ -0,0 +1,380 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "errorHandler.h"
+#include "hackEmulator.h"
+#include "inputs.h"
+#include "options.h"
+#include "vmTranslator.h"
+
+#define MAX_CYCLES          (50000000)
+#define MAX_PROGRAM_NAME    (64)
+#define MAX_LEVEL_NAME      (8)
+
+/// Optimization level every program is translated at, -O0 first as the
+/// reference of the others
+typedef struct Level {
+    const char* name;
+    OptLevel level;
+} Level;
+
+/// Outcome of running a program translated at one level
+typedef struct Run {
+    HackProgram program;     // Kept for the addresses of the static variables
+    HackMachine* machine;
+} Run;
+
+/// Cycles and size of a program at a level, as recorded with --record
+typedef struct BaselineEntry {
+    char program[MAX_PROGRAM_NAME];
+    char level[MAX_LEVEL_NAME];
+    uint64_t cycles;
+    size_t romWords;
+} BaselineEntry;
+
+typedef struct Baseline {
+    BaselineEntry* entries;
+    size_t count;
+} Baseline;
+
+static const Level levels[] = {
+    { "-O0", OPT_LEVEL_0 },
+    { "-O1", OPT_LEVEL_1 },
+    { "-O2", OPT_LEVEL_2 },
+    { "-Os", OPT_LEVEL_SIZE }
+};
+#define NUM_LEVELS    (sizeof(levels) / sizeof(levels[0]))
+
+// Local function prototypes
+static bool benchProject(const Project* project, const Baseline* baseline, FILE* record);
+static bool loadSources(const Project* project, VmSource* sources);
+static void freeSources(VmSource* sources, size_t numSources);
+static bool runLevel(const char* name, const VmSource* sources, size_t numSources,
+                     const Level* level, Run* run);
+static bool checkRun(const char* name, const Level* level, const Run* run, const Run* reference,
+                     const Baseline* baseline);
+static bool compareStatics(const char* name, const Level* level, const Run* run,
+                           const Run* reference);
+static uint16_t staticValue(const Run* run, const char* variable);
+static bool baseline_load(Baseline* baseline, const char* fileName);
+static const BaselineEntry* baseline_find(const Baseline* baseline, const char* program,
+                                          const char* level);
+static const char* baseName(const char* path);
+static double percentChange(double value, double reference);
+static void printUsage(const char* progName);
+
+// ---------------------------- PUBLIC FUNCTIONS --------------------------- //
+int main(int argc, char* argv[])
+{
+    const char* programsDir = NULL;
+    const char* baselineFile = NULL;
+    const char* recordFile = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            baselineFile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            recordFile = argv[++i];
+        }
+        else if (argv[i][0] != '-' && programsDir == NULL) {
+            programsDir = argv[i];
+        }
+        else {
+            printUsage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (programsDir == NULL) {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    Baseline baseline = { 0 };
+    if (baselineFile != NULL && !baseline_load(&baseline, baselineFile)) {
+        return EXIT_FAILURE;
+    }
+    FILE* record = NULL;
+    if (recordFile != NULL) {
+        record = fopen(recordFile, "w");
+        if (record == NULL) {
+            fprintf(stderr, "Unable to write %s\n", recordFile);
+            free(baseline.entries);
+            return EXIT_FAILURE;
+        }
+        fprintf(record, "# Cycles and ROM words of every program and level, checked by the\n"
+                        "# cycles target. Written by vm-translator-cycles --record\n");
+        fprintf(record, "# program level cycles rom-words\n");
+    }
+
+    // Every directory below the given one holding .vm files is a program
+    Inputs inputs;
+    inputs_new(&inputs);
+    bool ok = (inputs_add(&inputs, programsDir, true) == OK);
+    if (ok) {
+        printf("%-20s %-5s %12s %8s %10s %8s\n", "Program", "Level", "Cycles", "", "ROM words", "");
+    }
+    for (size_t p = 0; p < inputs.numProjects && ok; p++) {
+        // Every program is run, so that one report shows all failures
+        ok = benchProject(&inputs.projects[p], &baseline, record) && ok;
+    }
+
+    inputs_close(&inputs);
+    free(baseline.entries);
+    if (record != NULL) {
+        fclose(record);
+    }
+    if (!ok) {
+        fprintf(stderr, "Cycle benchmark failed\n");
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// -------------------------- PRIVATE FUNCTIONS ----------------------------- //
+/// @brief Translates a program at every level, runs it and prints the cycles
+/// and ROM words of each level
+/// @return false when a level changes the final RAM of -O0, takes more
+/// cycles than -O0 or than recorded in the baseline, or the program fails
+/// to translate or halt
+static bool benchProject(const Project* project, const Baseline* baseline, FILE* record)
+{
+    const char* name = baseName(project->path);
+    VmSource* sources = calloc(project->numFiles + 1, sizeof(VmSource));
+    if (sources == NULL || !loadSources(project, sources)) {
+        free(sources);
+        return false;
+    }
+
+    Run runs[NUM_LEVELS] = { 0 };
+    bool ok = true;
+    for (size_t l = 0; l < NUM_LEVELS && ok; l++) {
+        ok = runLevel(name, sources, project->numFiles, &levels[l], &runs[l]);
+        if (!ok) break;
+
+        uint64_t cycles = runs[l].machine->cycles;
+        size_t romWords = runs[l].program.numWords;
+        if (l == 0) {
+            printf("%-20s %-5s %12" PRIu64 " %8s %10zu %8s\n", name, levels[l].name, cycles, "",
+                   romWords, "");
+        }
+        else {
+            printf("%-20s %-5s %12" PRIu64 " %+7.1f%% %10zu %+7.1f%%\n", name, levels[l].name,
+                   cycles, percentChange((double)cycles, (double)runs[0].machine->cycles),
+                   romWords, percentChange((double)romWords, (double)runs[0].program.numWords));
+        }
+        if (record != NULL) {
+            fprintf(record, "%s %s %" PRIu64 " %zu\n", name, levels[l].name, cycles, romWords);
+        }
+        ok = checkRun(name, &levels[l], &runs[l], &runs[0], baseline);
+    }
+
+    for (size_t l = 0; l < NUM_LEVELS; l++) {
+        hackProgram_close(&runs[l].program);
+        free(runs[l].machine);
+    }
+    freeSources(sources, project->numFiles);
+    return ok;
+}
+
+/// @brief Reads the .vm files of a project, named after their file name like
+/// when the directory is translated
+static bool loadSources(const Project* project, VmSource* sources)
+{
+    for (size_t i = 0; i < project->numFiles; i++) {
+        const char* fileName = project->files[i];
+        FILE* file = fopen(fileName, "rb");
+        char* text = NULL;
+        long length = -1;
+        if (file != NULL && fseek(file, 0, SEEK_END) == 0 && (length = ftell(file)) >= 0 &&
+            fseek(file, 0, SEEK_SET) == 0) {
+            text = malloc((size_t)length + 1);
+        }
+        if (text == NULL || fread(text, 1, (size_t)length, file) != (size_t)length) {
+            fprintf(stderr, "Unable to read %s\n", fileName);
+            free(text);
+            if (file != NULL) fclose(file);
+            freeSources(sources, i);
+            return false;
+        }
+        fclose(file);
+        sources[i] = (VmSource) { baseName(fileName), text, (size_t)length };
+    }
+    return true;
+}
+
+static void freeSources(VmSource* sources, size_t numSources)
+{
+    for (size_t i = 0; i < numSources; i++) {
+        free((char*)sources[i].text);
+    }
+    free(sources);
+}
+
+/// @brief Translates the program at a level in memory, assembles and runs it
+static bool runLevel(const char* name, const VmSource* sources, size_t numSources,
+                     const Level* level, Run* run)
+{
+    Options opts;
+    options_setDefaults(&opts);
+    options_setLevel(&opts, level->level);
+
+    char* code = NULL;
+    size_t size = 0;
+    if (vmTranslator_translate(sources, numSources, &opts, &code, &size) != OK) {
+        fprintf(stderr, "FAIL %s %s: translation failed\n", name, level->name);
+        return false;
+    }
+    bool ok = hackProgram_assemble(&run->program, code, size);
+    free(code);
+    if (!ok) {
+        fprintf(stderr, "FAIL %s %s: the code doesn't assemble\n", name, level->name);
+        return false;
+    }
+
+    run->machine = malloc(sizeof(HackMachine));
+    if (run->machine == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return false;
+    }
+    hackMachine_run(run->machine, &run->program, MAX_CYCLES);
+    if (!run->machine->halted) {
+        fprintf(stderr, "FAIL %s %s: no halt within %d cycles\n", name, level->name, MAX_CYCLES);
+        return false;
+    }
+    return true;
+}
+
+/// @brief Compares the final RAM of a level with -O0: the static variables,
+/// found by name as the levels place them differently, and the heap and
+/// screen. The stack and temp are left out, as the levels use them
+/// differently. Then checks the cycles against -O0 and the baseline
+static bool checkRun(const char* name, const Level* level, const Run* run, const Run* reference,
+                     const Baseline* baseline)
+{
+    bool ok = compareStatics(name, level, run, reference);
+    for (size_t address = HACK_HEAP_BASE; address < HACK_SCREEN_END; address++) {
+        if (run->machine->ram[address] != reference->machine->ram[address]) {
+            fprintf(stderr, "FAIL %s %s: RAM[%zu] is %u, %u with -O0\n", name, level->name,
+                    address, run->machine->ram[address], reference->machine->ram[address]);
+            ok = false;
+            break;
+        }
+    }
+
+    if (run->machine->cycles > reference->machine->cycles) {
+        fprintf(stderr, "FAIL %s %s: %" PRIu64 " cycles, %" PRIu64 " with -O0\n", name,
+                level->name, run->machine->cycles, reference->machine->cycles);
+        ok = false;
+    }
+    const BaselineEntry* entry = baseline_find(baseline, name, level->name);
+    if (entry != NULL && run->machine->cycles > entry->cycles) {
+        fprintf(stderr, "FAIL %s %s: %" PRIu64 " cycles, %" PRIu64 " in the baseline\n", name,
+                level->name, run->machine->cycles, entry->cycles);
+        ok = false;
+    }
+    return ok;
+}
+
+/// @brief Compares the static variables, named like File.n, of both runs. A
+/// variable missing from a run is never written by it, so it holds 0
+static bool compareStatics(const char* name, const Level* level, const Run* run,
+                           const Run* reference)
+{
+    const Run* pair[] = { reference, run };
+    for (size_t r = 0; r < 2; r++) {
+        const HackProgram* program = &pair[r]->program;
+        for (size_t i = 0; i < program->numVariables; i++) {
+            const char* variable = program->variables[i].name;
+            if (strchr(variable, '.') == NULL) {
+                continue;
+            }
+            uint16_t value = staticValue(run, variable);
+            uint16_t expected = staticValue(reference, variable);
+            if (value != expected) {
+                fprintf(stderr, "FAIL %s %s: %s is %u, %u with -O0\n", name, level->name,
+                        variable, value, expected);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static uint16_t staticValue(const Run* run, const char* variable)
+{
+    long address = hackProgram_findVariable(&run->program, variable);
+    return (address >= 0) ? run->machine->ram[address] : 0;
+}
+
+/// @brief Reads a file written with --record
+static bool baseline_load(Baseline* baseline, const char* fileName)
+{
+    FILE* file = fopen(fileName, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Unable to read %s\n", fileName);
+        return false;
+    }
+
+    bool ok = true;
+    size_t capacity = 0;
+    char line[256];
+    while (ok && fgets(line, sizeof(line), file) != NULL) {
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+        if (baseline->count == capacity) {
+            capacity = (capacity == 0) ? 32 : capacity * 2;
+            BaselineEntry* entries = realloc(baseline->entries, capacity * sizeof(BaselineEntry));
+            if (entries == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                ok = false;
+                break;
+            }
+            baseline->entries = entries;
+        }
+        BaselineEntry* entry = &baseline->entries[baseline->count];
+        if (sscanf(line, "%63s %7s %" SCNu64 " %zu", entry->program, entry->level, &entry->cycles,
+                   &entry->romWords) != 4) {
+            fprintf(stderr, "Invalid line in %s: %s", fileName, line);
+            ok = false;
+        }
+        baseline->count++;
+    }
+    fclose(file);
+    return ok;
+}
+
+static const BaselineEntry* baseline_find(const Baseline* baseline, const char* program,
+                                          const char* level)
+{
+    for (size_t i = 0; i < baseline->count; i++) {
+        if (strcmp(baseline->entries[i].program, program) == 0 &&
+            strcmp(baseline->entries[i].level, level) == 0) {
+            return &baseline->entries[i];
+        }
+    }
+    return NULL;
+}
+
+static const char* baseName(const char* path)
+{
+    const char* slash = strrchr(path, '/');
+    return (slash != NULL) ? slash + 1 : path;
+}
+
+static double percentChange(double value, double reference)
+{
+    return (reference > 0) ? 100.0 * (value - reference) / reference : 0.0;
+}
+
+static void printUsage(const char* progName)
+{
+    printf("Use %s [--baseline <file>] [--record <file>] <programs dir>\n", progName);
+    printf("Translates every directory of .vm files below the given one at -O0, -O1, -O2\n");
+    printf("and -Os, runs it on a Hack emulator and prints the cycles and ROM words.\n");
+    printf("Fails when a level changes the static variables or the heap left by -O0, or\n");
+    printf("takes more cycles than -O0\n");
+    printf("  --baseline <file>   Also fail when a level takes more cycles than recorded\n");
+    printf("  --record <file>     Write the cycles and ROM words of every level\n");
+}
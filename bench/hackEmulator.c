@@ -0,0 +1,382 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hackEmulator.h"
+#include "program.h"
+
+#define FIRST_VARIABLE_ADDRESS  (16)
+#define ADDRESS_MASK            (0x7FFF)
+
+// Fields of a C instruction: 111a cccc ccdd djjj
+#define C_INSTRUCTION           (0xE000)
+#define COMP_SHIFT              (6)
+#define DEST_A                  (1u << 5)
+#define DEST_D                  (1u << 4)
+#define DEST_M                  (1u << 3)
+#define DEST_BITS               (DEST_A | DEST_D | DEST_M)
+#define JUMP_BITS               (0x7)
+
+/// Name of a label or variable and the address it stands for
+typedef struct Symbol {
+    const char* name;
+    uint16_t value;
+} Symbol;
+
+/// Open addressing table of the symbols, sized for the lines of the program
+typedef struct SymbolTable {
+    Symbol* buckets;         // name is NULL in empty buckets
+    size_t mask;
+} SymbolTable;
+
+typedef struct Mnemonic {
+    const char* text;
+    uint16_t bits;
+} Mnemonic;
+
+// The a bit and the c bits of every computation
+static const Mnemonic comps[] = {
+    { "0", 0x2A },   { "1", 0x3F },   { "-1", 0x3A },  { "D", 0x0C },
+    { "A", 0x30 },   { "!D", 0x0D },  { "!A", 0x31 },  { "-D", 0x0F },
+    { "-A", 0x33 },  { "D+1", 0x1F }, { "A+1", 0x37 }, { "D-1", 0x0E },
+    { "A-1", 0x32 }, { "D+A", 0x02 }, { "A+D", 0x02 }, { "D-A", 0x13 },
+    { "A-D", 0x07 }, { "D&A", 0x00 }, { "A&D", 0x00 }, { "D|A", 0x15 },
+    { "A|D", 0x15 },
+    { "M", 0x70 },   { "!M", 0x71 },  { "-M", 0x73 },  { "M+1", 0x77 },
+    { "M-1", 0x72 }, { "D+M", 0x42 }, { "M+D", 0x42 }, { "D-M", 0x53 },
+    { "M-D", 0x47 }, { "D&M", 0x40 }, { "M&D", 0x40 }, { "D|M", 0x55 },
+    { "M|D", 0x55 }
+};
+
+static const Mnemonic jumps[] = {
+    { "JGT", 1 }, { "JEQ", 2 }, { "JGE", 3 }, { "JLT", 4 },
+    { "JNE", 5 }, { "JLE", 6 }, { "JMP", 7 }
+};
+
+static const Symbol predefined[] = {
+    { "SP", 0 }, { "LCL", 1 }, { "ARG", 2 }, { "THIS", 3 }, { "THAT", 4 },
+    { "R0", 0 }, { "R1", 1 }, { "R2", 2 }, { "R3", 3 }, { "R4", 4 }, { "R5", 5 },
+    { "R6", 6 }, { "R7", 7 }, { "R8", 8 }, { "R9", 9 }, { "R10", 10 }, { "R11", 11 },
+    { "R12", 12 }, { "R13", 13 }, { "R14", 14 }, { "R15", 15 },
+    { "SCREEN", 16384 }, { "KBD", 24576 }
+};
+
+// Local function prototypes
+static char** splitLines(const char* code, size_t length, size_t* numLines);
+static bool assembleLine(HackProgram* program, SymbolTable* symbols, const char* line,
+                         uint16_t* nextVariable);
+static bool encodeCInstruction(const char* line, uint16_t* word);
+static bool findMnemonic(const Mnemonic* table, size_t size, const char* text, size_t length,
+                         uint16_t* bits);
+static bool addVariable(HackProgram* program, const char* name, uint16_t address);
+static bool symbolTable_new(SymbolTable* symbols, size_t capacity);
+static Symbol* symbolTable_find(SymbolTable* symbols, const char* name);
+static void symbolTable_close(SymbolTable* symbols);
+static uint16_t compute(uint16_t comp, uint16_t x, uint16_t y);
+static bool isJumpTaken(uint16_t jump, uint16_t value);
+
+// ---------------------------- PUBLIC FUNCTIONS --------------------------- //
+bool hackProgram_assemble(HackProgram* program, const char* code, size_t length)
+{
+    memset(program, 0, sizeof(HackProgram));
+    size_t numLines = 0;
+    char** lines = splitLines(code, length, &numLines);
+    SymbolTable symbols;
+    if (lines == NULL || !symbolTable_new(&symbols, numLines + sizeof(predefined) / sizeof(Symbol))) {
+        free(lines);
+        fprintf(stderr, "Out of memory\n");
+        return false;
+    }
+    for (size_t i = 0; i < sizeof(predefined) / sizeof(Symbol); i++) {
+        *symbolTable_find(&symbols, predefined[i].name) = predefined[i];
+    }
+
+    // Labels stand for the address of the next instruction
+    bool ok = true;
+    size_t address = 0;
+    for (size_t i = 0; i < numLines && ok; i++) {
+        size_t len = strlen(lines[i]);
+        if (lines[i][0] != '(') {
+            address++;
+            continue;
+        }
+        if (len < 3 || lines[i][len - 1] != ')') {
+            fprintf(stderr, "Invalid label: %s\n", lines[i]);
+            ok = false;
+            continue;
+        }
+        lines[i][len - 1] = '\0';
+        Symbol* label = symbolTable_find(&symbols, lines[i] + 1);
+        if (label->name != NULL) {
+            fprintf(stderr, "Repeated label: %s\n", lines[i] + 1);
+            ok = false;
+        }
+        *label = (Symbol) { lines[i] + 1, (uint16_t)address };
+    }
+
+    program->rom = malloc((address + 1) * sizeof(uint16_t));
+    if (ok && program->rom == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        ok = false;
+    }
+    uint16_t nextVariable = FIRST_VARIABLE_ADDRESS;
+    for (size_t i = 0; i < numLines && ok; i++) {
+        if (lines[i][0] != '(') {
+            ok = assembleLine(program, &symbols, lines[i], &nextVariable);
+        }
+    }
+
+    symbolTable_close(&symbols);
+    for (size_t i = 0; i < numLines; i++) {
+        free(lines[i]);
+    }
+    free(lines);
+    if (!ok) {
+        hackProgram_close(program);
+    }
+    return ok;
+}
+
+void hackProgram_close(HackProgram* program)
+{
+    for (size_t i = 0; i < program->numVariables; i++) {
+        free(program->variables[i].name);
+    }
+    free(program->variables);
+    free(program->rom);
+    memset(program, 0, sizeof(HackProgram));
+}
+
+long hackProgram_findVariable(const HackProgram* program, const char* name)
+{
+    for (size_t i = 0; i < program->numVariables; i++) {
+        if (strcmp(program->variables[i].name, name) == 0) {
+            return program->variables[i].address;
+        }
+    }
+    return -1;
+}
+
+void hackMachine_run(HackMachine* machine, const HackProgram* program, uint64_t maxCycles)
+{
+    memset(machine, 0, sizeof(HackMachine));
+    uint16_t* ram = machine->ram;
+    uint16_t a = 0;
+    uint16_t d = 0;
+    size_t pc = 0;
+    uint64_t cycles = 0;
+
+    while (cycles < maxCycles && pc < program->numWords) {
+        uint16_t word = program->rom[pc];
+        cycles++;
+        if ((word & 0x8000) == 0) {
+            a = word;
+            pc++;
+            continue;
+        }
+
+        uint16_t comp = (word >> COMP_SHIFT) & 0x7F;
+        uint16_t address = a & ADDRESS_MASK;
+        uint16_t result = compute(comp, d, (comp & 0x40) ? ram[address] : a);
+        uint16_t target = a;
+        if (word & DEST_M) ram[address] = result;
+        if (word & DEST_A) a = result;
+        if (word & DEST_D) d = result;
+
+        if (!isJumpTaken(word & JUMP_BITS, result)) {
+            pc++;
+            continue;
+        }
+        // Nothing changes while the loop runs, so it would never end
+        bool loopsOnItself = (target == pc) ||
+                             ((size_t)target + 1 == pc && (program->rom[target] & 0x8000) == 0);
+        if ((word & DEST_BITS) == 0 && loopsOnItself) {
+            machine->halted = true;
+            break;
+        }
+        pc = target;
+    }
+
+    machine->a = a;
+    machine->d = d;
+    machine->pc = pc;
+    machine->cycles = cycles;
+}
+
+// -------------------------- PRIVATE FUNCTIONS ----------------------------- //
+/// @return The lines holding an instruction or a label, without comments and
+/// white space, each allocated with malloc(). NULL when out of memory
+static char** splitLines(const char* code, size_t length, size_t* numLines)
+{
+    size_t capacity = 1;
+    for (size_t i = 0; i < length; i++) {
+        if (code[i] == '\n') capacity++;
+    }
+    char** lines = malloc(capacity * sizeof(char*));
+    if (lines == NULL) return NULL;
+
+    *numLines = 0;
+    size_t start = 0;
+    while (start < length) {
+        size_t end = start;
+        while (end < length && code[end] != '\n') end++;
+
+        char* line = malloc(end - start + 1);
+        if (line == NULL) {
+            for (size_t i = 0; i < *numLines; i++) free(lines[i]);
+            free(lines);
+            return NULL;
+        }
+        size_t len = 0;
+        for (size_t i = start; i < end; i++) {
+            if (code[i] == '/' && i + 1 < end && code[i + 1] == '/') break;
+            if (!isspace((unsigned char)code[i])) line[len++] = code[i];
+        }
+        line[len] = '\0';
+        if (len > 0) {
+            lines[(*numLines)++] = line;
+        }
+        else {
+            free(line);
+        }
+        start = end + 1;
+    }
+    return lines;
+}
+
+static bool assembleLine(HackProgram* program, SymbolTable* symbols, const char* line,
+                         uint16_t* nextVariable)
+{
+    uint16_t word = 0;
+    if (line[0] != '@') {
+        if (!encodeCInstruction(line, &word)) {
+            fprintf(stderr, "Invalid instruction: %s\n", line);
+            return false;
+        }
+    }
+    else if (isdigit((unsigned char)line[1])) {
+        long value = strtol(line + 1, NULL, 10);
+        if (value > ADDRESS_MASK) {
+            fprintf(stderr, "Constant out of range: %s\n", line);
+            return false;
+        }
+        word = (uint16_t)value;
+    }
+    else {
+        Symbol* symbol = symbolTable_find(symbols, line + 1);
+        if (symbol->name == NULL) {
+            *symbol = (Symbol) { line + 1, (*nextVariable)++ };
+            if (!addVariable(program, line + 1, symbol->value)) {
+                fprintf(stderr, "Out of memory\n");
+                return false;
+            }
+            // The table keeps the name of the variable, the line is freed
+            symbol->name = program->variables[program->numVariables - 1].name;
+        }
+        word = symbol->value;
+    }
+    program->rom[program->numWords++] = word;
+    return true;
+}
+
+/// @brief Encodes dest=comp;jump, where dest and jump are optional
+static bool encodeCInstruction(const char* line, uint16_t* word)
+{
+    const char* equals = strchr(line, '=');
+    const char* semicolon = strchr(line, ';');
+    const char* comp = (equals != NULL) ? equals + 1 : line;
+    size_t compLength = (semicolon != NULL) ? (size_t)(semicolon - comp) : strlen(comp);
+
+    uint16_t dest = 0;
+    for (const char* c = line; equals != NULL && c < equals; c++) {
+        if (*c == 'A') dest |= DEST_A;
+        else if (*c == 'D') dest |= DEST_D;
+        else if (*c == 'M') dest |= DEST_M;
+        else return false;
+    }
+
+    uint16_t compBits = 0;
+    uint16_t jump = 0;
+    if (!findMnemonic(comps, sizeof(comps) / sizeof(Mnemonic), comp, compLength, &compBits)) {
+        return false;
+    }
+    if (semicolon != NULL &&
+        !findMnemonic(jumps, sizeof(jumps) / sizeof(Mnemonic), semicolon + 1,
+                      strlen(semicolon + 1), &jump)) {
+        return false;
+    }
+    *word = (uint16_t)(C_INSTRUCTION | (compBits << COMP_SHIFT) | dest | jump);
+    return true;
+}
+
+static bool findMnemonic(const Mnemonic* table, size_t size, const char* text, size_t length,
+                         uint16_t* bits)
+{
+    for (size_t i = 0; i < size; i++) {
+        if (strlen(table[i].text) == length && strncmp(table[i].text, text, length) == 0) {
+            *bits = table[i].bits;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool addVariable(HackProgram* program, const char* name, uint16_t address)
+{
+    HackVariable* variables = realloc(program->variables,
+                                      (program->numVariables + 1) * sizeof(HackVariable));
+    if (variables == NULL) return false;
+    program->variables = variables;
+
+    char* copy = strdup(name);
+    if (copy == NULL) return false;
+    program->variables[program->numVariables++] = (HackVariable) { copy, address };
+    return true;
+}
+
+static bool symbolTable_new(SymbolTable* symbols, size_t capacity)
+{
+    size_t numBuckets = 64;
+    while (numBuckets < 2 * capacity) {
+        numBuckets *= 2;
+    }
+    symbols->buckets = calloc(numBuckets, sizeof(Symbol));
+    symbols->mask = numBuckets - 1;
+    return symbols->buckets != NULL;
+}
+
+/// @return The bucket of the symbol, whose name is NULL when it is not in
+/// the table yet
+static Symbol* symbolTable_find(SymbolTable* symbols, const char* name)
+{
+    size_t b = program_hashName(name) & symbols->mask;
+    while (symbols->buckets[b].name != NULL && strcmp(symbols->buckets[b].name, name) != 0) {
+        b = (b + 1) & symbols->mask;
+    }
+    return &symbols->buckets[b];
+}
+
+static void symbolTable_close(SymbolTable* symbols)
+{
+    free(symbols->buckets);
+    symbols->buckets = NULL;
+}
+
+/// @brief The Hack ALU: the c bits zx, nx, zy, ny, f and no of comp
+/// @param y A or M, as chosen by the a bit
+static uint16_t compute(uint16_t comp, uint16_t x, uint16_t y)
+{
+    if (comp & 0x20) x = 0;
+    if (comp & 0x10) x = (uint16_t)~x;
+    if (comp & 0x08) y = 0;
+    if (comp & 0x04) y = (uint16_t)~y;
+    uint16_t out = (comp & 0x02) ? (uint16_t)(x + y) : (uint16_t)(x & y);
+    if (comp & 0x01) out = (uint16_t)~out;
+    return out;
+}
+
+static bool isJumpTaken(uint16_t jump, uint16_t value)
+{
+    int16_t v = (int16_t)value;
+    return ((jump & 4) && v < 0) || ((jump & 2) && v == 0) || ((jump & 1) && v > 0);
+}
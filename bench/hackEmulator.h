@@ -0,0 +1,61 @@
+#ifndef HACK_EMULATOR_H
+#define HACK_EMULATOR_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HACK_RAM_SIZE       (32768)
+#define HACK_HEAP_BASE      (2048)
+#define HACK_SCREEN_END     (24576)  // One past the screen memory map
+
+/// A symbol the assembler gave a RAM address, from address 16 up
+typedef struct HackVariable {
+    char* name;
+    uint16_t address;
+} HackVariable;
+
+/// Assembled program, one word per instruction
+typedef struct HackProgram {
+    uint16_t* rom;
+    size_t numWords;
+    HackVariable* variables; // In the order of their first use
+    size_t numVariables;
+} HackProgram;
+
+typedef struct HackMachine {
+    uint16_t ram[HACK_RAM_SIZE];
+    uint16_t a;
+    uint16_t d;
+    size_t pc;
+    uint64_t cycles;         // Instructions executed
+    bool halted;             // Stopped in a loop that can't change any state
+} HackMachine;
+
+/// @brief Assembles Hack assembly, with labels, variables and the predefined
+/// symbols, into words of the Hack binary format
+/// @return false, after printing the line to stderr, on a line that is not
+/// valid assembly
+bool hackProgram_assemble(HackProgram* program, const char* code, size_t length);
+
+void hackProgram_close(HackProgram* program);
+
+/// @return The address of the named variable, -1 when the program has none
+long hackProgram_findVariable(const HackProgram* program, const char* name);
+
+/// @brief Runs a program from address 0 with zeroed RAM and registers until
+/// it halts, runs off the end of the ROM, or has executed maxCycles
+/// instructions. A program halts when a jump without a destination goes to
+/// itself, or to the A instruction right before it, which is how the end of
+/// a program is written
+void hackMachine_run(HackMachine* machine, const HackProgram* program, uint64_t maxCycles);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // HACK_EMULATOR_H
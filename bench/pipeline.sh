@@ -0,0 +1,62 @@
+#!/bin/bash
+# Compares the translation time of the serial loop with --pipeline.
+#
+# Usage: bench/pipeline.sh <vm-translator> [input.vm|dir] [runs] [flags...]
+#
+# Without an input, a program of 500 functions (about 7 MB of VM code) is
+# generated in a temporary directory. The best time of each mode is printed,
+# and both outputs are checked to be the same.
+
+TRANSLATOR=${1:?"run as bench/pipeline.sh <vm-translator> [input] [runs] [flags...]"}
+INPUT=$2
+RUNS=${3:-5}
+shift $(( $# < 3 ? $# : 3 ))
+FLAGS=("$@")
+
+WORK_DIR=$(mktemp -d)
+trap 'rm -rf "${WORK_DIR}"' EXIT
+
+if [[ -z ${INPUT} ]]; then
+    INPUT=${WORK_DIR}/Bench.vm
+    awk 'BEGIN {
+        for (f = 0; f < 500; f++) {
+            printf "function Bench.f%d 3\n", f
+            for (i = 0; i < 100; i++) {
+                printf "push argument 0\npush constant %d\nadd\npop local %d\n", i, i % 3
+                printf "push local %d\npush static %d\nlt\nif-goto L%d\n", i % 3, i % 8, i
+                printf "push this 1\npush that 2\nsub\npop pointer 1\nlabel L%d\n", i
+            }
+            printf "push local 0\ncall Bench.f%d 1\nreturn\n", (f + 1) % 500
+        }
+    }' > "${INPUT}"
+fi
+
+if [[ -d ${INPUT} ]]; then
+    OUTPUT=${INPUT%/}.asm
+else
+    OUTPUT=${INPUT%.vm}.asm
+fi
+
+# Prints the best wall time in seconds of the given translator flags
+function bestTime() {
+    local best=""
+    for ((run = 0; run < RUNS; run++)); do
+        local start=$(date +%s%N)
+        "${TRANSLATOR}" "$@" "${INPUT}" > /dev/null || exit $?
+        local elapsed=$(( $(date +%s%N) - start ))
+        if [[ -z ${best} || ${elapsed} -lt ${best} ]]; then
+            best=${elapsed}
+        fi
+    done
+    printf "%d.%03d" $((best / 1000000000)) $((best / 1000000 % 1000))
+}
+
+echo "Input: ${INPUT} ($(wc -c < "${INPUT}") bytes), best of ${RUNS} runs"
+echo "serial:     $(bestTime "${FLAGS[@]}") s"
+cp "${OUTPUT}" "${WORK_DIR}/serial.asm"
+echo "--pipeline: $(bestTime --pipeline "${FLAGS[@]}") s"
+
+if ! cmp -s "${OUTPUT}" "${WORK_DIR}/serial.asm"; then
+    echo "The outputs differ"
+    exit 1
+fi
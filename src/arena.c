@@ -0,0 +1,127 @@
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+// Local function prototypes
+static ArenaBlock* arena_newBlock(Arena* arena, size_t size);
+
+// ---------------------------- PUBLIC FUNCTIONS --------------------------- //
+void arena_new(Arena* arena, size_t blockSize)
+{
+    memset(arena, 0, sizeof(Arena));
+    arena->blockSize = blockSize;
+}
+
+void arena_close(Arena* arena)
+{
+    ArenaBlock* block = arena->first;
+    while (block != NULL) {
+        ArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->first = NULL;
+    arena->current = NULL;
+    arena->used = 0;
+}
+
+void* arena_alloc(Arena* arena, size_t size)
+{
+    size = (size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+
+    // Blocks left behind by arena_release() are used again in order, one
+    // too small for the allocation is skipped until the next release
+    ArenaBlock* block = arena->current;
+    ArenaBlock* last = NULL;
+    size_t used = arena->used;
+    while (block != NULL && used + size > block->size) {
+        last = block;
+        block = block->next;
+        used = 0;
+    }
+    if (block == NULL) {
+        block = arena_newBlock(arena, size);
+        if (block == NULL) return NULL;
+        if (last != NULL) {
+            last->next = block;
+        }
+        else {
+            arena->first = block;
+        }
+    }
+
+    arena->current = block;
+    arena->used = used + size;
+    arena->stats.allocations++;
+    arena->stats.bytes += size;
+    if (arena->stats.bytes > arena->stats.peakBytes) {
+        arena->stats.peakBytes = arena->stats.bytes;
+    }
+    return (char*)block->data + used;
+}
+
+char* arena_strdup(Arena* arena, const char* str)
+{
+    size_t size = strlen(str) + 1;
+    char* copy = arena_alloc(arena, size);
+    if (copy != NULL) {
+        memcpy(copy, str, size);
+    }
+    return copy;
+}
+
+ArenaMark arena_mark(const Arena* arena)
+{
+    return (ArenaMark) {
+        .block = arena->current,
+        .used = arena->used,
+        .bytes = arena->stats.bytes
+    };
+}
+
+void arena_release(Arena* arena, ArenaMark mark)
+{
+    // Before the first allocation there is no block to go back to
+    arena->current = (mark.block != NULL) ? mark.block : arena->first;
+    arena->used = mark.used;
+    arena->stats.bytes = mark.bytes;
+}
+
+void arena_reset(Arena* arena)
+{
+    arena->current = arena->first;
+    arena->used = 0;
+    arena->stats.bytes = 0;
+}
+
+void arenaStats_add(ArenaStats* total, const ArenaStats* stats)
+{
+    total->allocations += stats->allocations;
+    total->blocks += stats->blocks;
+    total->reservedBytes += stats->reservedBytes;
+    if (stats->peakBytes > total->peakBytes) {
+        total->peakBytes = stats->peakBytes;
+    }
+}
+
+void arenaStats_print(FILE* out, const char* name, const ArenaStats* stats)
+{
+    fprintf(out, "%-12s %zu allocations, peak %zu bytes, %zu blocks of %zu bytes in all\n",
+            name, stats->allocations, stats->peakBytes, stats->blocks, stats->reservedBytes);
+}
+
+// -------------------------- PRIVATE FUNCTIONS ----------------------------- //
+static ArenaBlock* arena_newBlock(Arena* arena, size_t size)
+{
+    if (size < arena->blockSize) {
+        size = arena->blockSize;
+    }
+    ArenaBlock* block = malloc(sizeof(ArenaBlock) + size);
+    if (block == NULL) return NULL;
+    block->next = NULL;
+    block->size = size;
+    arena->stats.blocks++;
+    arena->stats.reservedBytes += size;
+    return block;
+}
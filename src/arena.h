@@ -0,0 +1,77 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdio.h>
+
+#define DEFAULT_ARENA_BLOCK_SIZE    (64 * 1024) // Bytes of a block, unless an
+                                                // allocation is larger
+
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t size;             // Bytes of data
+    max_align_t data[];
+} ArenaBlock;
+
+/// What an arena allocated, reported with --stats
+typedef struct ArenaStats {
+    size_t allocations;      // arena_alloc() calls
+    size_t blocks;           // malloc() calls for blocks
+    size_t bytes;            // Bytes allocated and not released yet
+    size_t peakBytes;        // Most bytes allocated at once
+    size_t reservedBytes;    // Bytes of every block
+} ArenaStats;
+
+/// Bump allocator for what lives as long as a translation, or one file of
+/// it. Released memory stays in the blocks, so an arena that is reused for
+/// every file only calls malloc() when a file needs more than the ones
+/// before. Not thread safe, each thread uses its own arena
+typedef struct Arena {
+    ArenaBlock* first;
+    ArenaBlock* current;     // Block allocations are taken from, NULL until
+                             // the first one
+    size_t used;             // Bytes of current taken
+    size_t blockSize;
+    ArenaStats stats;
+} Arena;
+
+/// Position of an arena, where arena_release() rewinds it to
+typedef struct ArenaMark {
+    ArenaBlock* block;
+    size_t used;
+    size_t bytes;
+} ArenaMark;
+
+void arena_new(Arena* arena, size_t blockSize);
+
+/// @brief Frees every block
+void arena_close(Arena* arena);
+
+/// @return Memory aligned like malloc(), NULL when out of memory
+void* arena_alloc(Arena* arena, size_t size);
+char* arena_strdup(Arena* arena, const char* str);
+
+ArenaMark arena_mark(const Arena* arena);
+
+/// @brief Releases everything allocated since the mark was taken
+void arena_release(Arena* arena, ArenaMark mark);
+
+/// @brief Releases everything, keeping the blocks for what comes next
+void arena_reset(Arena* arena);
+
+/// @brief Adds the counts of an arena, closed or about to be, to a total.
+/// The peak is the largest of the arenas, the bytes in use are left alone
+void arenaStats_add(ArenaStats* total, const ArenaStats* stats);
+
+/// @brief Prints a line of --stats
+void arenaStats_print(FILE* out, const char* name, const ArenaStats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ARENA_H
@@ -0,0 +1,235 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "errorHandler.h"
+#include "optimizer.h"
+#include "parser.h"
+#include "program.h"
+
+// Registers whose value an array access leaves behind, tracked by the
+// liveness analysis as a bit set
+#define LIVE_THAT       (1u << 0)
+#define LIVE_TEMP0      (1u << 1)
+#define LIVE_ALL        (LIVE_THAT | LIVE_TEMP0)
+
+#define NO_TARGET       SIZE_MAX
+
+typedef struct LabelIndex {
+    const char* name;
+    size_t index;            // Index of the label command in the function
+} LabelIndex;
+
+// Local function prototypes
+static ErrorCode arrayIdioms_optimizeFile(VmFile* file);
+static ErrorCode arrayIdioms_rewriteFunction(VmFile* out, const Command* cmds, size_t numCmds);
+static ErrorCode computeLiveness(const Command* cmds, size_t numCmds, unsigned char* liveIn);
+static void liveness_genKill(const Command* cmd, unsigned* gen, unsigned* kill);
+static bool isLoadIdiom(const Command* cmds, size_t numCmds, size_t i);
+static bool isStoreIdiom(const Command* cmds, size_t numCmds, size_t i);
+static bool isSegmentCmd(const Command* cmd, CommandType type, const char* segment, long index);
+static int compareLabels(const void* a, const void* b);
+
+// ---------------------------- PUBLIC FUNCTIONS --------------------------- //
+ErrorCode arrayIdioms_optimize(Program* prog)
+{
+    ErrorCode err = OK;
+    for (size_t f = 0; f < prog->numFiles && err == OK; f++) {
+        err = arrayIdioms_optimizeFile(&prog->files[f]);
+    }
+    return err;
+}
+
+// -------------------------- PRIVATE FUNCTIONS ----------------------------- //
+static ErrorCode arrayIdioms_optimizeFile(VmFile* file)
+{
+    ErrorCode err = OK;
+    VmFile out = { 0 };
+
+    // Liveness is computed per function, from one function command to the next
+    size_t start = 0;
+    while (start < file->numCmds && err == OK) {
+        size_t end = start + 1;
+        while (end < file->numCmds && file->cmds[end].type != CMD_FUNCTION) {
+            end++;
+        }
+        err = arrayIdioms_rewriteFunction(&out, &file->cmds[start], end - start);
+        start = end;
+    }
+
+    if (err == OK) {
+        vmFile_replaceCommands(file, &out);
+    }
+    free(out.cmds);
+    return err;
+}
+
+/// @brief Appends the commands of one function to out, with the array load
+/// and store idioms fused
+static ErrorCode arrayIdioms_rewriteFunction(VmFile* out, const Command* cmds, size_t numCmds)
+{
+    unsigned char* liveIn = malloc((numCmds + 1) * sizeof(unsigned char));
+    if (liveIn == NULL) {
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+    ErrorCode err = computeLiveness(cmds, numCmds, liveIn);
+    // Falling off the end of the function runs into code that is not known here
+    liveIn[numCmds] = LIVE_ALL;
+
+    size_t i = 0;
+    while (i < numCmds && err == OK) {
+        if (isLoadIdiom(cmds, numCmds, i)) {
+            // add; pop pointer 1; push that 0
+            Command load = { .type = CMD_ARRAY_LOAD };
+            if (liveIn[i + 3] & LIVE_THAT) strcpy(load.Arg1, "that");
+            err = vmFile_append(out, &load);
+            i += 3;
+        }
+        else if (isStoreIdiom(cmds, numCmds, i)) {
+            // pop temp 0; pop pointer 1; push temp 0; pop that 0
+            Command store = { .type = CMD_ARRAY_STORE };
+            if (liveIn[i + 4] & LIVE_THAT) strcpy(store.Arg1, "that");
+            if (liveIn[i + 4] & LIVE_TEMP0) strcpy(store.Arg2, "temp");
+            err = vmFile_append(out, &store);
+            i += 4;
+        }
+        else {
+            err = vmFile_append(out, &cmds[i]);
+            i++;
+        }
+    }
+
+    free(liveIn);
+    return err;
+}
+
+/// @brief Backward liveness of THAT and temp 0 over the control flow of a
+/// function. Calls may read both, a return hands temp 0 back to the caller
+/// while THAT is restored from the frame, and jumps to labels outside the
+/// function are assumed to read both
+/// @param liveIn Filled with the registers live before each command
+static ErrorCode computeLiveness(const Command* cmds, size_t numCmds, unsigned char* liveIn)
+{
+    size_t numLabels = 0;
+    for (size_t i = 0; i < numCmds; i++) {
+        if (cmds[i].type == CMD_LABEL) numLabels++;
+    }
+
+    LabelIndex* labels = malloc((numLabels + 1) * sizeof(LabelIndex));
+    size_t* targets = malloc((numCmds + 1) * sizeof(size_t));
+    if (labels == NULL || targets == NULL) {
+        free(labels);
+        free(targets);
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+
+    numLabels = 0;
+    for (size_t i = 0; i < numCmds; i++) {
+        if (cmds[i].type == CMD_LABEL) {
+            labels[numLabels].name = cmds[i].Arg1;
+            labels[numLabels].index = i;
+            numLabels++;
+        }
+    }
+    qsort(labels, numLabels, sizeof(LabelIndex), compareLabels);
+
+    for (size_t i = 0; i < numCmds; i++) {
+        targets[i] = NO_TARGET;
+        liveIn[i] = 0;
+        if (cmds[i].type == CMD_GOTO || cmds[i].type == CMD_IF || cmds[i].type == CMD_IF_NOT) {
+            LabelIndex key = { .name = cmds[i].Arg1 };
+            const LabelIndex* found = bsearch(&key, labels, numLabels, sizeof(LabelIndex), compareLabels);
+            if (found != NULL) targets[i] = found->index;
+        }
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i = numCmds; i-- > 0;) {
+            unsigned next = (i + 1 < numCmds) ? liveIn[i + 1] : LIVE_ALL;
+            unsigned target = (targets[i] != NO_TARGET) ? liveIn[targets[i]] : LIVE_ALL;
+            unsigned liveOut;
+
+            switch (cmds[i].type) {
+                case CMD_GOTO:      liveOut = target; break;
+                case CMD_IF:
+                case CMD_IF_NOT:    liveOut = next | target; break;
+                case CMD_RETURN:    liveOut = LIVE_TEMP0; break;
+                case CMD_LIGHT_RETURN:
+                case CMD_TAIL_CALL:
+                case CMD_TAIL_JUMP: liveOut = LIVE_ALL; break;
+                default:            liveOut = next; break;
+            }
+
+            unsigned gen = 0;
+            unsigned kill = 0;
+            liveness_genKill(&cmds[i], &gen, &kill);
+            unsigned char in = (unsigned char)((liveOut & ~kill) | gen);
+            if (in != liveIn[i]) {
+                liveIn[i] = in;
+                changed = true;
+            }
+        }
+    }
+
+    free(labels);
+    free(targets);
+    return OK;
+}
+
+static void liveness_genKill(const Command* cmd, unsigned* gen, unsigned* kill)
+{
+    switch (cmd->type) {
+        case CMD_CALL:
+        case CMD_LIGHT_CALL:
+        case CMD_TAIL_CALL:
+        case CMD_TAIL_JUMP:
+            *gen = LIVE_ALL;
+            break;
+        case CMD_PUSH:
+        case CMD_POP:
+            if (strcmp(cmd->Arg1, "that") == 0) {
+                *gen = LIVE_THAT;
+            }
+            else if (isSegmentCmd(cmd, cmd->type, "pointer", 1)) {
+                *(cmd->type == CMD_PUSH ? gen : kill) = LIVE_THAT;
+            }
+            else if (isSegmentCmd(cmd, cmd->type, "temp", 0)) {
+                *(cmd->type == CMD_PUSH ? gen : kill) = LIVE_TEMP0;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static bool isLoadIdiom(const Command* cmds, size_t numCmds, size_t i)
+{
+    return (i + 3 <= numCmds) &&
+           (cmds[i].type == CMD_ARITHMETIC) && (strcmp(cmds[i].Arg1, "add") == 0) &&
+           isSegmentCmd(&cmds[i + 1], CMD_POP, "pointer", 1) &&
+           isSegmentCmd(&cmds[i + 2], CMD_PUSH, "that", 0);
+}
+
+static bool isStoreIdiom(const Command* cmds, size_t numCmds, size_t i)
+{
+    return (i + 4 <= numCmds) &&
+           isSegmentCmd(&cmds[i], CMD_POP, "temp", 0) &&
+           isSegmentCmd(&cmds[i + 1], CMD_POP, "pointer", 1) &&
+           isSegmentCmd(&cmds[i + 2], CMD_PUSH, "temp", 0) &&
+           isSegmentCmd(&cmds[i + 3], CMD_POP, "that", 0);
+}
+
+static bool isSegmentCmd(const Command* cmd, CommandType type, const char* segment, long index)
+{
+    return (cmd->type == type) && (strcmp(cmd->Arg1, segment) == 0) &&
+           (cmd->Arg2[0] != '\0') && (atol(cmd->Arg2) == index);
+}
+
+static int compareLabels(const void* a, const void* b)
+{
+    return strcmp(((const LabelIndex*)a)->name, ((const LabelIndex*)b)->name);
+}
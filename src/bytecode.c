@@ -0,0 +1,538 @@
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bytecode.h"
+#include "errorHandler.h"
+#include "parser.h"
+#include "program.h"
+
+#define RETURN_ON_ERR(err)    ({ErrorCode e = err; if (e != OK) return (e);})
+
+#define INITIAL_BUFFER_CAPACITY (4096)
+#define MAX_NUMBER_DIGITS       (9)     // Numbers written as varints fit in 32 bits
+
+/// Opcodes of the binary format, independent of the CommandType values
+typedef enum {
+    OP_INVALID,
+    OP_ARITHMETIC,
+    OP_PUSH,
+    OP_POP,
+    OP_LABEL,
+    OP_GOTO,
+    OP_IF,
+    OP_FUNCTION,
+    OP_RETURN,
+    OP_CALL,
+    NUM_OPCODES
+} Opcode;
+
+static const Opcode opcodeOf[CMD_MAX_COMMANDS] = {
+    [CMD_ARITHMETIC] = OP_ARITHMETIC,
+    [CMD_PUSH]       = OP_PUSH,
+    [CMD_POP]        = OP_POP,
+    [CMD_LABEL]      = OP_LABEL,
+    [CMD_GOTO]       = OP_GOTO,
+    [CMD_IF]         = OP_IF,
+    [CMD_FUNCTION]   = OP_FUNCTION,
+    [CMD_RETURN]     = OP_RETURN,
+    [CMD_CALL]       = OP_CALL,
+};
+
+static const CommandType commandOf[NUM_OPCODES] = {
+    [OP_INVALID]    = CMD_UNDEFINED,
+    [OP_ARITHMETIC] = CMD_ARITHMETIC,
+    [OP_PUSH]       = CMD_PUSH,
+    [OP_POP]        = CMD_POP,
+    [OP_LABEL]      = CMD_LABEL,
+    [OP_GOTO]       = CMD_GOTO,
+    [OP_IF]         = CMD_IF,
+    [OP_FUNCTION]   = CMD_FUNCTION,
+    [OP_RETURN]     = CMD_RETURN,
+    [OP_CALL]       = CMD_CALL,
+};
+
+typedef struct ByteBuffer {
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+} ByteBuffer;
+
+/// Distinct strings of the program, in order of first use. The strings
+/// point into the commands of the program being written
+typedef struct StringTable {
+    const char** strings;
+    size_t numStrings;
+    size_t* buckets;         // Index in strings plus one, 0 for empty buckets
+    size_t numBuckets;
+} StringTable;
+
+/// Position in a memory mapped .vmb file
+typedef struct Reader {
+    const uint8_t* pos;
+    const uint8_t* end;
+} Reader;
+
+/// String of a loaded .vmb file, pointing into the mapping
+typedef struct LoadedString {
+    const char* text;
+    uint32_t length;
+} LoadedString;
+
+// Local function prototypes
+static ErrorCode encodeProgram(const Program* prog, StringTable* strings, ByteBuffer* out,
+                               ByteBuffer* code);
+static ErrorCode encodeCommand(const Command* cmd, StringTable* strings, ByteBuffer* code);
+static ErrorCode strings_new(StringTable* table, size_t maxStrings);
+static void strings_close(StringTable* table);
+static size_t strings_intern(StringTable* table, const char* string);
+static bool hasArg1(Opcode op);
+static bool hasArg2(Opcode op);
+static bool isNumber(const char* arg);
+static ErrorCode buffer_reserve(ByteBuffer* buffer, size_t size);
+static ErrorCode buffer_putVarint(ByteBuffer* buffer, uint32_t value);
+static ErrorCode buffer_putBytes(ByteBuffer* buffer, const void* bytes, size_t length);
+static ErrorCode decodeProgram(Program* prog, Reader* in, const char* fileName);
+static ErrorCode decodeFile(Program* prog, Reader* in, const LoadedString* strings,
+                            uint32_t numStrings);
+static bool readVarint(Reader* in, uint32_t* value);
+static bool readString(Reader* in, const LoadedString* strings, uint32_t numStrings,
+                       LoadedString* string);
+static bool copyIdentifier(char* dest, const LoadedString* string);
+static void formatNumber(char* dest, uint32_t value);
+
+// ---------------------------- PUBLIC FUNCTIONS --------------------------- //
+ErrorCode bytecode_write(const Program* prog, FILE* out)
+{
+    // Every file name and argument may be a new string
+    size_t maxStrings = prog->numFiles + 1;
+    for (size_t f = 0; f < prog->numFiles; f++) {
+        maxStrings += 2 * prog->files[f].numCmds;
+    }
+
+    StringTable strings;
+    RETURN_ON_ERR(strings_new(&strings, maxStrings));
+    ByteBuffer buffer = {0};
+    ByteBuffer code = {0};
+
+    ErrorCode err = encodeProgram(prog, &strings, &buffer, &code);
+    if (err == OK && fwrite(buffer.data, 1, buffer.size, out) != buffer.size) {
+        logError(ERR_CANT_OPEN_OUTFILE, NULL);
+        err = ERR_CANT_OPEN_OUTFILE;
+    }
+    strings_close(&strings);
+    free(buffer.data);
+    free(code.data);
+    return err;
+}
+
+ErrorCode bytecode_load(Program* prog, const char* fileName)
+{
+    int fd = open(fileName, O_RDONLY);
+    struct stat s;
+    if (fd < 0 || fstat(fd, &s) != 0) {
+        if (fd >= 0) close(fd);
+        logError(ERR_CANT_OPEN_INPUT_FILE, fileName);
+        return ERR_CANT_OPEN_INPUT_FILE;
+    }
+    if (s.st_size == 0) {
+        close(fd);
+        logError(ERR_BAD_BYTECODE_FILE, fileName);
+        return ERR_BAD_BYTECODE_FILE;
+    }
+
+    void* mapping = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        logError(ERR_CANT_OPEN_INPUT_FILE, fileName);
+        return ERR_CANT_OPEN_INPUT_FILE;
+    }
+
+    Reader in = { .pos = mapping, .end = (const uint8_t*)mapping + s.st_size };
+    ErrorCode err = decodeProgram(prog, &in, fileName);
+    munmap(mapping, s.st_size);
+    return err;
+}
+
+// -------------------------- PRIVATE FUNCTIONS ----------------------------- //
+
+/// @brief Writes the header and string table to out, then every file, whose
+/// code is first encoded into the code buffer to know its size
+static ErrorCode encodeProgram(const Program* prog, StringTable* strings, ByteBuffer* out,
+                               ByteBuffer* code)
+{
+    // Intern every string first, so that the table comes before the code
+    for (size_t f = 0; f < prog->numFiles; f++) {
+        const VmFile* file = &prog->files[f];
+        strings_intern(strings, file->fileName);
+        for (size_t i = 0; i < file->numCmds; i++) {
+            const Command* cmd = &file->cmds[i];
+            Opcode op = opcodeOf[cmd->type];
+            if (op == OP_INVALID) {
+                logError(ERR_UNEXPEC_TOKEN, cmd->Arg1);
+                return ERR_UNEXPEC_TOKEN;
+            }
+            if (hasArg1(op)) strings_intern(strings, cmd->Arg1);
+            if (hasArg2(op) && !isNumber(cmd->Arg2)) strings_intern(strings, cmd->Arg2);
+        }
+    }
+
+    uint8_t version = BYTECODE_VERSION;
+    RETURN_ON_ERR(buffer_putBytes(out, BYTECODE_MAGIC, strlen(BYTECODE_MAGIC)));
+    RETURN_ON_ERR(buffer_putBytes(out, &version, 1));
+    RETURN_ON_ERR(buffer_putVarint(out, strings->numStrings));
+    for (size_t i = 0; i < strings->numStrings; i++) {
+        size_t length = strlen(strings->strings[i]);
+        RETURN_ON_ERR(buffer_putVarint(out, length));
+        RETURN_ON_ERR(buffer_putBytes(out, strings->strings[i], length));
+    }
+
+    RETURN_ON_ERR(buffer_putVarint(out, prog->numFiles));
+    for (size_t f = 0; f < prog->numFiles; f++) {
+        const VmFile* file = &prog->files[f];
+        RETURN_ON_ERR(buffer_putVarint(out, strings_intern(strings, file->fileName)));
+
+        size_t numFunctions = 0;
+        for (size_t i = 0; i < file->numCmds; i++) {
+            if (file->cmds[i].type == CMD_FUNCTION) numFunctions++;
+        }
+        RETURN_ON_ERR(buffer_putVarint(out, numFunctions));
+
+        code->size = 0;
+        for (size_t i = 0; i < file->numCmds; i++) {
+            const Command* cmd = &file->cmds[i];
+            if (cmd->type == CMD_FUNCTION) {
+                RETURN_ON_ERR(buffer_putVarint(out, strings_intern(strings, cmd->Arg1)));
+                RETURN_ON_ERR(buffer_putVarint(out, code->size));
+            }
+            RETURN_ON_ERR(encodeCommand(cmd, strings, code));
+        }
+        RETURN_ON_ERR(buffer_putVarint(out, file->numCmds));
+        RETURN_ON_ERR(buffer_putVarint(out, code->size));
+        RETURN_ON_ERR(buffer_putBytes(out, code->data, code->size));
+    }
+    return OK;
+}
+
+static ErrorCode encodeCommand(const Command* cmd, StringTable* strings, ByteBuffer* code)
+{
+    Opcode op = opcodeOf[cmd->type];
+    bool arg2IsString = hasArg2(op) && !isNumber(cmd->Arg2);
+    uint8_t opByte = op | (arg2IsString ? BYTECODE_ARG2_STRING : 0);
+
+    RETURN_ON_ERR(buffer_putBytes(code, &opByte, 1));
+    if (hasArg1(op)) {
+        RETURN_ON_ERR(buffer_putVarint(code, strings_intern(strings, cmd->Arg1)));
+    }
+    if (arg2IsString) {
+        RETURN_ON_ERR(buffer_putVarint(code, strings_intern(strings, cmd->Arg2)));
+    }
+    else if (hasArg2(op)) {
+        RETURN_ON_ERR(buffer_putVarint(code, strtoul(cmd->Arg2, NULL, 10)));
+    }
+    return OK;
+}
+
+static ErrorCode strings_new(StringTable* table, size_t maxStrings)
+{
+    memset(table, 0, sizeof(StringTable));
+
+    // Keep the load factor under one half
+    table->numBuckets = 16;
+    while (table->numBuckets < 2 * maxStrings) {
+        table->numBuckets *= 2;
+    }
+    table->strings = malloc(maxStrings * sizeof(const char*));
+    table->buckets = calloc(table->numBuckets, sizeof(size_t));
+    if (table->strings == NULL || table->buckets == NULL) {
+        strings_close(table);
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+    return OK;
+}
+
+static void strings_close(StringTable* table)
+{
+    free(table->strings);
+    free(table->buckets);
+    memset(table, 0, sizeof(StringTable));
+}
+
+/// @return Index of the string in the table, which is added if new
+static size_t strings_intern(StringTable* table, const char* string)
+{
+    size_t mask = table->numBuckets - 1;
+    size_t b = program_hashName(string) & mask;
+    while (table->buckets[b] != 0) {
+        size_t index = table->buckets[b] - 1;
+        if (strcmp(table->strings[index], string) == 0) {
+            return index;
+        }
+        b = (b + 1) & mask;
+    }
+    table->strings[table->numStrings] = string;
+    table->buckets[b] = ++table->numStrings;
+    return table->numStrings - 1;
+}
+
+static bool hasArg1(Opcode op)
+{
+    return op != OP_RETURN;
+}
+
+static bool hasArg2(Opcode op)
+{
+    return op == OP_PUSH || op == OP_POP || op == OP_FUNCTION || op == OP_CALL;
+}
+
+/// @return Whether the argument is written as a varint, which requires the
+/// decimal form of the value to give the same text back
+static bool isNumber(const char* arg)
+{
+    size_t length = strlen(arg);
+    if (length == 0 || length > MAX_NUMBER_DIGITS || (arg[0] == '0' && length > 1)) {
+        return false;
+    }
+    for (size_t i = 0; i < length; i++) {
+        if (arg[i] < '0' || arg[i] > '9') return false;
+    }
+    return true;
+}
+
+static ErrorCode buffer_reserve(ByteBuffer* buffer, size_t size)
+{
+    if (buffer->size + size <= buffer->capacity) {
+        return OK;
+    }
+    size_t newCapacity = (buffer->capacity == 0) ? INITIAL_BUFFER_CAPACITY : buffer->capacity * 2;
+    while (newCapacity < buffer->size + size) {
+        newCapacity *= 2;
+    }
+    uint8_t* newData = realloc(buffer->data, newCapacity);
+    if (newData == NULL) {
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+    buffer->data = newData;
+    buffer->capacity = newCapacity;
+    return OK;
+}
+
+/// @brief Appends an unsigned LEB128 varint: 7 bits per byte, lowest first,
+/// with the high bit set on every byte but the last
+static ErrorCode buffer_putVarint(ByteBuffer* buffer, uint32_t value)
+{
+    RETURN_ON_ERR(buffer_reserve(buffer, 5));
+    while (value >= 0x80) {
+        buffer->data[buffer->size++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    buffer->data[buffer->size++] = value;
+    return OK;
+}
+
+static ErrorCode buffer_putBytes(ByteBuffer* buffer, const void* bytes, size_t length)
+{
+    RETURN_ON_ERR(buffer_reserve(buffer, length));
+    memcpy(&buffer->data[buffer->size], bytes, length);
+    buffer->size += length;
+    return OK;
+}
+
+/// @brief Reads the header and string table, then adds every file to the
+/// program. The strings are not copied, they point into the mapping
+static ErrorCode decodeProgram(Program* prog, Reader* in, const char* fileName)
+{
+    size_t magicLen = strlen(BYTECODE_MAGIC);
+    if ((size_t)(in->end - in->pos) < magicLen + 1 || memcmp(in->pos, BYTECODE_MAGIC, magicLen) != 0 ||
+        in->pos[magicLen] != BYTECODE_VERSION) {
+        logError(ERR_BAD_BYTECODE_FILE, fileName);
+        return ERR_BAD_BYTECODE_FILE;
+    }
+    in->pos += magicLen + 1;
+
+    uint32_t numStrings = 0;
+    // Every string takes at least its length byte
+    if (!readVarint(in, &numStrings) || numStrings > (size_t)(in->end - in->pos)) {
+        logError(ERR_BAD_BYTECODE_FILE, fileName);
+        return ERR_BAD_BYTECODE_FILE;
+    }
+    LoadedString* strings = malloc((numStrings + 1) * sizeof(LoadedString));
+    if (strings == NULL) {
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+    for (uint32_t i = 0; i < numStrings; i++) {
+        uint32_t length = 0;
+        if (!readVarint(in, &length) || length > (size_t)(in->end - in->pos)) {
+            free(strings);
+            logError(ERR_BAD_BYTECODE_FILE, fileName);
+            return ERR_BAD_BYTECODE_FILE;
+        }
+        strings[i].text = (const char*)in->pos;
+        strings[i].length = length;
+        in->pos += length;
+    }
+
+    uint32_t numFiles = 0;
+    ErrorCode err = readVarint(in, &numFiles) ? OK : ERR_BAD_BYTECODE_FILE;
+    for (uint32_t f = 0; f < numFiles && err == OK; f++) {
+        err = decodeFile(prog, in, strings, numStrings);
+    }
+    if (err == OK && in->pos != in->end) {
+        err = ERR_BAD_BYTECODE_FILE;
+    }
+    if (err == ERR_BAD_BYTECODE_FILE) {
+        logError(ERR_BAD_BYTECODE_FILE, fileName);
+    }
+    free(strings);
+    return err;
+}
+
+/// @brief Adds a file to the program, decoding its commands straight into
+/// the command array. The function table must match the function commands
+static ErrorCode decodeFile(Program* prog, Reader* in, const LoadedString* strings,
+                            uint32_t numStrings)
+{
+    LoadedString name;
+    if (!readString(in, strings, numStrings, &name)) {
+        return ERR_BAD_BYTECODE_FILE;
+    }
+    char* vmFileName = strndup(name.text, name.length);
+    if (vmFileName == NULL) {
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+    ErrorCode err = program_addFile(prog, vmFileName);
+    free(vmFileName);
+    RETURN_ON_ERR(err);
+
+    // The function table is checked against the code as it is decoded
+    uint32_t numFunctions = 0;
+    if (!readVarint(in, &numFunctions)) {
+        return ERR_BAD_BYTECODE_FILE;
+    }
+    Reader functions = *in;
+    for (uint32_t i = 0; i < 2 * numFunctions; i++) {
+        uint32_t value = 0;
+        if (!readVarint(in, &value)) return ERR_BAD_BYTECODE_FILE;
+    }
+
+    uint32_t numCommands = 0;
+    uint32_t codeSize = 0;
+    if (!readVarint(in, &numCommands) || !readVarint(in, &codeSize) ||
+        codeSize > (size_t)(in->end - in->pos) || numCommands > codeSize) {
+        return ERR_BAD_BYTECODE_FILE;
+    }
+    VmFile* file = &prog->files[prog->numFiles - 1];
+    RETURN_ON_ERR(vmFile_reserve(file, numCommands));
+
+    Reader code = { .pos = in->pos, .end = in->pos + codeSize };
+    in->pos += codeSize;
+    for (uint32_t i = 0; i < numCommands; i++) {
+        uint32_t offset = code.pos - (in->pos - codeSize);
+        if (code.pos == code.end) return ERR_BAD_BYTECODE_FILE;
+        uint8_t opByte = *code.pos++;
+        Opcode op = opByte & ~BYTECODE_ARG2_STRING;
+        if (op == OP_INVALID || op >= NUM_OPCODES ||
+            ((opByte & BYTECODE_ARG2_STRING) && !hasArg2(op))) {
+            return ERR_BAD_BYTECODE_FILE;
+        }
+
+        Command* cmd = &file->cmds[file->numCmds];
+        cmd->type = commandOf[op];
+        cmd->Arg1[0] = '\0';
+        cmd->Arg2[0] = '\0';
+
+        LoadedString arg;
+        if (hasArg1(op)) {
+            if (!readString(&code, strings, numStrings, &arg) || !copyIdentifier(cmd->Arg1, &arg)) {
+                return ERR_BAD_BYTECODE_FILE;
+            }
+        }
+        if (opByte & BYTECODE_ARG2_STRING) {
+            if (!readString(&code, strings, numStrings, &arg) || !copyIdentifier(cmd->Arg2, &arg)) {
+                return ERR_BAD_BYTECODE_FILE;
+            }
+        }
+        else if (hasArg2(op)) {
+            uint32_t value = 0;
+            if (!readVarint(&code, &value)) return ERR_BAD_BYTECODE_FILE;
+            formatNumber(cmd->Arg2, value);
+        }
+
+        if (op == OP_FUNCTION) {
+            uint32_t expectedOffset = 0;
+            if (numFunctions == 0 || !readString(&functions, strings, numStrings, &arg) ||
+                !readVarint(&functions, &expectedOffset) || expectedOffset != offset ||
+                strncmp(cmd->Arg1, arg.text, arg.length) != 0 || cmd->Arg1[arg.length] != '\0') {
+                return ERR_BAD_BYTECODE_FILE;
+            }
+            numFunctions--;
+        }
+        file->numCmds++;
+    }
+    if (code.pos != code.end || numFunctions != 0) {
+        return ERR_BAD_BYTECODE_FILE;
+    }
+    return OK;
+}
+
+static bool readVarint(Reader* in, uint32_t* value)
+{
+    uint32_t result = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (in->pos == in->end) return false;
+        uint8_t byte = *in->pos++;
+        result |= (uint32_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool readString(Reader* in, const LoadedString* strings, uint32_t numStrings,
+                       LoadedString* string)
+{
+    uint32_t index = 0;
+    if (!readVarint(in, &index) || index >= numStrings) {
+        return false;
+    }
+    *string = strings[index];
+    return true;
+}
+
+/// @brief Copies a string of the mapping into a command argument, which
+/// has the same length limit as the identifiers of the parser
+static bool copyIdentifier(char* dest, const LoadedString* string)
+{
+    if (string->length == 0 || string->length >= MAX_IDENTIFIER_LEN ||
+        memchr(string->text, '\0', string->length) != NULL) {
+        return false;
+    }
+    memcpy(dest, string->text, string->length);
+    dest[string->length] = '\0';
+    return true;
+}
+
+static void formatNumber(char* dest, uint32_t value)
+{
+    char digits[16];
+    size_t numDigits = 0;
+    do {
+        digits[numDigits++] = '0' + (value % 10);
+        value /= 10;
+    } while (value != 0);
+    for (size_t i = 0; i < numDigits; i++) {
+        dest[i] = digits[numDigits - 1 - i];
+    }
+    dest[numDigits] = '\0';
+}
@@ -0,0 +1,43 @@
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include "errorHandler.h"
+#include "program.h"
+
+/// Binary form of the parsed commands of a program (.vmb), loaded without
+/// tokenizing any text. Every number is an unsigned LEB128 varint:
+///
+///   "HVMB" version
+///   numStrings, then every string as length and bytes
+///   numFiles, then for every file:
+///     name                     String index of the .vm path, for static symbols
+///     numFunctions, then the name and code offset of every function
+///     numCommands codeSize
+///     code                     One opcode byte per command and its operands
+///
+/// Identifiers, segments and arithmetic commands are string indices. The
+/// numeric second operand of push, pop, function and call is a varint, and
+/// a string index when the opcode has BYTECODE_ARG2_STRING set
+#define BYTECODE_MAGIC          "HVMB"
+#define BYTECODE_VERSION        (1)
+#define BYTECODE_ARG2_STRING    (0x80)
+
+/// @brief Writes the commands of every file of the program. Only parsed
+/// commands can be written, so it must be called before any optimization
+/// @param out File opened for writing in binary mode
+ErrorCode bytecode_write(const Program* prog, FILE* out);
+
+/// @brief Adds the files stored in a .vmb file to the program. The file is
+/// memory mapped and the commands are decoded from the mapping
+ErrorCode bytecode_load(Program* prog, const char* fileName);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BYTECODE_H
@@ -0,0 +1,229 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "errorHandler.h"
+#include "optimizer.h"
+#include "parser.h"
+#include "program.h"
+
+// Segment pointers a function reads or writes, as a bit set
+#define POINTER_THIS    (1u << 0)
+#define POINTER_THAT    (1u << 1)
+#define POINTER_ALL     (POINTER_THIS | POINTER_THAT)
+
+typedef struct FrameInfo {
+    unsigned reads;
+    unsigned writes;
+    const char* fullFrameReason;  // Why the full frame is kept, NULL when
+                                  // the saved pointers can be reduced
+} FrameInfo;
+
+// Local function prototypes
+static ErrorCode callFrames_analyze(const Program* prog, const FunctionTable* table, FrameInfo* infos);
+static ErrorCode callFrames_checkSharedCode(const Program* prog, const FunctionTable* table,
+                                           FrameInfo* infos);
+static void callFrames_rewrite(Program* prog, const FunctionTable* table, const FrameInfo* infos,
+                               FILE* report);
+static void callFrames_report(const FunctionTable* table, const FrameInfo* infos, FILE* report);
+static void pointerAccesses(const Command* cmd, unsigned* reads, unsigned* writes);
+static const char* pointerArgs(unsigned pointers);
+static const char* pointerNames(unsigned pointers);
+
+// ---------------------------- PUBLIC FUNCTIONS --------------------------- //
+ErrorCode callFrames_optimize(Program* prog, FILE* report)
+{
+    FunctionTable table;
+    ErrorCode err = program_buildFunctionTable(prog, &table);
+    if (err != OK) return err;
+
+    FrameInfo* infos = calloc(table.numFuncs + 1, sizeof(FrameInfo));
+    if (infos == NULL) {
+        functionTable_close(&table);
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+
+    err = callFrames_analyze(prog, &table, infos);
+    if (err == OK) {
+        err = callFrames_checkSharedCode(prog, &table, infos);
+    }
+    if (err == OK) {
+        if (report != NULL) {
+            callFrames_report(&table, infos, report);
+        }
+        callFrames_rewrite(prog, &table, infos, report);
+    }
+
+    free(infos);
+    functionTable_close(&table);
+    return err;
+}
+
+// -------------------------- PRIVATE FUNCTIONS ----------------------------- //
+/// @brief Collects the pointers every function reads and writes itself.
+/// Callees restore or never change the pointers of their caller, so calls
+/// don't add to the set. The callee of a tail call returns from the frame
+/// of the caller, so both keep the full frame, as do the functions that
+/// other modules call with the full frame
+static ErrorCode callFrames_analyze(const Program* prog, const FunctionTable* table, FrameInfo* infos)
+{
+    for (size_t f = 0; f < prog->numFiles; f++) {
+        const VmFile* file = &prog->files[f];
+        size_t current = NO_FUNCTION;
+        for (size_t i = 0; i < file->numCmds; i++) {
+            const Command* cmd = &file->cmds[i];
+            if (cmd->type == CMD_FUNCTION) {
+                current = functionTable_indexOf(table, cmd->Arg1);
+                continue;
+            }
+            if (current == NO_FUNCTION) {
+                continue;
+            }
+
+            pointerAccesses(cmd, &infos[current].reads, &infos[current].writes);
+            if (cmd->type == CMD_TAIL_CALL || cmd->type == CMD_TAIL_JUMP) {
+                infos[current].fullFrameReason = "makes tail calls";
+                size_t callee = functionTable_indexOf(table, cmd->Arg1);
+                if (callee != NO_FUNCTION) {
+                    infos[callee].fullFrameReason = "tail call target";
+                }
+            }
+        }
+    }
+
+    size_t boot = functionTable_indexOf(table, "Sys.init");
+    if (boot != NO_FUNCTION) {
+        infos[boot].fullFrameReason = "called by the bootstrap code";
+    }
+    for (size_t i = 0; i < table->numFuncs; i++) {
+        if (infos[i].fullFrameReason == NULL && program_isCalledExternally(prog, table->funcs[i].name)) {
+            infos[i].fullFrameReason = "called from another module";
+        }
+        if (infos[i].fullFrameReason == NULL && (infos[i].writes & POINTER_ALL) == POINTER_ALL) {
+            infos[i].fullFrameReason = "writes THIS and THAT";
+        }
+    }
+    return OK;
+}
+
+/// @brief Functions whose code runs on the frame of another function, by
+/// falling through into it or jumping to one of its labels, keep the full frame
+static ErrorCode callFrames_checkSharedCode(const Program* prog, const FunctionTable* table,
+                                           FrameInfo* infos)
+{
+    FunctionEdge* edges = NULL;
+    size_t numEdges = 0;
+    ErrorCode err = program_findSharedCode(prog, table, &edges, &numEdges);
+    if (err != OK) return err;
+
+    for (size_t e = 0; e < numEdges; e++) {
+        infos[edges[e].from].fullFrameReason = "continues into another function";
+        infos[edges[e].to].fullFrameReason = "entered without a call";
+    }
+    free(edges);
+    return OK;
+}
+
+/// @brief Turns the calls and returns of the functions that don't need the
+/// full frame into CMD_LIGHT_CALL and CMD_LIGHT_RETURN, which only save the
+/// pointers the function writes besides LCL and ARG
+static void callFrames_rewrite(Program* prog, const FunctionTable* table, const FrameInfo* infos,
+                               FILE* report)
+{
+    size_t numCalls = 0;
+    size_t numLightCalls = 0;
+
+    for (size_t f = 0; f < prog->numFiles; f++) {
+        VmFile* file = &prog->files[f];
+        size_t current = NO_FUNCTION;
+
+        for (size_t i = 0; i < file->numCmds; i++) {
+            Command* cmd = &file->cmds[i];
+            if (cmd->type == CMD_FUNCTION) {
+                current = functionTable_indexOf(table, cmd->Arg1);
+            }
+            else if (cmd->type == CMD_CALL) {
+                numCalls++;
+                size_t callee = functionTable_indexOf(table, cmd->Arg1);
+                if (callee == NO_FUNCTION || infos[callee].fullFrameReason != NULL) {
+                    continue;
+                }
+                unsigned saved = infos[callee].writes;
+                if (saved != 0) {
+                    size_t len = strlen(cmd->Arg2);
+                    snprintf(&cmd->Arg2[len], MAX_IDENTIFIER_LEN - len, " %s", pointerArgs(saved));
+                }
+                cmd->type = CMD_LIGHT_CALL;
+                numLightCalls++;
+            }
+            else if (cmd->type == CMD_RETURN && current != NO_FUNCTION &&
+                     infos[current].fullFrameReason == NULL) {
+                cmd->type = CMD_LIGHT_RETURN;
+                strcpy(cmd->Arg1, pointerArgs(infos[current].writes));
+            }
+        }
+    }
+
+    if (report != NULL) {
+        fprintf(report, "Reduced frames: %zu of %zu calls\n", numLightCalls, numCalls);
+    }
+}
+
+static void callFrames_report(const FunctionTable* table, const FrameInfo* infos, FILE* report)
+{
+    for (size_t i = 0; i < table->numFuncs; i++) {
+        const FrameInfo* info = &infos[i];
+        fprintf(report, "Frame of %s: reads %s, writes %s, ", table->funcs[i].name,
+                pointerNames(info->reads), pointerNames(info->writes));
+        if (info->fullFrameReason != NULL) {
+            fprintf(report, "full frame (%s)\n", info->fullFrameReason);
+        }
+        else {
+            fprintf(report, "saves LCL ARG%s%s\n", (info->writes != 0) ? " " : "",
+                    (info->writes != 0) ? pointerNames(info->writes) : "");
+        }
+    }
+}
+
+static void pointerAccesses(const Command* cmd, unsigned* reads, unsigned* writes)
+{
+    bool isPointer = (cmd->type == CMD_PUSH || cmd->type == CMD_POP) &&
+                     (strcmp(cmd->Arg1, "pointer") == 0);
+    unsigned pointer = (atol(cmd->Arg2) == 0) ? POINTER_THIS : POINTER_THAT;
+
+    if (isPointer) {
+        *(cmd->type == CMD_PUSH ? reads : writes) |= pointer;
+    }
+    else if (cmd->type == CMD_PUSH || cmd->type == CMD_POP) {
+        // Segment accesses read the pointer to address the segment
+        if (strcmp(cmd->Arg1, "this") == 0) *reads |= POINTER_THIS;
+        if (strcmp(cmd->Arg1, "that") == 0) *reads |= POINTER_THAT;
+    }
+    else if ((cmd->type == CMD_ARRAY_LOAD || cmd->type == CMD_ARRAY_STORE) &&
+             strcmp(cmd->Arg1, "that") == 0) {
+        *writes |= POINTER_THAT;
+    }
+}
+
+/// @return The saved pointers as written in the arguments of the light
+/// call and return commands
+static const char* pointerArgs(unsigned pointers)
+{
+    switch (pointers & POINTER_ALL) {
+        case POINTER_THIS:  return "this";
+        case POINTER_THAT:  return "that";
+        case POINTER_ALL:   return "this that";
+        default:            return "";
+    }
+}
+
+static const char* pointerNames(unsigned pointers)
+{
+    switch (pointers & POINTER_ALL) {
+        case POINTER_THIS:  return "THIS";
+        case POINTER_THAT:  return "THAT";
+        case POINTER_ALL:   return "THIS THAT";
+        default:            return "-";
+    }
+}
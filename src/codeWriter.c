@@ -2,17 +2,24 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include "arena.h"
+#include "bytecode.h"
 #include "errorHandler.h"
 #include "keywords.h"
+#include "optimizer.h"
+#include "outliner.h"
 #include "parser.h"
+#include "profile.h"
 #include "codeWriter.h"
 
 ///////////////////////////////////////////////////////////
 // Macros and defines
 ///////////////////////////////////////////////////////////
-#define NUM_ULONG_MAX_RANGE_CHARS               (11) // 4'294'967'295 has 11 chars
+#define CODE_WRITER_ARENA_BLOCK_SIZE            (4 * 1024)
+#define NUM_ULONG_MAX_RANGE_CHARS               (20) // 18'446'744'073'709'551'615 has 20 digits
+#define LABEL_ID_SIZE                           (MAX_IDENTIFIER_LEN + sizeof("$") + NUM_ULONG_MAX_RANGE_CHARS)
 #define GET_RETURN_ADDR_LABEL_SIZE(funcName)    \
-    (sizeof(funcName) + sizeof("_retAddr") + sizeof("_") + NUM_ULONG_MAX_RANGE_CHARS)
+    (sizeof(funcName) + sizeof("_retAddr") + sizeof("_") + LABEL_ID_SIZE)
 
 // The following are very common operations throughout the program, so macros were defined
 #define GENERATE_PUSH_CONSTANT_CODE(file, constant)    \
@@ -22,6 +29,58 @@
 
 #define GENERATE_GOTO_CODE(file, labelName)                 fprintf(file, "    @%s\n    0; JMP\n", (labelName))
 
+// Pushes the value held in D. One instruction shorter than the sequence used
+// by the generic templates, as the stack pointer is only addressed once
+#define GENERATE_PUSH_D_CODE(file)    \
+    fprintf(file, "    @SP\n    M=M+1\n    A=M-1\n    M=D\n")
+
+// Segment offsets below this limit are reached with a chain of A=A+1
+// instructions instead of loading the offset into A and adding it
+#define SEGMENT_OFFSET_CHAIN_LIMIT              (4)
+#define TEMP_SEGMENT_BASE_ADDR                  (5)
+#define TEMP_SEGMENT_SIZE                       (8)
+
+// Cost model weights, as {ROM words, executed instructions}
+#define SPEED_COST_WEIGHTS                      { 1, 4 }
+#define SIZE_COST_WEIGHTS                       { 4, 1 }
+
+// With -fsp-batching, stack slots at most this far from the stored SP are
+// reached with an increment chain. Further slots force SP to be updated
+#define STACK_OFFSET_CHAIN_LIMIT                (3)
+
+// Words pushed by a call on top of its arguments: return address, LCL, ARG,
+// THIS and THAT
+#define CALL_FRAME_SIZE                         (5)
+
+// Segment pointers saved by a call, in the order they are pushed
+#define FRAME_POINTERS                          { "LCL", "ARG", "THIS", "THAT" }
+#define NUM_FRAME_POINTERS                      (4)
+
+// Slots of the "frame" segment are assembler variables, which the assembler
+// places next to the static variables
+#define STATIC_FRAME_SYMBOL                     "__FRAME"
+
+// Calls and returns of the functions a profile finds cold jump to these
+#define CALL_ROUTINE_LABEL                      "__CALL"
+#define RETURN_ROUTINE_LABEL                    "__RETURN"
+
+#define MULTIPLY_ROUTINE_LABEL                  "__MULTIPLY"
+#define DIVIDE_ROUTINE_LABEL                    "__DIVIDE"
+#define SHIFT_RIGHT_ROUTINE_LABEL               "__SHIFT_RIGHT"
+#define WORD_BITS                               (16)
+// Rough instruction counts of the shared arithmetic routines, for the cost
+// model. The multiplication loop runs once per bit up to the highest set
+// bit of its second operand, the division loop once per bit of the word
+#define MULTIPLY_ROUTINE_CYCLES(bits)           (30 + 25 * (bits))
+#define DIVIDE_ROUTINE_CYCLES                   (60 + 35 * WORD_BITS)
+#define SHIFT_RIGHT_STEP_CYCLES                 (11)
+
+#define ZERO_LOCALS_ROUTINE_LABEL               "__ZERO_LOCALS"
+// The shared zeroing routine is written once and reused by every function
+// prologue that jumps into it. As code is written as it is translated, the
+// cost model assumes it is shared by this many functions
+#define ZERO_LOCALS_ROUTINE_EXPECTED_USERS      (4)
+
 ///////////////////////////////////////////////////////////
 // Local file-scoped functions and variables
 ///////////////////////////////////////////////////////////
@@ -31,91 +90,198 @@ static ErrorCode codeWriter_writePop(CodeWriter* cw, const Command* cmd);
 static ErrorCode codeWriter_writeLabel(CodeWriter* cw, const Command* cmd);
 static ErrorCode codeWriter_writeGoto(CodeWriter* cw, const Command* cmd);
 static ErrorCode codeWriter_writeIfGoto(CodeWriter* cw, const Command* cmd);
+static const char* ifGotoName(const Command* cmd);
+static const char* ifGotoJump(const Command* cmd);
 static ErrorCode codeWriter_writeFunction(CodeWriter* cw, const Command* cmd);
 static ErrorCode codeWriter_writeFunctionCall(CodeWriter* cw, const Command* cmd);
 static ErrorCode codeWriter_writeReturn(CodeWriter* cw, const Command* cmd);
-static char* codeWriter_getBaseFileName(CodeWriter* cw);
+static ErrorCode codeWriter_writeLightCall(CodeWriter* cw, const Command* cmd);
+static ErrorCode codeWriter_writeLightReturn(CodeWriter* cw, const Command* cmd);
+static ErrorCode codeWriter_writeCallFrame(CodeWriter* cw, const Command* cmd,
+                                           const char* const* pointers, int numPointers);
+static void codeWriter_writeFrameReturn(CodeWriter* cw, const char* const* pointers, int numPointers);
+static int lightFramePointers(const char* savedList, const char** pointers);
+static ErrorCode codeWriter_writeClearFrame(CodeWriter* cw, const Command* cmd);
+static ErrorCode codeWriter_writeDiscard(CodeWriter* cw, const Command* cmd);
+static ErrorCode codeWriter_writeTailCall(CodeWriter* cw, const Command* cmd);
+static ErrorCode codeWriter_writeTailJump(CodeWriter* cw, const Command* cmd);
+static void codeWriter_writeMoveFrameSlot(CodeWriter* cw, int slot, long shift);
+static ErrorCode codeWriter_writeSharedCall(CodeWriter* cw, const Command* cmd);
+static void codeWriter_writeCallRoutine(CodeWriter* cw);
+static void codeWriter_writeReturnRoutine(CodeWriter* cw);
+static ErrorCode codeWriter_writeIntrinsic(CodeWriter* cw, const Command* cmd);
+static void codeWriter_writeRoutineCall(CodeWriter* cw, const char* routine);
+static void codeWriter_writeMultiplyByConstant(CodeWriter* cw, long factor);
+static void codeWriter_writeDivideByPowerOfTwo(CodeWriter* cw, long divisor);
+static void codeWriter_writeMultiplyRoutine(CodeWriter* cw);
+static void codeWriter_writeDivideRoutine(CodeWriter* cw);
+static void codeWriter_writeShiftRightRoutine(CodeWriter* cw);
+static int bitLength(long value);
+static ErrorCode codeWriter_writeArrayLoad(CodeWriter* cw, const Command* cmd);
+static ErrorCode codeWriter_writeArrayStore(CodeWriter* cw, const Command* cmd);
+static int popCount(long value);
+static bool codeWriter_writeSpecializedLoad(CodeWriter* cw, const Command* cmd);
+static bool codeWriter_writeSpecializedPush(CodeWriter* cw, const Command* cmd);
+static bool codeWriter_writeSpecializedPop(CodeWriter* cw, const Command* cmd);
+static void codeWriter_writeSegmentAddress(CodeWriter* cw, const char* basePtr, long index);
+static const char* getSegmentBasePointer(const char* segment);
+static bool parseSegmentIndex(const char* str, long* index);
+static void codeWriter_writeConstantToD(CodeWriter* cw, const char* constant);
+static void codeWriter_writeCompactPrologue(CodeWriter* cw, const char* funcName, long nVars);
+
+typedef enum {
+    PROLOGUE_UNROLLED,  // Zero-fill every local, then advance SP once
+    PROLOGUE_LOOP,      // Counted loop pushing one zero per iteration
+    PROLOGUE_SHARED,    // Jump into a shared chain of zeroing pushes
+} PrologueStrategy;
+
+typedef struct SequenceCost {
+    unsigned long words;   // ROM words added to the program
+    unsigned long cycles;  // Instructions executed per invocation
+} SequenceCost;
 
-// The generated label for the return address of a function will be:
-// <functionName>_retAddr_<returnAddressCounter>
-// The counter was added at the end so that it serves as a unique identifier
-// when the same function is called twice. Without it, the same label would be
-// generated at different addresses, and the last one would overwrite all of the
-// previous ones
-static unsigned long returnAddressCounter = 0;
+static unsigned long costModel_score(CostModel model, SequenceCost cost);
+static CostModel functionCostModel(const Options* opts, const char* function);
+static PrologueStrategy choosePrologue(CostModel model, long routineLength, long nVars);
+
+static ErrorCode codeWriter_writeBatched(CodeWriter* cw, const Command* cmd, bool* written);
+static ErrorCode codeWriter_writeBatchedPush(CodeWriter* cw, const Command* cmd);
+static ErrorCode codeWriter_writeBatchedPop(CodeWriter* cw, const Command* cmd);
+static ErrorCode codeWriter_writeBatchedArithmetic(CodeWriter* cw, const Command* cmd);
+static ErrorCode codeWriter_writeBatchedIfGoto(CodeWriter* cw, const Command* cmd);
+static void codeWriter_commitStackPointer(CodeWriter* cw);
+static void codeWriter_reserveStackSlots(CodeWriter* cw, long lowest, long highest);
+static void codeWriter_writeStackSlotAddress(CodeWriter* cw, long slot);
+static ErrorCode codeWriter_writeLoadSegmentValue(CodeWriter* cw, const Command* cmd);
+static ErrorCode codeWriter_writePopTargetSetup(CodeWriter* cw, const Command* cmd, bool* viaR13);
+static void codeWriter_writeStoreToPopTarget(CodeWriter* cw, const Command* cmd, bool viaR13);
+static bool isBatchableSegmentAccess(const Command* cmd);
+static ErrorCode codeWriter_writeCached(CodeWriter* cw, const Command* cmd, bool* written);
+static ErrorCode codeWriter_writeCachedPop(CodeWriter* cw, const Command* cmd);
+static ErrorCode codeWriter_writeCachedArithmetic(CodeWriter* cw, const Command* cmd);
+static void codeWriter_spillTopOfStack(CodeWriter* cw);
+static void codeWriter_writePushD(CodeWriter* cw);
+static void codeWriter_writePopToD(CodeWriter* cw);
+static void codeWriter_writePopAddress(CodeWriter* cw);
+static void codeWriter_writeTopAddress(CodeWriter* cw);
+static bool popTargetNeedsR13(CodeWriter* cw, const Command* cmd);
+static bool isBinaryArithmetic(const char* op);
+
+static void codeWriter_trackStackDepth(CodeWriter* cw, const Command* cmd);
+static void codeWriter_recordLabelDepth(CodeWriter* cw, const char* label, long depth);
+static void codeWriter_reportStackUsage(CodeWriter* cw);
+static ErrorCode codeWriter_writeOutlined(CodeWriter* cw);
+static void codeWriter_enterLabelScope(CodeWriter* cw, const char* scope);
+static void codeWriter_enterFunction(CodeWriter* cw, const char* function);
+static void codeWriter_init(CodeWriter* cw, const Options* opts);
+static ErrorCode codeWriter_collectInMemory(CodeWriter* cw);
+static const char* codeWriter_nextLabelId(CodeWriter* cw, unsigned long* counter, char* id);
+
+// Used when codeWriter_new() is not given any options
+static const Options defaultOptions = { 0 };
 
 ///////////////////////////////////////////////////////////
 // PUBLIC FUNCTIONS
 ///////////////////////////////////////////////////////////
-ErrorCode codeWriter_new(CodeWriter *cw, const char* fileOrDirName, FileType fileType)
+ErrorCode codeWriter_new(CodeWriter *cw, const char* fileOrDirName, FileType fileType,
+                         const Options* opts)
 {
-    char* fileExtension = "";
-
-    // Initialize the current processed file name to NULL
-    // This should be later set with codeWriter_setCurrentFileName()
-    cw->currentVMfile = NULL;
-    cw->currentVMfile = 0;
+    codeWriter_init(cw, opts);
 
-    //  Only generate code for .vm files
+    //  Only generate code for .vm and .vmb files. A .vmb file can't be
+    //  written from itself, as it would be truncated before being loaded
+    size_t inExtensionLen = 0;
     if (FILE_REGULAR == fileType) {
-        if (strcmp(&fileOrDirName[strlen(fileOrDirName) - 3], ".vm") != 0) {
+        size_t nameLen = strlen(fileOrDirName);
+        if (nameLen >= strlen(".vm") && strcmp(&fileOrDirName[nameLen - 3], ".vm") == 0) {
+            inExtensionLen = strlen(".vm");
+        }
+        else if (nameLen >= strlen(".vmb") && strcmp(&fileOrDirName[nameLen - 4], ".vmb") == 0 &&
+                 !cw->opts->emitBinary) {
+            inExtensionLen = strlen(".vmb");
+        }
+        else {
             logError(ERR_FILENAME_NOT_VM, NULL);
             return (ERR_FILENAME_NOT_VM);
         }
-
-        fileExtension = "vm";
     }
 
     // Allocate memory for the file name
-    cw->outFileNameLen = strlen(fileOrDirName) - strlen(fileExtension) + strlen("asm");
-    cw->outFileName = malloc(cw->outFileNameLen);
+    const char* outExtension = cw->opts->emitBinary ? ".vmb" : cw->opts->emitObject ? ".vmo" : ".asm";
+    size_t baseLen = strlen(fileOrDirName) - inExtensionLen;
+    cw->outFileNameLen = baseLen + strlen(outExtension);
+    cw->outFileName = arena_alloc(&cw->arena, cw->outFileNameLen + 1);
     if (!cw->outFileName) {
         logError(ERR_PROG_OUT_OF_MEMORY, NULL);
         return ERR_PROG_OUT_OF_MEMORY;
     }
 
     // Replace the filename extension
-    if (FILE_REGULAR == fileType) {
-        strncpy(cw->outFileName, fileOrDirName, strlen(fileOrDirName) - strlen(".vm"));
-    }
-    else if (FILE_DIR == fileType) {
-        strncpy(cw->outFileName, fileOrDirName, strlen(fileOrDirName));
-    }
-    strcpy(&cw->outFileName[strlen(cw->outFileName)], ".asm");
+    memcpy(cw->outFileName, fileOrDirName, baseLen);
+    strcpy(&cw->outFileName[baseLen], outExtension);
+    cw->fileMark = arena_mark(&cw->arena);
 
     cw->outputFile = fopen(cw->outFileName, "w");
     if (!cw->outputFile) {
         logError(ERR_CANT_OPEN_OUTFILE, NULL);
         return ERR_CANT_OPEN_OUTFILE;
     }
-    return OK;
+    return codeWriter_collectInMemory(cw);
 }
 
-void codeWriter_close(CodeWriter *cw)
+ErrorCode codeWriter_newInMemory(CodeWriter* cw, char** output, size_t* outputSize,
+                                 const Options* opts)
 {
-    assert(cw->outFileName != NULL);
-    free(cw->outFileName);
+    codeWriter_init(cw, opts);
     cw->outFileName = NULL;
+    cw->outFileNameLen = 0;
+    cw->outputFile = open_memstream(output, outputSize);
+    if (!cw->outputFile) {
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+    return codeWriter_collectInMemory(cw);
+}
+
+void codeWriter_close(CodeWriter *cw)
+{
     if (cw->outputFile) {
         fclose(cw->outputFile);
         cw->outputFile = NULL;
     }
-
-    if (cw->currentVMfile == NULL) {
-        free(cw->currentVMfile);
+    if (cw->targetFile) {
+        fclose(cw->targetFile);
+        cw->targetFile = NULL;
     }
+    free(cw->buffer);
+    cw->buffer = NULL;
+
+    free(cw->stack.labels);
+    cw->stack.labels = NULL;
+
+    // The names of the output and of the current file go with the arena
+    arena_close(&cw->arena);
+    cw->outFileName = NULL;
+    cw->currentVMfile = NULL;
+    cw->staticPrefix = NULL;
 }
 
 ErrorCode codeWriter_setCurrentFileName(CodeWriter* cw, const char* fileName)
 {
-    if (cw->currentVMfile != NULL) {
-        free(cw->currentVMfile);
-    }
+    // The names of the previous file are not used anymore
+    arena_release(&cw->arena, cw->fileMark);
     cw->currentVMfileLen = strlen(fileName);
-    cw->currentVMfile = strdup(fileName);
-    if (cw->currentVMfile == NULL) {
+    cw->currentVMfile = arena_strdup(&cw->arena, fileName);
+    cw->staticPrefix = arena_alloc(&cw->arena, cw->currentVMfileLen + 1);
+    if (cw->currentVMfile == NULL || cw->staticPrefix == NULL) {
         return ERR_PROG_OUT_OF_MEMORY;
     }
+    vmFile_formatStaticPrefix(cw->staticPrefix, fileName);
+
+    // Code before the first function gets its labels numbered per file
+    if (cw->opts->jobs > 0) {
+        codeWriter_enterLabelScope(cw, cw->staticPrefix);
+    }
     return OK;
 }
 
@@ -133,9 +299,201 @@ ErrorCode codeWriter_writeStartupCode(CodeWriter *cw)
     return OK;
 }
 
+ErrorCode codeWriter_finish(CodeWriter *cw)
+{
+    codeWriter_spillTopOfStack(cw);
+    codeWriter_commitStackPointer(cw);
+    codeWriter_reportStackUsage(cw);
+
+    if (cw->zeroRoutineLength > 0) {
+        // Each entry pushes one zero and falls through to the next one,
+        // so jumping to entry n pushes n zeros. The return address is in D,
+        // which the routine never touches
+        fprintf(cw->outputFile, "\n// Shared zeroing routine for function prologues\n");
+        for (long i = cw->zeroRoutineLength; i > 0; i--) {
+            fprintf(cw->outputFile, "(%s_%ld)\n", ZERO_LOCALS_ROUTINE_LABEL, i);
+            fprintf(cw->outputFile, "    @SP\n    AM=M+1\n    A=A-1\n    M=0\n");
+        }
+        fprintf(cw->outputFile, "    A=D\n    0; JMP\n");
+    }
+    if (cw->callRoutineUsed) {
+        codeWriter_writeCallRoutine(cw);
+    }
+    if (cw->returnRoutineUsed) {
+        codeWriter_writeReturnRoutine(cw);
+    }
+    if (cw->multiplyRoutineUsed) {
+        codeWriter_writeMultiplyRoutine(cw);
+    }
+    if (cw->divideRoutineUsed) {
+        codeWriter_writeDivideRoutine(cw);
+    }
+    if (cw->shiftRightFirstEntry > 0) {
+        codeWriter_writeShiftRightRoutine(cw);
+    }
+    if (cw->targetFile) {
+        return codeWriter_writeOutlined(cw);
+    }
+    return OK;
+}
+
+ErrorCode codeWriter_writeModules(CodeWriter* cw, Linker* linker, const Program* prog)
+{
+    codeWriter_spillTopOfStack(cw);
+    codeWriter_commitStackPointer(cw);
+
+    RoutineUse routines = {
+        .zeroLength = cw->zeroRoutineLength,
+        .multiply = cw->multiplyRoutineUsed,
+        .divide = cw->divideRoutineUsed,
+        .shiftFirst = cw->shiftRightFirstEntry
+    };
+    ErrorCode err = linker_link(linker, prog, cw->outputFile, &routines, cw->reportFile);
+    cw->zeroRoutineLength = routines.zeroLength;
+    cw->multiplyRoutineUsed = routines.multiply;
+    cw->divideRoutineUsed = routines.divide;
+    cw->shiftRightFirstEntry = routines.shiftFirst;
+    return err;
+}
+
+ErrorCode codeWriter_writeObject(CodeWriter* cw, const Program* prog)
+{
+    codeWriter_spillTopOfStack(cw);
+    codeWriter_commitStackPointer(cw);
+    codeWriter_reportStackUsage(cw);
+
+    fclose(cw->outputFile);
+    cw->outputFile = cw->targetFile;
+    cw->targetFile = NULL;
+
+    RoutineUse routines = {
+        .zeroLength = cw->zeroRoutineLength,
+        .multiply = cw->multiplyRoutineUsed,
+        .divide = cw->divideRoutineUsed,
+        .shiftFirst = cw->shiftRightFirstEntry
+    };
+    ErrorCode err = linker_writeModule(cw->outputFile, prog, cw->buffer, cw->bufferSize, &routines);
+    free(cw->buffer);
+    cw->buffer = NULL;
+    return err;
+}
+
+ErrorCode codeWriter_writeBytecode(CodeWriter* cw, const Program* prog)
+{
+    return bytecode_write(prog, cw->outputFile);
+}
+
+ErrorCode codeWriter_newChunk(CodeWriter* chunk, const CodeWriter* cw, FILE* reportFile,
+                              long zeroRoutineLength)
+{
+    memset(chunk, 0, sizeof(CodeWriter));
+    arena_new(&chunk->arena, CODE_WRITER_ARENA_BLOCK_SIZE);
+    chunk->fileMark = arena_mark(&chunk->arena);
+    chunk->opts = cw->opts;
+    chunk->costModel = cw->opts->costModel;
+    chunk->zeroRoutineLength = zeroRoutineLength;
+    chunk->reportFile = reportFile;
+    chunk->outputFile = open_memstream(&chunk->buffer, &chunk->bufferSize);
+    if (!chunk->outputFile) {
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+    return OK;
+}
+
+void codeWriter_endChunk(CodeWriter* chunk)
+{
+    codeWriter_spillTopOfStack(chunk);
+    codeWriter_commitStackPointer(chunk);
+    codeWriter_reportStackUsage(chunk);
+}
+
+ErrorCode codeWriter_appendChunk(CodeWriter* cw, CodeWriter* chunk, bool last)
+{
+    fclose(chunk->outputFile);
+    chunk->outputFile = NULL;
+    if (fwrite(chunk->buffer, 1, chunk->bufferSize, cw->outputFile) != chunk->bufferSize) {
+        logError(ERR_CANT_OPEN_OUTFILE, NULL);
+        return ERR_CANT_OPEN_OUTFILE;
+    }
+
+    if (chunk->zeroRoutineLength > cw->zeroRoutineLength) {
+        cw->zeroRoutineLength = chunk->zeroRoutineLength;
+    }
+    cw->multiplyRoutineUsed |= chunk->multiplyRoutineUsed;
+    cw->divideRoutineUsed |= chunk->divideRoutineUsed;
+    cw->callRoutineUsed |= chunk->callRoutineUsed;
+    cw->returnRoutineUsed |= chunk->returnRoutineUsed;
+    arenaStats_add(&cw->arena.stats, &chunk->arena.stats);
+    if (chunk->shiftRightFirstEntry > 0 &&
+        (cw->shiftRightFirstEntry == 0 || chunk->shiftRightFirstEntry < cw->shiftRightFirstEntry)) {
+        cw->shiftRightFirstEntry = chunk->shiftRightFirstEntry;
+    }
+
+    // The end of the last chunk is the end of the program, which is left to
+    // codeWriter_finish() like in a serial run
+    if (last) {
+        cw->spOffset = chunk->spOffset;
+        cw->tosInD = chunk->tosInD;
+        cw->labels = chunk->labels;
+        strcpy(cw->stack.function, chunk->stack.function);
+        cw->stack.nLocals = chunk->stack.nLocals;
+        cw->stack.depth = chunk->stack.depth;
+        cw->stack.maxDepth = chunk->stack.maxDepth;
+        cw->stack.reachable = chunk->stack.reachable;
+        cw->costModel = chunk->costModel;
+        cw->coldFunction = chunk->coldFunction;
+    }
+    return OK;
+}
+
+void codeWriter_closeChunk(CodeWriter* chunk)
+{
+    if (chunk->outputFile) {
+        fclose(chunk->outputFile);
+        chunk->outputFile = NULL;
+    }
+    free(chunk->buffer);
+    chunk->buffer = NULL;
+    free(chunk->stack.labels);
+    chunk->stack.labels = NULL;
+    arena_close(&chunk->arena);
+    chunk->currentVMfile = NULL;
+    chunk->staticPrefix = NULL;
+}
+
+long codeWriter_prologueRoutineLength(const Options* opts, long routineLength, const Command* cmd)
+{
+    long nVars = atol(cmd->Arg2);
+    if (!opts->compactPrologue || nVars <= routineLength) {
+        return routineLength;
+    }
+    if (choosePrologue(functionCostModel(opts, cmd->Arg1), routineLength, nVars) ==
+        PROLOGUE_SHARED) {
+        return nVars;
+    }
+    return routineLength;
+}
+
 ErrorCode codeWriter_translateCmd(CodeWriter *cw, const Command *cmd)
 {
     ErrorCode err = ERR_UNKNOWN;
+    codeWriter_trackStackDepth(cw, cmd);
+    if (cmd->type == CMD_FUNCTION) {
+        codeWriter_enterFunction(cw, cmd->Arg1);
+    }
+
+    if (cw->opts->cacheTopOfStack) {
+        bool written = false;
+        err = codeWriter_writeCached(cw, cmd, &written);
+        if (err != OK || written) return err;
+    }
+    else if (cw->opts->batchStackPointer) {
+        bool written = false;
+        err = codeWriter_writeBatched(cw, cmd, &written);
+        if (err != OK || written) return err;
+    }
+
     switch (cmd->type) {
         case CMD_ARITHMETIC:
         {
@@ -168,6 +526,7 @@ ErrorCode codeWriter_translateCmd(CodeWriter *cw, const Command *cmd)
             break;
         }
         case CMD_IF:
+        case CMD_IF_NOT:
         {
             err = codeWriter_writeIfGoto(cw, cmd);
             if (err != OK) return err;
@@ -191,6 +550,60 @@ ErrorCode codeWriter_translateCmd(CodeWriter *cw, const Command *cmd)
             if (err != OK) return err;
             break;
         }
+        case CMD_CLEAR_FRAME:
+        {
+            err = codeWriter_writeClearFrame(cw, cmd);
+            if (err != OK) return err;
+            break;
+        }
+        case CMD_DISCARD:
+        {
+            err = codeWriter_writeDiscard(cw, cmd);
+            if (err != OK) return err;
+            break;
+        }
+        case CMD_LIGHT_CALL:
+        {
+            err = codeWriter_writeLightCall(cw, cmd);
+            if (err != OK) return err;
+            break;
+        }
+        case CMD_LIGHT_RETURN:
+        {
+            err = codeWriter_writeLightReturn(cw, cmd);
+            if (err != OK) return err;
+            break;
+        }
+        case CMD_TAIL_CALL:
+        {
+            err = codeWriter_writeTailCall(cw, cmd);
+            if (err != OK) return err;
+            break;
+        }
+        case CMD_TAIL_JUMP:
+        {
+            err = codeWriter_writeTailJump(cw, cmd);
+            if (err != OK) return err;
+            break;
+        }
+        case CMD_INTRINSIC:
+        {
+            err = codeWriter_writeIntrinsic(cw, cmd);
+            if (err != OK) return err;
+            break;
+        }
+        case CMD_ARRAY_LOAD:
+        {
+            err = codeWriter_writeArrayLoad(cw, cmd);
+            if (err != OK) return err;
+            break;
+        }
+        case CMD_ARRAY_STORE:
+        {
+            err = codeWriter_writeArrayStore(cw, cmd);
+            if (err != OK) return err;
+            break;
+        }
         default:
             break;
     }
@@ -198,6 +611,51 @@ ErrorCode codeWriter_translateCmd(CodeWriter *cw, const Command *cmd)
 }
 
 // --------------------------- PRIVATE FUNCTIONS ---------------------------- //
+/// @brief Resets the translation state, before the output is opened
+static void codeWriter_init(CodeWriter* cw, const Options* opts)
+{
+    cw->opts = (opts != NULL) ? opts : &defaultOptions;
+    cw->zeroRoutineLength = 0;
+    cw->multiplyRoutineUsed = false;
+    cw->divideRoutineUsed = false;
+    cw->shiftRightFirstEntry = 0;
+    cw->callRoutineUsed = false;
+    cw->returnRoutineUsed = false;
+    cw->costModel = cw->opts->costModel;
+    cw->coldFunction = false;
+    cw->spOffset = 0;
+    cw->tosInD = false;
+    cw->targetFile = NULL;
+    cw->buffer = NULL;
+    cw->bufferSize = 0;
+    cw->reportFile = cw->opts->reportFile;
+    memset(&cw->labels, 0, sizeof(LabelCounters));
+    memset(&cw->stack, 0, sizeof(StackUsage));
+    arena_new(&cw->arena, CODE_WRITER_ARENA_BLOCK_SIZE);
+    cw->fileMark = arena_mark(&cw->arena);
+
+    // Initialize the current processed file name to NULL
+    // This should be later set with codeWriter_setCurrentFileName()
+    cw->currentVMfile = NULL;
+    cw->staticPrefix = NULL;
+}
+
+/// @brief Outlining needs the whole program and an object module starts
+/// with what the code uses, so the code is collected in memory first and
+/// the opened output becomes the target
+static ErrorCode codeWriter_collectInMemory(CodeWriter* cw)
+{
+    if ((cw->opts->outline || cw->opts->emitObject) && !cw->opts->emitBinary) {
+        cw->targetFile = cw->outputFile;
+        cw->outputFile = open_memstream(&cw->buffer, &cw->bufferSize);
+        if (!cw->outputFile) {
+            logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+            return ERR_PROG_OUT_OF_MEMORY;
+        }
+    }
+    return OK;
+}
+
 ErrorCode codeWriter_writeArithmetic(CodeWriter* cw, const Command* cmd)
 {
     char* str;
@@ -218,22 +676,22 @@ ErrorCode codeWriter_writeArithmetic(CodeWriter* cw, const Command* cmd)
         fprintf(cw->outputFile, "%s\n", str);
     }
     else if (strcmp(cmd->Arg1, "gt") == 0) {
-        static size_t gt_jump_count = 0;
+        char id[LABEL_ID_SIZE];
+        codeWriter_nextLabelId(cw, &cw->labels.gtJump, id);
         fprintf(cw->outputFile, "// gt\n    @SP\n    AM=M-1\n    D=M\n    A=A-1\n    D=D-M\n");
-        fprintf(cw->outputFile, "    @__GT_%lu\n    D; JLE\n", gt_jump_count);
-        fprintf(cw->outputFile, "    @SP\n    A=M-1\n    M=0\n    @__GT_END_%lu\n", gt_jump_count);
-        fprintf(cw->outputFile, "    0; JMP\n(__GT_%lu)\n    @SP\n A=M-1\n", gt_jump_count);
-        fprintf(cw->outputFile, "    M=1\n(__GT_END_%lu)\n", gt_jump_count);
-        gt_jump_count++;
+        fprintf(cw->outputFile, "    @__GT_%s\n    D; JLE\n", id);
+        fprintf(cw->outputFile, "    @SP\n    A=M-1\n    M=0\n    @__GT_END_%s\n", id);
+        fprintf(cw->outputFile, "    0; JMP\n(__GT_%s)\n    @SP\n A=M-1\n", id);
+        fprintf(cw->outputFile, "    M=1\n(__GT_END_%s)\n", id);
     }
     else if (strcmp(cmd->Arg1, "lt") == 0) {
-        static size_t lt_jump_count = 0;
+        char id[LABEL_ID_SIZE];
+        codeWriter_nextLabelId(cw, &cw->labels.ltJump, id);
         fprintf(cw->outputFile, "// lt\n    @SP\n    AM=M-1\n    D=M\n    A=A-1\n    D=D-M\n");
-        fprintf(cw->outputFile, "    @__LT_%lu\n    D; JGT\n", lt_jump_count);
-        fprintf(cw->outputFile, "    @SP\n    A=M-1\n    M=0\n    @__LT_END_%lu\n", lt_jump_count);
-        fprintf(cw->outputFile, "    0; JMP\n(__LT_%lu)\n    @SP\n A=M-1\n", lt_jump_count);
-        fprintf(cw->outputFile, "    M=1\n(__LT_END_%lu)\n", lt_jump_count);
-        lt_jump_count++;
+        fprintf(cw->outputFile, "    @__LT_%s\n    D; JGT\n", id);
+        fprintf(cw->outputFile, "    @SP\n    A=M-1\n    M=0\n    @__LT_END_%s\n", id);
+        fprintf(cw->outputFile, "    0; JMP\n(__LT_%s)\n    @SP\n A=M-1\n", id);
+        fprintf(cw->outputFile, "    M=1\n(__LT_END_%s)\n", id);
     }
     else if (strcmp(cmd->Arg1, "and") == 0) {
         str = "//   and\n    @SP\n    AM=M-1\n    D=M\n    A=A-1\n    D=D&M\n    M=D";
@@ -255,8 +713,17 @@ ErrorCode codeWriter_writePush(CodeWriter* cw, const Command* cmd)
 {
     fprintf(cw->outputFile, "// push %s %s\n", cmd->Arg1, cmd->Arg2);
 
+    if (cw->opts->specializeSegmentOffsets && codeWriter_writeSpecializedPush(cw, cmd)) {
+        return OK;
+    }
+
     // Implementation for constant and pointer is different, so we return
     // early on either of them
+    if (strcmp(cmd->Arg1, "constant") == 0 && cmd->Arg2[0] == '-') {
+        codeWriter_writeConstantToD(cw, cmd->Arg2);
+        GENERATE_PUSH_D_CODE(cw->outputFile);
+        return OK;
+    }
     if (strcmp(cmd->Arg1, "constant") == 0) {
         GENERATE_PUSH_CONSTANT_CODE(cw->outputFile, cmd->Arg2);
         return OK;
@@ -297,10 +764,13 @@ ErrorCode codeWriter_writePush(CodeWriter* cw, const Command* cmd)
         fprintf(cw->outputFile, "    @5\n    D=A\n");
     }
     else if (strcmp(cmd->Arg1, "static") == 0) {
-        char* baseFileName = codeWriter_getBaseFileName(cw);
-        fprintf(cw->outputFile, "    @%s.%s\n    D=M\n", baseFileName, cmd->Arg2);
+        fprintf(cw->outputFile, "    @%s.%s\n    D=M\n", cw->staticPrefix, cmd->Arg2);
         fprintf(cw->outputFile, "    @SP\n    A=M\n    M=D\n    @SP\n    M=M+1\n");
-        free(baseFileName);
+        return OK;
+    }
+    else if (strcmp(cmd->Arg1, "frame") == 0) {
+        fprintf(cw->outputFile, "    @%s_%s\n    D=M\n", STATIC_FRAME_SYMBOL, cmd->Arg2);
+        GENERATE_PUSH_D_CODE(cw->outputFile);
         return OK;
     }
 
@@ -315,6 +785,10 @@ static ErrorCode codeWriter_writePop(CodeWriter* cw, const Command* cmd)
 {
     fprintf(cw->outputFile, "// pop %s %s\n", cmd->Arg1, cmd->Arg2);
 
+    if (cw->opts->specializeSegmentOffsets && codeWriter_writeSpecializedPop(cw, cmd)) {
+        return OK;
+    }
+
     // Implementation for constant and pointer is different, so we return
     // early on either of them
     if (strcmp(cmd->Arg1, "constant") == 0) {
@@ -357,9 +831,11 @@ static ErrorCode codeWriter_writePop(CodeWriter* cw, const Command* cmd)
         fprintf(cw->outputFile, "    @5\n    D=D+A\n");
     }
     else if (strcmp(cmd->Arg1, "static") == 0) {
-        char* baseFileName = codeWriter_getBaseFileName(cw);
-        fprintf(cw->outputFile, "    @%s.%s\n    M=D\n", baseFileName, cmd->Arg2);
-        free(baseFileName);
+        fprintf(cw->outputFile, "    @%s.%s\n    M=D\n", cw->staticPrefix, cmd->Arg2);
+        return OK;
+    }
+    else if (strcmp(cmd->Arg1, "frame") == 0) {
+        fprintf(cw->outputFile, "    @%s_%s\n    M=D\n", STATIC_FRAME_SYMBOL, cmd->Arg2);
         return OK;
     }
     else {
@@ -393,19 +869,39 @@ static ErrorCode codeWriter_writeIfGoto(CodeWriter* cw, const Command* cmd)
     // For some reason, the If-Goto command has the side effect of decrementing
     // the stack pointer. So it doesn't just checks the top of the stack to
     // know if it should jump or not but it actually pops the value
-    fprintf(cw->outputFile, "// if-goto %s\n", cmd->Arg1);
+    fprintf(cw->outputFile, "// %s %s\n", ifGotoName(cmd), cmd->Arg1);
     fprintf(cw->outputFile, "    @SP\n    AM=M-1\n    D=M\n");
-    fprintf(cw->outputFile, "    @%s\n    D; JGT\n", cmd->Arg1);
+    fprintf(cw->outputFile, "    @%s\n    D; %s\n", cmd->Arg1, ifGotoJump(cmd));
     return OK;
 }
 
+/// @return Name of a conditional jump in comments
+static const char* ifGotoName(const Command* cmd)
+{
+    return (cmd->type == CMD_IF_NOT) ? "if-not" : "if-goto";
+}
+
+/// @return Jump condition on the popped value of a conditional jump
+static const char* ifGotoJump(const Command* cmd)
+{
+    return (cmd->type == CMD_IF_NOT) ? "JLE" : "JGT";
+}
+
 static ErrorCode codeWriter_writeFunction(CodeWriter* cw, const Command* cmd)
 {
+    if (cw->opts->emitObject) {
+        // Marks where the function starts for the dead function elimination of the link
+        fprintf(cw->outputFile, ".function %s\n", cmd->Arg1);
+    }
     fprintf(cw->outputFile, "\n// function %s %s\n", cmd->Arg1, cmd->Arg2);
     GENERATE_LABEL_DECLARATION_CODE(cw->outputFile, cmd->Arg1);
 
     // Convert nVars argument from string to integer
     int nVars = atoi(cmd->Arg2);
+    if (cw->opts->compactPrologue) {
+        codeWriter_writeCompactPrologue(cw, cmd->Arg1, nVars);
+        return OK;
+    }
     for (int i = 0; i < nVars; i++) {
         // Push 0 nVars times into the stack
         GENERATE_PUSH_CONSTANT_CODE(cw->outputFile, "0");
@@ -416,37 +912,57 @@ static ErrorCode codeWriter_writeFunction(CodeWriter* cw, const Command* cmd)
 
 static ErrorCode codeWriter_writeFunctionCall(CodeWriter* cw, const Command* cmd)
 {
+    static const char* const pointers[] = FRAME_POINTERS;
     fprintf(cw->outputFile, "\n// call %s %s\n", cmd->Arg1, cmd->Arg2);
+    if (cw->coldFunction) {
+        return codeWriter_writeSharedCall(cw, cmd);
+    }
+    return codeWriter_writeCallFrame(cw, cmd, pointers, NUM_FRAME_POINTERS);
+}
+
+static ErrorCode codeWriter_writeLightCall(CodeWriter* cw, const Command* cmd)
+{
+    const char* pointers[NUM_FRAME_POINTERS];
+    int numPointers = lightFramePointers(strchr(cmd->Arg2, ' '), pointers);
+    fprintf(cw->outputFile, "\n// call %s %ld (reduced frame)\n", cmd->Arg1, atol(cmd->Arg2));
+    return codeWriter_writeCallFrame(cw, cmd, pointers, numPointers);
+}
 
+/// @brief Pushes the return address and the given segment pointers, then
+/// sets up ARG and LCL for the callee and jumps to it
+static ErrorCode codeWriter_writeCallFrame(CodeWriter* cw, const Command* cmd,
+                                           const char* const* pointers, int numPointers)
+{
     // Return address label will be the function name appended by _retAddr
-    char* retAddrLabel = malloc(sizeof(char) * GET_RETURN_ADDR_LABEL_SIZE(cmd->Arg1));
+    ArenaMark mark = arena_mark(&cw->arena);
+    char* retAddrLabel = arena_alloc(&cw->arena,
+                                     sizeof(char) * GET_RETURN_ADDR_LABEL_SIZE(cmd->Arg1));
 
     if (retAddrLabel == NULL) {
         logError(ERR_PROG_OUT_OF_MEMORY, NULL);
         return ERR_PROG_OUT_OF_MEMORY;
     }
-    sprintf(retAddrLabel, "%s_retAddr_%lu", cmd->Arg1, returnAddressCounter);
-    returnAddressCounter++;
+    char id[LABEL_ID_SIZE];
+    sprintf(retAddrLabel, "%s_retAddr_%s", cmd->Arg1,
+            codeWriter_nextLabelId(cw, &cw->labels.returnAddress, id));
 
     // Push the return address onto the stack
     GENERATE_PUSH_CONSTANT_CODE(cw->outputFile, retAddrLabel);
 
     // Push the caller's segment pointers into the stack
-    fprintf(cw->outputFile, "    @LCL\n    D=M\n    @SP\n    A=M\n    M=D\n    @SP\n    M=M+1");
-    fprintf(cw->outputFile, " // Push LCL\n");
-    fprintf(cw->outputFile, "    @ARG\n    D=M\n    @SP\n    A=M\n    M=D\n    @SP\n    M=M+1");
-    fprintf(cw->outputFile, " // Push ARG\n");
-    fprintf(cw->outputFile, "    @THIS\n    D=M\n    @SP\n    A=M\n    M=D\n    @SP\n    M=M+1");
-    fprintf(cw->outputFile, " // Push THIS\n");
-    fprintf(cw->outputFile, "    @THAT\n    D=M\n    @SP\n    A=M\n    M=D\n    @SP\n    M=M+1");
-    fprintf(cw->outputFile, " // Push THAT\n");
-
-    // Reposition ARG. Subtract 5 because we just pushed 5 things.
+    for (int i = 0; i < numPointers; i++) {
+        fprintf(cw->outputFile, "    @%s\n    D=M\n    @SP\n    A=M\n    M=D\n    @SP\n    M=M+1",
+                pointers[i]);
+        fprintf(cw->outputFile, " // Push %s\n", pointers[i]);
+    }
+
+    // Reposition ARG. Subtract 5 because we just pushed 5 things (fewer
+    // with a reduced frame).
     // We also need to subtract nArgs because that is the address where
     // the arguments start
     // *ARG = *SP - 5 - nArgs, but we can do (5+nArgs) locally and write
     // the result, so it is now *ARG = *SP - (5 + nArgs)
-    const int subtractValue = 5 + atoi(cmd->Arg2);
+    const int subtractValue = 1 + numPointers + atoi(cmd->Arg2);
     // @SP
     // D=M    // D = *SP = RAM[0]
     // @subtractValue
@@ -471,18 +987,41 @@ static ErrorCode codeWriter_writeFunctionCall(CodeWriter* cw, const Command* cmd
     // Write the return label declaration to the file
     GENERATE_LABEL_DECLARATION_CODE(cw->outputFile, retAddrLabel);
 
-    free(retAddrLabel);
-    retAddrLabel = NULL;
+    arena_release(&cw->arena, mark);
     return OK;
 }
 
 static ErrorCode codeWriter_writeReturn(CodeWriter* cw, const Command* cmd)
 {
+    (void)cmd;
+    static const char* const pointers[] = FRAME_POINTERS;
     fprintf(cw->outputFile, "// return\n");
+    if (cw->coldFunction) {
+        GENERATE_GOTO_CODE(cw->outputFile, RETURN_ROUTINE_LABEL);
+        cw->returnRoutineUsed = true;
+        return OK;
+    }
+    codeWriter_writeFrameReturn(cw, pointers, NUM_FRAME_POINTERS);
+    return OK;
+}
+
+static ErrorCode codeWriter_writeLightReturn(CodeWriter* cw, const Command* cmd)
+{
+    const char* pointers[NUM_FRAME_POINTERS];
+    int numPointers = lightFramePointers(cmd->Arg1, pointers);
+    fprintf(cw->outputFile, "// return (reduced frame)\n");
+    codeWriter_writeFrameReturn(cw, pointers, numPointers);
+    return OK;
+}
 
+/// @brief Returns from a frame holding the return address and the given
+/// segment pointers, restoring them
+static void codeWriter_writeFrameReturn(CodeWriter* cw, const char* const* pointers, int numPointers)
+{
     // Save return address into a temporary variable, as now LCL points to the
     // end of frame, but LCL will soon be overwriten with its old value
-    fprintf(cw->outputFile, "    @LCL\n    D=M\n    @5\n    A=D-A\n    D=M\n    @retAddrVar\n    M=D\n");
+    fprintf(cw->outputFile, "    @LCL\n    D=M\n    @%d\n    A=D-A\n    D=M\n    @retAddrVar\n    M=D\n",
+            1 + numPointers);
 
     // Move return value into the position of Argument 0 in the stack
     // At this point, the return value must be at the top of the stack
@@ -508,33 +1047,1425 @@ static ErrorCode codeWriter_writeReturn(CodeWriter* cw, const Command* cmd)
     // D=M    // D = RAM[ RAM[1] - 2]
     // @THIS
     // M=D
-    fprintf(cw->outputFile, "    @LCL\n    D=M\n    @1\n    A=D-A\n    D=M\n    @THAT\n    M=D\n");
-    fprintf(cw->outputFile, "    @LCL\n    D=M\n    @2\n    A=D-A\n    D=M\n    @THIS\n    M=D\n");
-    fprintf(cw->outputFile, "    @LCL\n    D=M\n    @3\n    A=D-A\n    D=M\n    @ARG\n    M=D\n");
-    fprintf(cw->outputFile, "    @LCL\n    D=M\n    @4\n    A=D-A\n    D=M\n    @LCL\n    M=D\n");
+    // LCL is restored last, as it is the base of the frame
+    for (int i = numPointers - 1; i >= 0; i--) {
+        fprintf(cw->outputFile, "    @LCL\n    D=M\n    @%d\n    A=D-A\n    D=M\n    @%s\n    M=D\n",
+                numPointers - i, pointers[i]);
+    }
 
     // Retrieve return address from the stack and go to it
     fprintf(cw->outputFile, "    @retAddrVar\n    A=M\n");
     fprintf(cw->outputFile, "    0; JMP\n");
+}
+
+/// @brief Zeroes the static frame slots holding the locals of a function,
+/// which are not reserved on the stack
+static ErrorCode codeWriter_writeClearFrame(CodeWriter* cw, const Command* cmd)
+{
+    long first = atol(cmd->Arg1);
+    long count = atol(cmd->Arg2);
+    fprintf(cw->outputFile, "// clear frame %s %s\n", cmd->Arg1, cmd->Arg2);
+    for (long slot = first; slot < first + count; slot++) {
+        fprintf(cw->outputFile, "    @%s_%ld\n    M=0\n", STATIC_FRAME_SYMBOL, slot);
+    }
+    return OK;
+}
+
+/// @brief Drops values from the top of the stack. A cached top of the stack
+/// is dropped without being written, and with -fsp-batching the others only
+/// change the pending SP offset
+static ErrorCode codeWriter_writeDiscard(CodeWriter* cw, const Command* cmd)
+{
+    long count = atol(cmd->Arg2);
+    fprintf(cw->outputFile, "// discard %s\n", cmd->Arg2);
+    if (cw->tosInD && count > 0) {
+        cw->tosInD = false;
+        count--;
+    }
+    if (cw->opts->batchStackPointer) {
+        cw->spOffset -= count;
+        return OK;
+    }
+    if (count > 0) {
+        fprintf(cw->outputFile, "    @SP\n");
+        for (long i = 0; i < count; i++) {
+            fprintf(cw->outputFile, "    M=M-1\n");
+        }
+    }
+    return OK;
+}
+
+/// @brief Lists the pointers saved by a reduced frame: LCL, ARG and the
+/// pointers named in the saved list of a light call or return
+/// @return Number of pointers in the frame
+static int lightFramePointers(const char* savedList, const char** pointers)
+{
+    int numPointers = 0;
+    pointers[numPointers++] = "LCL";
+    pointers[numPointers++] = "ARG";
+    if (savedList != NULL && strstr(savedList, "this") != NULL) {
+        pointers[numPointers++] = "THIS";
+    }
+    if (savedList != NULL && strstr(savedList, "that") != NULL) {
+        pointers[numPointers++] = "THAT";
+    }
+    return numPointers;
+}
+
+/// @brief Writes a tail call to a function taking a different number of
+/// arguments than the current one. The saved frame below LCL moves by the
+/// difference, to follow the arguments popped into place: before the pops
+/// when it moves up, as they would overwrite it, after them when it moves
+/// down. Without locals for the frame to move into, as left by static
+/// frames, a call and a return are written instead
+static ErrorCode codeWriter_writeTailCall(CodeWriter* cw, const Command* cmd)
+{
+    char* end = NULL;
+    long nArgs = strtol(cmd->Arg2, &end, 10);
+    long shift = nArgs - strtol(end, NULL, 10);
+    if (shift > cw->stack.nLocals) {
+        Command call = { .type = CMD_CALL };
+        Command ret = { .type = CMD_RETURN };
+        strcpy(call.Arg1, cmd->Arg1);
+        snprintf(call.Arg2, MAX_IDENTIFIER_LEN, "%ld", nArgs);
+        ErrorCode err = codeWriter_writeFunctionCall(cw, &call);
+        if (err != OK) return err;
+        return codeWriter_writeReturn(cw, &ret);
+    }
+
+    fprintf(cw->outputFile, "\n// tail call %s %ld (frame moved by %ld)\n", cmd->Arg1, nArgs, shift);
+    for (int k = CALL_FRAME_SIZE - 1; k >= 0 && shift > 0; k--) {
+        codeWriter_writeMoveFrameSlot(cw, k, shift);
+    }
+    for (long a = nArgs - 1; a >= 0; a--) {
+        Command pop = { .type = CMD_POP, .Arg1 = "argument" };
+        snprintf(pop.Arg2, MAX_IDENTIFIER_LEN, "%ld", a);
+        ErrorCode err = codeWriter_writePop(cw, &pop);
+        if (err != OK) return err;
+    }
+    for (int k = 0; k < CALL_FRAME_SIZE && shift < 0; k++) {
+        codeWriter_writeMoveFrameSlot(cw, k, shift);
+    }
+
+    // The frame of the callee starts after its arguments and the saved slots
+    fprintf(cw->outputFile, "    @ARG\n    D=M\n    @%ld\n    D=D+A\n    @LCL\n    M=D\n",
+            nArgs + CALL_FRAME_SIZE);
+    fprintf(cw->outputFile, "    @SP\n    M=D\n");
+    GENERATE_GOTO_CODE(cw->outputFile, cmd->Arg1);
     return OK;
 }
 
-static ErrorCode removePathBackslashes(char* fileNameToChange)
+static ErrorCode codeWriter_writeTailJump(CodeWriter* cw, const Command* cmd)
 {
-    int i = 0;
-    for (i = 0; i < strlen(fileNameToChange); i++) {
-        if (fileNameToChange[i] == '/')
-            fileNameToChange[i] = '_';
-        else if (fileNameToChange[i] == '.')
-            fileNameToChange[i] = 'x';
+    // The arguments were already popped into the current frame, which the
+    // callee takes over. Dropping the locals and working stack is all
+    // that is left to do
+    fprintf(cw->outputFile, "\n// tail call %s %s (frame reused)\n", cmd->Arg1, cmd->Arg2);
+    fprintf(cw->outputFile, "    @LCL\n    D=M\n    @SP\n    M=D\n");
+    GENERATE_GOTO_CODE(cw->outputFile, cmd->Arg1);
+    return OK;
+}
+
+/// @brief Copies a slot of the saved frame, the return address being slot
+/// 0 at LCL-5, to the address shift words away. The tail calls pass small
+/// shifts, so the address is stepped there one word at a time
+static void codeWriter_writeMoveFrameSlot(CodeWriter* cw, int slot, long shift)
+{
+    FILE* f = cw->outputFile;
+    fprintf(f, "    @LCL\n    D=M\n    @%d\n    A=D-A\n    D=M\n", CALL_FRAME_SIZE - slot);
+    for (long i = 0; i < labs(shift); i++) {
+        fprintf(f, (shift > 0) ? "    A=A+1\n" : "    A=A-1\n");
+    }
+    fprintf(f, "    M=D\n");
+}
+
+/// @brief Calls through the shared call routine, which builds the frame.
+/// The site only passes the callee in R13, the distance from SP down to the
+/// arguments in R14 and the return address in D
+static ErrorCode codeWriter_writeSharedCall(CodeWriter* cw, const Command* cmd)
+{
+    ArenaMark mark = arena_mark(&cw->arena);
+    char* retAddrLabel = arena_alloc(&cw->arena,
+                                     sizeof(char) * GET_RETURN_ADDR_LABEL_SIZE(cmd->Arg1));
+    if (retAddrLabel == NULL) {
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
     }
-    fileNameToChange[i] = '\0';
+    char id[LABEL_ID_SIZE];
+    sprintf(retAddrLabel, "%s_retAddr_%s", cmd->Arg1,
+            codeWriter_nextLabelId(cw, &cw->labels.returnAddress, id));
+
+    fprintf(cw->outputFile, "    @%s\n    D=A\n    @R13\n    M=D\n", cmd->Arg1);
+    fprintf(cw->outputFile, "    @%d\n    D=A\n    @R14\n    M=D\n",
+            CALL_FRAME_SIZE + atoi(cmd->Arg2));
+    fprintf(cw->outputFile, "    @%s\n    D=A\n", retAddrLabel);
+    GENERATE_GOTO_CODE(cw->outputFile, CALL_ROUTINE_LABEL);
+    GENERATE_LABEL_DECLARATION_CODE(cw->outputFile, retAddrLabel);
+    cw->callRoutineUsed = true;
+
+    arena_release(&cw->arena, mark);
     return OK;
 }
 
-static char* codeWriter_getBaseFileName(CodeWriter* cw)
+/// @brief Writes the routine building the frame of the calls of cold
+/// functions, see codeWriter_writeSharedCall()
+static void codeWriter_writeCallRoutine(CodeWriter* cw)
+{
+    static const char* const pointers[] = FRAME_POINTERS;
+    FILE* f = cw->outputFile;
+    fprintf(f, "\n// Shared call routine\n(%s)\n", CALL_ROUTINE_LABEL);
+    GENERATE_PUSH_D_CODE(f);
+    for (int i = 0; i < NUM_FRAME_POINTERS; i++) {
+        fprintf(f, "    @%s\n    D=M\n", pointers[i]);
+        GENERATE_PUSH_D_CODE(f);
+    }
+    fprintf(f, "    @SP\n    D=M\n    @R14\n    D=D-M\n    @ARG\n    M=D\n");
+    fprintf(f, "    @SP\n    D=M\n    @LCL\n    M=D\n");
+    fprintf(f, "    @R13\n    A=M\n    0; JMP\n");
+}
+
+/// @brief Writes the return shared by the cold functions, which jump to it
+static void codeWriter_writeReturnRoutine(CodeWriter* cw)
+{
+    static const char* const pointers[] = FRAME_POINTERS;
+    fprintf(cw->outputFile, "\n// Shared return routine\n(%s)\n", RETURN_ROUTINE_LABEL);
+    codeWriter_writeFrameReturn(cw, pointers, NUM_FRAME_POINTERS);
+}
+
+/// @brief Picks what the function is translated for from the profile:
+/// speed when it is hot, size when it is cold, the options otherwise. Cold
+/// functions share their calls and returns, unless the code goes to an
+/// object module, which can't hold the shared routines
+static void codeWriter_enterFunction(CodeWriter* cw, const char* function)
+{
+    if (cw->opts->jobs > 0) {
+        codeWriter_enterLabelScope(cw, function);
+    }
+    cw->costModel = functionCostModel(cw->opts, function);
+    cw->coldFunction = !cw->opts->emitObject &&
+                       profile_function(cw->opts->profile, function) == PROFILE_COLD;
+}
+
+/// @brief Restarts the label counters for the code of a function, or of a
+/// file before its first function. Used with -j, so that the labels of a
+/// function don't depend on the code translated before it
+static void codeWriter_enterLabelScope(CodeWriter* cw, const char* scope)
+{
+    memset(&cw->labels, 0, sizeof(LabelCounters));
+    snprintf(cw->labels.scope, sizeof(cw->labels.scope), "%s", scope);
+}
+
+/// @brief Formats the unique part of a generated label from the given
+/// counter, which is then incremented. Inside a label scope the counters
+/// restart at every function, so the scope name is added to the number
+/// @param id Buffer of LABEL_ID_SIZE chars
+static const char* codeWriter_nextLabelId(CodeWriter* cw, unsigned long* counter, char* id)
 {
-    char* str = strndup(cw->currentVMfile, cw->currentVMfileLen - strlen(".vm"));
-    removePathBackslashes(str);
-    return str;
+    if (cw->labels.scope[0] != '\0') {
+        sprintf(id, "%s$%lu", cw->labels.scope, (*counter)++);
+    }
+    else {
+        sprintf(id, "%lu", (*counter)++);
+    }
+    return id;
+}
+
+/// @brief Returns the name of the register holding the base address of the
+/// given segment, or NULL for segments that are not addressed indirectly
+static const char* getSegmentBasePointer(const char* segment)
+{
+    if (strcmp(segment, "local") == 0)    return "LCL";
+    if (strcmp(segment, "argument") == 0) return "ARG";
+    if (strcmp(segment, "this") == 0)     return "THIS";
+    if (strcmp(segment, "that") == 0)     return "THAT";
+    return NULL;
+}
+
+/// @brief Converts a segment index to an integer. Returns false if the string
+/// is not a plain decimal number
+static bool parseSegmentIndex(const char* str, long* index)
+{
+    char* end = NULL;
+    if (str[0] < '0' || str[0] > '9') {
+        return false;
+    }
+    *index = strtol(str, &end, 10);
+    return (*end == '\0');
+}
+
+/// @brief Leaves a constant in D. Constant folding may leave negative ones,
+/// which an A-instruction can't load directly
+static void codeWriter_writeConstantToD(CodeWriter* cw, const char* constant)
+{
+    long value = atol(constant);
+    if (value >= 0) {
+        fprintf(cw->outputFile, "    @%s\n    D=A\n", constant);
+    }
+    else if (value == -1) {
+        fprintf(cw->outputFile, "    D=-1\n");
+    }
+    else if (value == -32768) {
+        // 32768 doesn't fit an A-instruction, but its complement does
+        fprintf(cw->outputFile, "    @32767\n    D=!A\n");
+    }
+    else {
+        fprintf(cw->outputFile, "    @%ld\n    D=-A\n", -value);
+    }
+}
+
+/// @brief Leaves the address of basePtr[index] in A without touching D.
+/// Small offsets are reached with A=M+1 followed by a chain of increments,
+/// larger ones are added with an A-instruction, which clobbers D.
+static void codeWriter_writeSegmentAddress(CodeWriter* cw, const char* basePtr, long index)
+{
+    fprintf(cw->outputFile, "    @%s\n", basePtr);
+    if (index == 0) {
+        fprintf(cw->outputFile, "    A=M\n");
+    }
+    else if (index < SEGMENT_OFFSET_CHAIN_LIMIT) {
+        fprintf(cw->outputFile, "    A=M+1\n");
+        for (long i = 1; i < index; i++) {
+            fprintf(cw->outputFile, "    A=A+1\n");
+        }
+    }
+    else {
+        fprintf(cw->outputFile, "    D=M\n    @%ld\n    A=D+A\n", index);
+    }
+}
+
+/// @brief Loads a segment entry into D with the sequences specialized at
+/// translate time: temp and pointer go straight to their fixed addresses
+/// and small offsets of the indirect segments avoid the address arithmetic.
+/// @return true if code was written, false if the generic template must be used
+static bool codeWriter_writeSpecializedLoad(CodeWriter* cw, const Command* cmd)
+{
+    long index = 0;
+    if (!parseSegmentIndex(cmd->Arg2, &index)) {
+        return false;
+    }
+
+    const char* basePtr = getSegmentBasePointer(cmd->Arg1);
+    if (basePtr != NULL) {
+        codeWriter_writeSegmentAddress(cw, basePtr, index);
+        fprintf(cw->outputFile, "    D=M\n");
+    }
+    else if (strcmp(cmd->Arg1, "temp") == 0 && index < TEMP_SEGMENT_SIZE) {
+        fprintf(cw->outputFile, "    @%ld\n    D=M\n", TEMP_SEGMENT_BASE_ADDR + index);
+    }
+    else if (strcmp(cmd->Arg1, "pointer") == 0 && (index == 0 || index == 1)) {
+        fprintf(cw->outputFile, "    @%s\n    D=M\n", (index == 0) ? "THIS" : "THAT");
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+/// @brief Writes the specialized push sequences, see codeWriter_writeSpecializedLoad()
+/// @return true if code was written, false if the generic template must be used
+static bool codeWriter_writeSpecializedPush(CodeWriter* cw, const Command* cmd)
+{
+    if (!codeWriter_writeSpecializedLoad(cw, cmd)) {
+        return false;
+    }
+    GENERATE_PUSH_D_CODE(cw->outputFile);
+    return true;
+}
+
+/// @brief Writes the pop sequences specialized at translate time. The popped
+/// value is kept in D while the target address is formed in A, so neither
+/// the D=D+A ... A=D-A swap nor a scratch register is needed for small
+/// offsets. Larger offsets store the target address in R13 first.
+/// @return true if code was written, false if the generic template must be used
+static bool codeWriter_writeSpecializedPop(CodeWriter* cw, const Command* cmd)
+{
+    long index = 0;
+    if (!parseSegmentIndex(cmd->Arg2, &index)) {
+        return false;
+    }
+
+    const char* basePtr = getSegmentBasePointer(cmd->Arg1);
+    if (basePtr != NULL && index < SEGMENT_OFFSET_CHAIN_LIMIT) {
+        fprintf(cw->outputFile, "    @SP\n    AM=M-1\n    D=M\n");
+        codeWriter_writeSegmentAddress(cw, basePtr, index);
+        fprintf(cw->outputFile, "    M=D\n");
+    }
+    else if (basePtr != NULL) {
+        fprintf(cw->outputFile, "    @%s\n    D=M\n    @%ld\n    D=D+A\n    @R13\n    M=D\n",
+                basePtr, index);
+        fprintf(cw->outputFile, "    @SP\n    AM=M-1\n    D=M\n    @R13\n    A=M\n    M=D\n");
+    }
+    else if (strcmp(cmd->Arg1, "temp") == 0 && index < TEMP_SEGMENT_SIZE) {
+        fprintf(cw->outputFile, "    @SP\n    AM=M-1\n    D=M\n    @%ld\n    M=D\n",
+                TEMP_SEGMENT_BASE_ADDR + index);
+    }
+    else {
+        // pointer is already written to a fixed address by the generic code
+        return false;
+    }
+    return true;
+}
+
+/// @brief Weighs ROM words against executed instructions according to the
+/// selected cost model. Lower is better
+static unsigned long costModel_score(CostModel model, SequenceCost cost)
+{
+    static const unsigned long speedWeights[2] = SPEED_COST_WEIGHTS;
+    static const unsigned long sizeWeights[2] = SIZE_COST_WEIGHTS;
+    const unsigned long* w = (model == COST_MODEL_SIZE) ? sizeWeights : speedWeights;
+    return cost.words * w[0] + cost.cycles * w[1];
+}
+
+/// @return The cost model of the options, unless the profile finds the
+/// function hot, which is then optimized for speed, or cold, for size
+static CostModel functionCostModel(const Options* opts, const char* function)
+{
+    switch (profile_function(opts->profile, function)) {
+        case PROFILE_HOT:
+            return COST_MODEL_SPEED;
+        case PROFILE_COLD:
+            return COST_MODEL_SIZE;
+        default:
+            return opts->costModel;
+    }
+}
+
+/// @brief Picks the cheapest sequence pushing nVars zeros, given the number
+/// of entries the shared zeroing routine already has
+static PrologueStrategy choosePrologue(CostModel model, long routineLength, long nVars)
+{
+    // Unrolled: @SP A=M M=0 (A=A+1 M=0)*(n-1) D=A+1 @SP M=D
+    // A single local is cheaper with the plain @SP A=M M=0 @SP M=M+1
+    SequenceCost costs[3];
+    costs[PROLOGUE_UNROLLED].words = (nVars == 1) ? 5 : 2 * nVars + 4;
+    costs[PROLOGUE_UNROLLED].cycles = costs[PROLOGUE_UNROLLED].words;
+
+    // Loop: @n D=A (L) @SP AM=M+1 A=A-1 M=0 @L D=D-1;JGT
+    costs[PROLOGUE_LOOP].words = 8;
+    costs[PROLOGUE_LOOP].cycles = 2 + 6 * nVars;
+
+    // Shared: @ret D=A @entry 0;JMP at the call site, plus a share of the
+    // routine words needed to make the shared chain at least n entries long
+    long extension = nVars - routineLength;
+    costs[PROLOGUE_SHARED].words = 4;
+    if (extension > 0) {
+        long routineWords = 4 * extension + ((routineLength == 0) ? 2 : 0);
+        costs[PROLOGUE_SHARED].words += routineWords / ZERO_LOCALS_ROUTINE_EXPECTED_USERS;
+    }
+    costs[PROLOGUE_SHARED].cycles = 4 + 4 * nVars + 2;
+
+    PrologueStrategy best = PROLOGUE_UNROLLED;
+    for (int s = PROLOGUE_LOOP; s <= PROLOGUE_SHARED; s++) {
+        if (costModel_score(model, costs[s]) < costModel_score(model, costs[best])) {
+            best = s;
+        }
+    }
+    return best;
+}
+
+/// @brief Pushes nVars zeros using whichever of the unrolled, loop or shared
+/// routine sequences the cost model considers cheapest.
+static void codeWriter_writeCompactPrologue(CodeWriter* cw, const char* funcName, long nVars)
+{
+    if (nVars <= 0) {
+        return;
+    }
+
+    switch (choosePrologue(cw->costModel, cw->zeroRoutineLength, nVars)) {
+        case PROLOGUE_UNROLLED:
+            if (nVars == 1) {
+                fprintf(cw->outputFile, "    @SP\n    A=M\n    M=0\n    @SP\n    M=M+1\n");
+                break;
+            }
+            fprintf(cw->outputFile, "    @SP\n    A=M\n    M=0\n");
+            for (long i = 1; i < nVars; i++) {
+                fprintf(cw->outputFile, "    A=A+1\n    M=0\n");
+            }
+            fprintf(cw->outputFile, "    D=A+1\n    @SP\n    M=D\n");
+            break;
+        case PROLOGUE_LOOP:
+            fprintf(cw->outputFile, "    @%ld\n    D=A\n", nVars);
+            fprintf(cw->outputFile, "(%s$__zero_loop)\n", funcName);
+            fprintf(cw->outputFile, "    @SP\n    AM=M+1\n    A=A-1\n    M=0\n");
+            fprintf(cw->outputFile, "    @%s$__zero_loop\n    D=D-1; JGT\n", funcName);
+            break;
+        case PROLOGUE_SHARED:
+            if (nVars > cw->zeroRoutineLength) {
+                cw->zeroRoutineLength = nVars;
+            }
+            fprintf(cw->outputFile, "    @%s$__zero_ret\n    D=A\n", funcName);
+            fprintf(cw->outputFile, "    @%s_%ld\n    0; JMP\n", ZERO_LOCALS_ROUTINE_LABEL, nVars);
+            fprintf(cw->outputFile, "(%s$__zero_ret)\n", funcName);
+            break;
+    }
+}
+
+// ----------------------- STACK POINTER BATCHING --------------------------- //
+// Inside a basic block the position of every stack slot relative to SP is
+// known at translate time, so pushes and pops only adjust cw->spOffset and
+// address their slot relative to the stored SP. The stored SP is brought up
+// to date before anything that may leave the block or be jumped into
+// (labels, branches, calls, returns and function entries), and whenever a
+// slot would be too far away for a short increment chain.
+
+/// @brief Writes push, pop, arithmetic and if-goto with a batched SP. For any
+/// other command the pending SP offset is committed and written is set to
+/// false, so the regular template is used.
+static ErrorCode codeWriter_writeBatched(CodeWriter* cw, const Command* cmd, bool* written)
+{
+    *written = true;
+    switch (cmd->type) {
+        case CMD_PUSH:
+            if (isBatchableSegmentAccess(cmd)) {
+                return codeWriter_writeBatchedPush(cw, cmd);
+            }
+            break;
+        case CMD_POP:
+            if (isBatchableSegmentAccess(cmd) && strcmp(cmd->Arg1, "constant") != 0) {
+                return codeWriter_writeBatchedPop(cw, cmd);
+            }
+            break;
+        case CMD_ARITHMETIC:
+            return codeWriter_writeBatchedArithmetic(cw, cmd);
+        case CMD_IF:
+        case CMD_IF_NOT:
+            return codeWriter_writeBatchedIfGoto(cw, cmd);
+        case CMD_ARRAY_LOAD:
+            return codeWriter_writeArrayLoad(cw, cmd);
+        case CMD_ARRAY_STORE:
+            return codeWriter_writeArrayStore(cw, cmd);
+        case CMD_DISCARD:
+            return codeWriter_writeDiscard(cw, cmd);
+        default:
+            break;
+    }
+
+    codeWriter_commitStackPointer(cw);
+    *written = false;
+    return OK;
+}
+
+/// @brief Writes the pending pushes and pops to SP. Only M=M+1 and M=M-1 are
+/// used so D is preserved
+static void codeWriter_commitStackPointer(CodeWriter* cw)
+{
+    if (cw->spOffset == 0) {
+        return;
+    }
+    fprintf(cw->outputFile, "    @SP\n");
+    for (long i = 0; i < labs(cw->spOffset); i++) {
+        fprintf(cw->outputFile, (cw->spOffset > 0) ? "    M=M+1\n" : "    M=M-1\n");
+    }
+    cw->spOffset = 0;
+    cw->tosInD = false;
+}
+
+/// @brief Commits the pending SP offset if any slot in [lowest, highest],
+/// relative to the virtual stack pointer, is out of reach of a short chain
+static void codeWriter_reserveStackSlots(CodeWriter* cw, long lowest, long highest)
+{
+    if (cw->spOffset + lowest < -STACK_OFFSET_CHAIN_LIMIT ||
+        cw->spOffset + highest > STACK_OFFSET_CHAIN_LIMIT) {
+        codeWriter_commitStackPointer(cw);
+    }
+}
+
+/// @brief Leaves in A the address of a stack slot given relative to the
+/// virtual stack pointer, so -1 is the top of the stack and 0 the next free
+/// slot. D is preserved.
+static void codeWriter_writeStackSlotAddress(CodeWriter* cw, long slot)
+{
+    long offset = cw->spOffset + slot;
+    fprintf(cw->outputFile, "    @SP\n");
+    if (offset == 0) {
+        fprintf(cw->outputFile, "    A=M\n");
+        return;
+    }
+    fprintf(cw->outputFile, (offset > 0) ? "    A=M+1\n" : "    A=M-1\n");
+    for (long i = 1; i < labs(offset); i++) {
+        fprintf(cw->outputFile, (offset > 0) ? "    A=A+1\n" : "    A=A-1\n");
+    }
+}
+
+static bool isBatchableSegmentAccess(const Command* cmd)
+{
+    long index = 0;
+    if (strcmp(cmd->Arg1, "constant") == 0) {
+        return true;
+    }
+    if (!parseSegmentIndex(cmd->Arg2, &index)) {
+        return false;
+    }
+    if (strcmp(cmd->Arg1, "pointer") == 0) {
+        return index == 0 || index == 1;
+    }
+    return getSegmentBasePointer(cmd->Arg1) != NULL ||
+           strcmp(cmd->Arg1, "temp") == 0 ||
+           strcmp(cmd->Arg1, "static") == 0 ||
+           strcmp(cmd->Arg1, "frame") == 0;
+}
+
+static bool isBinaryArithmetic(const char* op)
+{
+    return strcmp(op, "neg") != 0 && strcmp(op, "not") != 0;
+}
+
+/// @brief Leaves the value of a segment entry in D without touching the stack
+static ErrorCode codeWriter_writeLoadSegmentValue(CodeWriter* cw, const Command* cmd)
+{
+    if (cw->opts->specializeSegmentOffsets && codeWriter_writeSpecializedLoad(cw, cmd)) {
+        return OK;
+    }
+
+    const char* basePtr = getSegmentBasePointer(cmd->Arg1);
+    if (strcmp(cmd->Arg1, "constant") == 0) {
+        codeWriter_writeConstantToD(cw, cmd->Arg2);
+    }
+    else if (strcmp(cmd->Arg1, "pointer") == 0) {
+        fprintf(cw->outputFile, "    @%s\n    D=M\n", (strcmp(cmd->Arg2, "0") == 0) ? "THIS" : "THAT");
+    }
+    else if (basePtr != NULL) {
+        fprintf(cw->outputFile, "    @%s\n    D=M\n    @%s\n    A=D+A\n    D=M\n", basePtr, cmd->Arg2);
+    }
+    else if (strcmp(cmd->Arg1, "temp") == 0) {
+        fprintf(cw->outputFile, "    @5\n    D=A\n    @%s\n    A=D+A\n    D=M\n", cmd->Arg2);
+    }
+    else if (strcmp(cmd->Arg1, "static") == 0) {
+        fprintf(cw->outputFile, "    @%s.%s\n    D=M\n", cw->staticPrefix, cmd->Arg2);
+    }
+    else if (strcmp(cmd->Arg1, "frame") == 0) {
+        fprintf(cw->outputFile, "    @%s_%s\n    D=M\n", STATIC_FRAME_SYMBOL, cmd->Arg2);
+    }
+    else {
+        logError(ERR_UNKNOWN_SEGMENT, cmd->Arg1);
+        return ERR_UNKNOWN_SEGMENT;
+    }
+    return OK;
+}
+
+/// @brief Returns true if the address a pop writes to can't be formed in A
+/// while the popped value is held in D
+static bool popTargetNeedsR13(CodeWriter* cw, const Command* cmd)
+{
+    long index = 0;
+    const char* basePtr = getSegmentBasePointer(cmd->Arg1);
+    parseSegmentIndex(cmd->Arg2, &index);
+
+    if (basePtr == NULL && strcmp(cmd->Arg1, "temp") != 0) {
+        // pointer, static and frame are stored directly
+        return false;
+    }
+    if (cw->opts->specializeSegmentOffsets) {
+        return !((basePtr != NULL && index < SEGMENT_OFFSET_CHAIN_LIMIT) ||
+                 (basePtr == NULL && index < TEMP_SEGMENT_SIZE));
+    }
+    return true;
+}
+
+/// @brief Computes the address a pop writes to into R13 when it can't be
+/// formed in A while the popped value is held in D. Must be written before
+/// the value is loaded
+static ErrorCode codeWriter_writePopTargetSetup(CodeWriter* cw, const Command* cmd, bool* viaR13)
+{
+    long index = 0;
+    const char* basePtr = getSegmentBasePointer(cmd->Arg1);
+    parseSegmentIndex(cmd->Arg2, &index);
+    *viaR13 = popTargetNeedsR13(cw, cmd);
+
+    if (!*viaR13) {
+        return OK;
+    }
+    if (basePtr != NULL) {
+        fprintf(cw->outputFile, "    @%s\n    D=M\n", basePtr);
+    }
+    else {
+        fprintf(cw->outputFile, "    @5\n    D=A\n");
+    }
+    fprintf(cw->outputFile, "    @%ld\n    D=D+A\n    @R13\n    M=D\n", index);
+    return OK;
+}
+
+/// @brief Stores D into the pop target, see codeWriter_writePopTargetSetup()
+static void codeWriter_writeStoreToPopTarget(CodeWriter* cw, const Command* cmd, bool viaR13)
+{
+    long index = 0;
+    parseSegmentIndex(cmd->Arg2, &index);
+
+    if (viaR13) {
+        fprintf(cw->outputFile, "    @R13\n    A=M\n");
+    }
+    else if (strcmp(cmd->Arg1, "pointer") == 0) {
+        fprintf(cw->outputFile, "    @%s\n", (index == 0) ? "THIS" : "THAT");
+    }
+    else if (strcmp(cmd->Arg1, "static") == 0) {
+        fprintf(cw->outputFile, "    @%s.%s\n", cw->staticPrefix, cmd->Arg2);
+    }
+    else if (strcmp(cmd->Arg1, "frame") == 0) {
+        fprintf(cw->outputFile, "    @%s_%s\n", STATIC_FRAME_SYMBOL, cmd->Arg2);
+    }
+    else if (strcmp(cmd->Arg1, "temp") == 0) {
+        fprintf(cw->outputFile, "    @%ld\n", TEMP_SEGMENT_BASE_ADDR + index);
+    }
+    else {
+        codeWriter_writeSegmentAddress(cw, getSegmentBasePointer(cmd->Arg1), index);
+    }
+    fprintf(cw->outputFile, "    M=D\n");
+}
+
+static ErrorCode codeWriter_writeBatchedPush(CodeWriter* cw, const Command* cmd)
+{
+    fprintf(cw->outputFile, "// push %s %s\n", cmd->Arg1, cmd->Arg2);
+    ErrorCode err = codeWriter_writeLoadSegmentValue(cw, cmd);
+    if (err != OK) return err;
+
+    codeWriter_reserveStackSlots(cw, 0, 0);
+    codeWriter_writeStackSlotAddress(cw, 0);
+    fprintf(cw->outputFile, "    M=D\n");
+    cw->spOffset++;
+    return OK;
+}
+
+static ErrorCode codeWriter_writeBatchedPop(CodeWriter* cw, const Command* cmd)
+{
+    bool viaR13 = false;
+    fprintf(cw->outputFile, "// pop %s %s\n", cmd->Arg1, cmd->Arg2);
+    ErrorCode err = codeWriter_writePopTargetSetup(cw, cmd, &viaR13);
+    if (err != OK) return err;
+
+    codeWriter_reserveStackSlots(cw, -1, -1);
+    codeWriter_writeStackSlotAddress(cw, -1);
+    fprintf(cw->outputFile, "    D=M\n");
+    cw->spOffset--;
+    codeWriter_writeStoreToPopTarget(cw, cmd, viaR13);
+    return OK;
+}
+
+static ErrorCode codeWriter_writeBatchedArithmetic(CodeWriter* cw, const Command* cmd)
+{
+    const char* op = cmd->Arg1;
+    fprintf(cw->outputFile, "// %s\n", op);
+
+    if (!isBinaryArithmetic(op)) {
+        codeWriter_reserveStackSlots(cw, -1, -1);
+        codeWriter_writeStackSlotAddress(cw, -1);
+        fprintf(cw->outputFile, (strcmp(op, "neg") == 0) ? "    M=-M\n" : "    M=!M\n");
+        return OK;
+    }
+
+    // Every slot used below is reserved up front, so SP is never committed
+    // on only one side of the gt/lt branches
+    codeWriter_reserveStackSlots(cw, -2, -1);
+    codeWriter_writeStackSlotAddress(cw, -1);
+    fprintf(cw->outputFile, "    D=M\n    A=A-1\n");
+    cw->spOffset--;
+
+    if (strcmp(op, "add") == 0) {
+        fprintf(cw->outputFile, "    M=D+M\n");
+    }
+    else if (strcmp(op, "sub") == 0) {
+        fprintf(cw->outputFile, "    M=M-D\n");
+    }
+    else if (strcmp(op, "and") == 0) {
+        fprintf(cw->outputFile, "    M=D&M\n");
+    }
+    else if (strcmp(op, "or") == 0) {
+        fprintf(cw->outputFile, "    M=D|M\n");
+    }
+    else if (strcmp(op, "eq") == 0) {
+        fprintf(cw->outputFile, "    D=D-M\n    M=D\n");
+    }
+    else if (strcmp(op, "gt") == 0 || strcmp(op, "lt") == 0) {
+        bool isGt = (strcmp(op, "gt") == 0);
+        const char* prefix = isGt ? "__GT" : "__LT";
+        char id[LABEL_ID_SIZE];
+        codeWriter_nextLabelId(cw, isGt ? &cw->labels.gtJump : &cw->labels.ltJump, id);
+
+        fprintf(cw->outputFile, "    D=D-M\n    @%s_%s\n    D; %s\n", prefix, id, isGt ? "JLE" : "JGT");
+        codeWriter_writeStackSlotAddress(cw, -1);
+        fprintf(cw->outputFile, "    M=0\n    @%s_END_%s\n    0; JMP\n", prefix, id);
+        fprintf(cw->outputFile, "(%s_%s)\n", prefix, id);
+        codeWriter_writeStackSlotAddress(cw, -1);
+        fprintf(cw->outputFile, "    M=1\n(%s_END_%s)\n", prefix, id);
+    }
+    return OK;
+}
+
+static ErrorCode codeWriter_writeBatchedIfGoto(CodeWriter* cw, const Command* cmd)
+{
+    fprintf(cw->outputFile, "// %s %s\n", ifGotoName(cmd), cmd->Arg1);
+    codeWriter_commitStackPointer(cw);
+    fprintf(cw->outputFile, "    @SP\n    AM=M-1\n    D=M\n");
+    fprintf(cw->outputFile, "    @%s\n    D; %s\n", cmd->Arg1, ifGotoJump(cmd));
+    return OK;
+}
+
+// ------------------------ TOP OF STACK CACHING ---------------------------- //
+// With -ftos-cache the value on top of the stack is kept in D whenever the
+// previous command left it there (cw->tosInD), and only written to memory
+// (spilled) when another value is pushed or the basic block ends. The
+// memory part of the stack is addressed through the SP batching primitives
+// when -fsp-batching is also given, and through SP directly otherwise.
+
+/// @brief Writes push, pop, arithmetic and if-goto keeping the top of the
+/// stack in D. For any other command the cached value is spilled, SP is
+/// committed and written is set to false, so the regular template is used.
+static ErrorCode codeWriter_writeCached(CodeWriter* cw, const Command* cmd, bool* written)
+{
+    ErrorCode err = OK;
+    *written = true;
+    switch (cmd->type) {
+        case CMD_PUSH:
+            if (!isBatchableSegmentAccess(cmd)) {
+                break;
+            }
+            fprintf(cw->outputFile, "// push %s %s\n", cmd->Arg1, cmd->Arg2);
+            codeWriter_spillTopOfStack(cw);
+            err = codeWriter_writeLoadSegmentValue(cw, cmd);
+            cw->tosInD = true;
+            return err;
+        case CMD_POP:
+            if (isBatchableSegmentAccess(cmd) && strcmp(cmd->Arg1, "constant") != 0) {
+                return codeWriter_writeCachedPop(cw, cmd);
+            }
+            break;
+        case CMD_ARITHMETIC:
+            return codeWriter_writeCachedArithmetic(cw, cmd);
+        case CMD_IF:
+        case CMD_IF_NOT:
+            fprintf(cw->outputFile, "// %s %s\n", ifGotoName(cmd), cmd->Arg1);
+            if (!cw->tosInD) {
+                codeWriter_writePopToD(cw);
+            }
+            cw->tosInD = false;
+            codeWriter_commitStackPointer(cw);
+            fprintf(cw->outputFile, "    @%s\n    D; %s\n", cmd->Arg1, ifGotoJump(cmd));
+            return OK;
+        case CMD_ARRAY_LOAD:
+            return codeWriter_writeArrayLoad(cw, cmd);
+        case CMD_ARRAY_STORE:
+            return codeWriter_writeArrayStore(cw, cmd);
+        case CMD_DISCARD:
+            return codeWriter_writeDiscard(cw, cmd);
+        default:
+            break;
+    }
+
+    codeWriter_spillTopOfStack(cw);
+    if (cw->opts->batchStackPointer) {
+        return codeWriter_writeBatched(cw, cmd, written);
+    }
+    *written = false;
+    return OK;
+}
+
+static ErrorCode codeWriter_writeCachedPop(CodeWriter* cw, const Command* cmd)
+{
+    bool viaR13 = false;
+    fprintf(cw->outputFile, "// pop %s %s\n", cmd->Arg1, cmd->Arg2);
+
+    // Forming the target address in R13 needs D, so in that case the cached
+    // value goes through memory like any other pop
+    if (cw->tosInD && popTargetNeedsR13(cw, cmd)) {
+        codeWriter_spillTopOfStack(cw);
+    }
+
+    ErrorCode err = codeWriter_writePopTargetSetup(cw, cmd, &viaR13);
+    if (err != OK) return err;
+    if (!cw->tosInD) {
+        codeWriter_writePopToD(cw);
+    }
+    codeWriter_writeStoreToPopTarget(cw, cmd, viaR13);
+    cw->tosInD = false;
+    return OK;
+}
+
+static ErrorCode codeWriter_writeCachedArithmetic(CodeWriter* cw, const Command* cmd)
+{
+    const char* op = cmd->Arg1;
+    fprintf(cw->outputFile, "// %s\n", op);
+
+    if (!isBinaryArithmetic(op)) {
+        if (cw->tosInD) {
+            fprintf(cw->outputFile, (strcmp(op, "neg") == 0) ? "    D=-D\n" : "    D=!D\n");
+        }
+        else {
+            codeWriter_writeTopAddress(cw);
+            fprintf(cw->outputFile, (strcmp(op, "neg") == 0) ? "    M=-M\n" : "    M=!M\n");
+        }
+        return OK;
+    }
+
+    // y (the top) goes to D and x is popped into A, the result stays in D
+    if (!cw->tosInD) {
+        codeWriter_writePopToD(cw);
+    }
+    codeWriter_writePopAddress(cw);
+    cw->tosInD = true;
+
+    if (strcmp(op, "add") == 0) {
+        fprintf(cw->outputFile, "    D=D+M\n");
+    }
+    else if (strcmp(op, "sub") == 0) {
+        fprintf(cw->outputFile, "    D=M-D\n");
+    }
+    else if (strcmp(op, "and") == 0) {
+        fprintf(cw->outputFile, "    D=D&M\n");
+    }
+    else if (strcmp(op, "or") == 0) {
+        fprintf(cw->outputFile, "    D=D|M\n");
+    }
+    else if (strcmp(op, "eq") == 0) {
+        fprintf(cw->outputFile, "    D=D-M\n");
+    }
+    else if (strcmp(op, "gt") == 0 || strcmp(op, "lt") == 0) {
+        bool isGt = (strcmp(op, "gt") == 0);
+        const char* prefix = isGt ? "__GT" : "__LT";
+        char id[LABEL_ID_SIZE];
+        codeWriter_nextLabelId(cw, isGt ? &cw->labels.gtJump : &cw->labels.ltJump, id);
+
+        fprintf(cw->outputFile, "    D=D-M\n    @%s_%s\n    D; %s\n", prefix, id, isGt ? "JLE" : "JGT");
+        fprintf(cw->outputFile, "    D=0\n    @%s_END_%s\n    0; JMP\n", prefix, id);
+        fprintf(cw->outputFile, "(%s_%s)\n    D=1\n(%s_END_%s)\n", prefix, id, prefix, id);
+    }
+    return OK;
+}
+
+/// @brief Writes the cached top of the stack to memory
+static void codeWriter_spillTopOfStack(CodeWriter* cw)
+{
+    if (cw->tosInD) {
+        codeWriter_writePushD(cw);
+        cw->tosInD = false;
+    }
+}
+
+/// @brief Pushes D to the stack in memory
+static void codeWriter_writePushD(CodeWriter* cw)
+{
+    if (cw->opts->batchStackPointer) {
+        codeWriter_reserveStackSlots(cw, 0, 0);
+        codeWriter_writeStackSlotAddress(cw, 0);
+        fprintf(cw->outputFile, "    M=D\n");
+        cw->spOffset++;
+    }
+    else {
+        GENERATE_PUSH_D_CODE(cw->outputFile);
+    }
+}
+
+/// @brief Pops the top of the stack in memory into D
+static void codeWriter_writePopToD(CodeWriter* cw)
+{
+    codeWriter_writePopAddress(cw);
+    fprintf(cw->outputFile, "    D=M\n");
+}
+
+/// @brief Pops the top of the stack in memory, leaving its address in A
+/// without touching D
+static void codeWriter_writePopAddress(CodeWriter* cw)
+{
+    if (cw->opts->batchStackPointer) {
+        codeWriter_reserveStackSlots(cw, -1, -1);
+        codeWriter_writeStackSlotAddress(cw, -1);
+        cw->spOffset--;
+    }
+    else {
+        fprintf(cw->outputFile, "    @SP\n    AM=M-1\n");
+    }
+}
+
+/// @brief Leaves the address of the top of the stack in memory in A
+static void codeWriter_writeTopAddress(CodeWriter* cw)
+{
+    if (cw->opts->batchStackPointer) {
+        codeWriter_reserveStackSlots(cw, -1, -1);
+        codeWriter_writeStackSlotAddress(cw, -1);
+    }
+    else {
+        fprintf(cw->outputFile, "    @SP\n    A=M-1\n");
+    }
+}
+
+// ------------------------- STACK DEPTH ANALYSIS --------------------------- //
+
+/// @brief Follows the operand stack depth through the current function.
+/// The depth at a label is taken from the jumps to it seen so far, or from
+/// the fall-through path when it is reachable
+static void codeWriter_trackStackDepth(CodeWriter* cw, const Command* cmd)
+{
+    StackUsage* su = &cw->stack;
+
+    switch (cmd->type) {
+        case CMD_FUNCTION:
+            codeWriter_reportStackUsage(cw);
+            snprintf(su->function, sizeof(su->function), "%s", cmd->Arg1);
+            su->nLocals = atol(cmd->Arg2);
+            su->depth = 0;
+            su->maxDepth = 0;
+            su->reachable = true;
+            su->numLabels = 0;
+            break;
+        case CMD_PUSH:
+            su->depth++;
+            break;
+        case CMD_POP:
+            su->depth--;
+            break;
+        case CMD_ARITHMETIC:
+            if (isBinaryArithmetic(cmd->Arg1)) {
+                su->depth--;
+            }
+            break;
+        case CMD_LABEL:
+            for (size_t i = 0; i < su->numLabels; i++) {
+                if (strcmp(su->labels[i].label, cmd->Arg1) == 0) {
+                    long jumpDepth = su->labels[i].depth;
+                    su->depth = (su->reachable && su->depth > jumpDepth) ? su->depth : jumpDepth;
+                    break;
+                }
+            }
+            su->reachable = true;
+            break;
+        case CMD_GOTO:
+            codeWriter_recordLabelDepth(cw, cmd->Arg1, su->depth);
+            su->reachable = false;
+            break;
+        case CMD_IF:
+        case CMD_IF_NOT:
+            su->depth--;
+            codeWriter_recordLabelDepth(cw, cmd->Arg1, su->depth);
+            break;
+        case CMD_CALL:
+            // The callee's frame starts right above the caller's stack
+            if (su->depth + CALL_FRAME_SIZE > su->maxDepth) {
+                su->maxDepth = su->depth + CALL_FRAME_SIZE;
+            }
+            su->depth = su->depth - atol(cmd->Arg2) + 1;
+            break;
+        case CMD_LIGHT_CALL:
+        {
+            const char* pointers[NUM_FRAME_POINTERS];
+            long frameSize = 1 + lightFramePointers(strchr(cmd->Arg2, ' '), pointers);
+            if (su->depth + frameSize > su->maxDepth) {
+                su->maxDepth = su->depth + frameSize;
+            }
+            su->depth = su->depth - atol(cmd->Arg2) + 1;
+            break;
+        }
+        case CMD_TAIL_CALL:
+            // Without room to move the frame, a call pushes one
+            if (su->depth + CALL_FRAME_SIZE > su->maxDepth) {
+                su->maxDepth = su->depth + CALL_FRAME_SIZE;
+            }
+            su->reachable = false;
+            break;
+        case CMD_RETURN:
+        case CMD_LIGHT_RETURN:
+        case CMD_TAIL_JUMP:
+            su->reachable = false;
+            break;
+        case CMD_INTRINSIC:
+            // The shared routines use up to two words above the stack
+            if (su->depth + 2 > su->maxDepth) {
+                su->maxDepth = su->depth + 2;
+            }
+            su->depth += intrinsics_stackEffect(cmd);
+            break;
+        case CMD_ARRAY_LOAD:
+            su->depth--;
+            break;
+        case CMD_ARRAY_STORE:
+            su->depth -= 2;
+            break;
+        case CMD_DISCARD:
+            su->depth -= atol(cmd->Arg2);
+            break;
+        default:
+            break;
+    }
+
+    if (su->depth > su->maxDepth) {
+        su->maxDepth = su->depth;
+    }
+}
+
+static void codeWriter_recordLabelDepth(CodeWriter* cw, const char* label, long depth)
+{
+    StackUsage* su = &cw->stack;
+    for (size_t i = 0; i < su->numLabels; i++) {
+        if (strcmp(su->labels[i].label, label) == 0) {
+            if (depth > su->labels[i].depth) {
+                su->labels[i].depth = depth;
+            }
+            return;
+        }
+    }
+
+    if (su->numLabels == su->labelsCapacity) {
+        size_t newCapacity = (su->labelsCapacity == 0) ? 16 : su->labelsCapacity * 2;
+        LabelDepth* newLabels = realloc(su->labels, newCapacity * sizeof(LabelDepth));
+        if (newLabels == NULL) {
+            // The report is best effort, the label is just not remembered
+            return;
+        }
+        su->labels = newLabels;
+        su->labelsCapacity = newCapacity;
+    }
+    strncpy(su->labels[su->numLabels].label, label, MAX_IDENTIFIER_LEN - 1);
+    su->labels[su->numLabels].label[MAX_IDENTIFIER_LEN - 1] = '\0';
+    su->labels[su->numLabels].depth = depth;
+    su->numLabels++;
+}
+
+/// @brief Prints the stack usage of the function translated last, if
+/// requested with --stack-report
+static void codeWriter_reportStackUsage(CodeWriter* cw)
+{
+    StackUsage* su = &cw->stack;
+    if (!cw->opts->stackReport || cw->reportFile == NULL || su->function[0] == '\0') {
+        return;
+    }
+    fprintf(cw->reportFile, "Stack usage of %s: %ld locals + %ld working = %ld words\n",
+            su->function, su->nLocals, su->maxDepth, su->nLocals + su->maxDepth);
+    su->function[0] = '\0';
+}
+
+// ------------------------------ INTRINSICS -------------------------------- //
+/// @brief Writes a call of an OS function as inline code, assuming the
+/// standard OS semantics. With a folded constant, the constant operand was
+/// not pushed and the code is specialized for it
+static ErrorCode codeWriter_writeIntrinsic(CodeWriter* cw, const Command* cmd)
+{
+    FILE* f = cw->outputFile;
+    bool hasConstant = (cmd->Arg2[0] != '\0');
+    long constant = atol(cmd->Arg2);
+
+    fprintf(f, "\n// call %s (inline%s%s)\n", cmd->Arg1, hasConstant ? ", constant " : "", cmd->Arg2);
+    if (strcmp(cmd->Arg1, "Memory.peek") == 0) {
+        if (hasConstant) {
+            fprintf(f, "    @%ld\n    D=M\n", constant);
+            GENERATE_PUSH_D_CODE(f);
+        }
+        else {
+            fprintf(f, "    @SP\n    A=M-1\n    A=M\n    D=M\n    @SP\n    A=M-1\n    M=D\n");
+        }
+    }
+    else if (strcmp(cmd->Arg1, "Memory.poke") == 0) {
+        // Store the value at the address below it, which is replaced by
+        // the return value 0
+        fprintf(f, "    @SP\n    AM=M-1\n    D=M\n    @SP\n    A=M-1\n    A=M\n    M=D\n");
+        fprintf(f, "    @SP\n    A=M-1\n    M=0\n");
+    }
+    else if (strcmp(cmd->Arg1, "Math.multiply") == 0) {
+        if (hasConstant) {
+            codeWriter_writeMultiplyByConstant(cw, constant);
+        }
+        else {
+            codeWriter_writeRoutineCall(cw, MULTIPLY_ROUTINE_LABEL);
+        }
+    }
+    else if (strcmp(cmd->Arg1, "Math.divide") == 0) {
+        if (hasConstant) {
+            codeWriter_writeDivideByPowerOfTwo(cw, constant);
+        }
+        else {
+            codeWriter_writeRoutineCall(cw, DIVIDE_ROUTINE_LABEL);
+        }
+    }
+    return OK;
+}
+
+/// @brief Jumps to a shared arithmetic routine, passing the return address
+/// in D. Both operands are on the stack and the result replaces them
+static void codeWriter_writeRoutineCall(CodeWriter* cw, const char* routine)
+{
+    FILE* f = cw->outputFile;
+    char id[LABEL_ID_SIZE];
+    codeWriter_nextLabelId(cw, &cw->labels.intrinsic, id);
+    fprintf(f, "    @%s_retAddr_%s\n    D=A\n", routine, id);
+    GENERATE_GOTO_CODE(f, routine);
+    fprintf(f, "(%s_retAddr_%s)\n", routine, id);
+
+    if (strcmp(routine, MULTIPLY_ROUTINE_LABEL) == 0) {
+        cw->multiplyRoutineUsed = true;
+    }
+    else {
+        cw->divideRoutineUsed = true;
+    }
+}
+
+/// @brief Multiplies the top of the stack by a constant with a doubling and
+/// adding sequence following the bits of the constant from the highest one,
+/// unless the cost model prefers pushing it and using the shared routine
+static void codeWriter_writeMultiplyByConstant(CodeWriter* cw, long factor)
+{
+    FILE* f = cw->outputFile;
+    if (factor == 0) {
+        fprintf(f, "    @SP\n    A=M-1\n    M=0\n");
+        return;
+    }
+    if (factor == 1) {
+        return;
+    }
+
+    int bits = bitLength(factor);
+    int ones = popCount(factor);
+    unsigned long shiftAddWords = 2 + ((ones > 1) ? 5 : 0) + 2 * (bits - 1) + 5 * (ones - 1);
+    SequenceCost shiftAdd = { shiftAddWords, shiftAddWords };
+    SequenceCost routine = { 10, 10 + MULTIPLY_ROUTINE_CYCLES(bits) };
+    if (costModel_score(cw->costModel, routine) < costModel_score(cw->costModel, shiftAdd)) {
+        fprintf(f, "    @%ld\n    D=A\n", factor);
+        GENERATE_PUSH_D_CODE(f);
+        codeWriter_writeRoutineCall(cw, MULTIPLY_ROUTINE_LABEL);
+        return;
+    }
+
+    // The product is built in place, the operand is kept in R13 when it
+    // has to be added more than once
+    fprintf(f, "    @SP\n    A=M-1\n");
+    if (ones > 1) {
+        fprintf(f, "    D=M\n    @R13\n    M=D\n    @SP\n    A=M-1\n");
+    }
+    for (int bit = bits - 2; bit >= 0; bit--) {
+        fprintf(f, "    D=M\n    M=D+M\n");
+        if (factor & (1L << bit)) {
+            fprintf(f, "    @R13\n    D=M\n    @SP\n    A=M-1\n    M=D+M\n");
+        }
+    }
+}
+
+/// @brief Divides the top of the stack by a power of two, rounding towards
+/// zero like Math.divide. The magnitude is shifted right by the shared
+/// routine, unless the cost model prefers pushing the divisor and using the
+/// general division routine
+static void codeWriter_writeDivideByPowerOfTwo(CodeWriter* cw, long divisor)
+{
+    FILE* f = cw->outputFile;
+    int shift = bitLength(divisor) - 1;
+    if (shift == 0) {
+        return;
+    }
+
+    SequenceCost shiftRight = { 26, 29 + SHIFT_RIGHT_STEP_CYCLES * (WORD_BITS - shift) };
+    SequenceCost routine = { 10, 10 + DIVIDE_ROUTINE_CYCLES };
+    if (costModel_score(cw->costModel, routine) < costModel_score(cw->costModel, shiftRight)) {
+        fprintf(f, "    @%ld\n    D=A\n", divisor);
+        GENERATE_PUSH_D_CODE(f);
+        codeWriter_writeRoutineCall(cw, DIVIDE_ROUTINE_LABEL);
+        return;
+    }
+
+    // The dividend is kept in R13 for its sign, its magnitude goes to R14
+    // and the quotient is built on top of the stack
+    char id[LABEL_ID_SIZE];
+    codeWriter_nextLabelId(cw, &cw->labels.intrinsic, id);
+    fprintf(f, "    @SP\n    A=M-1\n    D=M\n    @R13\n    M=D\n");
+    fprintf(f, "    @%s_POSITIVE_%s\n    D; JGE\n    D=-D\n", SHIFT_RIGHT_ROUTINE_LABEL, id);
+    fprintf(f, "(%s_POSITIVE_%s)\n", SHIFT_RIGHT_ROUTINE_LABEL, id);
+    fprintf(f, "    @R14\n    M=D\n    @SP\n    A=M-1\n    M=0\n");
+    fprintf(f, "    @%s_retAddr_%s\n    D=A\n    @R15\n    M=D\n", SHIFT_RIGHT_ROUTINE_LABEL, id);
+    fprintf(f, "    @%s_%d\n    0; JMP\n", SHIFT_RIGHT_ROUTINE_LABEL, shift);
+    fprintf(f, "(%s_retAddr_%s)\n", SHIFT_RIGHT_ROUTINE_LABEL, id);
+    fprintf(f, "    @R13\n    D=M\n    @%s_DONE_%s\n    D; JGE\n", SHIFT_RIGHT_ROUTINE_LABEL, id);
+    fprintf(f, "    @SP\n    A=M-1\n    M=-M\n");
+    fprintf(f, "(%s_DONE_%s)\n", SHIFT_RIGHT_ROUTINE_LABEL, id);
+
+    if (cw->shiftRightFirstEntry == 0 || shift < cw->shiftRightFirstEntry) {
+        cw->shiftRightFirstEntry = shift;
+    }
+}
+
+/// @brief Writes the shared multiplication routine. On entry D holds the
+/// return address and the operands x and y are on top of the stack. Each
+/// set bit of y adds the matching multiple of x to the sum, kept in the
+/// slot of y, and the loop ends as soon as no bit of y is left
+static void codeWriter_writeMultiplyRoutine(CodeWriter* cw)
+{
+    FILE* f = cw->outputFile;
+    const char* l = MULTIPLY_ROUTINE_LABEL;
+    fprintf(f, "\n// Shared multiplication routine\n(%s)\n", l);
+    fprintf(f, "    @R15\n    M=D\n");
+    fprintf(f, "    @SP\n    AM=M-1\n    D=M\n    @R14\n    M=D\n    @SP\n    A=M\n    M=0\n");
+    // x goes to R13 and its slot holds the bit mask
+    fprintf(f, "    @SP\n    A=M-1\n    D=M\n    @R13\n    M=D\n    @SP\n    A=M-1\n    M=1\n");
+    fprintf(f, "(%s_LOOP)\n", l);
+    fprintf(f, "    @R14\n    D=M\n    @%s_END\n    D; JEQ\n", l);
+    fprintf(f, "    @SP\n    A=M-1\n    D=M\n    @R14\n    D=D&M\n    @%s_NEXT\n    D; JEQ\n", l);
+    fprintf(f, "    @R14\n    M=M-D\n    @R13\n    D=M\n    @SP\n    A=M\n    M=D+M\n");
+    fprintf(f, "(%s_NEXT)\n", l);
+    fprintf(f, "    @R13\n    D=M\n    M=D+M\n    @SP\n    A=M-1\n    D=M\n    M=D+M\n");
+    fprintf(f, "    @%s_LOOP\n    0; JMP\n", l);
+    fprintf(f, "(%s_END)\n", l);
+    fprintf(f, "    @SP\n    A=M\n    D=M\n    A=A-1\n    M=D\n    @R15\n    A=M\n    0; JMP\n");
+}
+
+/// @brief Writes the shared division routine, a long division of the
+/// magnitudes whose quotient is negated when the signs differ. On entry D
+/// holds the return address and the operands x and y are on top of the
+/// stack. x is shifted left with a sentinel bit, which reaches the top bit
+/// once every bit has been brought into the remainder. Division by zero is
+/// not reported
+static void codeWriter_writeDivideRoutine(CodeWriter* cw)
+{
+    FILE* f = cw->outputFile;
+    const char* l = DIVIDE_ROUTINE_LABEL;
+    fprintf(f, "\n// Shared division routine\n(%s)\n", l);
+
+    // The return address goes above the stack and the slot of y holds
+    // the sign of the quotient. |x| is in R13, |y| in R14, the remainder in
+    // R15 and the quotient is built in the slot of x
+    fprintf(f, "    @SP\n    A=M\n    M=D\n");
+    fprintf(f, "    @SP\n    AM=M-1\n    D=M\n    @R14\n    M=D\n    @SP\n    A=M\n    M=0\n");
+    fprintf(f, "    @SP\n    A=M-1\n    D=M\n    @R13\n    M=D\n");
+    fprintf(f, "    @%s_X_POSITIVE\n    D; JGE\n    @R13\n    M=-M\n    @SP\n    A=M\n    M=!M\n", l);
+    fprintf(f, "(%s_X_POSITIVE)\n", l);
+    fprintf(f, "    @R14\n    D=M\n    @%s_Y_POSITIVE\n    D; JGE\n", l);
+    fprintf(f, "    @R14\n    M=-M\n    @SP\n    A=M\n    M=!M\n");
+    fprintf(f, "(%s_Y_POSITIVE)\n", l);
+    fprintf(f, "    @SP\n    A=M-1\n    M=0\n    @R15\n    M=0\n");
+    fprintf(f, "    @R13\n    D=M\n    M=D+M\n    M=M+1\n    @%s_COMPARE\n    D; JGE\n", l);
+    fprintf(f, "    @R15\n    M=1\n");
+
+    // Unsigned remainder >= |y|, where |y| is at most 32768
+    fprintf(f, "(%s_COMPARE)\n", l);
+    fprintf(f, "    @R14\n    D=M\n    @%s_Y_LARGE\n    D; JLT\n", l);
+    fprintf(f, "    @R15\n    D=M\n    @%s_SUBTRACT\n    D; JLT\n", l);
+    fprintf(f, "    @R14\n    D=D-M\n    @%s_NEXT\n    D; JLT\n", l);
+    fprintf(f, "(%s_SUBTRACT)\n", l);
+    fprintf(f, "    @R14\n    D=M\n    @R15\n    M=M-D\n    @SP\n    A=M-1\n    M=M+1\n");
+    fprintf(f, "(%s_NEXT)\n", l);
+    fprintf(f, "    @R13\n    D=M\n    @32767\n    D=D&A\n    @%s_END\n    D; JEQ\n", l);
+    fprintf(f, "    @SP\n    A=M-1\n    D=M\n    M=D+M\n    @R15\n    D=M\n    M=D+M\n");
+    fprintf(f, "    @R13\n    D=M\n    M=D+M\n    @%s_COMPARE\n    D; JGE\n", l);
+    fprintf(f, "    @R15\n    M=M+1\n    @%s_COMPARE\n    0; JMP\n", l);
+    fprintf(f, "(%s_Y_LARGE)\n", l);
+    fprintf(f, "    @R15\n    D=M\n    @%s_SUBTRACT\n    D; JLT\n    @%s_NEXT\n    0; JMP\n", l, l);
+
+    fprintf(f, "(%s_END)\n", l);
+    fprintf(f, "    @SP\n    A=M\n    D=M\n    @%s_RETURN\n    D; JEQ\n    @SP\n    A=M-1\n    M=-M\n", l);
+    fprintf(f, "(%s_RETURN)\n", l);
+    fprintf(f, "    @SP\n    A=M+1\n    A=M\n    0; JMP\n");
+}
+
+/// @brief Writes the shared right shift used by divisions by 2^n. Each step
+/// moves the top bit of R14 into the quotient on top of the stack, and
+/// entry n runs the 16 - n steps that bring in bits 15 to n. Returns to the
+/// address in R15
+static void codeWriter_writeShiftRightRoutine(CodeWriter* cw)
+{
+    FILE* f = cw->outputFile;
+    const char* l = SHIFT_RIGHT_ROUTINE_LABEL;
+    fprintf(f, "\n// Shared right shift routine\n");
+    for (int entry = cw->shiftRightFirstEntry; entry < WORD_BITS; entry++) {
+        fprintf(f, "(%s_%d)\n", l, entry);
+        fprintf(f, "    @SP\n    A=M-1\n    D=M\n    M=D+M\n    @R14\n    D=M\n    M=D+M\n");
+        fprintf(f, "    @%s_SKIP_%d\n    D; JGE\n    @SP\n    A=M-1\n    M=M+1\n", l, entry);
+        fprintf(f, "(%s_SKIP_%d)\n", l, entry);
+    }
+    fprintf(f, "    @R15\n    A=M\n    0; JMP\n");
+}
+
+static int bitLength(long value)
+{
+    int bits = 0;
+    while (value > 0) {
+        bits++;
+        value >>= 1;
+    }
+    return bits;
+}
+
+static int popCount(long value)
+{
+    int ones = 0;
+    while (value > 0) {
+        ones += (int)(value & 1);
+        value >>= 1;
+    }
+    return ones;
+}
+
+// ----------------------------- ARRAY ACCESS ------------------------------- //
+/// @brief Reads base[index], with the index on top of the base address. THAT
+/// is only set when it is read later on
+static ErrorCode codeWriter_writeArrayLoad(CodeWriter* cw, const Command* cmd)
+{
+    FILE* f = cw->outputFile;
+    bool setThat = (strcmp(cmd->Arg1, "that") == 0);
+    fprintf(f, "// array load%s\n", setThat ? "" : " (THAT not kept)");
+
+    if (!cw->tosInD) {
+        codeWriter_writePopToD(cw);
+    }
+    // The element replaces the base address on the stack
+    if (cw->opts->cacheTopOfStack) {
+        codeWriter_writePopAddress(cw);
+    }
+    else {
+        codeWriter_writeTopAddress(cw);
+    }
+    fprintf(f, "    D=D+M\n");
+    if (setThat) {
+        fprintf(f, "    @THAT\n    M=D\n");
+    }
+    fprintf(f, "    A=D\n    D=M\n");
+
+    if (cw->opts->cacheTopOfStack) {
+        cw->tosInD = true;
+    }
+    else {
+        codeWriter_writeTopAddress(cw);
+        fprintf(f, "    M=D\n");
+    }
+    return OK;
+}
+
+/// @brief Writes the value on top of the stack to the address below it.
+/// THAT and temp 0 are only set when they are read later on
+static ErrorCode codeWriter_writeArrayStore(CodeWriter* cw, const Command* cmd)
+{
+    FILE* f = cw->outputFile;
+    bool setThat = (strcmp(cmd->Arg1, "that") == 0);
+    bool setTemp = (strcmp(cmd->Arg2, "temp") == 0);
+    fprintf(f, "// array store%s%s\n", setThat ? "" : " (THAT not kept)",
+            setTemp ? "" : " (temp 0 not kept)");
+
+    if (!cw->tosInD) {
+        codeWriter_writePopToD(cw);
+    }
+    cw->tosInD = false;
+    if (setTemp) {
+        fprintf(f, "    @%d\n    M=D\n", TEMP_SEGMENT_BASE_ADDR);
+    }
+
+    if (setThat) {
+        fprintf(f, "    @R13\n    M=D\n");
+        codeWriter_writePopAddress(cw);
+        fprintf(f, "    D=M\n    @THAT\n    M=D\n    @R13\n    D=M\n    @THAT\n    A=M\n    M=D\n");
+    }
+    else {
+        codeWriter_writePopAddress(cw);
+        fprintf(f, "    A=M\n    M=D\n");
+    }
+    return OK;
+}
+
+/// @brief Outlines the code collected in memory into the .asm file
+static ErrorCode codeWriter_writeOutlined(CodeWriter* cw)
+{
+    fclose(cw->outputFile);
+    cw->outputFile = cw->targetFile;
+    cw->targetFile = NULL;
+
+    OutlineStats stats;
+    ErrorCode err = outliner_run(cw->buffer, cw->bufferSize, cw->outputFile, &stats);
+    free(cw->buffer);
+    cw->buffer = NULL;
+    if (err == OK && cw->opts->outlineReport && cw->reportFile != NULL) {
+        fprintf(cw->reportFile,
+                "Outlined %zu sequences at %zu sites, saving %zu ROM words (%zu -> %zu)\n",
+                stats.numSequences, stats.numSites, stats.romBefore - stats.romAfter,
+               stats.romBefore, stats.romAfter);
+    }
+    return err;
 }
@@ -6,23 +6,137 @@ extern "C" {
 #endif
 
 #include "main.h"
+#include "arena.h"
 #include "errorHandler.h"
+#include "linker.h"
+#include "options.h"
 #include "parser.h"
+#include "program.h"
 #include <stdio.h>
 
+typedef struct LabelDepth {
+    char label[MAX_IDENTIFIER_LEN];
+    long depth;
+} LabelDepth;
+
+typedef struct StackUsage {
+    char function[MAX_IDENTIFIER_LEN]; // Function being translated
+    long nLocals;            // Words reserved for locals by its prologue
+    long depth;              // Current operand stack depth, locals excluded
+    long maxDepth;           // Maximum depth, including call frames pushed
+    bool reachable;          // False right after goto and return
+    LabelDepth* labels;      // Stack depth at the jumps to each label
+    size_t numLabels;
+    size_t labelsCapacity;
+} StackUsage;
+
+/// Counters numbering the labels the code writer generates
+typedef struct LabelCounters {
+    char scope[MAX_IDENTIFIER_LEN]; // With -j, the function (or file) the counters
+                             // belong to, as they restart for each one. Empty
+                             // when they run through the whole program
+    unsigned long returnAddress; // <callee>_retAddr_<n> of calls
+    unsigned long gtJump;    // __GT_<n> and __GT_END_<n>
+    unsigned long ltJump;    // __LT_<n> and __LT_END_<n>
+    unsigned long intrinsic; // Return addresses and branches of intrinsics
+} LabelCounters;
+
 typedef struct CodeWriter {
     size_t outFileNameLen;   // strlen(outFileName)
     char* outFileName;       // File name without extension
     char* currentVMfile;     // Currently processed VM file, when input is not
                              // a directory, this is the same as outFileName
     size_t currentVMfileLen; // strlen(currentVMfile) 
+    char* staticPrefix;      // Prefix of the static symbols of currentVMfile
     FILE* outputFile;        // File handle to write
+    FILE* targetFile;        // With -foutline or -c, the output file, while
+                             // outputFile collects the code in buffer
+    char* buffer;
+    size_t bufferSize;
+    const Options* opts;     // Code generation options, never NULL
+    long zeroRoutineLength;  // Number of locals the shared prologue routine
+                             // can zero, 0 when no function uses it
+    bool multiplyRoutineUsed;// Whether the shared Math.multiply routine is needed
+    bool divideRoutineUsed;  // Whether the shared Math.divide routine is needed
+    long shiftRightFirstEntry;// Smallest shift used by divisions by powers of
+                             // two, 0 when the shift routine is not needed
+    bool callRoutineUsed;    // Whether the shared call routine is needed
+    bool returnRoutineUsed;  // Whether the shared return routine is needed
+    CostModel costModel;     // Of the function being translated, which the
+                             // profile of --profile-use may override
+    bool coldFunction;       // The profile finds the function being translated
+                             // (almost) never runs, its calls and returns use
+                             // the shared routines
+    long spOffset;           // Pushes minus pops not yet written to SP, only
+                             // non-zero inside a basic block with -fsp-batching
+    bool tosInD;             // With -ftos-cache, true while the top of the
+                             // stack is held in D instead of memory
+    StackUsage stack;        // Static stack depth tracking of the current function
+    FILE* reportFile;        // Where the reports are printed, the one of the
+                             // options unless the writer translates a chunk
+                             // of a parallel run. NULL prints nothing
+    LabelCounters labels;
+    Arena arena;             // Names of the output and of the current file, and
+                             // labels while a command is written
+    ArenaMark fileMark;      // Where the names of the current file start
 } CodeWriter;
 
 
-ErrorCode codeWriter_new(CodeWriter *cw, const char* fileName, FileType fileType);
+/// @brief Creates a code writer that writes into <fileName>.asm
+/// @param opts Code generation options. When NULL, the defaults are used
+ErrorCode codeWriter_new(CodeWriter *cw, const char* fileName, FileType fileType,
+                         const Options* opts);
+
+/// @brief Creates a code writer that writes into memory instead of a file
+/// @param output Set to the code, NUL terminated, when the writer is closed.
+/// The caller frees it, see open_memstream()
+ErrorCode codeWriter_newInMemory(CodeWriter* cw, char** output, size_t* outputSize,
+                                 const Options* opts);
 void codeWriter_close(CodeWriter *cw);
 ErrorCode codeWriter_writeStartupCode(CodeWriter *cw);
+
+/// @brief Writes the shared routines requested while translating, then
+/// outlines repeated sequences with -foutline. Must be called once after
+/// the last command has been translated
+ErrorCode codeWriter_finish(CodeWriter *cw);
+
+/// @brief Writes the code of the linked object modules that the program
+/// uses. Called after the last command and before codeWriter_finish()
+ErrorCode codeWriter_writeModules(CodeWriter* cw, Linker* linker, const Program* prog);
+
+/// @brief With -c, writes the object module instead of codeWriter_finish().
+/// The shared routines are left to the link
+ErrorCode codeWriter_writeObject(CodeWriter* cw, const Program* prog);
+
+/// @brief With --emit-binary, writes the parsed program as binary VM code
+/// instead of translating it
+ErrorCode codeWriter_writeBytecode(CodeWriter* cw, const Program* prog);
+
+/// @brief Creates a code writer translating, into memory, a chunk of the
+/// program that starts at a function command, for a parallel run with -j.
+/// Label counters restart at every function with -j, so the chunk only
+/// needs the state the compact prologues left
+/// @param reportFile Where the chunk prints --stack-report
+/// @param zeroRoutineLength Length of the shared zeroing routine after the
+/// functions before the chunk, see codeWriter_prologueRoutineLength()
+ErrorCode codeWriter_newChunk(CodeWriter* chunk, const CodeWriter* cw, FILE* reportFile,
+                              long zeroRoutineLength);
+
+/// @brief Writes what the next function command would have written in a
+/// serial run, the cached top of the stack and the pending SP offset, and
+/// reports the last function. Not called for the last chunk
+void codeWriter_endChunk(CodeWriter* chunk);
+
+/// @brief Appends the code of a chunk and adds the shared routines it uses.
+/// The writer takes over the state left by the last chunk
+ErrorCode codeWriter_appendChunk(CodeWriter* cw, CodeWriter* chunk, bool last);
+void codeWriter_closeChunk(CodeWriter* chunk);
+
+/// @return Length of the shared zeroing routine after writing the given
+/// function command, whose compact prologue depends on it and on the cost
+/// model the profile gives the function
+long codeWriter_prologueRoutineLength(const Options* opts, long routineLength, const Command* cmd);
+
 ErrorCode codeWriter_translateCmd(CodeWriter* cw, const Command* cmd);
 ErrorCode codeWriter_setCurrentFileName(CodeWriter* cw, const char* fileName);
 
@@ -0,0 +1,245 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "errorHandler.h"
+#include "optimizer.h"
+#include "parser.h"
+#include "program.h"
+
+#define MAX_KNOWN_SLOTS     (32) // Segment entries whose value is tracked at once
+
+/// A segment entry holding a known constant
+typedef struct KnownSlot {
+    const char* segment;     // "local", "argument", "temp" or "static"
+    long index;
+    int16_t value;
+} KnownSlot;
+
+/// Constants stored in the segments by the current basic block
+typedef struct KnownSlots {
+    KnownSlot slots[MAX_KNOWN_SLOTS];
+    size_t count;
+} KnownSlots;
+
+// Local function prototypes
+static ErrorCode constantFolding_optimizeFile(VmFile* file);
+static ErrorCode constantFolding_rewrite(VmFile* out, const Command* cmd, KnownSlots* known);
+static bool foldArithmetic(VmFile* out, const char* op);
+static bool getConstant(const Command* cmd, int16_t* value);
+static void setConstant(Command* cmd, int16_t value);
+static const char* trackedSegment(const char* segment);
+static KnownSlot* knownSlots_find(KnownSlots* known, const char* segment, long index);
+static void knownSlots_set(KnownSlots* known, const char* segment, long index, int16_t value);
+static void knownSlots_forget(KnownSlots* known, const char* segment, long index);
+static void knownSlots_keepFrame(KnownSlots* known);
+
+// ---------------------------- PUBLIC FUNCTIONS --------------------------- //
+ErrorCode constantFolding_optimize(Program* prog)
+{
+    ErrorCode err = OK;
+    for (size_t f = 0; f < prog->numFiles && err == OK; f++) {
+        err = constantFolding_optimizeFile(&prog->files[f]);
+    }
+    return err;
+}
+
+bool constantFolding_evaluate(const char* op, int16_t x, int16_t y, int16_t* result)
+{
+    int16_t difference = (int16_t)(uint16_t)((uint16_t)y - (uint16_t)x);
+    if (strcmp(op, "add") == 0)      *result = (int16_t)(uint16_t)((uint16_t)x + (uint16_t)y);
+    else if (strcmp(op, "sub") == 0) *result = (int16_t)(uint16_t)((uint16_t)x - (uint16_t)y);
+    else if (strcmp(op, "and") == 0) *result = x & y;
+    else if (strcmp(op, "or") == 0)  *result = x | y;
+    else if (strcmp(op, "eq") == 0)  *result = difference;
+    else if (strcmp(op, "gt") == 0)  *result = (difference <= 0) ? 1 : 0;
+    else if (strcmp(op, "lt") == 0)  *result = (difference > 0) ? 1 : 0;
+    else if (strcmp(op, "neg") == 0) *result = (int16_t)(uint16_t)(0 - (uint16_t)y);
+    else if (strcmp(op, "not") == 0) *result = ~y;
+    else return false;
+    return true;
+}
+
+// -------------------------- PRIVATE FUNCTIONS ----------------------------- //
+static ErrorCode constantFolding_optimizeFile(VmFile* file)
+{
+    ErrorCode err = OK;
+    VmFile out = { 0 };
+    KnownSlots known = { .count = 0 };
+
+    for (size_t i = 0; i < file->numCmds && err == OK; i++) {
+        err = constantFolding_rewrite(&out, &file->cmds[i], &known);
+    }
+
+    if (err == OK) {
+        vmFile_replaceCommands(file, &out);
+    }
+    free(out.cmds);
+    return err;
+}
+
+/// @brief Appends a command to out, folded into the constants pushed before
+/// it or with a known segment entry replaced by its constant
+static ErrorCode constantFolding_rewrite(VmFile* out, const Command* cmd, KnownSlots* known)
+{
+    int16_t value = 0;
+    switch (cmd->type) {
+        case CMD_PUSH:
+        {
+            const char* segment = trackedSegment(cmd->Arg1);
+            KnownSlot* slot = (segment != NULL) ? knownSlots_find(known, segment, atol(cmd->Arg2))
+                                                : NULL;
+            if (slot != NULL) {
+                Command push = { .type = CMD_PUSH, .Arg1 = "constant" };
+                setConstant(&push, slot->value);
+                return vmFile_append(out, &push);
+            }
+            return vmFile_append(out, cmd);
+        }
+        case CMD_POP:
+        {
+            // The store is kept, the block may be left before the entry is read
+            const char* segment = trackedSegment(cmd->Arg1);
+            const Command* last = (out->numCmds > 0) ? &out->cmds[out->numCmds - 1] : NULL;
+            if (segment != NULL && last != NULL && getConstant(last, &value)) {
+                knownSlots_set(known, segment, atol(cmd->Arg2), value);
+            }
+            else if (segment != NULL) {
+                knownSlots_forget(known, segment, atol(cmd->Arg2));
+            }
+            else if (strcmp(cmd->Arg1, "pointer") != 0) {
+                // this and that may point anywhere in RAM
+                known->count = 0;
+            }
+            return vmFile_append(out, cmd);
+        }
+        case CMD_ARITHMETIC:
+            if (foldArithmetic(out, cmd->Arg1)) {
+                return OK;
+            }
+            return vmFile_append(out, cmd);
+        case CMD_CALL:
+            // The callee may change the statics and temp, not the frame of
+            // the caller
+            knownSlots_keepFrame(known);
+            return vmFile_append(out, cmd);
+        default:
+            // Labels join control flow from elsewhere, and the other
+            // commands end the basic block or write memory
+            known->count = 0;
+            return vmFile_append(out, cmd);
+    }
+}
+
+/// @brief Folds an arithmetic command into the constants on top of the
+/// stack, which are the last commands of out. Adding, subtracting or or-ing
+/// 0 and and-ing -1 leave the other operand as it is
+/// @return true if the command was folded and must not be appended
+static bool foldArithmetic(VmFile* out, const char* op)
+{
+    int16_t y = 0;
+    int16_t x = 0;
+    int16_t result = 0;
+    Command* top = (out->numCmds > 0) ? &out->cmds[out->numCmds - 1] : NULL;
+    Command* below = (out->numCmds > 1) ? &out->cmds[out->numCmds - 2] : NULL;
+    if (top == NULL || !getConstant(top, &y)) {
+        return false;
+    }
+
+    bool isUnary = (strcmp(op, "neg") == 0 || strcmp(op, "not") == 0);
+    if (isUnary) {
+        constantFolding_evaluate(op, 0, y, &result);
+        setConstant(top, result);
+        return true;
+    }
+    if (below != NULL && getConstant(below, &x) && constantFolding_evaluate(op, x, y, &result)) {
+        setConstant(below, result);
+        out->numCmds--;
+        return true;
+    }
+    if ((y == 0 && (strcmp(op, "add") == 0 || strcmp(op, "sub") == 0 || strcmp(op, "or") == 0)) ||
+        (y == -1 && strcmp(op, "and") == 0)) {
+        out->numCmds--;
+        return true;
+    }
+    return false;
+}
+
+/// @return Whether the command pushes a constant of the 16 bit range. Folded
+/// constants may be negative
+static bool getConstant(const Command* cmd, int16_t* value)
+{
+    if (cmd->type != CMD_PUSH || strcmp(cmd->Arg1, "constant") != 0) {
+        return false;
+    }
+    char* end = NULL;
+    long constant = strtol(cmd->Arg2, &end, 10);
+    if (cmd->Arg2[0] == '\0' || *end != '\0' || constant < INT16_MIN || constant > INT16_MAX) {
+        return false;
+    }
+    *value = (int16_t)constant;
+    return true;
+}
+
+static void setConstant(Command* cmd, int16_t value)
+{
+    snprintf(cmd->Arg2, MAX_IDENTIFIER_LEN, "%d", value);
+}
+
+/// @return The segment as a string constant when its entries are tracked
+static const char* trackedSegment(const char* segment)
+{
+    static const char* const segments[] = { "local", "argument", "temp", "static" };
+    for (size_t i = 0; i < sizeof(segments) / sizeof(segments[0]); i++) {
+        if (strcmp(segment, segments[i]) == 0) {
+            return segments[i];
+        }
+    }
+    return NULL;
+}
+
+static KnownSlot* knownSlots_find(KnownSlots* known, const char* segment, long index)
+{
+    for (size_t i = 0; i < known->count; i++) {
+        if (known->slots[i].segment == segment && known->slots[i].index == index) {
+            return &known->slots[i];
+        }
+    }
+    return NULL;
+}
+
+/// @brief Records a constant stored in a segment entry. When the table is
+/// full, the entry stored first is forgotten
+static void knownSlots_set(KnownSlots* known, const char* segment, long index, int16_t value)
+{
+    knownSlots_forget(known, segment, index);
+    if (known->count == MAX_KNOWN_SLOTS) {
+        memmove(&known->slots[0], &known->slots[1], (MAX_KNOWN_SLOTS - 1) * sizeof(KnownSlot));
+        known->count--;
+    }
+    known->slots[known->count++] = (KnownSlot) { segment, index, value };
+}
+
+static void knownSlots_forget(KnownSlots* known, const char* segment, long index)
+{
+    KnownSlot* slot = knownSlots_find(known, segment, index);
+    if (slot != NULL) {
+        size_t i = (size_t)(slot - known->slots);
+        memmove(slot, slot + 1, (known->count - i - 1) * sizeof(KnownSlot));
+        known->count--;
+    }
+}
+
+/// @brief Forgets every entry but the locals and arguments
+static void knownSlots_keepFrame(KnownSlots* known)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < known->count; i++) {
+        const char* segment = known->slots[i].segment;
+        if (strcmp(segment, "local") == 0 || strcmp(segment, "argument") == 0) {
+            known->slots[kept++] = known->slots[i];
+        }
+    }
+    known->count = kept;
+}
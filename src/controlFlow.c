@@ -0,0 +1,505 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "errorHandler.h"
+#include "optimizer.h"
+#include "parser.h"
+#include "profile.h"
+#include "program.h"
+
+#define RETURN_ON_ERR(err)    ({ErrorCode e = err; if (e != OK) return (e);})
+
+// Longest chain of gotos followed when threading a jump, which also stops
+// threading around goto cycles
+#define MAX_THREADING_STEPS     64
+// Threading and simplifying only shorten jump chains or remove commands,
+// this bounds the rounds for goto cycles
+#define MAX_ROUNDS              32
+
+#define ROTATED_LOOP_LABEL      "__LOOP_BODY"
+
+/// Number of jumps to a label from anywhere in the program. As labels are
+/// not scoped to functions, a label is only removed once nothing jumps to it
+typedef struct LabelRef {
+    char name[MAX_IDENTIFIER_LEN];
+    long refs;
+} LabelRef;
+
+typedef struct LabelTable {
+    LabelRef* entries;       // Open addressing, empty names for free slots
+    size_t capacity;
+    unsigned long rotatedLoops; // Unique identifier for the body labels of
+                             // rotated loops
+} LabelTable;
+
+/// Label positions inside the function being optimized, sorted by name
+typedef struct LabelIndex {
+    const char* name;
+    size_t index;
+} LabelIndex;
+
+// Local function prototypes
+static ErrorCode controlFlow_optimizeFunction(VmFile* fn, LabelTable* labels,
+                                              const Profile* profile, SiteOrdinals* ordinals);
+static ErrorCode controlFlow_layOutBranches(VmFile* fn, LabelTable* labels,
+                                            const Profile* profile, SiteOrdinals* ordinals);
+static ErrorCode controlFlow_swapBranches(VmFile* fn, size_t branch, size_t thenEnd,
+                                          size_t end);
+static ErrorCode controlFlow_cleanUp(VmFile* fn, LabelTable* labels);
+static ErrorCode controlFlow_threadJumps(VmFile* fn, LabelTable* labels, bool* changed);
+static ErrorCode controlFlow_simplify(VmFile* fn, LabelTable* labels, bool* changed);
+static ErrorCode controlFlow_rotateLoop(VmFile* fn, LabelTable* labels, bool* changed);
+static size_t findLoopLatch(const VmFile* fn, size_t header, size_t branch);
+static size_t skipDeadCode(VmFile* fn, LabelTable* labels, size_t i, bool* changed);
+static bool labelFollows(const VmFile* fn, size_t i, const char* label);
+static ErrorCode labelTable_build(const Program* prog, LabelTable* labels);
+static LabelRef* labelTable_find(LabelTable* labels, const char* name);
+static ErrorCode buildLabelIndex(const VmFile* fn, LabelIndex** index, size_t* numLabels);
+static int compareLabels(const void* a, const void* b);
+static bool isJump(const Command* cmd);
+static bool endsBlock(const Command* cmd);
+static CommandType invertBranch(CommandType type);
+
+// ---------------------------- PUBLIC FUNCTIONS --------------------------- //
+ErrorCode controlFlow_optimize(Program* prog, const Profile* profile)
+{
+    LabelTable labels;
+    RETURN_ON_ERR(labelTable_build(prog, &labels));
+    SiteOrdinals ordinals = { 0 };
+
+    ErrorCode err = OK;
+    for (size_t f = 0; f < prog->numFiles && err == OK; f++) {
+        VmFile* file = &prog->files[f];
+        VmFile out = { 0 };
+
+        size_t start = 0;
+        while (start < file->numCmds && err == OK) {
+            size_t end = start + 1;
+            while (end < file->numCmds && file->cmds[end].type != CMD_FUNCTION) {
+                end++;
+            }
+
+            VmFile fn = { 0 };
+            for (size_t i = start; i < end && err == OK; i++) {
+                err = vmFile_append(&fn, &file->cmds[i]);
+            }
+            if (err == OK) err = controlFlow_optimizeFunction(&fn, &labels, profile, &ordinals);
+            for (size_t i = 0; i < fn.numCmds && err == OK; i++) {
+                err = vmFile_append(&out, &fn.cmds[i]);
+            }
+            free(fn.cmds);
+            start = end;
+        }
+
+        if (err == OK) {
+            vmFile_replaceCommands(file, &out);
+        }
+        free(out.cmds);
+    }
+
+    free(labels.entries);
+    siteOrdinals_close(&ordinals);
+    return err;
+}
+
+// -------------------------- PRIVATE FUNCTIONS ----------------------------- //
+static ErrorCode controlFlow_optimizeFunction(VmFile* fn, LabelTable* labels,
+                                              const Profile* profile, SiteOrdinals* ordinals)
+{
+    // The branches are found by their place in the parsed program, which the
+    // clean up changes
+    if (profile != NULL) {
+        RETURN_ON_ERR(controlFlow_layOutBranches(fn, labels, profile, ordinals));
+    }
+    RETURN_ON_ERR(controlFlow_cleanUp(fn, labels));
+
+    // Each rotation consumes the goto closing a loop, so this ends once every
+    // loop of the function has been rotated
+    bool rotated = true;
+    while (rotated) {
+        rotated = false;
+        RETURN_ON_ERR(controlFlow_rotateLoop(fn, labels, &rotated));
+    }
+    return controlFlow_cleanUp(fn, labels);
+}
+
+/// @brief Swaps the branches of every if-else of the form
+///     if-goto T; goto F; label T; <then>; goto E; label F; <else>; label E
+/// whose branch the profile finds mostly taken into
+///     if-goto T; label F; <else>; goto E; label T; <then>; label E
+/// so that the more frequent branch is the one falling through to E
+/// instead of ending with a goto
+static ErrorCode controlFlow_layOutBranches(VmFile* fn, LabelTable* labels,
+                                            const Profile* profile, SiteOrdinals* ordinals)
+{
+    if (fn->numCmds == 0 || fn->cmds[0].type != CMD_FUNCTION) return OK;
+    siteOrdinals_reset(ordinals);
+
+    for (size_t i = 1; i < fn->numCmds; i++) {
+        const Command* cmd = &fn->cmds[i];
+        if (cmd->type != CMD_IF) continue;
+
+        size_t ordinal = siteOrdinals_next(ordinals, cmd->Arg1);
+        if (ordinal == SIZE_MAX) continue;
+        const ProfileEntry* entry = profile_find(profile, "branch", fn->cmds[0].Arg1,
+                                                 cmd->Arg1, ordinal);
+        if (entry == NULL || entry->count <= entry->notTaken) continue;
+
+        bool overGoto = (i + 2 < fn->numCmds) && (fn->cmds[i + 1].type == CMD_GOTO) &&
+                        (fn->cmds[i + 2].type == CMD_LABEL) && labelFollows(fn, i + 2, cmd->Arg1);
+        if (!overGoto) continue;
+        const char* elseLabel = fn->cmds[i + 1].Arg1;
+
+        size_t thenEnd = i + 3;
+        while (thenEnd < fn->numCmds && !(fn->cmds[thenEnd].type == CMD_GOTO &&
+                                          labelFollows(fn, thenEnd + 1, elseLabel))) {
+            thenEnd++;
+        }
+        if (thenEnd >= fn->numCmds) continue;
+        size_t end = thenEnd + 1;
+        while (end < fn->numCmds && !(fn->cmds[end].type == CMD_LABEL &&
+                                      strcmp(fn->cmds[end].Arg1, fn->cmds[thenEnd].Arg1) == 0)) {
+            end++;
+        }
+        if (end >= fn->numCmds) continue;
+
+        // The goto F is dropped, the goto E moves from the then to the else
+        // branch
+        labelTable_find(labels, elseLabel)->refs--;
+        RETURN_ON_ERR(controlFlow_swapBranches(fn, i, thenEnd, end));
+    }
+    return OK;
+}
+
+/// @brief Rewrites `if-goto T; goto F; <then>; goto E; <else>` as
+/// `if-goto T; <else>; goto E; <then>`. The then branch starts two commands
+/// after the if-goto, its goto E is at thenEnd and the else branch ends
+/// right before end
+static ErrorCode controlFlow_swapBranches(VmFile* fn, size_t branch, size_t thenEnd,
+                                          size_t end)
+{
+    VmFile out = { 0 };
+    ErrorCode err = OK;
+    for (size_t i = 0; i <= branch && err == OK; i++) {
+        err = vmFile_append(&out, &fn->cmds[i]);
+    }
+    for (size_t i = thenEnd + 1; i < end && err == OK; i++) {
+        err = vmFile_append(&out, &fn->cmds[i]);
+    }
+    if (err == OK) err = vmFile_append(&out, &fn->cmds[thenEnd]);
+    for (size_t i = branch + 2; i < thenEnd && err == OK; i++) {
+        err = vmFile_append(&out, &fn->cmds[i]);
+    }
+    for (size_t i = end; i < fn->numCmds && err == OK; i++) {
+        err = vmFile_append(&out, &fn->cmds[i]);
+    }
+
+    if (err == OK) {
+        vmFile_replaceCommands(fn, &out);
+    }
+    free(out.cmds);
+    return err;
+}
+
+/// @brief Threads jumps and simplifies the function until nothing changes
+static ErrorCode controlFlow_cleanUp(VmFile* fn, LabelTable* labels)
+{
+    bool changed = true;
+    for (int round = 0; changed && round < MAX_ROUNDS; round++) {
+        changed = false;
+        RETURN_ON_ERR(controlFlow_threadJumps(fn, labels, &changed));
+        RETURN_ON_ERR(controlFlow_simplify(fn, labels, &changed));
+    }
+    return OK;
+}
+
+/// @brief Retargets jumps to labels that are directly followed by a goto,
+/// so that they jump to the end of the goto chain
+static ErrorCode controlFlow_threadJumps(VmFile* fn, LabelTable* labels, bool* changed)
+{
+    LabelIndex* index = NULL;
+    size_t numLabels = 0;
+    RETURN_ON_ERR(buildLabelIndex(fn, &index, &numLabels));
+
+    for (size_t i = 0; i < fn->numCmds; i++) {
+        Command* cmd = &fn->cmds[i];
+        if (!isJump(cmd)) continue;
+
+        const char* target = cmd->Arg1;
+        for (int step = 0; step < MAX_THREADING_STEPS; step++) {
+            LabelIndex key = { .name = target };
+            const LabelIndex* found = bsearch(&key, index, numLabels, sizeof(LabelIndex), compareLabels);
+            if (found == NULL) break;
+
+            size_t next = found->index;
+            while (next < fn->numCmds && fn->cmds[next].type == CMD_LABEL) {
+                next++;
+            }
+            if (next >= fn->numCmds || fn->cmds[next].type != CMD_GOTO ||
+                strcmp(fn->cmds[next].Arg1, target) == 0) {
+                break;
+            }
+            target = fn->cmds[next].Arg1;
+        }
+
+        if (strcmp(target, cmd->Arg1) != 0) {
+            labelTable_find(labels, cmd->Arg1)->refs--;
+            labelTable_find(labels, target)->refs++;
+            // target points into another command, which is left untouched
+            snprintf(cmd->Arg1, MAX_IDENTIFIER_LEN, "%s", target);
+            *changed = true;
+        }
+    }
+
+    free(index);
+    return OK;
+}
+
+/// @brief Removes unreachable commands, gotos to the next command and
+/// labels nothing jumps to, and turns an if-goto over a goto into a single
+/// inverted branch
+static ErrorCode controlFlow_simplify(VmFile* fn, LabelTable* labels, bool* changed)
+{
+    ErrorCode err = OK;
+    VmFile out = { 0 };
+
+    size_t i = 0;
+    while (i < fn->numCmds && err == OK) {
+        Command* cmd = &fn->cmds[i];
+
+        if (cmd->type == CMD_LABEL && labelTable_find(labels, cmd->Arg1)->refs <= 0) {
+            *changed = true;
+            i++;
+            continue;
+        }
+        if (cmd->type == CMD_GOTO && labelFollows(fn, i + 1, cmd->Arg1)) {
+            labelTable_find(labels, cmd->Arg1)->refs--;
+            *changed = true;
+            i++;
+            continue;
+        }
+        // if-goto A; goto B; label A  ->  if-not B; label A
+        bool branchesOverGoto = (cmd->type == CMD_IF || cmd->type == CMD_IF_NOT) &&
+                                (i + 1 < fn->numCmds) && (fn->cmds[i + 1].type == CMD_GOTO) &&
+                                labelFollows(fn, i + 2, cmd->Arg1);
+        if (branchesOverGoto) {
+            Command inverted = { .type = invertBranch(cmd->type) };
+            strcpy(inverted.Arg1, fn->cmds[i + 1].Arg1);
+            labelTable_find(labels, cmd->Arg1)->refs--;
+            err = vmFile_append(&out, &inverted);
+            *changed = true;
+            i = skipDeadCode(fn, labels, i + 2, changed);
+            continue;
+        }
+
+        err = vmFile_append(&out, cmd);
+        i = endsBlock(cmd) ? skipDeadCode(fn, labels, i + 1, changed) : i + 1;
+    }
+
+    if (err == OK) {
+        vmFile_replaceCommands(fn, &out);
+    }
+    free(out.cmds);
+    return err;
+}
+
+/// @brief Rotates the first loop of the form
+///     label H; <condition>; if-goto E; <body>; goto H; label E
+/// into
+///     goto H; label B; <body>; label H; <condition>; if-not B; label E
+/// so that each iteration takes a single conditional branch instead of a
+/// branch and a goto. The condition must be straight-line code
+static ErrorCode controlFlow_rotateLoop(VmFile* fn, LabelTable* labels, bool* changed)
+{
+    for (size_t header = 0; header < fn->numCmds; header++) {
+        if (fn->cmds[header].type != CMD_LABEL) continue;
+
+        size_t branch = header + 1;
+        while (branch < fn->numCmds && !endsBlock(&fn->cmds[branch]) &&
+               !isJump(&fn->cmds[branch]) && fn->cmds[branch].type != CMD_LABEL) {
+            branch++;
+        }
+        if (branch >= fn->numCmds) continue;
+        const Command* exitBranch = &fn->cmds[branch];
+        if (exitBranch->type != CMD_IF && exitBranch->type != CMD_IF_NOT) continue;
+        if (strcmp(exitBranch->Arg1, fn->cmds[header].Arg1) == 0) continue;
+
+        size_t latch = findLoopLatch(fn, header, branch);
+        if (latch == 0) continue;
+
+        VmFile out = { 0 };
+        ErrorCode err = OK;
+        Command bodyLabel = { .type = CMD_LABEL };
+        snprintf(bodyLabel.Arg1, MAX_IDENTIFIER_LEN, "%s_%lu", ROTATED_LOOP_LABEL,
+                 labels->rotatedLoops++);
+        Command entry = { .type = CMD_GOTO };
+        strcpy(entry.Arg1, fn->cmds[header].Arg1);
+        Command backEdge = { .type = invertBranch(exitBranch->type) };
+        strcpy(backEdge.Arg1, bodyLabel.Arg1);
+
+        for (size_t i = 0; i < header && err == OK; i++) {
+            err = vmFile_append(&out, &fn->cmds[i]);
+        }
+        if (err == OK) err = vmFile_append(&out, &entry);
+        if (err == OK) err = vmFile_append(&out, &bodyLabel);
+        for (size_t i = branch + 1; i < latch && err == OK; i++) {
+            err = vmFile_append(&out, &fn->cmds[i]);
+        }
+        for (size_t i = header; i < branch && err == OK; i++) {
+            err = vmFile_append(&out, &fn->cmds[i]);
+        }
+        if (err == OK) err = vmFile_append(&out, &backEdge);
+        for (size_t i = latch + 1; i < fn->numCmds && err == OK; i++) {
+            err = vmFile_append(&out, &fn->cmds[i]);
+        }
+        if (err != OK) {
+            free(out.cmds);
+            return err;
+        }
+
+        // The goto H moved from the latch to the entry, the exit branch now
+        // falls through to E and the back edge jumps to the new body label
+        labelTable_find(labels, exitBranch->Arg1)->refs--;
+        labelTable_find(labels, bodyLabel.Arg1)->refs++;
+        vmFile_replaceCommands(fn, &out);
+        free(out.cmds);
+        *changed = true;
+        return OK;
+    }
+    return OK;
+}
+
+/// @return Index of the first goto back to the loop header that is directly
+/// followed by the exit label of the loop, 0 when there is none
+static size_t findLoopLatch(const VmFile* fn, size_t header, size_t branch)
+{
+    const char* headerLabel = fn->cmds[header].Arg1;
+    const char* exitLabel = fn->cmds[branch].Arg1;
+    for (size_t i = branch + 1; i < fn->numCmds; i++) {
+        const Command* cmd = &fn->cmds[i];
+        if (cmd->type == CMD_GOTO && strcmp(cmd->Arg1, headerLabel) == 0 &&
+            labelFollows(fn, i + 1, exitLabel)) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+/// @brief Drops the commands from i up to the next label, which no path
+/// reaches
+/// @return Index of the next label, or the end of the function
+static size_t skipDeadCode(VmFile* fn, LabelTable* labels, size_t i, bool* changed)
+{
+    for (; i < fn->numCmds && fn->cmds[i].type != CMD_LABEL; i++) {
+        if (isJump(&fn->cmds[i])) {
+            labelTable_find(labels, fn->cmds[i].Arg1)->refs--;
+        }
+        *changed = true;
+    }
+    return i;
+}
+
+/// @return Whether the run of labels starting at i declares the given label
+static bool labelFollows(const VmFile* fn, size_t i, const char* label)
+{
+    for (; i < fn->numCmds && fn->cmds[i].type == CMD_LABEL; i++) {
+        if (strcmp(fn->cmds[i].Arg1, label) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static ErrorCode labelTable_build(const Program* prog, LabelTable* labels)
+{
+    // Rotated loops add at most one label per conditional branch
+    size_t numNames = 16;
+    for (size_t f = 0; f < prog->numFiles; f++) {
+        for (size_t i = 0; i < prog->files[f].numCmds; i++) {
+            const Command* cmd = &prog->files[f].cmds[i];
+            if (cmd->type == CMD_LABEL) numNames++;
+            if (isJump(cmd)) numNames += 2;
+        }
+    }
+
+    labels->rotatedLoops = 0;
+    labels->capacity = 16;
+    while (labels->capacity < 2 * numNames) {
+        labels->capacity *= 2;
+    }
+    labels->entries = calloc(labels->capacity, sizeof(LabelRef));
+    if (labels->entries == NULL) {
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+
+    for (size_t f = 0; f < prog->numFiles; f++) {
+        for (size_t i = 0; i < prog->files[f].numCmds; i++) {
+            const Command* cmd = &prog->files[f].cmds[i];
+            if (cmd->type == CMD_LABEL) {
+                labelTable_find(labels, cmd->Arg1);
+            }
+            else if (isJump(cmd)) {
+                labelTable_find(labels, cmd->Arg1)->refs++;
+            }
+        }
+    }
+    return OK;
+}
+
+/// @return The entry of the label, added with no references if needed. The
+/// table is sized for every label the pass can create
+static LabelRef* labelTable_find(LabelTable* labels, const char* name)
+{
+    size_t mask = labels->capacity - 1;
+    size_t b = program_hashName(name) & mask;
+    for (; labels->entries[b].name[0] != '\0'; b = (b + 1) & mask) {
+        if (strcmp(labels->entries[b].name, name) == 0) {
+            return &labels->entries[b];
+        }
+    }
+    strcpy(labels->entries[b].name, name);
+    return &labels->entries[b];
+}
+
+static ErrorCode buildLabelIndex(const VmFile* fn, LabelIndex** index, size_t* numLabels)
+{
+    *numLabels = 0;
+    *index = malloc((fn->numCmds + 1) * sizeof(LabelIndex));
+    if (*index == NULL) {
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+    for (size_t i = 0; i < fn->numCmds; i++) {
+        if (fn->cmds[i].type == CMD_LABEL) {
+            (*index)[*numLabels].name = fn->cmds[i].Arg1;
+            (*index)[*numLabels].index = i;
+            (*numLabels)++;
+        }
+    }
+    qsort(*index, *numLabels, sizeof(LabelIndex), compareLabels);
+    return OK;
+}
+
+static int compareLabels(const void* a, const void* b)
+{
+    return strcmp(((const LabelIndex*)a)->name, ((const LabelIndex*)b)->name);
+}
+
+static bool isJump(const Command* cmd)
+{
+    return cmd->type == CMD_GOTO || cmd->type == CMD_IF || cmd->type == CMD_IF_NOT;
+}
+
+/// @return Whether control never falls through to the next command
+static bool endsBlock(const Command* cmd)
+{
+    return cmd->type == CMD_GOTO || cmd->type == CMD_RETURN || cmd->type == CMD_LIGHT_RETURN ||
+           cmd->type == CMD_TAIL_CALL || cmd->type == CMD_TAIL_JUMP;
+}
+
+static CommandType invertBranch(CommandType type)
+{
+    return (type == CMD_IF) ? CMD_IF_NOT : CMD_IF;
+}
@@ -0,0 +1,466 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "errorHandler.h"
+#include "optimizer.h"
+#include "parser.h"
+#include "program.h"
+
+#define NUM_TRACKED_SLOTS   (64) // Locals and arguments tracked, higher indices stay live
+#define NUM_TEMP_SLOTS      (8)
+#define NO_TARGET           SIZE_MAX
+
+/// Segment entries whose value may still be read, as bit sets indexed by
+/// the entry
+typedef struct LiveSet {
+    uint64_t local;
+    uint64_t argument;
+    uint64_t temp;
+} LiveSet;
+
+/// How a function uses the temp segment, which it shares with its callers
+/// and callees
+typedef struct TempUse {
+    uint64_t readOnEntry;    // Entries the function, or its callees, may read
+                             // before writing them
+    uint64_t readAfterReturn;// Entries the callers may read after the call
+} TempUse;
+
+/// The functions of the program and their use of temp, which the liveness
+/// of a function depends on at its calls and returns
+typedef struct TempUses {
+    const FunctionTable* table;
+    TempUse* uses;           // Indexed like table->funcs
+} TempUses;
+
+typedef struct LabelIndex {
+    const char* name;
+    size_t index;            // Index of the label command in the function
+} LabelIndex;
+
+static const LiveSet liveAll = { UINT64_MAX, UINT64_MAX, UINT64_MAX };
+
+// Local function prototypes
+static ErrorCode deadStores_optimizeOnce(Program* prog, bool* changed);
+static ErrorCode tempUses_compute(const Program* prog, TempUses* temps);
+static ErrorCode tempUses_update(const TempUses* temps, const Command* cmds, size_t numCmds,
+                                 bool* changed);
+static ErrorCode deadStores_rewriteFunction(VmFile* out, const Command* cmds, size_t numCmds,
+                                            const TempUses* temps);
+static ErrorCode computeLiveness(const Command* cmds, size_t numCmds, const TempUses* temps,
+                                 LiveSet* liveIn);
+static LiveSet liveness_transfer(const Command* cmd, LiveSet liveOut, const TempUses* temps);
+static uint64_t calleeReads(const TempUses* temps, const char* callee);
+static uint64_t* entryBits(LiveSet* set, const Command* cmd, uint64_t* mask);
+static bool isDeadStore(const Command* cmd, LiveSet liveOut);
+static ErrorCode appendDiscard(VmFile* out, long count);
+static size_t functionEnd(const VmFile* file, size_t start);
+static bool liveSet_equals(const LiveSet* a, const LiveSet* b);
+static LiveSet liveSet_union(LiveSet a, LiveSet b);
+static int compareLabels(const void* a, const void* b);
+
+// ---------------------------- PUBLIC FUNCTIONS --------------------------- //
+ErrorCode deadStores_optimize(Program* prog)
+{
+    // Removing a push is removing a read, which can make the store of the
+    // pushed entry dead in turn
+    bool changed = true;
+    ErrorCode err = OK;
+    while (changed && err == OK) {
+        err = deadStores_optimizeOnce(prog, &changed);
+    }
+    return err;
+}
+
+// -------------------------- PRIVATE FUNCTIONS ----------------------------- //
+/// @param changed Set when any store was removed
+static ErrorCode deadStores_optimizeOnce(Program* prog, bool* changed)
+{
+    FunctionTable table;
+    ErrorCode err = program_buildFunctionTable(prog, &table);
+    if (err != OK) return err;
+
+    TempUses temps = { .table = &table };
+    temps.uses = calloc(table.numFuncs + 1, sizeof(TempUse));
+    if (temps.uses == NULL) {
+        functionTable_close(&table);
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+    err = tempUses_compute(prog, &temps);
+
+    *changed = false;
+    for (size_t f = 0; f < prog->numFiles && err == OK; f++) {
+        VmFile* file = &prog->files[f];
+        VmFile out = { 0 };
+        size_t numPops = 0;
+        size_t numPopsLeft = 0;
+
+        // Liveness is computed per function, from one function command to the next
+        size_t start = 0;
+        while (start < file->numCmds && err == OK) {
+            size_t end = functionEnd(file, start);
+            err = deadStores_rewriteFunction(&out, &file->cmds[start], end - start, &temps);
+            start = end;
+        }
+
+        if (err == OK) {
+            for (size_t i = 0; i < file->numCmds; i++) {
+                if (file->cmds[i].type == CMD_POP) numPops++;
+            }
+            for (size_t i = 0; i < out.numCmds; i++) {
+                if (out.cmds[i].type == CMD_POP) numPopsLeft++;
+            }
+            *changed |= (numPopsLeft != numPops);
+            vmFile_replaceCommands(file, &out);
+        }
+        free(out.cmds);
+    }
+
+    free(temps.uses);
+    functionTable_close(&table);
+    return err;
+}
+
+/// @brief Works out the temp entries every function reads on entry and its
+/// callers read after it returns, iterating the liveness of all functions
+/// until neither grows. The callers of the functions entered by the bootstrap
+/// code, other modules, tail calls or shared code are not known, so they
+/// may read any entry
+static ErrorCode tempUses_compute(const Program* prog, TempUses* temps)
+{
+    const FunctionTable* table = temps->table;
+    for (size_t f = 0; f < prog->numFiles; f++) {
+        const VmFile* file = &prog->files[f];
+        for (size_t i = 0; i < file->numCmds; i++) {
+            const Command* cmd = &file->cmds[i];
+            size_t callee = (cmd->type == CMD_TAIL_CALL || cmd->type == CMD_TAIL_JUMP)
+                                ? functionTable_indexOf(table, cmd->Arg1)
+                                : NO_FUNCTION;
+            if (callee != NO_FUNCTION) {
+                temps->uses[callee].readAfterReturn = liveAll.temp;
+            }
+        }
+    }
+    for (size_t i = 0; i < table->numFuncs; i++) {
+        if (strcmp(table->funcs[i].name, "Sys.init") == 0 ||
+            program_isCalledExternally(prog, table->funcs[i].name)) {
+            temps->uses[i].readAfterReturn = liveAll.temp;
+        }
+    }
+
+    FunctionEdge* edges = NULL;
+    size_t numEdges = 0;
+    ErrorCode err = program_findSharedCode(prog, table, &edges, &numEdges);
+    if (err != OK) return err;
+    for (size_t e = 0; e < numEdges; e++) {
+        temps->uses[edges[e].to].readAfterReturn = liveAll.temp;
+    }
+    free(edges);
+
+    bool changed = true;
+    while (changed && err == OK) {
+        changed = false;
+        for (size_t f = 0; f < prog->numFiles && err == OK; f++) {
+            const VmFile* file = &prog->files[f];
+            size_t start = 0;
+            while (start < file->numCmds && err == OK) {
+                size_t end = functionEnd(file, start);
+                err = tempUses_update(temps, &file->cmds[start], end - start, &changed);
+                start = end;
+            }
+        }
+    }
+    return err;
+}
+
+/// @brief Adds what the liveness of one function finds to the temp uses: the
+/// entries it reads on entry, and the ones read after each of its calls to
+/// the uses of the callee
+/// @param changed Set when any use grows
+static ErrorCode tempUses_update(const TempUses* temps, const Command* cmds, size_t numCmds,
+                                 bool* changed)
+{
+    LiveSet* liveIn = malloc((numCmds + 1) * sizeof(LiveSet));
+    if (liveIn == NULL) {
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+    ErrorCode err = computeLiveness(cmds, numCmds, temps, liveIn);
+    liveIn[numCmds] = liveAll;
+
+    // Commands before the first function of a file still call functions
+    size_t current = (cmds[0].type == CMD_FUNCTION) ? functionTable_indexOf(temps->table, cmds[0].Arg1)
+                                                    : NO_FUNCTION;
+    if (err == OK && current != NO_FUNCTION) {
+        TempUse* use = &temps->uses[current];
+        *changed |= (liveIn[0].temp & ~use->readOnEntry) != 0;
+        use->readOnEntry |= liveIn[0].temp;
+    }
+    for (size_t i = 0; i < numCmds && err == OK; i++) {
+        size_t callee = (cmds[i].type == CMD_CALL || cmds[i].type == CMD_LIGHT_CALL)
+                            ? functionTable_indexOf(temps->table, cmds[i].Arg1)
+                            : NO_FUNCTION;
+        if (callee != NO_FUNCTION) {
+            TempUse* use = &temps->uses[callee];
+            *changed |= (liveIn[i + 1].temp & ~use->readAfterReturn) != 0;
+            use->readAfterReturn |= liveIn[i + 1].temp;
+        }
+    }
+
+    free(liveIn);
+    return err;
+}
+
+/// @brief Appends the commands of one function to out, with the pops into
+/// dead entries turned into discards of the popped value
+static ErrorCode deadStores_rewriteFunction(VmFile* out, const Command* cmds, size_t numCmds,
+                                            const TempUses* temps)
+{
+    LiveSet* liveIn = malloc((numCmds + 1) * sizeof(LiveSet));
+    if (liveIn == NULL) {
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+    ErrorCode err = computeLiveness(cmds, numCmds, temps, liveIn);
+    // Falling off the end of the function runs into code that is not known here
+    liveIn[numCmds] = liveAll;
+
+    for (size_t i = 0; i < numCmds && err == OK; i++) {
+        // A pop only falls through, so what is live after it is live before
+        // the next command
+        if (isDeadStore(&cmds[i], liveIn[i + 1])) {
+            err = appendDiscard(out, 1);
+        }
+        else {
+            err = vmFile_append(out, &cmds[i]);
+        }
+    }
+
+    free(liveIn);
+    return err;
+}
+
+/// @brief Backward liveness of the locals, arguments and temp entries over
+/// the control flow of a function. The frame of the function is gone after
+/// a return, while temp is shared with the callers and callees, see
+/// TempUses. Tail calls and jumps to labels outside the function are
+/// assumed to read everything
+/// @param liveIn Filled with the entries live before each command
+static ErrorCode computeLiveness(const Command* cmds, size_t numCmds, const TempUses* temps,
+                                 LiveSet* liveIn)
+{
+    size_t numLabels = 0;
+    for (size_t i = 0; i < numCmds; i++) {
+        if (cmds[i].type == CMD_LABEL) numLabels++;
+    }
+
+    LabelIndex* labels = malloc((numLabels + 1) * sizeof(LabelIndex));
+    size_t* targets = malloc((numCmds + 1) * sizeof(size_t));
+    if (labels == NULL || targets == NULL) {
+        free(labels);
+        free(targets);
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+
+    numLabels = 0;
+    for (size_t i = 0; i < numCmds; i++) {
+        if (cmds[i].type == CMD_LABEL) {
+            labels[numLabels].name = cmds[i].Arg1;
+            labels[numLabels].index = i;
+            numLabels++;
+        }
+    }
+    qsort(labels, numLabels, sizeof(LabelIndex), compareLabels);
+
+    for (size_t i = 0; i < numCmds; i++) {
+        targets[i] = NO_TARGET;
+        liveIn[i] = (LiveSet) { 0 };
+        if (cmds[i].type == CMD_GOTO || cmds[i].type == CMD_IF || cmds[i].type == CMD_IF_NOT) {
+            LabelIndex key = { .name = cmds[i].Arg1 };
+            const LabelIndex* found = bsearch(&key, labels, numLabels, sizeof(LabelIndex), compareLabels);
+            if (found != NULL) targets[i] = found->index;
+        }
+    }
+
+    size_t current = (cmds[0].type == CMD_FUNCTION) ? functionTable_indexOf(temps->table, cmds[0].Arg1)
+                                                    : NO_FUNCTION;
+    LiveSet returned = { 0, 0, liveAll.temp };
+    if (current != NO_FUNCTION) {
+        returned.temp = temps->uses[current].readAfterReturn;
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i = numCmds; i-- > 0;) {
+            LiveSet next = (i + 1 < numCmds) ? liveIn[i + 1] : liveAll;
+            LiveSet target = (targets[i] != NO_TARGET) ? liveIn[targets[i]] : liveAll;
+            LiveSet liveOut;
+
+            switch (cmds[i].type) {
+                case CMD_GOTO:      liveOut = target; break;
+                case CMD_IF:
+                case CMD_IF_NOT:    liveOut = liveSet_union(next, target); break;
+                case CMD_RETURN:
+                case CMD_LIGHT_RETURN: liveOut = returned; break;
+                case CMD_TAIL_CALL:
+                case CMD_TAIL_JUMP: liveOut = liveAll; break;
+                default:            liveOut = next; break;
+            }
+
+            LiveSet in = liveness_transfer(&cmds[i], liveOut, temps);
+            if (!liveSet_equals(&in, &liveIn[i])) {
+                liveIn[i] = in;
+                changed = true;
+            }
+        }
+    }
+
+    free(labels);
+    free(targets);
+    return OK;
+}
+
+/// @return The entries live before the command, given the ones live after it
+static LiveSet liveness_transfer(const Command* cmd, LiveSet liveOut, const TempUses* temps)
+{
+    LiveSet in = liveOut;
+    uint64_t mask = 0;
+    uint64_t* bits = NULL;
+
+    switch (cmd->type) {
+        case CMD_PUSH:
+            bits = entryBits(&in, cmd, &mask);
+            if (bits != NULL) *bits |= mask;
+            break;
+        case CMD_POP:
+            bits = entryBits(&in, cmd, &mask);
+            if (bits != NULL) *bits &= ~mask;
+            break;
+        case CMD_CALL:
+        case CMD_LIGHT_CALL:
+            // The callee may leave the entries read after the call unchanged
+            in.temp |= calleeReads(temps, cmd->Arg1);
+            break;
+        case CMD_ARITHMETIC:
+        case CMD_LABEL:
+        case CMD_GOTO:
+        case CMD_IF:
+        case CMD_IF_NOT:
+        case CMD_FUNCTION:
+        case CMD_RETURN:
+        case CMD_LIGHT_RETURN:
+        case CMD_CLEAR_FRAME:
+        case CMD_DISCARD:
+            break;
+        default:
+            // The code written for the other commands may read temp
+            in.temp = liveAll.temp;
+            break;
+    }
+    return in;
+}
+
+/// @return The temp entries a call of the function may read, all of them
+/// when it is not part of the program
+static uint64_t calleeReads(const TempUses* temps, const char* callee)
+{
+    size_t index = functionTable_indexOf(temps->table, callee);
+    return (index != NO_FUNCTION) ? temps->uses[index].readOnEntry : liveAll.temp;
+}
+
+/// @brief Finds the bit of the entry a push or pop accesses
+/// @return The bit set holding it, NULL when the entry is not tracked
+static uint64_t* entryBits(LiveSet* set, const Command* cmd, uint64_t* mask)
+{
+    long index = atol(cmd->Arg2);
+    long numSlots = NUM_TRACKED_SLOTS;
+    uint64_t* bits = NULL;
+    if (strcmp(cmd->Arg1, "local") == 0) {
+        bits = &set->local;
+    }
+    else if (strcmp(cmd->Arg1, "argument") == 0) {
+        bits = &set->argument;
+    }
+    else if (strcmp(cmd->Arg1, "temp") == 0) {
+        bits = &set->temp;
+        numSlots = NUM_TEMP_SLOTS;
+    }
+    if (bits == NULL || index < 0 || index >= numSlots) {
+        return NULL;
+    }
+    *mask = 1ull << index;
+    return bits;
+}
+
+/// @return Whether the command pops into an entry that is not live after it
+static bool isDeadStore(const Command* cmd, LiveSet liveOut)
+{
+    uint64_t mask = 0;
+    const uint64_t* bits = (cmd->type == CMD_POP) ? entryBits(&liveOut, cmd, &mask) : NULL;
+    return bits != NULL && (*bits & mask) == 0;
+}
+
+/// @brief Drops count values from the top of the stack. The pushes and
+/// arithmetic that computed them are removed instead when they are the last
+/// commands of out, then the remaining values are dropped by a single
+/// CMD_DISCARD
+static ErrorCode appendDiscard(VmFile* out, long count)
+{
+    while (count > 0 && out->numCmds > 0) {
+        const Command* last = &out->cmds[out->numCmds - 1];
+        if (last->type == CMD_PUSH) {
+            count--;
+        }
+        else if (last->type == CMD_ARITHMETIC) {
+            bool isUnary = (strcmp(last->Arg1, "neg") == 0 || strcmp(last->Arg1, "not") == 0);
+            count += isUnary ? 0 : 1;
+        }
+        else {
+            break;
+        }
+        out->numCmds--;
+    }
+    if (count == 0) {
+        return OK;
+    }
+
+    Command* last = (out->numCmds > 0) ? &out->cmds[out->numCmds - 1] : NULL;
+    if (last != NULL && last->type == CMD_DISCARD) {
+        snprintf(last->Arg2, MAX_IDENTIFIER_LEN, "%ld", atol(last->Arg2) + count);
+        return OK;
+    }
+    Command discard = { .type = CMD_DISCARD };
+    snprintf(discard.Arg2, MAX_IDENTIFIER_LEN, "%ld", count);
+    return vmFile_append(out, &discard);
+}
+
+/// @return Index of the next function command after start, or the end of
+/// the file
+static size_t functionEnd(const VmFile* file, size_t start)
+{
+    size_t end = start + 1;
+    while (end < file->numCmds && file->cmds[end].type != CMD_FUNCTION) {
+        end++;
+    }
+    return end;
+}
+
+static bool liveSet_equals(const LiveSet* a, const LiveSet* b)
+{
+    return a->local == b->local && a->argument == b->argument && a->temp == b->temp;
+}
+
+static LiveSet liveSet_union(LiveSet a, LiveSet b)
+{
+    return (LiveSet) { a.local | b.local, a.argument | b.argument, a.temp | b.temp };
+}
+
+static int compareLabels(const void* a, const void* b)
+{
+    return strcmp(((const LabelIndex*)a)->name, ((const LabelIndex*)b)->name);
+}
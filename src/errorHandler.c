@@ -5,13 +5,23 @@
 #define RESET  "\x1B[0m"
 #define RED    "\x1B[31m"
 
+static FILE* logFile = NULL;
+
+void errorHandler_setLogFile(FILE* file)
+{
+    logFile = file;
+}
+
 void logError(ErrorCode err, const char* msg)
 {
 #ifndef THIS_IS_TEST
+    if (logFile == NULL) {
+        return;
+    }
     switch (err) {
         case ERR_CANT_OPEN_INPUT_FILE:
         {
-            printf("%sERROR. Could not open input file %s%s\n",
+            fprintf(logFile, "%sERROR. Could not open input file %s%s\n",
                     RED,
                     msg,
                     RESET);
@@ -19,7 +29,7 @@ void logError(ErrorCode err, const char* msg)
         }
         case ERR_CANT_OPEN_DIR:
         {
-            printf("%sERROR. Could not open directory %s%s\n",
+            fprintf(logFile, "%sERROR. Could not open directory %s%s\n",
                     RED,
                     msg,
                     RESET);
@@ -27,14 +37,70 @@ void logError(ErrorCode err, const char* msg)
         }
         case ERR_FILENAME_NOT_VM:
         {
-            printf("%sERROR. Please provide a file with .vm extension%s\n",
+            fprintf(logFile, "%sERROR. Please provide a file with .vm or .vmb extension%s\n",
                     RED,
                     RESET);
             break;
         }
         case ERR_UNEXPEC_TOKEN:
         {
-            printf("%sERROR. Unexpected token '%s'%s\n",
+            fprintf(logFile, "%sERROR. Unexpected token '%s'%s\n",
+                    RED,
+                    msg,
+                    RESET);
+            break;
+        }
+        case ERR_UNKNOWN_OPTION:
+        {
+            fprintf(logFile, "%sERROR. Unknown option or extra argument '%s'%s\n",
+                    RED,
+                    msg,
+                    RESET);
+            break;
+        }
+        case ERR_BAD_OBJECT_FILE:
+        {
+            fprintf(logFile, "%sERROR. Malformed object module %s%s\n",
+                    RED,
+                    msg,
+                    RESET);
+            break;
+        }
+        case ERR_DUPLICATE_FUNCTION:
+        {
+            fprintf(logFile, "%sERROR. Function %s is defined by more than one module%s\n",
+                    RED,
+                    msg,
+                    RESET);
+            break;
+        }
+        case ERR_BAD_BYTECODE_FILE:
+        {
+            fprintf(logFile, "%sERROR. Malformed binary VM file %s%s\n",
+                    RED,
+                    msg,
+                    RESET);
+            break;
+        }
+        case ERR_BAD_PROFILE_FILE:
+        {
+            fprintf(logFile, "%sERROR. Malformed profile %s%s\n",
+                    RED,
+                    msg,
+                    RESET);
+            break;
+        }
+        case ERR_PROFILE_RUN:
+        {
+            fprintf(logFile, "%sERROR. Can't profile the program, %s%s\n",
+                    RED,
+                    msg,
+                    RESET);
+            break;
+        }
+        case ERR_CANT_STAT_FILE:
+        {
+            fprintf(logFile, "%sERROR. Unable to stat file %s%s\n",
                     RED,
                     msg,
                     RESET);
@@ -49,20 +115,24 @@ void logError(ErrorCode err, const char* msg)
 void parser_logError(const Parser *p, ErrorCode err)
 {
 #ifndef THIS_IS_TEST
+    if (logFile == NULL) {
+        return;
+    }
     switch (err) {
         case ERR_MAX_IDENTIFIER_LEN:
         {
-            printf("%sERROR. Maximum length for an identifier Line %llu%s\n",
+            fprintf(logFile, "%sERROR. Maximum length for an identifier Line %llu%s\n",
                     RED,
-                    p->lineNumber,
+                    (unsigned long long)p->lineNumber,
                     RESET);
+            break;
         }
         case ERR_UNEXPEC_TOKEN:
         {
-            printf("%sERROR. Unexpected token '%c' on line %llu%s\n",
+            fprintf(logFile, "%sERROR. Unexpected token '%c' on line %llu%s\n",
                     RED,
                     p->content[p->cursor],
-                    p->lineNumber,
+                    (unsigned long long)p->lineNumber,
                     RESET);
             break;
         }
@@ -5,6 +5,8 @@
 extern "C" {
 #endif
 
+#include <stdio.h>
+
 typedef enum {
     OK,
     ERR_UNKNOWN,
@@ -17,14 +19,25 @@ typedef enum {
     ERR_MAX_IDENTIFIER_LEN,
     ERR_PUSHPOP_PTR_NOT_0_OR_1,
     ERR_UNKNOWN_SEGMENT,
-    ERR_PROG_OUT_OF_MEMORY
+    ERR_PROG_OUT_OF_MEMORY,
+    ERR_UNKNOWN_OPTION,
+    ERR_BAD_OBJECT_FILE,
+    ERR_DUPLICATE_FUNCTION,
+    ERR_BAD_BYTECODE_FILE,
+    ERR_BAD_PROFILE_FILE,
+    ERR_PROFILE_RUN,
+    ERR_CANT_STAT_FILE
 } ErrorCode;
 
+/// @brief Sets where errors are logged. The library logs nothing until a
+/// file is set, the executable sets stdout
+void errorHandler_setLogFile(FILE* file);
+
 typedef struct Parser Parser;
-/// @brief: Logs errors related to the parsing process to STDOUT
+/// @brief: Logs errors related to the parsing process to the log file
 void parser_logError(const Parser* parserObject, ErrorCode err);
 
-/// @brief: Logs errors to STDOUT
+/// @brief: Logs errors to the log file
 void logError(ErrorCode err, const char* msg);
 
 #ifdef __cplusplus
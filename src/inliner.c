@@ -0,0 +1,371 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "errorHandler.h"
+#include "optimizer.h"
+#include "parser.h"
+#include "profile.h"
+#include "program.h"
+
+#define RETURN_ON_ERR(err)    ({ErrorCode e = err; if (e != OK) return (e);})
+
+// A call costs about as much ROM as this many plain VM commands, so smaller
+// expansions don't count against the growth budget
+#define CALL_COST_IN_COMMANDS   5
+// The program may grow by a quarter of its commands, or at least this many
+#define MIN_GROWTH_BUDGET       64
+// Hot call sites of a profile inline bodies up to this many times the limit
+#define HOT_LIMIT_FACTOR        4
+
+/// Copy of the body of a function that can be inlined, taken before any file
+/// is rewritten
+typedef struct InlineBody {
+    bool inlinable;
+    Command* cmds;           // Commands between the function command and the return
+    size_t numCmds;
+    long nLocals;
+    long numArgsUsed;        // One past the highest argument index used
+    bool usesStatic;         // Only inlined in the file declaring the function
+    bool writesThis;         // Pops into pointer 0
+    bool writesThat;         // Pops into pointer 1
+    size_t numInlined;       // Call sites replaced with the body
+} InlineBody;
+
+typedef struct Inliner {
+    const FunctionTable* table;
+    InlineBody* bodies;      // Indexed like table->funcs
+    long growthBudget;       // Commands the program may still grow by
+    long limit;              // Largest body inlined at sites not known to be hot
+    const Profile* profile;  // NULL without --profile-use
+    SiteOrdinals ordinals;   // Call sites of the current function
+} Inliner;
+
+// Local function prototypes
+static void inliner_collectBody(Inliner* inl, const Program* prog, size_t funcIndex, long limit);
+static ErrorCode inliner_rewriteFile(Inliner* inl, VmFile* file, size_t fileIndex);
+static bool inliner_fitsSite(Inliner* inl, const InlineBody* body, const char* caller,
+                             const char* callee, bool* isHot);
+static ErrorCode inliner_expandCall(VmFile* out, const InlineBody* body, long nArgs,
+                                    long firstFreeLocal, long* localsUsed);
+static ErrorCode inliner_removeFunctions(Inliner* inl, const Program* prog, VmFile* file);
+static void setLocalCount(Command* functionCmd, long nLocals);
+static ErrorCode appendSegmentCmd(VmFile* out, CommandType type, const char* segment, long index);
+static bool isPointerIndex(const Command* cmd, const char* index);
+
+// ---------------------------- PUBLIC FUNCTIONS --------------------------- //
+ErrorCode inliner_optimize(Program* prog, long limit, const Profile* profile)
+{
+    FunctionTable table;
+    RETURN_ON_ERR(program_buildFunctionTable(prog, &table));
+
+    Inliner inl = { .table = &table, .limit = limit, .profile = profile };
+    inl.bodies = calloc(table.numFuncs + 1, sizeof(InlineBody));
+    if (inl.bodies == NULL) {
+        functionTable_close(&table);
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+
+    size_t totalCmds = 0;
+    for (size_t f = 0; f < prog->numFiles; f++) {
+        totalCmds += prog->files[f].numCmds;
+    }
+    inl.growthBudget = (long)(totalCmds / 4);
+    if (inl.growthBudget < MIN_GROWTH_BUDGET) {
+        inl.growthBudget = MIN_GROWTH_BUDGET;
+    }
+
+    long bodyLimit = (profile != NULL) ? limit * HOT_LIMIT_FACTOR : limit;
+    for (size_t i = 0; i < table.numFuncs; i++) {
+        inliner_collectBody(&inl, prog, i, bodyLimit);
+    }
+
+    ErrorCode err = OK;
+    for (size_t f = 0; f < prog->numFiles && err == OK; f++) {
+        err = inliner_rewriteFile(&inl, &prog->files[f], f);
+    }
+    for (size_t f = 0; f < prog->numFiles && err == OK; f++) {
+        err = inliner_removeFunctions(&inl, prog, &prog->files[f]);
+    }
+
+    for (size_t i = 0; i < table.numFuncs; i++) {
+        free(inl.bodies[i].cmds);
+    }
+    free(inl.bodies);
+    siteOrdinals_close(&inl.ordinals);
+    functionTable_close(&table);
+    return err;
+}
+
+// -------------------------- PRIVATE FUNCTIONS ----------------------------- //
+/// @brief Decides whether a function can be inlined and keeps a copy of its
+/// body if so. Only straight-line leaf functions ending with their single
+/// return, with exactly the return value left on the stack, are inlined
+static void inliner_collectBody(Inliner* inl, const Program* prog, size_t funcIndex, long limit)
+{
+    const VmFunction* func = &inl->table->funcs[funcIndex];
+    const VmFile* file = &prog->files[func->file];
+    InlineBody* body = &inl->bodies[funcIndex];
+
+    size_t first = func->first + 1;
+    size_t last = func->end - 1;
+    if (func->end <= first || file->cmds[last].type != CMD_RETURN) return;
+    if ((long)(last - first) > limit) return;
+
+    long depth = 0;
+    for (size_t i = first; i < last; i++) {
+        const Command* cmd = &file->cmds[i];
+        switch (cmd->type) {
+            case CMD_PUSH:
+            case CMD_POP: {
+                long index = atol(cmd->Arg2);
+                if (strcmp(cmd->Arg1, "argument") == 0 && index >= body->numArgsUsed) {
+                    body->numArgsUsed = index + 1;
+                }
+                else if (strcmp(cmd->Arg1, "local") == 0 && index >= func->nLocals) {
+                    return;
+                }
+                else if (strcmp(cmd->Arg1, "static") == 0) {
+                    body->usesStatic = true;
+                }
+                else if (cmd->type == CMD_POP && isPointerIndex(cmd, "0")) {
+                    body->writesThis = true;
+                }
+                else if (cmd->type == CMD_POP && isPointerIndex(cmd, "1")) {
+                    body->writesThat = true;
+                }
+                depth += (cmd->type == CMD_PUSH) ? 1 : -1;
+                break;
+            }
+            case CMD_ARITHMETIC:
+                if (strcmp(cmd->Arg1, "neg") != 0 && strcmp(cmd->Arg1, "not") != 0) {
+                    depth--;
+                }
+                break;
+            case CMD_INTRINSIC: {
+                // Every intrinsic leaves one value in place of its operands
+                long effect = intrinsics_stackEffect(cmd);
+                if (depth < 1 - effect) return;
+                depth += effect;
+                break;
+            }
+            default:
+                // Calls, returns and control flow keep the function out
+                return;
+        }
+        // The body must not touch the caller's working stack
+        if (depth < 0) return;
+    }
+    if (depth != 1) return;
+
+    body->numCmds = last - first;
+    body->cmds = malloc((body->numCmds + 1) * sizeof(Command));
+    if (body->cmds == NULL) return;
+    memcpy(body->cmds, &file->cmds[first], body->numCmds * sizeof(Command));
+    body->nLocals = func->nLocals;
+    body->inlinable = true;
+}
+
+static ErrorCode inliner_rewriteFile(Inliner* inl, VmFile* file, size_t fileIndex)
+{
+    ErrorCode err = OK;
+    VmFile out = { 0 };
+    size_t functionCmd = 0;   // Index in out of the current function command
+    bool inFunction = false;
+    long nLocals = 0;         // Locals declared by the current function
+    long extraLocals = 0;     // Locals added for inlined bodies
+    const char* caller = NULL;
+
+    for (size_t i = 0; i < file->numCmds && err == OK; i++) {
+        const Command* cmd = &file->cmds[i];
+
+        if (cmd->type == CMD_FUNCTION) {
+            if (inFunction) setLocalCount(&out.cmds[functionCmd], nLocals + extraLocals);
+            inFunction = true;
+            functionCmd = out.numCmds;
+            nLocals = atol(cmd->Arg2);
+            extraLocals = 0;
+            caller = cmd->Arg1;
+            siteOrdinals_reset(&inl->ordinals);
+        }
+        else if (cmd->type == CMD_CALL && inFunction) {
+            const VmFunction* callee = functionTable_find(inl->table, cmd->Arg1);
+            const InlineBody* body = NULL;
+            if (callee != NULL) body = &inl->bodies[callee - inl->table->funcs];
+
+            long nArgs = atol(cmd->Arg2);
+            bool canInline = (body != NULL) && body->inlinable &&
+                             (body->numArgsUsed <= nArgs) &&
+                             (!body->usesStatic || callee->file == fileIndex);
+            bool isHot = false;
+            if (canInline) {
+                canInline = inliner_fitsSite(inl, body, caller, cmd->Arg1, &isHot);
+            }
+            if (canInline) {
+                size_t before = out.numCmds;
+                long localsUsed = 0;
+                err = inliner_expandCall(&out, body, nArgs, nLocals, &localsUsed);
+                long growth = (long)(out.numCmds - before) - CALL_COST_IN_COMMANDS;
+
+                if (err == OK && (isHot || growth <= inl->growthBudget)) {
+                    if (growth > 0 && !isHot) inl->growthBudget -= growth;
+                    if (localsUsed > extraLocals) extraLocals = localsUsed;
+                    inl->bodies[callee - inl->table->funcs].numInlined++;
+                    continue;
+                }
+                // Over budget, keep the call
+                out.numCmds = before;
+            }
+        }
+
+        if (err == OK) err = vmFile_append(&out, cmd);
+    }
+    if (err == OK && inFunction) {
+        setLocalCount(&out.cmds[functionCmd], nLocals + extraLocals);
+    }
+
+    if (err == OK) {
+        vmFile_replaceCommands(file, &out);
+    }
+    free(out.cmds);
+    return err;
+}
+
+/// @brief Numbers the call site like the profile does and decides whether
+/// the body may replace it: never at a cold site, and at a hot one even when
+/// it is bigger than the limit or the growth budget is used up
+/// @param isHot Returns whether the site is hot
+static bool inliner_fitsSite(Inliner* inl, const InlineBody* body, const char* caller,
+                             const char* callee, bool* isHot)
+{
+    *isHot = false;
+    if (inl->profile == NULL) return true;
+
+    size_t ordinal = siteOrdinals_next(&inl->ordinals, callee);
+    if (ordinal == SIZE_MAX) return (long)body->numCmds <= inl->limit;
+
+    ProfileTemperature temperature = profile_callSite(inl->profile, caller, callee, ordinal);
+    if (temperature == PROFILE_COLD) return false;
+    *isHot = (temperature == PROFILE_HOT);
+    return *isHot || (long)body->numCmds <= inl->limit;
+}
+
+/// @brief Appends the body of a function in place of a call to it. The
+/// saved THIS/THAT, the arguments and the locals of the callee are mapped
+/// to the locals of the caller starting at firstFreeLocal, in that order
+/// @param localsUsed Returns how many locals of the caller were used
+static ErrorCode inliner_expandCall(VmFile* out, const InlineBody* body, long nArgs,
+                                    long firstFreeLocal, long* localsUsed)
+{
+    long slot = firstFreeLocal;
+
+    long savedThis = slot;
+    if (body->writesThis) {
+        RETURN_ON_ERR(appendSegmentCmd(out, CMD_PUSH, "pointer", 0));
+        RETURN_ON_ERR(appendSegmentCmd(out, CMD_POP, "local", savedThis));
+        slot++;
+    }
+    long savedThat = slot;
+    if (body->writesThat) {
+        RETURN_ON_ERR(appendSegmentCmd(out, CMD_PUSH, "pointer", 1));
+        RETURN_ON_ERR(appendSegmentCmd(out, CMD_POP, "local", savedThat));
+        slot++;
+    }
+
+    // The last argument is on top of the stack
+    long firstArg = slot;
+    for (long a = nArgs - 1; a >= 0; a--) {
+        RETURN_ON_ERR(appendSegmentCmd(out, CMD_POP, "local", firstArg + a));
+    }
+    slot += nArgs;
+
+    // Locals start at zero on every call, but only the ones the body reads
+    // need to be cleared again
+    long firstLocal = slot;
+    for (long l = 0; l < body->nLocals; l++) {
+        bool isRead = false;
+        for (size_t i = 0; i < body->numCmds && !isRead; i++) {
+            isRead = (body->cmds[i].type == CMD_PUSH) &&
+                     (strcmp(body->cmds[i].Arg1, "local") == 0) &&
+                     (atol(body->cmds[i].Arg2) == l);
+        }
+        if (isRead) {
+            RETURN_ON_ERR(appendSegmentCmd(out, CMD_PUSH, "constant", 0));
+            RETURN_ON_ERR(appendSegmentCmd(out, CMD_POP, "local", firstLocal + l));
+        }
+    }
+    slot += body->nLocals;
+
+    for (size_t i = 0; i < body->numCmds; i++) {
+        const Command* cmd = &body->cmds[i];
+        bool isArgument = (strcmp(cmd->Arg1, "argument") == 0);
+        bool isLocal = (strcmp(cmd->Arg1, "local") == 0);
+
+        if ((cmd->type == CMD_PUSH || cmd->type == CMD_POP) && (isArgument || isLocal)) {
+            long base = isArgument ? firstArg : firstLocal;
+            RETURN_ON_ERR(appendSegmentCmd(out, cmd->type, "local", base + atol(cmd->Arg2)));
+        }
+        else {
+            RETURN_ON_ERR(vmFile_append(out, cmd));
+        }
+    }
+
+    // The return value stays on top of the stack while the pointers are restored
+    if (body->writesThis) {
+        RETURN_ON_ERR(appendSegmentCmd(out, CMD_PUSH, "local", savedThis));
+        RETURN_ON_ERR(appendSegmentCmd(out, CMD_POP, "pointer", 0));
+    }
+    if (body->writesThat) {
+        RETURN_ON_ERR(appendSegmentCmd(out, CMD_PUSH, "local", savedThat));
+        RETURN_ON_ERR(appendSegmentCmd(out, CMD_POP, "pointer", 1));
+    }
+
+    *localsUsed = slot - firstFreeLocal;
+    return OK;
+}
+
+/// @brief Drops the functions whose every call site was inlined, unless a
+/// linked module may call them too
+static ErrorCode inliner_removeFunctions(Inliner* inl, const Program* prog, VmFile* file)
+{
+    ErrorCode err = OK;
+    VmFile out = { 0 };
+    bool skipping = false;
+
+    for (size_t i = 0; i < file->numCmds && err == OK; i++) {
+        const Command* cmd = &file->cmds[i];
+        if (cmd->type == CMD_FUNCTION) {
+            const VmFunction* func = functionTable_find(inl->table, cmd->Arg1);
+            const InlineBody* body = &inl->bodies[func - inl->table->funcs];
+            skipping = (func->numCallSites > 0) && (body->numInlined == func->numCallSites) &&
+                       !program_isCalledExternally(prog, func->name);
+        }
+        if (!skipping) {
+            err = vmFile_append(&out, cmd);
+        }
+    }
+
+    if (err == OK) {
+        vmFile_replaceCommands(file, &out);
+    }
+    free(out.cmds);
+    return err;
+}
+
+static void setLocalCount(Command* functionCmd, long nLocals)
+{
+    snprintf(functionCmd->Arg2, MAX_IDENTIFIER_LEN, "%ld", nLocals);
+}
+
+static ErrorCode appendSegmentCmd(VmFile* out, CommandType type, const char* segment, long index)
+{
+    Command cmd = { .type = type };
+    strcpy(cmd.Arg1, segment);
+    snprintf(cmd.Arg2, MAX_IDENTIFIER_LEN, "%ld", index);
+    return vmFile_append(out, &cmd);
+}
+
+static bool isPointerIndex(const Command* cmd, const char* index)
+{
+    return (strcmp(cmd->Arg1, "pointer") == 0) && (strcmp(cmd->Arg2, index) == 0);
+}
@@ -0,0 +1,267 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "errorHandler.h"
+#include "inputs.h"
+
+/// Paths found while listing a directory
+typedef struct PathList {
+    char** paths;
+    size_t count;
+    size_t capacity;
+} PathList;
+
+/// Entries of a directory, by kind
+typedef struct DirListing {
+    PathList files;          // .vm and .vmb
+    PathList modules;        // .vmo
+    PathList subdirs;        // Only listed when recursive
+} DirListing;
+
+// Local function prototypes
+static ErrorCode scanDirectory(Inputs* inputs, int fd, const char* path, bool recursive,
+                               bool given);
+static ErrorCode listDirectory(DirListing* listing, int fd, const char* path, bool recursive);
+static ErrorCode addProject(Inputs* inputs, const char* path, FileType type, PathList* files,
+                            PathList* modules);
+static ErrorCode pathList_add(PathList* list, const char* dir, const char* name);
+static void pathList_sort(PathList* list);
+static void pathList_free(PathList* list);
+static int comparePaths(const void* a, const void* b);
+
+// ---------------------------- PUBLIC FUNCTIONS --------------------------- //
+void inputs_new(Inputs* inputs)
+{
+    memset(inputs, 0, sizeof(Inputs));
+}
+
+void inputs_close(Inputs* inputs)
+{
+    for (size_t p = 0; p < inputs->numProjects; p++) {
+        Project* project = &inputs->projects[p];
+        PathList files = { .paths = project->files, .count = project->numFiles };
+        PathList modules = { .paths = project->modules, .count = project->numModules };
+        pathList_free(&files);
+        pathList_free(&modules);
+        free(project->path);
+    }
+    free(inputs->projects);
+    memset(inputs, 0, sizeof(Inputs));
+}
+
+ErrorCode inputs_add(Inputs* inputs, const char* path, bool recursive)
+{
+    struct stat s;
+    if (stat(path, &s) != 0 || (!S_ISREG(s.st_mode) && !S_ISDIR(s.st_mode))) {
+        logError(ERR_CANT_OPEN_INPUT_FILE, path);
+        return ERR_CANT_OPEN_INPUT_FILE;
+    }
+    if (S_ISREG(s.st_mode)) {
+        PathList files = { 0 };
+        PathList modules = { 0 };
+        ErrorCode err = pathList_add(&files, NULL, path);
+        if (err == OK) {
+            err = addProject(inputs, path, FILE_REGULAR, &files, &modules);
+        }
+        pathList_free(&files);
+        return err;
+    }
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        logError(ERR_CANT_OPEN_DIR, path);
+        return ERR_CANT_OPEN_DIR;
+    }
+    return scanDirectory(inputs, fd, path, recursive, true);
+}
+
+bool inputs_hasExtension(const char* name, const char* extension)
+{
+    size_t nameLen = strlen(name);
+    size_t extensionLen = strlen(extension);
+    return nameLen >= extensionLen && strcmp(name + nameLen - extensionLen, extension) == 0;
+}
+
+// -------------------------- PRIVATE FUNCTIONS ----------------------------- //
+/// @brief Adds the project of a directory, then the ones below it in name
+/// order. Closes the given descriptor of the directory
+/// @param given Whether the directory was given on the command line, which
+/// makes it a project even without files, unless scanning recursively
+static ErrorCode scanDirectory(Inputs* inputs, int fd, const char* path, bool recursive,
+                               bool given)
+{
+    DirListing listing = { 0 };
+    ErrorCode err = listDirectory(&listing, fd, path, recursive);
+    if (err == OK && ((given && !recursive) || listing.files.count > 0)) {
+        err = addProject(inputs, path, FILE_DIR, &listing.files, &listing.modules);
+    }
+
+    // Subdirectories are opened relative to their parent, without building
+    // and resolving their whole path again
+    size_t pathLen = strlen(path);
+    for (size_t i = 0; i < listing.subdirs.count && err == OK; i++) {
+        const char* subdir = listing.subdirs.paths[i];
+        int subdirFd = openat(fd, subdir + pathLen + 1, O_RDONLY | O_DIRECTORY);
+        if (subdirFd < 0) {
+            logError(ERR_CANT_OPEN_DIR, subdir);
+            err = ERR_CANT_OPEN_DIR;
+        }
+        else {
+            err = scanDirectory(inputs, subdirFd, subdir, recursive, false);
+        }
+    }
+
+    pathList_free(&listing.files);
+    pathList_free(&listing.modules);
+    pathList_free(&listing.subdirs);
+    close(fd);
+    return err;
+}
+
+/// @brief Sorts the entries of a directory by kind and name. readdir()
+/// gives the type of most entries, the others are looked up relative to the
+/// directory
+static ErrorCode listDirectory(DirListing* listing, int fd, const char* path, bool recursive)
+{
+    // The stream owns the descriptor it is given, which the caller still uses
+    int streamFd = dup(fd);
+    DIR* dir = (streamFd >= 0) ? fdopendir(streamFd) : NULL;
+    if (dir == NULL) {
+        if (streamFd >= 0) close(streamFd);
+        logError(ERR_CANT_OPEN_DIR, path);
+        return ERR_CANT_OPEN_DIR;
+    }
+
+    ErrorCode err = OK;
+    struct dirent* entry = NULL;
+    while (err == OK && (entry = readdir(dir)) != NULL) {
+        const char* name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+
+        struct stat s;
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            type = (fstatat(fd, name, &s, AT_SYMLINK_NOFOLLOW) == 0) ? IFTODT(s.st_mode) : DT_UNKNOWN;
+        }
+        bool isLink = (type == DT_LNK);
+        if (isLink) {
+            type = (fstatat(fd, name, &s, 0) == 0) ? IFTODT(s.st_mode) : DT_UNKNOWN;
+        }
+
+        if (type == DT_DIR) {
+            if (recursive && !isLink) {
+                err = pathList_add(&listing->subdirs, path, name);
+            }
+        }
+        // An entry that can't be looked up is skipped, the scan goes on
+        else if (type == DT_UNKNOWN) {
+            char fullName[PATH_MAX];
+            snprintf(fullName, sizeof(fullName), "%s/%s", path, name);
+            logError(ERR_CANT_STAT_FILE, fullName);
+        }
+        // Only process files with .vm or .vmb extension, and link .vmo ones
+        else if (type == DT_REG && (inputs_hasExtension(name, ".vm") || inputs_hasExtension(name, ".vmb"))) {
+            err = pathList_add(&listing->files, path, name);
+        }
+        else if (type == DT_REG && inputs_hasExtension(name, ".vmo")) {
+            err = pathList_add(&listing->modules, path, name);
+        }
+    }
+    closedir(dir);
+
+    // readdir() order depends on the file system, the output must not
+    pathList_sort(&listing->files);
+    pathList_sort(&listing->modules);
+    pathList_sort(&listing->subdirs);
+    return err;
+}
+
+/// @brief Adds a project, which takes the paths of the lists
+static ErrorCode addProject(Inputs* inputs, const char* path, FileType type, PathList* files,
+                            PathList* modules)
+{
+    if (inputs->numProjects == inputs->capacity) {
+        size_t capacity = (inputs->capacity == 0) ? 4 : inputs->capacity * 2;
+        Project* projects = realloc(inputs->projects, capacity * sizeof(Project));
+        if (projects == NULL) {
+            logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+            return ERR_PROG_OUT_OF_MEMORY;
+        }
+        inputs->projects = projects;
+        inputs->capacity = capacity;
+    }
+
+    char* projectPath = strdup(path);
+    if (projectPath == NULL) {
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+    inputs->projects[inputs->numProjects++] = (Project) {
+        .path = projectPath,
+        .type = type,
+        .files = files->paths,
+        .numFiles = files->count,
+        .modules = modules->paths,
+        .numModules = modules->count
+    };
+    memset(files, 0, sizeof(PathList));
+    memset(modules, 0, sizeof(PathList));
+    return OK;
+}
+
+/// @brief Adds dir/name, or name alone when dir is NULL
+static ErrorCode pathList_add(PathList* list, const char* dir, const char* name)
+{
+    if (list->count == list->capacity) {
+        size_t capacity = (list->capacity == 0) ? 16 : list->capacity * 2;
+        char** paths = realloc(list->paths, capacity * sizeof(char*));
+        if (paths == NULL) {
+            logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+            return ERR_PROG_OUT_OF_MEMORY;
+        }
+        list->paths = paths;
+        list->capacity = capacity;
+    }
+
+    size_t dirLen = (dir != NULL) ? strlen(dir) + 1 : 0;
+    char* path = malloc(dirLen + strlen(name) + 1);
+    if (path == NULL) {
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+    if (dir != NULL) {
+        memcpy(path, dir, dirLen - 1);
+        path[dirLen - 1] = '/';
+    }
+    strcpy(path + dirLen, name);
+    list->paths[list->count++] = path;
+    return OK;
+}
+
+static void pathList_sort(PathList* list)
+{
+    if (list->count > 1) {
+        qsort(list->paths, list->count, sizeof(char*), comparePaths);
+    }
+}
+
+static void pathList_free(PathList* list)
+{
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->paths[i]);
+    }
+    free(list->paths);
+    memset(list, 0, sizeof(PathList));
+}
+
+static int comparePaths(const void* a, const void* b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
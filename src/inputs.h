@@ -0,0 +1,52 @@
+#ifndef INPUTS_H
+#define INPUTS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "errorHandler.h"
+#include "main.h"
+
+/// What is translated into one output: a .vm or .vmb file, or a directory
+/// whose files are translated together
+typedef struct Project {
+    char* path;              // Input path, which the output is named after
+    FileType type;           // FILE_REGULAR or FILE_DIR
+    char** files;            // .vm and .vmb files, sorted by name
+    size_t numFiles;
+    char** modules;          // .vmo files of a directory, sorted by name
+    size_t numModules;
+} Project;
+
+/// Projects of every path given on the command line, in that order
+typedef struct Inputs {
+    Project* projects;
+    size_t numProjects;
+    size_t capacity;
+} Inputs;
+
+void inputs_new(Inputs* inputs);
+void inputs_close(Inputs* inputs);
+
+/// @brief Adds the projects of a path given on the command line. A file is
+/// a project of its own, and a directory is one with the .vm, .vmb and .vmo
+/// files it holds. Directories are listed once, with the entry types of
+/// readdir() and fstatat() relative to the open directory only when the type
+/// is unknown or the entry is a symbolic link
+/// @param recursive Whether the given directory and every directory below
+/// it are projects, each when it holds .vm or .vmb files. Symbolic links to
+/// directories are not followed, so that a link cycle can't make the scan
+/// endless
+ErrorCode inputs_add(Inputs* inputs, const char* path, bool recursive);
+
+/// @return Whether the file name ends with the extension, e.g. ".vmb"
+bool inputs_hasExtension(const char* name, const char* extension);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // INPUTS_H
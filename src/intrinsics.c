@@ -0,0 +1,115 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "errorHandler.h"
+#include "optimizer.h"
+#include "parser.h"
+#include "program.h"
+
+typedef struct Intrinsic {
+    const char* name;
+    long nArgs;
+    long effect;             // Stack effect without a folded constant
+} Intrinsic;
+
+static const Intrinsic intrinsics[] = {
+    { "Math.multiply", 2, -1 },
+    { "Math.divide",   2, -1 },
+    { "Memory.peek",   1,  0 },
+    { "Memory.poke",   2, -1 },
+};
+
+// Local function prototypes
+static const Intrinsic* findIntrinsic(const char* name);
+static bool canFoldConstant(const char* name, long constant);
+static bool isPushConstant(const Command* cmd);
+static ErrorCode intrinsics_optimizeFile(VmFile* file);
+
+// ---------------------------- PUBLIC FUNCTIONS --------------------------- //
+ErrorCode intrinsics_optimize(Program* prog)
+{
+    ErrorCode err = OK;
+    for (size_t f = 0; f < prog->numFiles && err == OK; f++) {
+        err = intrinsics_optimizeFile(&prog->files[f]);
+    }
+    return err;
+}
+
+long intrinsics_stackEffect(const Command* cmd)
+{
+    const Intrinsic* intrinsic = findIntrinsic(cmd->Arg1);
+    if (intrinsic == NULL) {
+        return 0;
+    }
+    // The folded constant is no longer pushed before the command
+    return intrinsic->effect + ((cmd->Arg2[0] != '\0') ? 1 : 0);
+}
+
+// -------------------------- PRIVATE FUNCTIONS ----------------------------- //
+static ErrorCode intrinsics_optimizeFile(VmFile* file)
+{
+    ErrorCode err = OK;
+    VmFile out = { 0 };
+
+    for (size_t i = 0; i < file->numCmds && err == OK; i++) {
+        const Command* cmd = &file->cmds[i];
+        const Intrinsic* intrinsic = NULL;
+        if (cmd->type == CMD_CALL) {
+            intrinsic = findIntrinsic(cmd->Arg1);
+        }
+        if (intrinsic == NULL || atol(cmd->Arg2) != intrinsic->nArgs) {
+            err = vmFile_append(&out, cmd);
+            continue;
+        }
+
+        Command intr = { .type = CMD_INTRINSIC };
+        strcpy(intr.Arg1, cmd->Arg1);
+
+        Command* last = (out.numCmds >= 1) ? &out.cmds[out.numCmds - 1] : NULL;
+        Command* beforeLast = (out.numCmds >= 2) ? &out.cmds[out.numCmds - 2] : NULL;
+        if (last != NULL && isPushConstant(last) && canFoldConstant(cmd->Arg1, atol(last->Arg2))) {
+            strcpy(intr.Arg2, last->Arg2);
+            out.numCmds--;
+        }
+        else if (strcmp(cmd->Arg1, "Math.multiply") == 0 && beforeLast != NULL &&
+                 isPushConstant(beforeLast) && last->type == CMD_PUSH) {
+            // Multiplication commutes and pushes have no side effects, so a
+            // constant first factor can be folded as well
+            strcpy(intr.Arg2, beforeLast->Arg2);
+            *beforeLast = *last;
+            out.numCmds--;
+        }
+
+        err = vmFile_append(&out, &intr);
+    }
+
+    if (err == OK) {
+        vmFile_replaceCommands(file, &out);
+    }
+    free(out.cmds);
+    return err;
+}
+
+static const Intrinsic* findIntrinsic(const char* name)
+{
+    for (size_t i = 0; i < sizeof(intrinsics) / sizeof(intrinsics[0]); i++) {
+        if (strcmp(intrinsics[i].name, name) == 0) {
+            return &intrinsics[i];
+        }
+    }
+    return NULL;
+}
+
+static bool canFoldConstant(const char* name, long constant)
+{
+    if (strcmp(name, "Math.divide") == 0) {
+        // Hack has no right shift, only power of two divisors are reduced
+        return (constant > 0) && ((constant & (constant - 1)) == 0);
+    }
+    return (strcmp(name, "Math.multiply") == 0) || (strcmp(name, "Memory.peek") == 0);
+}
+
+static bool isPushConstant(const Command* cmd)
+{
+    return (cmd->type == CMD_PUSH) && (strcmp(cmd->Arg1, "constant") == 0);
+}
@@ -0,0 +1,645 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "errorHandler.h"
+#include "linker.h"
+#include "parser.h"
+#include "program.h"
+
+#define RETURN_ON_ERR(err)    ({ErrorCode e = err; if (e != OK) return (e);})
+
+#define OBJECT_MAGIC                "// Hack VM object module"
+#define INITIAL_MODULES_CAPACITY    (8)
+
+/// Label declared by the code of a module
+typedef struct Symbol {
+    char* name;
+    size_t module;
+    size_t block;            // Index in ObjectModule.blocks
+} Symbol;
+
+typedef struct SymbolTable {
+    Symbol* symbols;         // Sorted by name, then module
+    size_t numSymbols;
+} SymbolTable;
+
+// Local function prototypes
+static ErrorCode readFile(const char* fileName, char** text, size_t* length);
+static ErrorCode parseModule(ObjectModule* module);
+static ErrorCode buildSymbols(const Linker* linker, SymbolTable* table);
+static void symbols_close(SymbolTable* table);
+static ErrorCode checkDuplicates(const Linker* linker, const Program* prog);
+static const Symbol* findSymbol(const SymbolTable* table, const char* name, size_t module);
+static void markLive(Linker* linker, const SymbolTable* table, const Program* prog);
+static void markSymbolLive(Linker* linker, const Symbol* symbol, size_t* work, size_t* numWork);
+static void writeBlock(const Linker* linker, const SymbolTable* table, size_t module,
+                       const ObjectBlock* block, FILE* out);
+static size_t symbolAt(const char* line, const char** symbol);
+static bool isModuleLocal(const char* name);
+static bool fallsThrough(const ObjectModule* module, const ObjectBlock* block);
+static bool isReference(const Command* cmd);
+static int compareSymbols(const void* a, const void* b);
+static int compareStrings(const void* a, const void* b);
+
+// ---------------------------- PUBLIC FUNCTIONS --------------------------- //
+void linker_new(Linker* linker)
+{
+    memset(linker, 0, sizeof(Linker));
+}
+
+void linker_close(Linker* linker)
+{
+    for (size_t m = 0; m < linker->numModules; m++) {
+        ObjectModule* module = &linker->modules[m];
+        free(module->fileName);
+        free(module->text);
+        free(module->lines);
+        free(module->blocks);
+    }
+    free(linker->modules);
+    memset(linker, 0, sizeof(Linker));
+}
+
+ErrorCode linker_addModule(Linker* linker, const char* fileName)
+{
+    if (linker->numModules == linker->capacity) {
+        size_t newCapacity = (linker->capacity == 0) ? INITIAL_MODULES_CAPACITY : linker->capacity * 2;
+        ObjectModule* newModules = realloc(linker->modules, newCapacity * sizeof(ObjectModule));
+        if (newModules == NULL) {
+            logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+            return ERR_PROG_OUT_OF_MEMORY;
+        }
+        linker->modules = newModules;
+        linker->capacity = newCapacity;
+    }
+
+    ObjectModule* module = &linker->modules[linker->numModules];
+    memset(module, 0, sizeof(ObjectModule));
+    linker->numModules++;
+
+    module->fileName = strdup(fileName);
+    if (module->fileName == NULL) {
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+    size_t length = 0;
+    RETURN_ON_ERR(readFile(fileName, &module->text, &length));
+    return parseModule(module);
+}
+
+ErrorCode linker_exportUses(const Linker* linker, Program* prog)
+{
+    SymbolTable table;
+    RETURN_ON_ERR(buildSymbols(linker, &table));
+
+    // Any symbol with a dot that no module declares may name a function of
+    // the program. Static variables and the like are never found there
+    size_t numNames = 0;
+    for (size_t m = 0; m < linker->numModules; m++) {
+        numNames += linker->modules[m].numLines;
+    }
+    char** names = malloc((numNames + 1) * sizeof(char*));
+    if (names == NULL) {
+        symbols_close(&table);
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+
+    numNames = 0;
+    ErrorCode err = OK;
+    for (size_t m = 0; m < linker->numModules && err == OK; m++) {
+        const ObjectModule* module = &linker->modules[m];
+        prog->external.numStatics += module->numStatics;
+        for (size_t i = 0; i < module->numLines && err == OK; i++) {
+            const char* symbol = NULL;
+            size_t len = symbolAt(module->lines[i], &symbol);
+            if (len == 0 || symbol[-1] != '@' || memchr(symbol, '.', len) == NULL) continue;
+
+            char* name = strndup(symbol, len);
+            if (name == NULL) {
+                logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+                err = ERR_PROG_OUT_OF_MEMORY;
+            }
+            else if (findSymbol(&table, name, m) != NULL) {
+                free(name);
+            }
+            else {
+                names[numNames++] = name;
+            }
+        }
+    }
+
+    if (err == OK) {
+        qsort(names, numNames, sizeof(char*), compareStrings);
+        size_t unique = 0;
+        for (size_t i = 0; i < numNames; i++) {
+            if (unique > 0 && strcmp(names[unique - 1], names[i]) == 0) {
+                free(names[i]);
+                continue;
+            }
+            names[unique++] = names[i];
+        }
+        prog->external.names = names;
+        prog->external.numNames = unique;
+    }
+    else {
+        for (size_t i = 0; i < numNames; i++) free(names[i]);
+        free(names);
+    }
+    symbols_close(&table);
+    return err;
+}
+
+ErrorCode linker_link(Linker* linker, const Program* prog, FILE* out, RoutineUse* routines,
+                      FILE* report)
+{
+    if (linker->numModules == 0) {
+        return OK;
+    }
+    RETURN_ON_ERR(checkDuplicates(linker, prog));
+
+    SymbolTable table;
+    RETURN_ON_ERR(buildSymbols(linker, &table));
+    markLive(linker, &table, prog);
+
+    size_t numFunctions = 0;
+    size_t numLive = 0;
+    for (size_t m = 0; m < linker->numModules; m++) {
+        const ObjectModule* module = &linker->modules[m];
+        fprintf(out, "\n// **** Module %s ****\n", module->fileName);
+        for (size_t b = 0; b < module->numBlocks; b++) {
+            const ObjectBlock* block = &module->blocks[b];
+            if (block->name != NULL) {
+                numFunctions++;
+                if (block->live) numLive++;
+            }
+            if (block->live) {
+                writeBlock(linker, &table, m, block, out);
+            }
+        }
+
+        // The shared routines are written once for every module
+        const RoutineUse* used = &module->routines;
+        if (used->zeroLength > routines->zeroLength) routines->zeroLength = used->zeroLength;
+        routines->multiply |= used->multiply;
+        routines->divide |= used->divide;
+        if (used->shiftFirst > 0 && (routines->shiftFirst == 0 || used->shiftFirst < routines->shiftFirst)) {
+            routines->shiftFirst = used->shiftFirst;
+        }
+    }
+
+    if (report != NULL) {
+        fprintf(report, "Linked %zu modules, keeping %zu of %zu functions\n", linker->numModules,
+                numLive, numFunctions);
+    }
+    symbols_close(&table);
+    return OK;
+}
+
+ErrorCode linker_writeModule(FILE* out, const Program* prog, const char* code, size_t length,
+                             const RoutineUse* routines)
+{
+    fprintf(out, "%s\n", OBJECT_MAGIC);
+    fprintf(out, ".routines %ld %d %d %ld\n", routines->zeroLength, routines->multiply,
+            routines->divide, routines->shiftFirst);
+
+    for (size_t f = 0; f < prog->numFiles; f++) {
+        const VmFile* file = &prog->files[f];
+        long maxIndex = -1;
+        for (size_t i = 0; i < file->numCmds; i++) {
+            const Command* cmd = &file->cmds[i];
+            if ((cmd->type == CMD_PUSH || cmd->type == CMD_POP) && strcmp(cmd->Arg1, "static") == 0 &&
+                atol(cmd->Arg2) > maxIndex) {
+                maxIndex = atol(cmd->Arg2);
+            }
+        }
+        if (maxIndex < 0) continue;
+
+        char* prefix = vmFile_staticPrefix(file->fileName);
+        bool* used = calloc(maxIndex + 1, sizeof(bool));
+        if (prefix == NULL || used == NULL) {
+            free(prefix);
+            free(used);
+            logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+            return ERR_PROG_OUT_OF_MEMORY;
+        }
+        for (size_t i = 0; i < file->numCmds; i++) {
+            const Command* cmd = &file->cmds[i];
+            if ((cmd->type == CMD_PUSH || cmd->type == CMD_POP) && strcmp(cmd->Arg1, "static") == 0 &&
+                atol(cmd->Arg2) >= 0) {
+                used[atol(cmd->Arg2)] = true;
+            }
+        }
+        for (long index = 0; index <= maxIndex; index++) {
+            if (used[index]) fprintf(out, ".static %s.%ld\n", prefix, index);
+        }
+        free(prefix);
+        free(used);
+    }
+
+    fwrite(code, 1, length, out);
+    return OK;
+}
+
+// -------------------------- PRIVATE FUNCTIONS ----------------------------- //
+static ErrorCode readFile(const char* fileName, char** text, size_t* length)
+{
+    FILE* file = fopen(fileName, "rb");
+    if (file == NULL) {
+        logError(ERR_CANT_OPEN_INPUT_FILE, fileName);
+        return ERR_CANT_OPEN_INPUT_FILE;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    *text = malloc((size > 0 ? size : 0) + 1);
+    if (*text == NULL) {
+        fclose(file);
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+    *length = fread(*text, 1, (size > 0) ? size : 0, file);
+    (*text)[*length] = '\0';
+    fclose(file);
+    return OK;
+}
+
+/// @brief Splits the module into lines, reading the directives and the
+/// function blocks
+static ErrorCode parseModule(ObjectModule* module)
+{
+    size_t numLines = 1;
+    for (const char* c = module->text; *c != '\0'; c++) {
+        if (*c == '\n') numLines++;
+    }
+    module->lines = malloc(numLines * sizeof(char*));
+    module->blocks = malloc((numLines + 1) * sizeof(ObjectBlock));
+    if (module->lines == NULL || module->blocks == NULL) {
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+
+    ObjectBlock* current = &module->blocks[0];
+    memset(current, 0, sizeof(ObjectBlock));
+    module->numBlocks = 1;
+
+    bool first = true;
+    char* line = module->text;
+    while (line != NULL && (*line != '\0' || !first)) {
+        char* next = strchr(line, '\n');
+        if (next != NULL) *next++ = '\0';
+        size_t len = strlen(line);
+        if (len > 0 && line[len - 1] == '\r') line[len - 1] = '\0';
+
+        if (first) {
+            if (strcmp(line, OBJECT_MAGIC) != 0) {
+                logError(ERR_BAD_OBJECT_FILE, module->fileName);
+                return ERR_BAD_OBJECT_FILE;
+            }
+            first = false;
+        }
+        else if (strncmp(line, ".function ", strlen(".function ")) == 0) {
+            current->end = module->numLines;
+            current = &module->blocks[module->numBlocks++];
+            current->name = line + strlen(".function ");
+            current->first = module->numLines;
+            current->live = false;
+        }
+        else if (strncmp(line, ".static ", strlen(".static ")) == 0) {
+            module->numStatics++;
+        }
+        else if (strncmp(line, ".routines ", strlen(".routines ")) == 0) {
+            RoutineUse* r = &module->routines;
+            int multiply = 0;
+            int divide = 0;
+            if (sscanf(line, ".routines %ld %d %d %ld", &r->zeroLength, &multiply, &divide,
+                       &r->shiftFirst) != 4) {
+                logError(ERR_BAD_OBJECT_FILE, module->fileName);
+                return ERR_BAD_OBJECT_FILE;
+            }
+            r->multiply = multiply;
+            r->divide = divide;
+        }
+        else if (line[0] == '.') {
+            logError(ERR_BAD_OBJECT_FILE, module->fileName);
+            return ERR_BAD_OBJECT_FILE;
+        }
+        else if (next != NULL || line[0] != '\0') {
+            module->lines[module->numLines++] = line;
+        }
+        line = next;
+    }
+    if (first) {
+        logError(ERR_BAD_OBJECT_FILE, module->fileName);
+        return ERR_BAD_OBJECT_FILE;
+    }
+    current->end = module->numLines;
+
+    // The code before the first function is always kept
+    module->blocks[0].live = true;
+    return OK;
+}
+
+static ErrorCode buildSymbols(const Linker* linker, SymbolTable* table)
+{
+    size_t numSymbols = 0;
+    for (size_t m = 0; m < linker->numModules; m++) {
+        numSymbols += linker->modules[m].numLines;
+    }
+    table->symbols = malloc((numSymbols + 1) * sizeof(Symbol));
+    table->numSymbols = 0;
+    if (table->symbols == NULL) {
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+
+    for (size_t m = 0; m < linker->numModules; m++) {
+        const ObjectModule* module = &linker->modules[m];
+        for (size_t b = 0; b < module->numBlocks; b++) {
+            const ObjectBlock* block = &module->blocks[b];
+            for (size_t i = block->first; i < block->end; i++) {
+                const char* symbol = NULL;
+                size_t len = symbolAt(module->lines[i], &symbol);
+                if (len == 0 || symbol[-1] != '(') continue;
+
+                Symbol* s = &table->symbols[table->numSymbols];
+                s->name = strndup(symbol, len);
+                s->module = m;
+                s->block = b;
+                if (s->name == NULL) {
+                    symbols_close(table);
+                    logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+                    return ERR_PROG_OUT_OF_MEMORY;
+                }
+                table->numSymbols++;
+            }
+        }
+    }
+    qsort(table->symbols, table->numSymbols, sizeof(Symbol), compareSymbols);
+    return OK;
+}
+
+static void symbols_close(SymbolTable* table)
+{
+    for (size_t i = 0; i < table->numSymbols; i++) {
+        free(table->symbols[i].name);
+    }
+    free(table->symbols);
+    memset(table, 0, sizeof(SymbolTable));
+}
+
+/// @brief Unlike the functions of the translated files, the ones of linked
+/// modules can't be defined twice, as a whole module would be lost
+static ErrorCode checkDuplicates(const Linker* linker, const Program* prog)
+{
+    FunctionTable functions;
+    RETURN_ON_ERR(program_buildFunctionTable(prog, &functions));
+
+    size_t numNames = 0;
+    for (size_t m = 0; m < linker->numModules; m++) {
+        numNames += linker->modules[m].numBlocks;
+    }
+    const char** names = malloc((numNames + 1) * sizeof(char*));
+    if (names == NULL) {
+        functionTable_close(&functions);
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+
+    numNames = 0;
+    ErrorCode err = OK;
+    for (size_t m = 0; m < linker->numModules && err == OK; m++) {
+        const ObjectModule* module = &linker->modules[m];
+        for (size_t b = 0; b < module->numBlocks && err == OK; b++) {
+            const char* name = module->blocks[b].name;
+            if (name == NULL) continue;
+            if (functionTable_find(&functions, name) != NULL) {
+                logError(ERR_DUPLICATE_FUNCTION, name);
+                err = ERR_DUPLICATE_FUNCTION;
+            }
+            names[numNames++] = name;
+        }
+    }
+
+    if (err == OK) {
+        qsort(names, numNames, sizeof(char*), compareStrings);
+        for (size_t i = 1; i < numNames && err == OK; i++) {
+            if (strcmp(names[i - 1], names[i]) == 0) {
+                logError(ERR_DUPLICATE_FUNCTION, names[i]);
+                err = ERR_DUPLICATE_FUNCTION;
+            }
+        }
+    }
+    free(names);
+    functionTable_close(&functions);
+    return err;
+}
+
+/// @return The declaration of a label in the given module, or else the
+/// first one in any module. NULL if no module declares it
+static const Symbol* findSymbol(const SymbolTable* table, const char* name, size_t module)
+{
+    size_t low = 0;
+    size_t high = table->numSymbols;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        int cmp = strcmp(table->symbols[mid].name, name);
+        if (cmp < 0 || (cmp == 0 && table->symbols[mid].module < module)) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    if (low < table->numSymbols && table->symbols[low].module == module &&
+        strcmp(table->symbols[low].name, name) == 0) {
+        return &table->symbols[low];
+    }
+    while (low > 0 && strcmp(table->symbols[low - 1].name, name) == 0) {
+        low--;
+    }
+    return (low < table->numSymbols && strcmp(table->symbols[low].name, name) == 0) ?
+           &table->symbols[low] : NULL;
+}
+
+/// @brief Dead function elimination. A function is kept when the program or
+/// kept code refers to one of its labels, or when kept code falls through
+/// into it
+static void markLive(Linker* linker, const SymbolTable* table, const Program* prog)
+{
+    size_t numBlocks = 0;
+    for (size_t m = 0; m < linker->numModules; m++) {
+        numBlocks += linker->modules[m].numBlocks;
+    }
+    // Blocks are queued as module and block index pairs
+    size_t* work = malloc(2 * (numBlocks + 1) * sizeof(size_t));
+    if (work == NULL) {
+        // Keep everything
+        for (size_t m = 0; m < linker->numModules; m++) {
+            for (size_t b = 0; b < linker->modules[m].numBlocks; b++) {
+                linker->modules[m].blocks[b].live = true;
+            }
+        }
+        return;
+    }
+
+    size_t numWork = 0;
+    for (size_t m = 0; m < linker->numModules; m++) {
+        if (linker->modules[m].numBlocks > 0) {
+            work[numWork++] = m;
+            work[numWork++] = 0;
+        }
+    }
+    markSymbolLive(linker, findSymbol(table, "Sys.init", 0), work, &numWork);
+    for (size_t f = 0; f < prog->numFiles; f++) {
+        const VmFile* file = &prog->files[f];
+        for (size_t i = 0; i < file->numCmds; i++) {
+            if (isReference(&file->cmds[i])) {
+                markSymbolLive(linker, findSymbol(table, file->cmds[i].Arg1, 0), work, &numWork);
+            }
+        }
+    }
+
+    while (numWork > 0) {
+        size_t b = work[--numWork];
+        size_t m = work[--numWork];
+        const ObjectModule* module = &linker->modules[m];
+        const ObjectBlock* block = &module->blocks[b];
+
+        for (size_t i = block->first; i < block->end; i++) {
+            const char* symbol = NULL;
+            size_t len = symbolAt(module->lines[i], &symbol);
+            if (len == 0 || symbol[-1] != '@') continue;
+
+            char name[MAX_IDENTIFIER_LEN + 16];
+            if (len >= sizeof(name)) continue;
+            memcpy(name, symbol, len);
+            name[len] = '\0';
+            markSymbolLive(linker, findSymbol(table, name, m), work, &numWork);
+        }
+        if (b + 1 < module->numBlocks && fallsThrough(module, block) && !module->blocks[b + 1].live) {
+            module->blocks[b + 1].live = true;
+            work[numWork++] = m;
+            work[numWork++] = b + 1;
+        }
+    }
+    free(work);
+}
+
+static void markSymbolLive(Linker* linker, const Symbol* symbol, size_t* work, size_t* numWork)
+{
+    if (symbol == NULL) {
+        return;
+    }
+    ObjectBlock* block = &linker->modules[symbol->module].blocks[symbol->block];
+    if (!block->live) {
+        block->live = true;
+        work[(*numWork)++] = symbol->module;
+        work[(*numWork)++] = symbol->block;
+    }
+}
+
+static void writeBlock(const Linker* linker, const SymbolTable* table, size_t module,
+                       const ObjectBlock* block, FILE* out)
+{
+    const ObjectModule* mod = &linker->modules[module];
+    for (size_t i = block->first; i < block->end; i++) {
+        const char* line = mod->lines[i];
+        const char* symbol = NULL;
+        size_t len = symbolAt(line, &symbol);
+        if (len == 0) {
+            fprintf(out, "%s\n", line);
+            continue;
+        }
+
+        char name[MAX_IDENTIFIER_LEN + 16];
+        if (len >= sizeof(name)) {
+            fprintf(out, "%s\n", line);
+            continue;
+        }
+        memcpy(name, symbol, len);
+        name[len] = '\0';
+
+        const Symbol* declared = findSymbol(table, name, module);
+        if (declared != NULL && declared->module == module && isModuleLocal(name)) {
+            fprintf(out, "%.*s$%zu%s\n", (int)(symbol - line + len), line, module, symbol + len);
+        }
+        else {
+            fprintf(out, "%s\n", line);
+        }
+    }
+}
+
+/// @brief Finds the symbol of an A-instruction or a label declaration
+/// @param symbol Set to the first character of the symbol
+/// @return Length of the symbol, 0 when the line has none. Numbers are not
+/// symbols
+static size_t symbolAt(const char* line, const char** symbol)
+{
+    while (*line == ' ' || *line == '\t') line++;
+    if ((*line != '@' && *line != '(') || line[1] == '\0' || (line[1] >= '0' && line[1] <= '9')) {
+        return 0;
+    }
+    *symbol = line + 1;
+    return strcspn(*symbol, " \t)/");
+}
+
+/// @return Whether a label is one the code writer generates with a counter.
+/// Those are only referred to by the module declaring them
+static bool isModuleLocal(const char* name)
+{
+    return strncmp(name, "__", 2) == 0 || strstr(name, "_retAddr_") != NULL;
+}
+
+/// @return Whether the last instruction of a block may continue into the
+/// next block
+static bool fallsThrough(const ObjectModule* module, const ObjectBlock* block)
+{
+    for (size_t i = block->end; i-- > block->first;) {
+        const char* line = module->lines[i];
+        while (*line == ' ' || *line == '\t') line++;
+        if (*line == '\0' || (line[0] == '/' && line[1] == '/')) continue;
+
+        char instr[16];
+        size_t len = 0;
+        for (; *line != '\0' && len + 1 < sizeof(instr); line++) {
+            if (line[0] == '/' && line[1] == '/') break;
+            if (*line != ' ' && *line != '\t') instr[len++] = *line;
+        }
+        instr[len] = '\0';
+        return strcmp(instr, "0;JMP") != 0;
+    }
+    return true;
+}
+
+static bool isReference(const Command* cmd)
+{
+    switch (cmd->type) {
+        case CMD_CALL:
+        case CMD_LIGHT_CALL:
+        case CMD_TAIL_CALL:
+        case CMD_TAIL_JUMP:
+        case CMD_GOTO:
+        case CMD_IF:
+        case CMD_IF_NOT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static int compareSymbols(const void* a, const void* b)
+{
+    const Symbol* x = a;
+    const Symbol* y = b;
+    int cmp = strcmp(x->name, y->name);
+    if (cmp != 0) return cmp;
+    return (x->module > y->module) - (x->module < y->module);
+}
+
+static int compareStrings(const void* a, const void* b)
+{
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
@@ -0,0 +1,83 @@
+#ifndef LINKER_H
+#define LINKER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "errorHandler.h"
+#include "program.h"
+
+/// Shared routines the code of a module jumps to. They are written once,
+/// after the code of every module
+typedef struct RoutineUse {
+    long zeroLength;         // Locals the shared zeroing routine must clear
+    bool multiply;
+    bool divide;
+    long shiftFirst;         // Smallest right shift entry, 0 when unused
+} RoutineUse;
+
+/// Code of one function of an object module, from its .function directive
+/// to the next one
+typedef struct ObjectBlock {
+    const char* name;        // NULL for the code before the first function
+    size_t first;            // Index in ObjectModule.lines
+    size_t end;
+    bool live;
+} ObjectBlock;
+
+/// An object module (.vmo) loaded for linking. The file is kept in memory
+/// and split into lines in place
+typedef struct ObjectModule {
+    char* fileName;
+    char* text;
+    char** lines;            // Code lines, without the directives
+    size_t numLines;
+    ObjectBlock* blocks;
+    size_t numBlocks;
+    RoutineUse routines;
+    long numStatics;
+} ObjectModule;
+
+typedef struct Linker {
+    ObjectModule* modules;
+    size_t numModules;
+    size_t capacity;
+} Linker;
+
+void linker_new(Linker* linker);
+void linker_close(Linker* linker);
+
+/// @brief Loads an object module written by linker_writeModule()
+ErrorCode linker_addModule(Linker* linker, const char* fileName);
+
+/// @brief Tells the optimization passes which functions of the program the
+/// loaded modules call and how many static variables they use
+ErrorCode linker_exportUses(const Linker* linker, Program* prog);
+
+/// @brief Writes the code of the loaded modules that the program can reach,
+/// starting from Sys.init and the calls and jumps of the program. Labels
+/// generated by the translator are local to their module and get the module
+/// number as suffix, so that the counters of separately translated modules
+/// don't clash
+/// @param routines Shared routines used by the program, to which the ones
+/// of the modules are added
+/// @param report Where the number of linked functions is printed, NULL for
+/// nowhere
+ErrorCode linker_link(Linker* linker, const Program* prog, FILE* out, RoutineUse* routines,
+                      FILE* report);
+
+/// @brief Writes an object module: the translated code, in which the code
+/// writer marks every function with a .function directive, preceded by the
+/// static variables of the program and the shared routines the code uses
+ErrorCode linker_writeModule(FILE* out, const Program* prog, const char* code, size_t length,
+                             const RoutineUse* routines);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LINKER_H
@@ -4,12 +4,20 @@
 #include <stdlib.h>
 #include <string.h>
 #include <string.h>
-#include <dirent.h>
-#include <sys/stat.h>
-#include <sys/types.h>
+#include <sys/resource.h>
+#include "arena.h"
+#include "bytecode.h"
 #include "codeWriter.h"
 #include "errorHandler.h"
+#include "inputs.h"
+#include "linker.h"
+#include "options.h"
 #include "parser.h"
+#include "pipeline.h"
+#include "profile.h"
+#include "program.h"
+#include "readAhead.h"
+#include "vmTranslator.h"
 #include "main.h"
 
 #define EXIT_ON_ERR(err)    ({ErrorCode e = err; if (e != OK) exit(e);})
@@ -20,10 +28,22 @@
 ///////////////////////////////////////////////////////////
 static Parser parser;
 static CodeWriter codeWriter;
-
-static FileType getFileType(const char* path);
-static ErrorCode processDirectory(const char* dirName);
-static ErrorCode processFile(const char* fileName);
+static Options options;
+static Inputs inputs;
+static Program program;
+static Linker linker;
+static Profile profile;        // Counts of --profile-use
+static ReadAhead readAhead;
+static Arena inputArena;       // Files parsed, released after each one
+static ArenaStats writerStats; // Code writers of the projects translated
+
+static ErrorCode startReadAhead(void);
+static ErrorCode translateProject(const Project* project);
+static ErrorCode translateFiles(const Project* project);
+static bool canPipeline(const Project* project);
+static ErrorCode parseFile(const char* fileName);
+static void closeProject(void);
+static void printStats(void);
 static void attemptCleanup(void);
 
 ///////////////////////////////////////////////////////////
@@ -32,29 +52,36 @@ static void attemptCleanup(void);
 int main(int argc, char* argv[])
 {
     atexit(attemptCleanup);
-    if (argc != 2) {
-        printf("Use %s <file_path>\n", argv[0]);
-        exit(ERR_NO_FILENAME_GIVEN);
-    }
-    const char* path = argv[1];
-
-    switch (getFileType(path)) {
-        case FILE_REGULAR:
-            EXIT_ON_ERR(codeWriter_new(&codeWriter, path, FILE_REGULAR));
-            EXIT_ON_ERR(codeWriter_writeStartupCode(&codeWriter));
-            EXIT_ON_ERR(processFile(path));
-            break;
-        case FILE_DIR:
-            EXIT_ON_ERR(codeWriter_new(&codeWriter, path, FILE_DIR));
-            EXIT_ON_ERR(codeWriter_writeStartupCode(&codeWriter));
-            EXIT_ON_ERR(processDirectory(path));
-            break;
-        default:
-            logError(ERR_CANT_OPEN_INPUT_FILE, "Unknown file type");
-            exit(ERR_CANT_OPEN_INPUT_FILE);
-            break;
+    errorHandler_setLogFile(stdout);
+    ErrorCode err = options_parse(&options, argc, argv);
+    if (err != OK) {
+        options_printUsage(argv[0]);
+        exit(err);
+    }
+    options.reportFile = stdout;
+
+    if (options.profileUse != NULL) {
+        EXIT_ON_ERR(profile_load(&profile, options.profileUse));
+        options.profile = &profile;
     }
+    arena_new(&inputArena, DEFAULT_ARENA_BLOCK_SIZE);
 
+    // Every path is scanned before any file is parsed, so that the
+    // read-ahead knows the files of the whole batch
+    inputs_new(&inputs);
+    for (size_t i = 0; i < options.numInputPaths; i++) {
+        EXIT_ON_ERR(inputs_add(&inputs, options.inputPaths[i], options.recursive));
+    }
+    if (options.readAheadFiles > 0) {
+        EXIT_ON_ERR(startReadAhead());
+    }
+
+    for (size_t p = 0; p < inputs.numProjects; p++) {
+        EXIT_ON_ERR(translateProject(&inputs.projects[p]));
+    }
+    if (options.stats) {
+        printStats();
+    }
     return 0;
 }
 
@@ -62,75 +89,129 @@ int main(int argc, char* argv[])
 // Private functions
 ///////////////////////////////////////////////////////////
 
-static FileType getFileType(const char* path)
+/// @brief Reads the next files on another thread while one is parsed. A
+/// single read-ahead goes through the files of every project
+static ErrorCode startReadAhead(void)
 {
-    struct stat s;
-    if ( stat(path, &s) == 0 ) {
-        if (s.st_mode & S_IFDIR) {
-            return FILE_DIR;
-        }
-        else if (s.st_mode & S_IFREG) {
-            return FILE_REGULAR;
-        }
+    size_t numFiles = 0;
+    for (size_t p = 0; p < inputs.numProjects; p++) {
+        numFiles += inputs.projects[p].numFiles;
+    }
+    char** files = malloc((numFiles + 1) * sizeof(char*));
+    if (files == NULL) {
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+    numFiles = 0;
+    for (size_t p = 0; p < inputs.numProjects; p++) {
+        const Project* project = &inputs.projects[p];
+        memcpy(&files[numFiles], project->files, project->numFiles * sizeof(char*));
+        numFiles += project->numFiles;
     }
-    return FILE_ERR;
+    ErrorCode err = readAhead_start(&readAhead, files, numFiles, options.readAheadFiles,
+                                    options.readAheadBytes);
+    free(files);
+    return err;
 }
 
-static ErrorCode processDirectory(const char* dirName)
+/// @brief Translates the files of a project into its own output
+static ErrorCode translateProject(const Project* project)
 {
-    struct dirent *dp = NULL;
-    DIR *dfd = NULL;
+    program_new(&program);
+    linker_new(&linker);
+    ErrorCode err = translateFiles(project);
+    closeProject();
+    return err;
+}
 
-    dfd = opendir(dirName);
-    if (dfd == NULL) {
-        logError(ERR_CANT_OPEN_DIR, dirName);
+/// @brief Every file is parsed into the program first, so that
+/// optimization passes get a whole program view before any code is written
+static ErrorCode translateFiles(const Project* project)
+{
+    RETURN_ON_ERR(codeWriter_new(&codeWriter, project->path, project->type, &options));
+    for (size_t i = 0; i < project->numModules; i++) {
+        printf("Loading %s\n", project->modules[i]);
+        RETURN_ON_ERR(linker_addModule(&linker, project->modules[i]));
+    }
+    if (project->type == FILE_DIR) {
+        for (size_t i = 0; i < project->numFiles; i++) {
+            printf("Processing %s\n", project->files[i]);
+        }
     }
 
-    char fileName[100];
-
-    while ( (dp = readdir(dfd)) != NULL) {
-        struct stat stbuf ;
-        sprintf( fileName , "%s/%s", dirName, dp->d_name) ;
+    // Without linked modules, binary files or passes needing the whole
+    // program, the files are translated while they are parsed
+    if (options.pipeline && canPipeline(project)) {
+        RETURN_ON_ERR(codeWriter_writeStartupCode(&codeWriter));
+        RETURN_ON_ERR(pipeline_run(&codeWriter, project->files, project->numFiles, &readAhead,
+                                   &inputArena));
+        RETURN_ON_ERR(codeWriter_writeModules(&codeWriter, &linker, &program));
+        return codeWriter_finish(&codeWriter);
+    }
+    for (size_t i = 0; i < project->numFiles; i++) {
+        RETURN_ON_ERR(parseFile(project->files[i]));
+    }
+    return vmTranslator_writeProgram(&codeWriter, &program, &linker, &options);
+}
 
-        if( stat(fileName, &stbuf ) == -1 )
-        {
-            printf("Unable to stat file: %s\n", fileName) ;
-            continue ;
+static bool canPipeline(const Project* project)
+{
+    if (!pipeline_isSupported(&options) || linker.numModules > 0) {
+        return false;
+    }
+    for (size_t i = 0; i < project->numFiles; i++) {
+        const char* fileName = project->files[i];
+        if (inputs_hasExtension(fileName, ".vmb")) {
+            return false;
         }
+    }
+    return true;
+}
 
-        if ( ( stbuf.st_mode & S_IFMT ) == S_IFDIR )
-        {
-            // Skip directories
-            continue;
-        }
-        else
-        {
-            // Only process files with .vm extension
-            if (strcmp(fileName + strlen(fileName) - strlen(".vm"), ".vm") == 0) {
-                printf("Processing %s\n", fileName);
-                RETURN_ON_ERR(processFile(fileName));
-            }
-        }
+static ErrorCode parseFile(const char* fileName)
+{
+    // Binary files hold already parsed commands, of one or more .vm files
+    if (inputs_hasExtension(fileName, ".vmb")) {
+        return bytecode_load(&program, fileName);
     }
+    RETURN_ON_ERR(readAhead_openParser(&readAhead, &parser, fileName, &inputArena));
+    ErrorCode err = vmTranslator_parseFile(&program, &parser, fileName, &options);
+    parser_close(&parser);
 
-    return OK;
+    // The commands hold copies of their arguments, the text is not needed
+    arena_reset(&inputArena);
+    return err;
 }
 
-static ErrorCode processFile(const char* fileName)
+static void closeProject(void)
 {
-    RETURN_ON_ERR(parser_new(&parser, fileName));
-    RETURN_ON_ERR(codeWriter_setCurrentFileName(&codeWriter, fileName));
-
-    while (parser_hasMoreCommands(&parser)) {
-        RETURN_ON_ERR(parser_advance(&parser));
-        RETURN_ON_ERR(codeWriter_translateCmd(&codeWriter, &parser.currCmd));
-    }
     parser_close(&parser);
-    return OK;
+    program_close(&program);
+    linker_close(&linker);
+    if (codeWriter.outFileName != NULL) {
+        arenaStats_add(&writerStats, &codeWriter.arena.stats);
+        codeWriter_close(&codeWriter);
+    }
+}
+
+/// @brief Prints what the arenas allocated over the whole run, and the peak
+/// resident memory of the process
+static void printStats(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("Memory statistics:\n");
+    arenaStats_print(stdout, "Input files", &inputArena.stats);
+    arenaStats_print(stdout, "Code writer", &writerStats);
+    printf("Peak resident memory: %ld KB\n", usage.ru_maxrss);
 }
 
 static void attemptCleanup(void)
 {
-    parser_close(&parser);
-    codeWriter_close(&codeWriter);
+    readAhead_stop(&readAhead);
+    closeProject();
+    arena_close(&inputArena);
+    inputs_close(&inputs);
+    options_close(&options);
+    profile_close(&profile);
 }
@@ -0,0 +1,257 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "codeWriter.h"
+#include "errorHandler.h"
+#include "optimizer.h"
+#include "options.h"
+#include "program.h"
+
+#define RETURN_ON_ERR(err)    ({ErrorCode e = err; if (e != OK) return (e);})
+
+/// A VM level pass over the whole program
+typedef struct Pass {
+    const char* name;
+    bool (*isEnabled)(const Options* opts);
+    ErrorCode (*run)(Program* prog, const Options* opts);
+} Pass;
+
+/// Size of the program, reported with --pass-report
+typedef struct ProgramSize {
+    size_t commands;         // VM commands
+    size_t romWords;         // Instructions of the translated program
+} ProgramSize;
+
+// Local function prototypes
+static bool intrinsicsEnabled(const Options* opts);
+static bool inlinerEnabled(const Options* opts);
+static bool constantFoldingEnabled(const Options* opts);
+static bool controlFlowEnabled(const Options* opts);
+static bool tailCallsEnabled(const Options* opts);
+static bool deadStoresEnabled(const Options* opts);
+static bool arrayIdiomsEnabled(const Options* opts);
+static bool staticFramesEnabled(const Options* opts);
+static bool callFramesEnabled(const Options* opts);
+static ErrorCode runIntrinsics(Program* prog, const Options* opts);
+static ErrorCode runInliner(Program* prog, const Options* opts);
+static ErrorCode runConstantFolding(Program* prog, const Options* opts);
+static ErrorCode runControlFlow(Program* prog, const Options* opts);
+static ErrorCode runTailCalls(Program* prog, const Options* opts);
+static ErrorCode runDeadStores(Program* prog, const Options* opts);
+static ErrorCode runArrayIdioms(Program* prog, const Options* opts);
+static ErrorCode runStaticFrames(Program* prog, const Options* opts);
+static ErrorCode runCallFrames(Program* prog, const Options* opts);
+static ErrorCode runAndReport(Program* prog, const Options* opts);
+static ErrorCode measureProgram(const Program* prog, const Options* opts, ProgramSize* size);
+static ErrorCode translateProgram(CodeWriter* cw, const Program* prog);
+static size_t countInstructions(const char* code, size_t length);
+static double elapsedMs(const struct timespec* start, const struct timespec* end);
+
+/// The passes in the order they run
+static const Pass passes[] = {
+    // Intrinsics go first so that functions using them can still be inlined,
+    // and inlining before tail calls lets that pass see the calls that remain
+    { "intrinsics", intrinsicsEnabled, runIntrinsics },
+    { "inline", inlinerEnabled, runInliner },
+    // Inlined bodies get the constant arguments of their call sites
+    { "constant-folding", constantFoldingEnabled, runConstantFolding },
+    // Removing gotos and labels can bring a call right before its return
+    { "control-flow", controlFlowEnabled, runControlFlow },
+    { "tail-calls", tailCallsEnabled, runTailCalls },
+    // Folded and inlined code leaves stores that nothing reads
+    { "dead-stores", deadStoresEnabled, runDeadStores },
+    // Runs last so the liveness of THAT covers the code left by other passes
+    { "array-idioms", arrayIdiomsEnabled, runArrayIdioms },
+    // After inlining and tail calls, which change the locals and the call graph
+    { "static-frames", staticFramesEnabled, runStaticFrames },
+    // Last, as the other passes may remove pointer writes or add tail calls
+    { "reduced-frames", callFramesEnabled, runCallFrames }
+};
+#define NUM_PASSES    (sizeof(passes) / sizeof(passes[0]))
+
+// ---------------------------- PUBLIC FUNCTIONS --------------------------- //
+ErrorCode optimizer_run(Program* prog, const Options* opts)
+{
+    if (opts->passReport && opts->reportFile != NULL) {
+        return runAndReport(prog, opts);
+    }
+    for (size_t i = 0; i < NUM_PASSES; i++) {
+        if (passes[i].isEnabled(opts)) {
+            RETURN_ON_ERR(passes[i].run(prog, opts));
+        }
+    }
+    return OK;
+}
+
+bool optimizer_hasPasses(const Options* opts)
+{
+    for (size_t i = 0; i < NUM_PASSES; i++) {
+        if (passes[i].isEnabled(opts)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// -------------------------- PRIVATE FUNCTIONS ----------------------------- //
+static bool intrinsicsEnabled(const Options* opts)   { return opts->intrinsics; }
+static bool inlinerEnabled(const Options* opts)      { return opts->inlineFunctions; }
+static bool constantFoldingEnabled(const Options* opts) { return opts->constantFolding; }
+static bool controlFlowEnabled(const Options* opts)  { return opts->controlFlow; }
+static bool tailCallsEnabled(const Options* opts)    { return opts->tailCalls; }
+static bool deadStoresEnabled(const Options* opts)   { return opts->deadStores; }
+static bool arrayIdiomsEnabled(const Options* opts)  { return opts->arrayIdioms; }
+static bool staticFramesEnabled(const Options* opts) { return opts->staticFrames; }
+static bool callFramesEnabled(const Options* opts)   { return opts->reducedFrames; }
+
+static ErrorCode runIntrinsics(Program* prog, const Options* opts)
+{
+    (void)opts;
+    return intrinsics_optimize(prog);
+}
+
+static ErrorCode runInliner(Program* prog, const Options* opts)
+{
+    return inliner_optimize(prog, opts->inlineLimit, opts->profile);
+}
+
+static ErrorCode runConstantFolding(Program* prog, const Options* opts)
+{
+    (void)opts;
+    return constantFolding_optimize(prog);
+}
+
+static ErrorCode runControlFlow(Program* prog, const Options* opts)
+{
+    return controlFlow_optimize(prog, opts->profile);
+}
+
+static ErrorCode runTailCalls(Program* prog, const Options* opts)
+{
+    (void)opts;
+    return tailCalls_optimize(prog);
+}
+
+static ErrorCode runDeadStores(Program* prog, const Options* opts)
+{
+    (void)opts;
+    return deadStores_optimize(prog);
+}
+
+static ErrorCode runArrayIdioms(Program* prog, const Options* opts)
+{
+    (void)opts;
+    return arrayIdioms_optimize(prog);
+}
+
+static ErrorCode runStaticFrames(Program* prog, const Options* opts)
+{
+    return staticFrames_optimize(prog, opts->frameReport ? opts->reportFile : NULL);
+}
+
+static ErrorCode runCallFrames(Program* prog, const Options* opts)
+{
+    return callFrames_optimize(prog, opts->frameReport ? opts->reportFile : NULL);
+}
+
+/// @brief Runs the enabled passes, printing the time each one takes and the
+/// size of the program before and after it. The program is translated
+/// between the passes to count its instructions, which is not timed
+static ErrorCode runAndReport(Program* prog, const Options* opts)
+{
+    ProgramSize before;
+    RETURN_ON_ERR(measureProgram(prog, opts, &before));
+    FILE* report = opts->reportFile;
+    fprintf(report, "%-16s %10s %24s %24s\n", "Pass", "Time (ms)", "VM commands", "ROM words");
+
+    double totalMs = 0.0;
+    ProgramSize first = before;
+    for (size_t i = 0; i < NUM_PASSES; i++) {
+        if (!passes[i].isEnabled(opts)) continue;
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        RETURN_ON_ERR(passes[i].run(prog, opts));
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double ms = elapsedMs(&start, &end);
+        totalMs += ms;
+
+        ProgramSize after;
+        RETURN_ON_ERR(measureProgram(prog, opts, &after));
+        fprintf(report, "%-16s %10.3f %10zu -> %-10zu %10zu -> %zu\n", passes[i].name, ms,
+                before.commands, after.commands, before.romWords, after.romWords);
+        before = after;
+    }
+    fprintf(report, "%-16s %10.3f %10zu -> %-10zu %10zu -> %zu\n", "total", totalMs,
+            first.commands, before.commands, first.romWords, before.romWords);
+    return OK;
+}
+
+/// @brief Counts the commands of the program and the instructions of its
+/// translation, without linked modules and before outlining
+static ErrorCode measureProgram(const Program* prog, const Options* opts, ProgramSize* size)
+{
+    size->commands = 0;
+    for (size_t f = 0; f < prog->numFiles; f++) {
+        size->commands += prog->files[f].numCmds;
+    }
+
+    // Reports of the code writer are left to the real translation
+    Options measureOpts = *opts;
+    measureOpts.outline = false;
+    measureOpts.emitObject = false;
+    measureOpts.emitBinary = false;
+    measureOpts.reportFile = NULL;
+    measureOpts.jobs = 0;
+
+    char* code = NULL;
+    size_t codeSize = 0;
+    CodeWriter cw;
+    ErrorCode err = codeWriter_newInMemory(&cw, &code, &codeSize, &measureOpts);
+    if (err == OK) {
+        err = translateProgram(&cw, prog);
+        codeWriter_close(&cw);
+    }
+    size->romWords = (err == OK) ? countInstructions(code, codeSize) : 0;
+    free(code);
+    return err;
+}
+
+static ErrorCode translateProgram(CodeWriter* cw, const Program* prog)
+{
+    const Command endOfFile = { .type = CMD_END };
+    RETURN_ON_ERR(codeWriter_writeStartupCode(cw));
+    for (size_t f = 0; f < prog->numFiles; f++) {
+        const VmFile* file = &prog->files[f];
+        RETURN_ON_ERR(codeWriter_setCurrentFileName(cw, file->fileName));
+        for (size_t i = 0; i < file->numCmds; i++) {
+            RETURN_ON_ERR(codeWriter_translateCmd(cw, &file->cmds[i]));
+        }
+        RETURN_ON_ERR(codeWriter_translateCmd(cw, &endOfFile));
+    }
+    return codeWriter_finish(cw);
+}
+
+/// @return Lines of the assembly that are neither empty, comments nor labels
+static size_t countInstructions(const char* code, size_t length)
+{
+    size_t count = 0;
+    size_t i = 0;
+    while (i < length) {
+        while (i < length && (code[i] == ' ' || code[i] == '\t')) i++;
+        if (i < length && code[i] != '\n' && code[i] != '\r' && code[i] != '(' &&
+            !(code[i] == '/' && i + 1 < length && code[i + 1] == '/')) {
+            count++;
+        }
+        while (i < length && code[i] != '\n') i++;
+        i++;
+    }
+    return count;
+}
+
+static double elapsedMs(const struct timespec* start, const struct timespec* end)
+{
+    return (double)(end->tv_sec - start->tv_sec) * 1000.0 +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e6;
+}
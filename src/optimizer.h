@@ -0,0 +1,114 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "errorHandler.h"
+#include "options.h"
+#include "profile.h"
+#include "program.h"
+
+/// @brief Runs the VM level optimization passes enabled in the options over
+/// the whole program, before any code is written
+ErrorCode optimizer_run(Program* prog, const Options* opts);
+
+/// @return Whether the options enable any of the passes of optimizer_run()
+bool optimizer_hasPasses(const Options* opts);
+
+/// @brief Replaces calls of Math.multiply, Math.divide, Memory.peek and
+/// Memory.poke with CMD_INTRINSIC commands, which the code writer expands
+/// inline. A constant pushed right before the call is folded into the
+/// command when the code writer can use it: any factor of a multiplication,
+/// a power of two divisor, or a peeked address.
+ErrorCode intrinsics_optimize(Program* prog);
+
+/// @return Values pushed minus values popped by a CMD_INTRINSIC command
+long intrinsics_stackEffect(const Command* cmd);
+
+/// @brief Replaces calls of small leaf functions with their body. The
+/// arguments and locals of the callee become extra locals of the caller and
+/// THIS/THAT are saved around the body when the callee changes them.
+/// Functions whose call sites were all inlined are removed
+/// @param limit Largest body, in VM commands, of an inlined function
+/// @param profile With --profile-use, hot call sites inline bodies up to
+/// four times the limit without counting against the growth of the program,
+/// and cold ones are never inlined. NULL without a profile
+ErrorCode inliner_optimize(Program* prog, long limit, const Profile* profile);
+
+/// @brief Folds arithmetic on pushed constants into a single constant, which
+/// may be negative, and drops adding, subtracting or or-ing 0 and and-ing -1.
+/// Within a basic block, pushes of local, argument, temp and static entries
+/// known to hold a constant push the constant instead. Calls only keep the
+/// locals and arguments known, pops through this and that nothing
+ErrorCode constantFolding_optimize(Program* prog);
+
+/// @brief Computes an arithmetic command on 16 bit values like the code
+/// writer does: eq leaves y - x, which is 0 when they are equal, gt leaves 1
+/// when y - x <= 0 and lt leaves 1 when y - x > 0, 0 otherwise
+/// @param x Operand below the top of the stack
+/// @param y Top of the stack, the only operand of neg and not
+/// @return false for an unknown command
+bool constantFolding_evaluate(const char* op, int16_t x, int16_t y, int16_t* result);
+
+/// @brief Turns a `call F n` directly followed by `return` into a tail
+/// call reusing the frame of the current function. When every call site of
+/// the current function passes n arguments, the arguments are popped into
+/// place and a CMD_TAIL_JUMP is used. When they pass a different number,
+/// known at every call site, a CMD_TAIL_CALL moves the frame by the
+/// difference, as long as few words move. Other calls are left as they are
+ErrorCode tailCalls_optimize(Program* prog);
+
+/// @brief Removes the stores to locals, arguments and temp entries that a
+/// liveness analysis of the function finds are never read again, such as
+/// the `pop temp 0` discarding the result of a void call. The pushes and
+/// arithmetic computing the stored value are removed with it, otherwise the
+/// value is dropped by a CMD_DISCARD, which only moves SP
+ErrorCode deadStores_optimize(Program* prog);
+
+/// @brief Cleans up the control flow of every function: jumps to gotos are
+/// threaded to the end of the chain, gotos to the next command, unreachable
+/// commands and unused labels are removed, an if-goto over a goto becomes a
+/// single CMD_IF_NOT, and while loops are rotated so that the loop condition
+/// follows the body and branches back to it
+/// @param profile With --profile-use, the branches of if-else statements
+/// are swapped when the profile finds the then branch more frequent, so that
+/// it falls through instead of ending with a goto. NULL without a profile
+ErrorCode controlFlow_optimize(Program* prog, const Profile* profile);
+
+/// @brief Fuses the array load (add; pop pointer 1; push that 0) and store
+/// (pop temp 0; pop pointer 1; push temp 0; pop that 0) sequences of the
+/// Jack compiler into CMD_ARRAY_LOAD and CMD_ARRAY_STORE. THAT and temp 0
+/// are only written by the fused commands where a liveness analysis of the
+/// function finds that they may still be read
+ErrorCode arrayIdioms_optimize(Program* prog);
+
+/// @brief Gives the locals of every non-recursive function fixed slots of
+/// the "frame" segment, which the code writer places at assembler variables,
+/// so that they are accessed directly instead of through LCL. Each frame sits
+/// above the frames of the functions that may be active when it is called,
+/// so functions never active at the same time share slots. Frames are only
+/// assigned while they fit in RAM next to the static variables
+/// @param report Where the slots given to every function are printed, NULL
+/// for nowhere
+ErrorCode staticFrames_optimize(Program* prog, FILE* report);
+
+/// @brief Works out which of THIS and THAT every function writes. Calls of
+/// the functions that can use a reduced frame become CMD_LIGHT_CALL, which
+/// only saves LCL, ARG and the written pointers, and their returns become
+/// CMD_LIGHT_RETURN. Functions involved in tail calls, entered by the
+/// bootstrap code or reachable from other functions by jumps or fall-through
+/// keep the full frame
+/// @param report Where the pointers used by every function and the number of
+/// calls using a reduced frame are printed, NULL for nowhere
+ErrorCode callFrames_optimize(Program* prog, FILE* report);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // OPTIMIZER_H
@@ -0,0 +1,269 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "errorHandler.h"
+#include "options.h"
+
+// ---------------------------- PUBLIC FUNCTIONS --------------------------- //
+void options_setDefaults(Options* opts)
+{
+    memset(opts, 0, sizeof(Options));
+    opts->inlineLimit = DEFAULT_INLINE_LIMIT;
+    opts->readAheadBytes = DEFAULT_READ_AHEAD_BYTES;
+}
+
+void options_setLevel(Options* opts, OptLevel level)
+{
+    opts->optLevel = level;
+    opts->specializeSegmentOffsets = (level != OPT_LEVEL_0);
+    opts->compactPrologue = (level != OPT_LEVEL_0);
+    opts->batchStackPointer = (level != OPT_LEVEL_0);
+    opts->cacheTopOfStack = (level != OPT_LEVEL_0);
+    opts->controlFlow = (level != OPT_LEVEL_0);
+    opts->constantFolding = (level != OPT_LEVEL_0);
+    opts->deadStores = (level != OPT_LEVEL_0);
+    opts->arrayIdioms = (level != OPT_LEVEL_0);
+    opts->tailCalls = (level == OPT_LEVEL_2 || level == OPT_LEVEL_SIZE);
+    opts->reducedFrames = (level == OPT_LEVEL_2 || level == OPT_LEVEL_SIZE);
+    opts->staticFrames = (level == OPT_LEVEL_2 || level == OPT_LEVEL_SIZE);
+    opts->inlineFunctions = (level == OPT_LEVEL_2);
+    opts->outline = (level == OPT_LEVEL_SIZE);
+    opts->costModel = (level == OPT_LEVEL_SIZE) ? COST_MODEL_SIZE : COST_MODEL_SPEED;
+}
+
+ErrorCode options_parse(Options* opts, int argc, char* argv[])
+{
+    options_setDefaults(opts);
+    opts->inputPaths = malloc(argc * sizeof(const char*));
+    if (opts->inputPaths == NULL) {
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+
+        if (arg[0] != '-') {
+            opts->inputPaths[opts->numInputPaths++] = arg;
+        }
+        else if (strcmp(arg, "-r") == 0) {
+            opts->recursive = true;
+        }
+        else if (strcmp(arg, "-O0") == 0) {
+            options_setLevel(opts, OPT_LEVEL_0);
+        }
+        else if (strcmp(arg, "-O1") == 0) {
+            options_setLevel(opts, OPT_LEVEL_1);
+        }
+        else if (strcmp(arg, "-O2") == 0) {
+            options_setLevel(opts, OPT_LEVEL_2);
+        }
+        else if (strcmp(arg, "-Os") == 0) {
+            options_setLevel(opts, OPT_LEVEL_SIZE);
+        }
+        else if (strcmp(arg, "-fsegment-offsets") == 0) {
+            opts->specializeSegmentOffsets = true;
+        }
+        else if (strcmp(arg, "-fcompact-prologue") == 0) {
+            opts->compactPrologue = true;
+        }
+        else if (strcmp(arg, "-fcost-model=speed") == 0) {
+            opts->costModel = COST_MODEL_SPEED;
+        }
+        else if (strcmp(arg, "-fcost-model=size") == 0) {
+            opts->costModel = COST_MODEL_SIZE;
+        }
+        else if (strcmp(arg, "-fsp-batching") == 0) {
+            opts->batchStackPointer = true;
+        }
+        else if (strcmp(arg, "-ftos-cache") == 0) {
+            opts->cacheTopOfStack = true;
+        }
+        else if (strcmp(arg, "-ftail-calls") == 0) {
+            opts->tailCalls = true;
+        }
+        else if (strcmp(arg, "-fintrinsics") == 0) {
+            opts->intrinsics = true;
+        }
+        else if (strcmp(arg, "-farray-idioms") == 0) {
+            opts->arrayIdioms = true;
+        }
+        else if (strcmp(arg, "-fcontrol-flow") == 0) {
+            opts->controlFlow = true;
+        }
+        else if (strcmp(arg, "-fconstant-folding") == 0) {
+            opts->constantFolding = true;
+        }
+        else if (strcmp(arg, "-fdead-stores") == 0) {
+            opts->deadStores = true;
+        }
+        else if (strcmp(arg, "-finline") == 0) {
+            opts->inlineFunctions = true;
+        }
+        else if (strncmp(arg, "-finline-limit=", strlen("-finline-limit=")) == 0) {
+            const char* value = arg + strlen("-finline-limit=");
+            char* endPtr = NULL;
+            long limit = strtol(value, &endPtr, 10);
+            if (*value == '\0' || *endPtr != '\0' || limit < 0) {
+                logError(ERR_UNKNOWN_OPTION, arg);
+                return ERR_UNKNOWN_OPTION;
+            }
+            opts->inlineLimit = limit;
+        }
+        else if (strncmp(arg, "-j", strlen("-j")) == 0) {
+            const char* value = arg + strlen("-j");
+            char* endPtr = NULL;
+            long jobs = strtol(value, &endPtr, 10);
+            if (*value == '\0' || *endPtr != '\0' || jobs < 1) {
+                logError(ERR_UNKNOWN_OPTION, arg);
+                return ERR_UNKNOWN_OPTION;
+            }
+            opts->jobs = jobs;
+        }
+        else if (strcmp(arg, "-freduced-frames") == 0) {
+            opts->reducedFrames = true;
+        }
+        else if (strcmp(arg, "-fstatic-frames") == 0) {
+            opts->staticFrames = true;
+        }
+        else if (strcmp(arg, "-c") == 0) {
+            opts->emitObject = true;
+        }
+        else if (strcmp(arg, "-foutline") == 0) {
+            opts->outline = true;
+        }
+        else if (strcmp(arg, "--emit-binary") == 0) {
+            opts->emitBinary = true;
+        }
+        else if (strncmp(arg, "--read-ahead=", strlen("--read-ahead=")) == 0) {
+            const char* value = arg + strlen("--read-ahead=");
+            char* endPtr = NULL;
+            long files = strtol(value, &endPtr, 10);
+            if (*value == '\0' || *endPtr != '\0' || files < 0) {
+                logError(ERR_UNKNOWN_OPTION, arg);
+                return ERR_UNKNOWN_OPTION;
+            }
+            opts->readAheadFiles = files;
+        }
+        else if (strncmp(arg, "--read-ahead-bytes=", strlen("--read-ahead-bytes=")) == 0) {
+            const char* value = arg + strlen("--read-ahead-bytes=");
+            char* endPtr = NULL;
+            long bytes = strtol(value, &endPtr, 10);
+            if (*endPtr == 'k' || *endPtr == 'K') {
+                bytes *= 1024;
+                endPtr++;
+            }
+            else if (*endPtr == 'm' || *endPtr == 'M') {
+                bytes *= 1024 * 1024;
+                endPtr++;
+            }
+            if (*value == '\0' || *endPtr != '\0' || bytes < 1) {
+                logError(ERR_UNKNOWN_OPTION, arg);
+                return ERR_UNKNOWN_OPTION;
+            }
+            opts->readAheadBytes = bytes;
+        }
+        else if (strncmp(arg, "--profile-generate=", strlen("--profile-generate=")) == 0 &&
+                 arg[strlen("--profile-generate=")] != '\0') {
+            opts->profileGenerate = arg + strlen("--profile-generate=");
+        }
+        else if (strncmp(arg, "--profile-use=", strlen("--profile-use=")) == 0 &&
+                 arg[strlen("--profile-use=")] != '\0') {
+            opts->profileUse = arg + strlen("--profile-use=");
+        }
+        else if (strcmp(arg, "--pipeline") == 0) {
+            opts->pipeline = true;
+        }
+        else if (strcmp(arg, "--frame-report") == 0) {
+            opts->frameReport = true;
+        }
+        else if (strcmp(arg, "--stack-report") == 0) {
+            opts->stackReport = true;
+        }
+        else if (strcmp(arg, "--outline-report") == 0) {
+            opts->outlineReport = true;
+        }
+        else if (strcmp(arg, "--stats") == 0) {
+            opts->stats = true;
+        }
+        else if (strcmp(arg, "--pass-report") == 0) {
+            opts->passReport = true;
+        }
+        else {
+            logError(ERR_UNKNOWN_OPTION, arg);
+            return ERR_UNKNOWN_OPTION;
+        }
+    }
+
+    if (opts->numInputPaths == 0) {
+        return ERR_NO_FILENAME_GIVEN;
+    }
+    return OK;
+}
+
+void options_close(Options* opts)
+{
+    free(opts->inputPaths);
+    opts->inputPaths = NULL;
+    opts->numInputPaths = 0;
+}
+
+void options_printUsage(const char* progName)
+{
+    printf("Use %s [options] <file_path>...\n", progName);
+    printf("Each .vm file, and each directory, is translated into its own .asm file\n");
+    printf("Options:\n");
+    printf("  -r                  Also translate every directory below the given ones that\n");
+    printf("                      holds .vm files, each into its own .asm file\n");
+    printf("  -O0                 Plain translation (default)\n");
+    printf("  -O1                 -fsegment-offsets -fcompact-prologue -fsp-batching -ftos-cache\n");
+    printf("                      -fcontrol-flow -fconstant-folding -fdead-stores\n");
+    printf("                      -farray-idioms\n");
+    printf("  -O2                 -O1 and -ftail-calls -finline -freduced-frames -fstatic-frames\n");
+    printf("  -Os                 -O1 and -ftail-calls -freduced-frames -fstatic-frames -foutline\n");
+    printf("                      -fcost-model=size\n");
+    printf("  -c                  Write an object module (.vmo) to link later. The .vmo files\n");
+    printf("                      found in the input directory are linked into the program\n");
+    printf("  -fsegment-offsets   Specialized push/pop code for small segment offsets\n");
+    printf("  -fcompact-prologue  Pick the cheapest local zeroing code for each function\n");
+    printf("  -fcost-model=speed|size\n");
+    printf("                      Whether code size choices favour cycles or ROM words\n");
+    printf("  -fsp-batching       Update SP once per basic block instead of once per command\n");
+    printf("  -ftos-cache         Keep the top of the stack in D within basic blocks\n");
+    printf("  -ftail-calls        Reuse the current frame for calls directly followed by return\n");
+    printf("  -fintrinsics        Write Math.multiply/divide and Memory.peek/poke inline,\n");
+    printf("                      assuming the standard OS semantics\n");
+    printf("  -farray-idioms      Fused code for the array loads and stores of the Jack compiler\n");
+    printf("  -fcontrol-flow      Thread jumps, invert branches over gotos and rotate loops\n");
+    printf("  -fconstant-folding  Fold arithmetic on constants and propagate constants stored\n");
+    printf("                      in segments within basic blocks\n");
+    printf("  -fdead-stores       Remove stores to locals, arguments and temp that are never\n");
+    printf("                      read, with the code computing the stored value\n");
+    printf("  -finline            Inline small leaf functions at their call sites\n");
+    printf("  -finline-limit=n    Largest body, in VM commands, that -finline inlines (default %d)\n",
+           DEFAULT_INLINE_LIMIT);
+    printf("  -freduced-frames    Only save the THIS/THAT pointers a callee writes\n");
+    printf("  -fstatic-frames     Fixed RAM slots for the locals of non-recursive functions\n");
+    printf("  -foutline           Share repeated instruction sequences as subroutines\n");
+    printf("  -j<n>               Parse and translate large files on n threads. Labels are\n");
+    printf("                      numbered per function, so the code doesn't depend on n\n");
+    printf("  --pipeline          Translate the commands on another thread while parsing,\n");
+    printf("                      when no option needs the whole program first\n");
+    printf("  --read-ahead=n      Read the next n .vm files on another thread while parsing\n");
+    printf("  --read-ahead-bytes=n[k|m]\n");
+    printf("                      Memory for the files read ahead (default 16m)\n");
+    printf("  --profile-generate=<file>\n");
+    printf("                      Run the program on a VM emulator before optimizing it and\n");
+    printf("                      write how often each function, call and branch ran\n");
+    printf("  --profile-use=<file>\n");
+    printf("                      Inline hot calls, write cold functions compactly and lay\n");
+    printf("                      out branches by the counts of --profile-generate\n");
+    printf("  --stack-report      Print the maximum stack depth of every function\n");
+    printf("  --frame-report      Print the frames chosen by -freduced-frames and -fstatic-frames\n");
+    printf("  --outline-report    Print the sequences outlined by -foutline and the words saved\n");
+    printf("  --pass-report       Print the time of every optimization pass and the size of the\n");
+    printf("                      program before and after it\n");
+    printf("  --stats             Print the allocations and the peak memory of the translation\n");
+    printf("  --emit-binary       Write the parsed program as binary VM code (.vmb) instead of\n");
+    printf("                      translating it\n");
+}
@@ -0,0 +1,100 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "errorHandler.h"
+
+#define DEFAULT_INLINE_LIMIT    12  // VM commands in the body of an inlined function
+#define DEFAULT_READ_AHEAD_BYTES    (16L * 1024 * 1024) // Input read ahead at most
+
+typedef struct Profile Profile;
+
+typedef enum {
+    COST_MODEL_SPEED,   // Prefer fewer executed instructions
+    COST_MODEL_SIZE     // Prefer fewer ROM words
+} CostModel;
+
+/// Option sets of -O<level>, see options_setLevel()
+typedef enum {
+    OPT_LEVEL_0,        // -O0, the plain translation
+    OPT_LEVEL_1,        // -O1, code generation and cleanup that cost no size
+    OPT_LEVEL_2,        // -O2, everything that saves cycles
+    OPT_LEVEL_SIZE      // -Os, everything that saves ROM words
+} OptLevel;
+
+typedef struct Options {
+    const char** inputPaths;        // Files and directories given on the command line
+    size_t numInputPaths;
+    bool recursive;                 // -r
+    bool specializeSegmentOffsets;  // -fsegment-offsets
+    bool compactPrologue;           // -fcompact-prologue
+    CostModel costModel;            // -fcost-model=speed|size
+    bool batchStackPointer;         // -fsp-batching
+    bool stackReport;               // --stack-report
+    bool cacheTopOfStack;           // -ftos-cache
+    bool tailCalls;                 // -ftail-calls
+    bool intrinsics;                // -fintrinsics
+    bool arrayIdioms;               // -farray-idioms
+    bool controlFlow;               // -fcontrol-flow
+    bool constantFolding;           // -fconstant-folding
+    bool deadStores;                // -fdead-stores
+    bool inlineFunctions;           // -finline
+    long inlineLimit;               // -finline-limit=n
+    bool reducedFrames;             // -freduced-frames
+    bool staticFrames;              // -fstatic-frames
+    bool frameReport;               // --frame-report
+    bool stats;                     // --stats
+    bool passReport;                // --pass-report
+    OptLevel optLevel;              // -O0, -O1, -O2 or -Os given last
+    bool outline;                   // -foutline
+    bool outlineReport;             // --outline-report
+    bool emitObject;                // -c
+    bool emitBinary;                // --emit-binary
+    long jobs;                      // -j<n>, 0 when not given
+    bool pipeline;                  // --pipeline
+    long readAheadFiles;            // --read-ahead=n, 0 when not given
+    long readAheadBytes;            // --read-ahead-bytes=n[k|m]
+    const char* profileGenerate;    // --profile-generate=<file>
+    const char* profileUse;         // --profile-use=<file>
+    const Profile* profile;         // Counts loaded from profileUse, see
+                                    // profile_load(). NULL without a profile
+    FILE* reportFile;               // Where the reports and notes are printed,
+                                    // NULL (the default) prints nothing. The
+                                    // executable sets stdout
+} Options;
+
+/// @brief Fills the given options object with the default values, which
+/// generate the same code as the plain (unoptimized) translator
+/// @param opts Pointer to an options object
+void options_setDefaults(Options* opts);
+
+/// @brief Sets the options of an optimization level, clearing the ones of
+/// the other levels. Options given after -O<level> on the command line
+/// add to it
+void options_setLevel(Options* opts, OptLevel level);
+
+/// @brief Parses the command line arguments into the given options object.
+/// At least one non-option argument (an input path) is expected.
+/// @param opts Pointer to an options object
+/// @param argc Argument count as received by main()
+/// @param argv Argument vector as received by main()
+ErrorCode options_parse(Options* opts, int argc, char* argv[]);
+
+/// @brief Frees the list of input paths
+void options_close(Options* opts);
+
+/// @brief Prints the command line usage to STDOUT
+/// @param progName Name of the executable (argv[0])
+void options_printUsage(const char* progName);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // OPTIONS_H
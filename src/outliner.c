@@ -0,0 +1,633 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "errorHandler.h"
+#include "outliner.h"
+#include "program.h"
+
+#define RETURN_ON_ERR(err)    ({ErrorCode e = err; if (e != OK) return (e);})
+
+#define OUTLINED_LABEL              "__OUTLINED"
+#define OUTLINE_RETURN_LABEL        "__OUTLINE_RET"
+#define OUTLINE_RETURN_VARIABLE     "__OUTLINE_RET"
+
+// ROM words of a use and of the entry and exit of the shared copy
+#define PLAIN_SITE_WORDS            (2)  // @seq, 0;JMP
+#define RETURNING_SITE_WORDS        (4)  // @ret, D=A, @seq, 0;JMP
+#define RETURNING_OVERHEAD_WORDS    (5)  // Saving D, then @var, A=M, 0;JMP
+#define MIN_SEQUENCE_LENGTH         (3)
+
+typedef enum {
+    LINE_INSTRUCTION,
+    LINE_LABEL,
+    LINE_OTHER,              // Comments and blank lines
+} LineKind;
+
+typedef struct AsmLine {
+    const char* text;        // Line as written, without the newline
+    LineKind kind;
+    size_t token;            // Index in the token stream, for instructions and labels
+} AsmLine;
+
+/// Instructions and labels, each mapped to an integer. Identical instructions
+/// share their number while every label gets its own, so that no repeated
+/// sequence contains a label
+typedef struct TokenStream {
+    size_t* lines;           // Index in the line array of every token
+    size_t* ids;
+    size_t numTokens;
+    size_t numIds;
+    bool* isAInstruction;
+    bool* isUnconditionalJump;
+    size_t* nextReadD;       // First token at or after each one reading D
+    size_t* nextWriteD;      // First token at or after each one writing D
+} TokenStream;
+
+/// Run of suffixes in the suffix array sharing a prefix of the given length
+typedef struct Candidate {
+    size_t first;
+    size_t last;
+    size_t length;
+    long bound;              // Words saved if every occurrence could be used
+} Candidate;
+
+typedef struct Outlined {
+    size_t start;            // First token of the copy kept
+    size_t length;
+    bool returns;            // Whether the copy returns with a computed jump
+    size_t numSites;
+} Outlined;
+
+typedef struct OutlineState {
+    TokenStream tokens;
+    size_t* suffixes;
+    size_t* lcp;
+    bool* claimed;
+    long* siteOf;            // Outlined sequence starting at each token, or -1
+    Outlined* outlined;
+    size_t numOutlined;
+} OutlineState;
+
+// Local function prototypes
+static ErrorCode splitLines(char* asmText, size_t length, AsmLine** lines, size_t* numLines);
+static ErrorCode buildTokens(AsmLine* lines, size_t numLines, TokenStream* tokens);
+static ErrorCode buildSuffixArray(const size_t* ids, size_t n, size_t numIds, size_t* suffixes);
+static ErrorCode buildLcp(const size_t* ids, const size_t* suffixes, size_t n, size_t* lcp);
+static ErrorCode collectCandidates(const OutlineState* st, Candidate** candidates, size_t* numCandidates);
+static ErrorCode outlineCandidate(OutlineState* st, const Candidate* cand);
+static long selectSites(const OutlineState* st, const size_t* positions, size_t count, size_t length,
+                        bool returns, bool checkNext, bool* selected);
+static void writeOutput(const OutlineState* st, const AsmLine* lines, size_t numLines, FILE* out);
+static void normalize(const char* line, char* buffer, size_t size);
+static bool readsD(const char* instr);
+static bool writesD(const char* instr);
+static long sequenceBenefit(size_t length, size_t sites, bool returns);
+static int compareCandidates(const void* a, const void* b);
+static int compareSizes(const void* a, const void* b);
+static void tokens_close(TokenStream* tokens);
+
+// ---------------------------- PUBLIC FUNCTIONS --------------------------- //
+ErrorCode outliner_run(char* asmText, size_t length, FILE* out, OutlineStats* stats)
+{
+    AsmLine* lines = NULL;
+    size_t numLines = 0;
+    RETURN_ON_ERR(splitLines(asmText, length, &lines, &numLines));
+
+    OutlineState st = { 0 };
+    ErrorCode err = buildTokens(lines, numLines, &st.tokens);
+    size_t n = st.tokens.numTokens;
+    if (err == OK) {
+        st.suffixes = malloc((n + 1) * sizeof(size_t));
+        st.lcp = malloc((n + 1) * sizeof(size_t));
+        st.claimed = calloc(n + 1, sizeof(bool));
+        st.siteOf = malloc((n + 1) * sizeof(long));
+        st.outlined = malloc((n / MIN_SEQUENCE_LENGTH + 1) * sizeof(Outlined));
+        if (st.suffixes == NULL || st.lcp == NULL || st.claimed == NULL || st.siteOf == NULL ||
+            st.outlined == NULL) {
+            logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+            err = ERR_PROG_OUT_OF_MEMORY;
+        }
+    }
+    if (err == OK) {
+        for (size_t i = 0; i < n; i++) st.siteOf[i] = -1;
+        err = buildSuffixArray(st.tokens.ids, n, st.tokens.numIds, st.suffixes);
+    }
+    if (err == OK) {
+        err = buildLcp(st.tokens.ids, st.suffixes, n, st.lcp);
+    }
+
+    Candidate* candidates = NULL;
+    size_t numCandidates = 0;
+    if (err == OK) {
+        err = collectCandidates(&st, &candidates, &numCandidates);
+    }
+    if (err == OK) {
+        // Most promising first, each later one only gets what is left
+        qsort(candidates, numCandidates, sizeof(Candidate), compareCandidates);
+        for (size_t c = 0; c < numCandidates && err == OK; c++) {
+            err = outlineCandidate(&st, &candidates[c]);
+        }
+    }
+
+    if (err == OK) {
+        memset(stats, 0, sizeof(OutlineStats));
+        for (size_t i = 0; i < n; i++) {
+            if (lines[st.tokens.lines[i]].kind == LINE_INSTRUCTION) stats->romBefore++;
+        }
+        stats->romAfter = stats->romBefore;
+        stats->numSequences = st.numOutlined;
+        for (size_t s = 0; s < st.numOutlined; s++) {
+            const Outlined* o = &st.outlined[s];
+            stats->numSites += o->numSites;
+            stats->romAfter -= sequenceBenefit(o->length, o->numSites, o->returns);
+        }
+        writeOutput(&st, lines, numLines, out);
+    }
+
+    free(candidates);
+    free(st.suffixes);
+    free(st.lcp);
+    free(st.claimed);
+    free(st.siteOf);
+    free(st.outlined);
+    tokens_close(&st.tokens);
+    free(lines);
+    return err;
+}
+
+// -------------------------- PRIVATE FUNCTIONS ----------------------------- //
+static ErrorCode splitLines(char* asmText, size_t length, AsmLine** lines, size_t* numLines)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (asmText[i] == '\n') count++;
+    }
+    *lines = malloc((count + 2) * sizeof(AsmLine));
+    if (*lines == NULL) {
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+
+    *numLines = 0;
+    char* start = asmText;
+    char* end = asmText + length;
+    while (start < end) {
+        char* newline = memchr(start, '\n', end - start);
+        if (newline == NULL) newline = end;
+        *newline = '\0';
+
+        const char* p = start;
+        while (*p == ' ' || *p == '\t') p++;
+        AsmLine* line = &(*lines)[(*numLines)++];
+        line->text = start;
+        line->kind = (*p == '(') ? LINE_LABEL :
+                     (*p == '\0' || (p[0] == '/' && p[1] == '/')) ? LINE_OTHER : LINE_INSTRUCTION;
+        start = newline + 1;
+    }
+    return OK;
+}
+
+/// Interned instruction text, open addressing over program_hashName()
+typedef struct InternEntry {
+    char* text;
+    size_t id;
+} InternEntry;
+
+static ErrorCode buildTokens(AsmLine* lines, size_t numLines, TokenStream* tokens)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < numLines; i++) {
+        if (lines[i].kind != LINE_OTHER) n++;
+    }
+
+    size_t numBuckets = 16;
+    while (numBuckets < 2 * n) numBuckets *= 2;
+    InternEntry* buckets = calloc(numBuckets, sizeof(InternEntry));
+
+    memset(tokens, 0, sizeof(TokenStream));
+    tokens->lines = malloc((n + 1) * sizeof(size_t));
+    tokens->ids = malloc((n + 1) * sizeof(size_t));
+    tokens->isAInstruction = calloc(n + 1, sizeof(bool));
+    tokens->isUnconditionalJump = calloc(n + 1, sizeof(bool));
+    tokens->nextReadD = malloc((n + 1) * sizeof(size_t));
+    tokens->nextWriteD = malloc((n + 1) * sizeof(size_t));
+    if (buckets == NULL || tokens->lines == NULL || tokens->ids == NULL ||
+        tokens->isAInstruction == NULL || tokens->isUnconditionalJump == NULL ||
+        tokens->nextReadD == NULL || tokens->nextWriteD == NULL) {
+        free(buckets);
+        tokens_close(tokens);
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+
+    ErrorCode err = OK;
+    char instr[MAX_IDENTIFIER_LEN + 16];
+    size_t numLabels = 0;
+    for (size_t i = 0; i < numLines && err == OK; i++) {
+        if (lines[i].kind == LINE_OTHER) continue;
+
+        size_t t = tokens->numTokens++;
+        tokens->lines[t] = i;
+        lines[i].token = t;
+        if (lines[i].kind == LINE_LABEL) {
+            // Numbered from the top so they never match an instruction
+            tokens->ids[t] = n + numLabels++;
+            continue;
+        }
+
+        normalize(lines[i].text, instr, sizeof(instr));
+        const char* jump = strchr(instr, ';');
+        tokens->isAInstruction[t] = (instr[0] == '@');
+        tokens->isUnconditionalJump[t] = (jump != NULL && strcmp(jump, ";JMP") == 0);
+
+        size_t mask = numBuckets - 1;
+        size_t b = program_hashName(instr) & mask;
+        while (buckets[b].text != NULL && strcmp(buckets[b].text, instr) != 0) {
+            b = (b + 1) & mask;
+        }
+        if (buckets[b].text == NULL) {
+            buckets[b].text = strdup(instr);
+            buckets[b].id = tokens->numIds++;
+            if (buckets[b].text == NULL) {
+                logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+                err = ERR_PROG_OUT_OF_MEMORY;
+            }
+        }
+        tokens->ids[t] = buckets[b].id;
+    }
+    // Label numbers are moved right after the instruction numbers
+    for (size_t t = 0; t < tokens->numTokens; t++) {
+        if (tokens->ids[t] >= n) tokens->ids[t] = tokens->ids[t] - n + tokens->numIds;
+    }
+    tokens->numIds += numLabels;
+
+    // Labels are jump targets, so D may be read by code reached from elsewhere
+    size_t nextRead = n;
+    size_t nextWrite = n;
+    for (size_t t = tokens->numTokens; t-- > 0;) {
+        const AsmLine* line = &lines[tokens->lines[t]];
+        if (line->kind == LINE_LABEL) {
+            nextRead = t;
+        }
+        else {
+            normalize(line->text, instr, sizeof(instr));
+            if (readsD(instr)) nextRead = t;
+            if (writesD(instr)) nextWrite = t;
+        }
+        tokens->nextReadD[t] = nextRead;
+        tokens->nextWriteD[t] = nextWrite;
+    }
+
+    for (size_t b = 0; b < numBuckets; b++) {
+        free(buckets[b].text);
+    }
+    free(buckets);
+    return err;
+}
+
+/// @brief Prefix doubling, each round sorting by the rank pairs with two
+/// counting sort passes
+static ErrorCode buildSuffixArray(const size_t* ids, size_t n, size_t numIds, size_t* suffixes)
+{
+    size_t range = (numIds > n ? numIds : n) + 2;
+    size_t* rank = malloc((n + 1) * sizeof(size_t));
+    size_t* newRank = malloc((n + 1) * sizeof(size_t));
+    size_t* tmp = malloc((n + 1) * sizeof(size_t));
+    size_t* count = malloc((range + 1) * sizeof(size_t));
+    if (rank == NULL || newRank == NULL || tmp == NULL || count == NULL) {
+        free(rank);
+        free(newRank);
+        free(tmp);
+        free(count);
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+
+    // Ranks start at 1, 0 stands for the end of the stream
+    for (size_t i = 0; i < n; i++) {
+        rank[i] = ids[i] + 1;
+        suffixes[i] = i;
+    }
+
+    for (size_t k = 1; n > 0; k *= 2) {
+        // Sort by the second key, then stably by the first key
+        memset(count, 0, (range + 1) * sizeof(size_t));
+        for (size_t i = 0; i < n; i++) count[(i + k < n) ? rank[i + k] : 0]++;
+        for (size_t r = 1; r <= range; r++) count[r] += count[r - 1];
+        for (size_t i = n; i-- > 0;) tmp[--count[(i + k < n) ? rank[i + k] : 0]] = i;
+
+        memset(count, 0, (range + 1) * sizeof(size_t));
+        for (size_t i = 0; i < n; i++) count[rank[i]]++;
+        for (size_t r = 1; r <= range; r++) count[r] += count[r - 1];
+        for (size_t i = n; i-- > 0;) suffixes[--count[rank[tmp[i]]]] = tmp[i];
+
+        newRank[suffixes[0]] = 1;
+        for (size_t i = 1; i < n; i++) {
+            size_t a = suffixes[i - 1];
+            size_t b = suffixes[i];
+            size_t a2 = (a + k < n) ? rank[a + k] : 0;
+            size_t b2 = (b + k < n) ? rank[b + k] : 0;
+            newRank[b] = newRank[a] + ((rank[a] != rank[b] || a2 != b2) ? 1 : 0);
+        }
+        memcpy(rank, newRank, n * sizeof(size_t));
+        if (rank[suffixes[n - 1]] == n) break;
+    }
+
+    free(rank);
+    free(newRank);
+    free(tmp);
+    free(count);
+    return OK;
+}
+
+/// @brief Kasai's algorithm. lcp[i] is the common prefix length of the
+/// suffixes at i - 1 and i of the suffix array
+static ErrorCode buildLcp(const size_t* ids, const size_t* suffixes, size_t n, size_t* lcp)
+{
+    size_t* rank = malloc((n + 1) * sizeof(size_t));
+    if (rank == NULL) {
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+    for (size_t i = 0; i < n; i++) rank[suffixes[i]] = i;
+
+    size_t h = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (rank[i] == 0) {
+            lcp[0] = 0;
+            h = 0;
+            continue;
+        }
+        size_t j = suffixes[rank[i] - 1];
+        while (i + h < n && j + h < n && ids[i + h] == ids[j + h]) h++;
+        lcp[rank[i]] = h;
+        if (h > 0) h--;
+    }
+    free(rank);
+    return OK;
+}
+
+/// @brief Lists the runs of the suffix array sharing a prefix (the LCP
+/// intervals), with a stack over the LCP array
+static ErrorCode collectCandidates(const OutlineState* st, Candidate** candidates, size_t* numCandidates)
+{
+    size_t n = st->tokens.numTokens;
+    size_t* stackLcp = malloc((n + 2) * sizeof(size_t));
+    size_t* stackFirst = malloc((n + 2) * sizeof(size_t));
+    *candidates = malloc((n + 1) * sizeof(Candidate));
+    if (stackLcp == NULL || stackFirst == NULL || *candidates == NULL) {
+        free(stackLcp);
+        free(stackFirst);
+        free(*candidates);
+        *candidates = NULL;
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+
+    *numCandidates = 0;
+    size_t top = 0;
+    stackLcp[0] = 0;
+    stackFirst[0] = 0;
+    for (size_t i = 1; i <= n; i++) {
+        size_t value = (i < n) ? st->lcp[i] : 0;
+        size_t first = i - 1;
+        while (value < stackLcp[top]) {
+            size_t length = stackLcp[top];
+            first = stackFirst[top];
+            top--;
+            long bound = sequenceBenefit(length, i - first, false);
+            if (length >= MIN_SEQUENCE_LENGTH && bound > 0) {
+                Candidate* c = &(*candidates)[(*numCandidates)++];
+                c->first = first;
+                c->last = i - 1;
+                c->length = length;
+                c->bound = bound;
+            }
+        }
+        if (value > stackLcp[top]) {
+            top++;
+            stackLcp[top] = value;
+            stackFirst[top] = first;
+        }
+    }
+
+    free(stackLcp);
+    free(stackFirst);
+    return OK;
+}
+
+/// @brief Outlines the best prefix of a candidate at the occurrences still
+/// free: the longest one ending with an unconditional jump, the full length
+/// when the next instruction is an A-instruction, or the longest shorter
+/// prefix followed by one
+static ErrorCode outlineCandidate(OutlineState* st, const Candidate* cand)
+{
+    const TokenStream* tk = &st->tokens;
+    size_t count = cand->last - cand->first + 1;
+    size_t* positions = malloc(count * sizeof(size_t));
+    bool* selected = malloc(count * sizeof(bool));
+    bool* best = malloc(count * sizeof(bool));
+    if (positions == NULL || selected == NULL || best == NULL) {
+        free(positions);
+        free(selected);
+        free(best);
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+    memcpy(positions, &st->suffixes[cand->first], count * sizeof(size_t));
+    qsort(positions, count, sizeof(size_t), compareSizes);
+
+    // The occurrences are identical over the candidate length, so the
+    // properties of one prefix hold for every occurrence
+    size_t p0 = positions[0];
+    long bestBenefit = 0;
+    size_t bestLength = 0;
+    bool bestReturns = false;
+
+    if (tk->isAInstruction[p0]) {
+        for (size_t len = cand->length; len >= MIN_SEQUENCE_LENGTH; len--) {
+            if (tk->isUnconditionalJump[p0 + len - 1]) {
+                long benefit = selectSites(st, positions, count, len, false, false, selected);
+                if (benefit > bestBenefit) {
+                    bestBenefit = benefit;
+                    bestLength = len;
+                    bestReturns = false;
+                    memcpy(best, selected, count * sizeof(bool));
+                }
+                break;
+            }
+        }
+
+        for (size_t len = cand->length; len >= MIN_SEQUENCE_LENGTH; len--) {
+            bool deadD = tk->nextWriteD[p0] < p0 + len && tk->nextWriteD[p0] < tk->nextReadD[p0];
+            if (!deadD) break;
+            bool checkNext = (len == cand->length);
+            if (!checkNext && !tk->isAInstruction[p0 + len]) continue;
+
+            long benefit = selectSites(st, positions, count, len, true, checkNext, selected);
+            if (benefit > bestBenefit) {
+                bestBenefit = benefit;
+                bestLength = len;
+                bestReturns = true;
+                memcpy(best, selected, count * sizeof(bool));
+            }
+            if (!checkNext) break;
+        }
+    }
+
+    if (bestBenefit > 0) {
+        Outlined* o = &st->outlined[st->numOutlined];
+        o->length = bestLength;
+        o->returns = bestReturns;
+        o->numSites = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (!best[i]) continue;
+            if (o->numSites == 0) o->start = positions[i];
+            st->siteOf[positions[i]] = (long)st->numOutlined;
+            for (size_t t = positions[i]; t < positions[i] + bestLength; t++) {
+                st->claimed[t] = true;
+            }
+            o->numSites++;
+        }
+        st->numOutlined++;
+    }
+
+    free(positions);
+    free(selected);
+    free(best);
+    return OK;
+}
+
+/// @brief Picks the occurrences, in order, that overlap neither an earlier
+/// pick nor an outlined sequence
+/// @param checkNext Whether the instruction after each occurrence must be
+/// checked, as it differs between occurrences
+/// @return Words saved by outlining the picked occurrences
+static long selectSites(const OutlineState* st, const size_t* positions, size_t count, size_t length,
+                        bool returns, bool checkNext, bool* selected)
+{
+    const TokenStream* tk = &st->tokens;
+    size_t sites = 0;
+    size_t freeFrom = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t p = positions[i];
+        selected[i] = false;
+        if (p < freeFrom || (checkNext && (p + length >= tk->numTokens || !tk->isAInstruction[p + length]))) {
+            continue;
+        }
+        bool isFree = true;
+        for (size_t t = p; t < p + length && isFree; t++) {
+            isFree = !st->claimed[t];
+        }
+        if (isFree) {
+            selected[i] = true;
+            freeFrom = p + length;
+            sites++;
+        }
+    }
+    return (sites >= 2) ? sequenceBenefit(length, sites, returns) : 0;
+}
+
+static void writeOutput(const OutlineState* st, const AsmLine* lines, size_t numLines, FILE* out)
+{
+    const TokenStream* tk = &st->tokens;
+    unsigned long returnCounter = 0;
+
+    for (size_t i = 0; i < numLines; i++) {
+        const AsmLine* line = &lines[i];
+        long seq = (line->kind != LINE_OTHER) ? st->siteOf[line->token] : -1;
+        if (seq < 0) {
+            fprintf(out, "%s\n", line->text);
+            continue;
+        }
+
+        const Outlined* o = &st->outlined[seq];
+        fprintf(out, "// outlined sequence %ld\n", seq);
+        if (o->returns) {
+            fprintf(out, "    @%s_%lu\n    D=A\n", OUTLINE_RETURN_LABEL, returnCounter);
+        }
+        fprintf(out, "    @%s_%ld\n    0; JMP\n", OUTLINED_LABEL, seq);
+        if (o->returns) {
+            fprintf(out, "(%s_%lu)\n", OUTLINE_RETURN_LABEL, returnCounter++);
+        }
+        // Skip the rest of the occurrence, with the comments inside it
+        i = tk->lines[line->token + o->length - 1];
+    }
+
+    for (size_t s = 0; s < st->numOutlined; s++) {
+        const Outlined* o = &st->outlined[s];
+        fprintf(out, "\n// Outlined sequence %zu, %zu uses\n(%s_%zu)\n", s, o->numSites, OUTLINED_LABEL, s);
+        if (o->returns) {
+            fprintf(out, "    @%s\n    M=D\n", OUTLINE_RETURN_VARIABLE);
+        }
+        for (size_t t = o->start; t < o->start + o->length; t++) {
+            fprintf(out, "%s\n", lines[tk->lines[t]].text);
+        }
+        if (o->returns) {
+            fprintf(out, "    @%s\n    A=M\n    0; JMP\n", OUTLINE_RETURN_VARIABLE);
+        }
+    }
+}
+
+/// @brief Copies an instruction without blanks and trailing comment
+static void normalize(const char* line, char* buffer, size_t size)
+{
+    size_t len = 0;
+    for (const char* p = line; *p != '\0' && len + 1 < size; p++) {
+        if (p[0] == '/' && p[1] == '/') break;
+        if (*p != ' ' && *p != '\t' && *p != '\r') buffer[len++] = *p;
+    }
+    buffer[len] = '\0';
+}
+
+static bool readsD(const char* instr)
+{
+    if (instr[0] == '@') return false;
+    const char* comp = strchr(instr, '=');
+    comp = (comp != NULL) ? comp + 1 : instr;
+    const char* jump = strchr(comp, ';');
+    size_t compLen = (jump != NULL) ? (size_t)(jump - comp) : strlen(comp);
+    return memchr(comp, 'D', compLen) != NULL;
+}
+
+static bool writesD(const char* instr)
+{
+    const char* eq = strchr(instr, '=');
+    return instr[0] != '@' && eq != NULL && memchr(instr, 'D', eq - instr) != NULL;
+}
+
+/// @return ROM words saved by sharing a sequence between the given number
+/// of uses
+static long sequenceBenefit(size_t length, size_t sites, bool returns)
+{
+    long siteWords = returns ? RETURNING_SITE_WORDS : PLAIN_SITE_WORDS;
+    long overhead = returns ? RETURNING_OVERHEAD_WORDS : 0;
+    return (long)sites * ((long)length - siteWords) - ((long)length + overhead);
+}
+
+static int compareCandidates(const void* a, const void* b)
+{
+    long ba = ((const Candidate*)a)->bound;
+    long bb = ((const Candidate*)b)->bound;
+    return (ba < bb) - (ba > bb);
+}
+
+static int compareSizes(const void* a, const void* b)
+{
+    size_t x = *(const size_t*)a;
+    size_t y = *(const size_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void tokens_close(TokenStream* tokens)
+{
+    free(tokens->lines);
+    free(tokens->ids);
+    free(tokens->isAInstruction);
+    free(tokens->isUnconditionalJump);
+    free(tokens->nextReadD);
+    free(tokens->nextWriteD);
+    memset(tokens, 0, sizeof(TokenStream));
+}
@@ -0,0 +1,34 @@
+#ifndef OUTLINER_H
+#define OUTLINER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdio.h>
+#include "errorHandler.h"
+
+typedef struct OutlineStats {
+    size_t numSequences;     // Shared copies written
+    size_t numSites;         // Occurrences replaced by a jump to a copy
+    size_t romBefore;        // Instructions before outlining
+    size_t romAfter;         // Instructions after outlining
+} OutlineStats;
+
+/// @brief Replaces instruction sequences repeated in the generated assembly
+/// with jumps to a single shared copy. Sequences ending with an unconditional
+/// jump are entered with a plain jump. Other sequences get the return address
+/// in D, so they must write D before reading it, and return with a computed
+/// jump, so the instruction following every use must be an A-instruction.
+/// Repeats are found with a suffix array of the instruction stream
+/// @param asmText Assembly written by the code writer, modified in place
+/// @param out File the outlined assembly is written to
+/// @param stats Filled with the number of outlined sequences and the code size
+ErrorCode outliner_run(char* asmText, size_t length, FILE* out, OutlineStats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // OUTLINER_H
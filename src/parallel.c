@@ -0,0 +1,332 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "codeWriter.h"
+#include "errorHandler.h"
+#include "parallel.h"
+#include "parser.h"
+#include "program.h"
+#include "threadPool.h"
+
+#define RETURN_ON_ERR(err)    ({ErrorCode e = err; if (e != OK) return (e);})
+
+#define CHUNKS_PER_JOB          (8)     // Spare chunks for the threads that finish early
+#define MIN_PARSE_CHUNK         (64 * 1024) // Bytes of text
+#define MIN_TRANSLATE_CHUNK     (512)   // Commands
+
+/// Lines of a .vm file, starting at a function command (or at the start of
+/// the file), and the commands parsed from them
+typedef struct ParseChunk {
+    uint64_t start;          // Offset in the text
+    uint64_t end;
+    uint64_t lineNumber;     // Line number of start
+    VmFile cmds;
+} ParseChunk;
+
+typedef struct ParseJob {
+    const Parser* whole;
+    ParseChunk* chunks;
+    size_t numChunks;
+    size_t capacity;
+} ParseJob;
+
+/// Commands of the program from a function command (or from the start of
+/// the program) to the start of the next chunk, which may be in another file
+typedef struct TranslateChunk {
+    size_t file;
+    size_t first;
+    size_t endFile;
+    size_t end;
+    long zeroRoutineLength;  // Shared zeroing routine entries before the chunk
+    CodeWriter writer;
+    FILE* reportFile;        // --stack-report of the chunk, printed in order
+    char* report;
+    size_t reportSize;
+} TranslateChunk;
+
+typedef struct TranslateJob {
+    const CodeWriter* cw;
+    const Program* prog;
+    TranslateChunk* chunks;
+    size_t numChunks;
+    size_t capacity;
+} TranslateJob;
+
+// Local function prototypes
+static ErrorCode splitText(ParseJob* job, long jobs);
+static ErrorCode addParseChunk(ParseJob* job, uint64_t start, uint64_t end, uint64_t lineNumber);
+static bool isFunctionLine(const char* line, uint64_t length);
+static ErrorCode parseChunk(void* context, size_t task);
+static ErrorCode joinChunks(Program* prog, const char* fileName, ParseJob* job);
+static ErrorCode splitProgram(TranslateJob* job, long jobs);
+static ErrorCode addTranslateChunk(TranslateJob* job, size_t file, size_t first, long zeroRoutineLength);
+static ErrorCode translateChunk(void* context, size_t task);
+static ErrorCode writeChunks(CodeWriter* cw, TranslateJob* job);
+
+// ---------------------------- PUBLIC FUNCTIONS --------------------------- //
+ErrorCode parallel_parseFile(Program* prog, const char* fileName, const Parser* whole, long jobs)
+{
+    ParseJob job = { .whole = whole };
+    ErrorCode err = splitText(&job, jobs);
+    if (err == OK) {
+        err = threadPool_run(jobs, job.numChunks, parseChunk, &job);
+    }
+    if (err == OK) {
+        err = joinChunks(prog, fileName, &job);
+    }
+
+    for (size_t c = 0; c < job.numChunks; c++) {
+        free(job.chunks[c].cmds.cmds);
+    }
+    free(job.chunks);
+    return err;
+}
+
+ErrorCode parallel_translate(CodeWriter* cw, const Program* prog, long jobs)
+{
+    TranslateJob job = { .cw = cw, .prog = prog };
+    ErrorCode err = splitProgram(&job, jobs);
+    if (err == OK) {
+        err = threadPool_run(jobs, job.numChunks, translateChunk, &job);
+    }
+    if (err == OK) {
+        err = writeChunks(cw, &job);
+    }
+
+    for (size_t c = 0; c < job.numChunks; c++) {
+        codeWriter_closeChunk(&job.chunks[c].writer);
+        if (job.chunks[c].reportFile != NULL) {
+            fclose(job.chunks[c].reportFile);
+        }
+        free(job.chunks[c].report);
+    }
+    free(job.chunks);
+    return err;
+}
+
+// -------------------------- PRIVATE FUNCTIONS ----------------------------- //
+
+/// @brief Splits the text of the file at function lines into chunks of at
+/// least MIN_PARSE_CHUNK bytes. Lines are only checked for a function
+/// command once the current chunk is long enough
+static ErrorCode splitText(ParseJob* job, long jobs)
+{
+    const char* text = job->whole->content;
+    uint64_t length = job->whole->contentLen;
+    uint64_t target = length / (jobs * CHUNKS_PER_JOB);
+    if (target < MIN_PARSE_CHUNK) {
+        target = MIN_PARSE_CHUNK;
+    }
+
+    uint64_t chunkStart = 0;
+    uint64_t chunkLine = 1;
+    uint64_t lineNumber = 1;
+    uint64_t pos = 0;
+    while (pos < length) {
+        const char* newline = memchr(&text[pos], '\n', length - pos);
+        uint64_t lineEnd = (newline != NULL) ? (uint64_t)(newline - text) + 1 : length;
+        if (pos - chunkStart >= target && isFunctionLine(&text[pos], lineEnd - pos)) {
+            RETURN_ON_ERR(addParseChunk(job, chunkStart, pos, chunkLine));
+            chunkStart = pos;
+            chunkLine = lineNumber;
+        }
+        lineNumber++;
+        pos = lineEnd;
+    }
+    return addParseChunk(job, chunkStart, length, chunkLine);
+}
+
+static ErrorCode addParseChunk(ParseJob* job, uint64_t start, uint64_t end, uint64_t lineNumber)
+{
+    if (job->numChunks == job->capacity) {
+        size_t newCapacity = (job->capacity == 0) ? 16 : job->capacity * 2;
+        ParseChunk* newChunks = realloc(job->chunks, newCapacity * sizeof(ParseChunk));
+        if (newChunks == NULL) {
+            logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+            return ERR_PROG_OUT_OF_MEMORY;
+        }
+        job->chunks = newChunks;
+        job->capacity = newCapacity;
+    }
+    ParseChunk* chunk = &job->chunks[job->numChunks++];
+    memset(chunk, 0, sizeof(ParseChunk));
+    chunk->start = start;
+    chunk->end = end;
+    chunk->lineNumber = lineNumber;
+    return OK;
+}
+
+/// @return Whether the line holds a function command, like the parser
+/// recognizes them after the leading whitespace
+static bool isFunctionLine(const char* line, uint64_t length)
+{
+    uint64_t i = 0;
+    while (i < length && (line[i] == ' ' || line[i] == '\t')) {
+        i++;
+    }
+    return (length - i > strlen("function")) &&
+           (strncmp(&line[i], "function", strlen("function")) == 0) &&
+           (line[i + strlen("function")] == ' ' || line[i + strlen("function")] == '\t');
+}
+
+static ErrorCode parseChunk(void* context, size_t task)
+{
+    ParseJob* job = context;
+    ParseChunk* chunk = &job->chunks[task];
+    Parser p;
+    parser_newView(&p, job->whole, chunk->start, chunk->end, chunk->lineNumber);
+
+    while (parser_hasMoreCommands(&p)) {
+        RETURN_ON_ERR(parser_advance(&p));
+        if (p.currCmd.type != CMD_END) {
+            RETURN_ON_ERR(vmFile_append(&chunk->cmds, &p.currCmd));
+        }
+    }
+    parser_close(&p);
+    return OK;
+}
+
+/// @brief Adds the file to the program with the commands of every chunk
+static ErrorCode joinChunks(Program* prog, const char* fileName, ParseJob* job)
+{
+    RETURN_ON_ERR(program_addFile(prog, fileName));
+    VmFile* file = &prog->files[prog->numFiles - 1];
+
+    size_t numCmds = 0;
+    for (size_t c = 0; c < job->numChunks; c++) {
+        numCmds += job->chunks[c].cmds.numCmds;
+    }
+    RETURN_ON_ERR(vmFile_reserve(file, numCmds));
+    for (size_t c = 0; c < job->numChunks; c++) {
+        const VmFile* cmds = &job->chunks[c].cmds;
+        memcpy(&file->cmds[file->numCmds], cmds->cmds, cmds->numCmds * sizeof(Command));
+        file->numCmds += cmds->numCmds;
+    }
+    return OK;
+}
+
+/// @brief Splits the program at function commands into chunks of at least
+/// MIN_TRANSLATE_CHUNK commands. The compact prologues of the functions
+/// before a chunk decide how long the shared zeroing routine is when the
+/// chunk starts, which its own prologues depend on
+static ErrorCode splitProgram(TranslateJob* job, long jobs)
+{
+    const Program* prog = job->prog;
+    size_t numCmds = 0;
+    for (size_t f = 0; f < prog->numFiles; f++) {
+        numCmds += prog->files[f].numCmds;
+    }
+    size_t target = numCmds / (jobs * CHUNKS_PER_JOB);
+    if (target < MIN_TRANSLATE_CHUNK) {
+        target = MIN_TRANSLATE_CHUNK;
+    }
+
+    long zeroRoutineLength = job->cw->zeroRoutineLength;
+    size_t chunkSize = 0;
+    RETURN_ON_ERR(addTranslateChunk(job, 0, 0, zeroRoutineLength));
+    for (size_t f = 0; f < prog->numFiles; f++) {
+        const VmFile* file = &prog->files[f];
+        for (size_t i = 0; i < file->numCmds; i++) {
+            if (file->cmds[i].type == CMD_FUNCTION) {
+                if (chunkSize >= target) {
+                    RETURN_ON_ERR(addTranslateChunk(job, f, i, zeroRoutineLength));
+                    chunkSize = 0;
+                }
+                zeroRoutineLength = codeWriter_prologueRoutineLength(job->cw->opts, zeroRoutineLength,
+                                                                     &file->cmds[i]);
+            }
+            chunkSize++;
+        }
+    }
+
+    // Each chunk ends where the next one starts, the last one at the end
+    for (size_t c = 0; c + 1 < job->numChunks; c++) {
+        job->chunks[c].endFile = job->chunks[c + 1].file;
+        job->chunks[c].end = job->chunks[c + 1].first;
+    }
+    job->chunks[job->numChunks - 1].endFile = prog->numFiles;
+    job->chunks[job->numChunks - 1].end = 0;
+    return OK;
+}
+
+static ErrorCode addTranslateChunk(TranslateJob* job, size_t file, size_t first, long zeroRoutineLength)
+{
+    if (job->numChunks == job->capacity) {
+        size_t newCapacity = (job->capacity == 0) ? 16 : job->capacity * 2;
+        TranslateChunk* newChunks = realloc(job->chunks, newCapacity * sizeof(TranslateChunk));
+        if (newChunks == NULL) {
+            logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+            return ERR_PROG_OUT_OF_MEMORY;
+        }
+        job->chunks = newChunks;
+        job->capacity = newCapacity;
+    }
+    TranslateChunk* chunk = &job->chunks[job->numChunks++];
+    memset(chunk, 0, sizeof(TranslateChunk));
+    chunk->file = file;
+    chunk->first = first;
+    chunk->zeroRoutineLength = zeroRoutineLength;
+    return OK;
+}
+
+static ErrorCode translateChunk(void* context, size_t task)
+{
+    TranslateJob* job = context;
+    TranslateChunk* chunk = &job->chunks[task];
+    const Program* prog = job->prog;
+    const Command endOfFile = { .type = CMD_END };
+
+    FILE* reportFile = job->cw->reportFile;
+    if (job->cw->opts->stackReport && job->cw->reportFile != NULL) {
+        chunk->reportFile = open_memstream(&chunk->report, &chunk->reportSize);
+        if (chunk->reportFile == NULL) {
+            logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+            return ERR_PROG_OUT_OF_MEMORY;
+        }
+        reportFile = chunk->reportFile;
+    }
+    CodeWriter* writer = &chunk->writer;
+    RETURN_ON_ERR(codeWriter_newChunk(writer, job->cw, reportFile, chunk->zeroRoutineLength));
+
+    size_t f = chunk->file;
+    size_t i = chunk->first;
+    if (f < prog->numFiles) {
+        RETURN_ON_ERR(codeWriter_setCurrentFileName(writer, prog->files[f].fileName));
+    }
+    while (f < chunk->endFile || (f == chunk->endFile && i < chunk->end)) {
+        const VmFile* file = &prog->files[f];
+        if (i < file->numCmds) {
+            RETURN_ON_ERR(codeWriter_translateCmd(writer, &file->cmds[i]));
+            i++;
+            continue;
+        }
+        RETURN_ON_ERR(codeWriter_translateCmd(writer, &endOfFile));
+        f++;
+        i = 0;
+        if (f < chunk->endFile || (f == chunk->endFile && chunk->end > 0)) {
+            RETURN_ON_ERR(codeWriter_setCurrentFileName(writer, prog->files[f].fileName));
+        }
+    }
+
+    if (task + 1 < job->numChunks) {
+        codeWriter_endChunk(writer);
+    }
+    return OK;
+}
+
+/// @brief Writes the code and the stack reports of the chunks in order
+static ErrorCode writeChunks(CodeWriter* cw, TranslateJob* job)
+{
+    for (size_t c = 0; c < job->numChunks; c++) {
+        TranslateChunk* chunk = &job->chunks[c];
+        if (chunk->reportFile != NULL) {
+            fclose(chunk->reportFile);
+            chunk->reportFile = NULL;
+            fwrite(chunk->report, 1, chunk->reportSize, cw->reportFile);
+        }
+        RETURN_ON_ERR(codeWriter_appendChunk(cw, &chunk->writer, c + 1 == job->numChunks));
+    }
+    return OK;
+}
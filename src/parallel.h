@@ -0,0 +1,32 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "codeWriter.h"
+#include "errorHandler.h"
+#include "parser.h"
+#include "program.h"
+
+/// @brief Parses a .vm file on the given number of threads and adds it to
+/// the program. A pre-scan splits the text at function commands into
+/// chunks, which are parsed separately and joined in source order
+/// @param whole Parser opened on the file, not advanced yet. It is left
+/// open, as the chunks are parsed from its content
+ErrorCode parallel_parseFile(Program* prog, const char* fileName, const Parser* whole, long jobs);
+
+/// @brief Translates every file of the program on the given number of
+/// threads, like translating each command in order followed by a CMD_END
+/// at the end of each file. The program is split at function commands into
+/// chunks, each translated into memory by its own code writer, and the code
+/// is written in source order. Labels are numbered per function with -j, so
+/// the result doesn't depend on the number of threads
+ErrorCode parallel_translate(CodeWriter* cw, const Program* prog, long jobs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PARALLEL_H
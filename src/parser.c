@@ -18,20 +18,18 @@
 #define IF_GOTO_STRLEN  (7)
 
 // Local function prototypes
-static ErrorCode readInputFile(Parser* p, const char* fileName);
+static ErrorCode readInputFile(Parser* p, const char* fileName, Arena* arena);
 static ErrorCode parser_parseComment(Parser* p);
 static ErrorCode parser_parseArg(Parser* p, int arg);
 static ErrorCode parser_parseOneArgCommand(Parser* p, CommandType cmdType);
 static ErrorCode parser_parseTwoArgCommand(Parser* p, CommandType cmdType);
 static bool isEOF(Parser* p);
 static bool isEOL(Parser* p);
-static uint32_t str2int(const char* str, size_t len);
 static void parser_trimLeft(Parser* p);
 static void parser_trimLeftInline(Parser *p);
 static void parser_consumeChar(Parser* p);
 static bool isSpace(const char c);
 static bool isInlineSpace(const char c);
-static bool isValidSymbolStart(const char c);
 static bool isValidSymbolChar(const char c);
 static bool lineStartsWith(Parser* p, const char* str);
 
@@ -46,25 +44,73 @@ const char* commandKeywords[CMD_MAX_COMMANDS] = {
     "function", // CMD_FUNCTION
     "return",   // CMD_RETURN
     "call",     // CMD_CALL
+    "",         // CMD_TAIL_CALL
+    "",         // CMD_TAIL_JUMP
+    "",         // CMD_IF_NOT
+    "",         // CMD_INTRINSIC
+    "",         // CMD_ARRAY_LOAD
+    "",         // CMD_ARRAY_STORE
+    "",         // CMD_LIGHT_CALL
+    "",         // CMD_LIGHT_RETURN
+    "",         // CMD_CLEAR_FRAME
+    "",         // CMD_DISCARD
     ""          // CMD_END
 };
 
 // ---------------------------- PUBLIC FUNCTIONS --------------------------- //
 ErrorCode parser_new(Parser* p, const char* fileName)
+{
+    return parser_newInArena(p, fileName, NULL);
+}
+
+ErrorCode parser_newInArena(Parser* p, const char* fileName, Arena* arena)
 {
     ErrorCode err;
-    err = readInputFile(p, fileName);
+    err = readInputFile(p, fileName, arena);
     if (err != OK) return err;
 
     p->contentLen = strlen(p->content);
     p->lineNumber = 1;
     p->cursor = 0;
+    p->isView = false;
+    p->inArena = (arena != NULL);
     p->currCmd.type = CMD_UNDEFINED;
     return OK;
 }
 
+void parser_newFromBuffer(Parser* p, char* content)
+{
+    p->content = content;
+    p->contentLen = strlen(p->content);
+    p->lineNumber = 1;
+    p->cursor = 0;
+    p->isView = false;
+    p->inArena = false;
+    p->currCmd.type = CMD_UNDEFINED;
+}
+
+void parser_newFromArena(Parser* p, const char* content)
+{
+    parser_newFromBuffer(p, (char*)content);
+    p->inArena = true;
+}
+
+void parser_newView(Parser* p, const Parser* whole, uint64_t start, uint64_t end,
+                    uint64_t lineNumber)
+{
+    memset(p, 0, sizeof(Parser));
+    p->content = whole->content + start;
+    p->contentLen = end - start;
+    p->lineNumber = lineNumber;
+    p->isView = true;
+    p->currCmd.type = CMD_UNDEFINED;
+}
+
 void parser_close(Parser* p)
 {
+    if (p->isView || p->inArena) {
+        p->content = NULL;
+    }
     if (p->content != NULL) {
         free((char*)p->content);
         p->content = NULL;
@@ -124,7 +170,7 @@ ErrorCode parser_advance(Parser* p)
         }
         else if (lineStartsWith(p, "return")) {
             // Return doesn't have any arguments
-            for (int i = 0; i < strlen("return"); i++) {
+            for (size_t i = 0; i < strlen("return"); i++) {
                 parser_consumeChar(p);
             }
             parser_trimLeftInline(p);
@@ -156,7 +202,7 @@ ErrorCode parser_advance(Parser* p)
 
 /// @brief This function assumes only .vm files will be passed, as that
 /// should be checked before calling parser_new()
-static ErrorCode readInputFile(Parser* p, const char* fileName)
+static ErrorCode readInputFile(Parser* p, const char* fileName, Arena* arena)
 {
     char* buffer;
     buffer = NULL;
@@ -172,7 +218,7 @@ static ErrorCode readInputFile(Parser* p, const char* fileName)
     uint64_t fsize = ftell(f);
     fseek(f, 0, SEEK_SET);
 
-    buffer = malloc(fsize + 1);
+    buffer = (arena != NULL) ? arena_alloc(arena, fsize + 1) : malloc(fsize + 1);
     if (buffer == NULL) {
         fclose(f);
         logError(ERR_PROG_OUT_OF_MEMORY, NULL);
@@ -206,25 +252,11 @@ static bool isInlineSpace(const char c)
     return c == ' ' || c == '\t' || c == '\r';
 }
 
-static bool isValidSymbolStart(const char c)
-{
-    return isalpha(c) || c == '_';
-}
-
 static bool isValidSymbolChar(const char c)
 {
     return isalnum(c) || c == '_' || c == '.' || c == '$';
 }
 
-static uint32_t str2int(const char* str, size_t len)
-{
-    uint32_t ret = 0;
-    for (int i = 0; i < len; i++) {
-        ret = ret*10 + (str[i] - '0');
-    }
-    return ret;
-}
-
 static void parser_trimLeft(Parser* p)
 {
     while (!isEOF(p) && isSpace(p->content[p->cursor])) {
@@ -8,6 +8,7 @@ extern "C" {
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include "arena.h"
 #include "errorHandler.h"
 
 #define MAX_IDENTIFIER_LEN    (120)
@@ -23,6 +24,24 @@ typedef enum {
     CMD_FUNCTION,
     CMD_RETURN,
     CMD_CALL,
+
+    // Only created by optimization passes, never parsed
+    CMD_TAIL_CALL,  // Call reusing the frame of the current function, Arg2 holds the
+                    // argument count then the one of the current function, e.g. "2 1"
+    CMD_TAIL_JUMP,  // Jump to a function whose arguments are already in place
+    CMD_IF_NOT,     // if-goto taken when the popped value is not positive
+    CMD_INTRINSIC,  // OS function written inline, Arg2 holds a folded constant operand
+    CMD_ARRAY_LOAD, // add; pop pointer 1; push that 0. Arg1 is "that" if THAT is still read
+    CMD_ARRAY_STORE,// pop temp 0; pop pointer 1; push temp 0; pop that 0. Arg1 is "that"
+                    // and Arg2 "temp" if THAT and temp 0 are still read
+    CMD_LIGHT_CALL, // Call saving LCL, ARG and only the pointers listed in Arg2 after
+                    // the argument count, e.g. "2 this"
+    CMD_LIGHT_RETURN,// Return from a function called with CMD_LIGHT_CALL, Arg1 lists
+                    // the saved pointers
+    CMD_CLEAR_FRAME,// Zeroes the Arg2 static frame slots starting at slot Arg1, which
+                    // hold the locals of a function as the "frame" segment
+    CMD_DISCARD,    // Drops the Arg2 values on top of the stack
+
     CMD_END,
 
     CMD_MAX_COMMANDS
@@ -40,6 +59,8 @@ typedef struct Parser {
     uint64_t cursor;
     uint64_t lineNumber;
     uint64_t lineStart;
+    bool isView;             // The content belongs to another parser
+    bool inArena;            // The content belongs to an arena
     Command currCmd;
 } Parser;
 
@@ -48,6 +69,28 @@ typedef struct Parser {
 /// @param fileName path to input file
 ErrorCode parser_new(Parser* p, const char* fileName);
 
+/// @brief Creates a parser like parser_new(), reading the file into memory
+/// of the given arena, which is left alone when the parser is closed. The
+/// memory can be released once the commands are parsed
+/// @param arena When NULL, the file is read into memory of its own
+ErrorCode parser_newInArena(Parser* p, const char* fileName, Arena* arena);
+
+/// @brief Creates a parser for content already read from a .vm file
+/// @param content NUL terminated text, which the parser frees when closed
+void parser_newFromBuffer(Parser* p, char* content);
+
+/// @brief Creates a parser for text allocated from an arena
+/// @param content NUL terminated text, which the parser doesn't free
+void parser_newFromArena(Parser* p, const char* content);
+
+/// @brief Creates a parser for a range of the content of another parser,
+/// which must start at the beginning of a line and end after a newline or at
+/// the end of the content. The range is not copied, so the other parser must
+/// not be closed first
+/// @param lineNumber Line number of the start of the range, for errors
+void parser_newView(Parser* p, const Parser* whole, uint64_t start, uint64_t end,
+                    uint64_t lineNumber);
+
 /// @brief Frees allocated memory
 /// @param p Pointer to a parser object
 void parser_close(Parser* p);
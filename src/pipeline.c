@@ -0,0 +1,449 @@
+#define _GNU_SOURCE          // fopencookie()
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include "arena.h"
+#include "codeWriter.h"
+#include "errorHandler.h"
+#include "optimizer.h"
+#include "parser.h"
+#include "pipeline.h"
+#include "readAhead.h"
+
+#define RETURN_ON_ERR(err)    ({ErrorCode e = err; if (e != OK) return (e);})
+
+#define COMMAND_RING_CAPACITY   (4096)      // Power of two
+#define COMMAND_BATCH           (64)        // Commands published or taken at once
+#define BLOCK_RING_CAPACITY     (16)        // Power of two, bounds the unwritten output
+#define OUTPUT_BLOCK_SIZE       (64 * 1024) // Buffer of the writer's output stream
+#define RING_SPIN_LIMIT         (64)        // Yields before a waiting thread sleeps
+#define CACHE_LINE_SIZE         (64)
+
+/// Single producer, single consumer queue of fixed size elements. Each side
+/// only stores its own index, so no lock is needed: the release store of the
+/// tail publishes the elements before it, and the one of the head gives their
+/// slots back. The indices grow without wrapping, the capacity is a power of
+/// two. The producer publishes in batches, so that the consumer sees a new
+/// tail, and the cache line holding it moves, once per batch
+typedef struct Ring {
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t head; // Next element to take
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t tail; // One past the last published element
+    _Alignas(CACHE_LINE_SIZE) size_t written;     // Producer side, one past the last
+                             // element written, published or not
+    size_t knownHead;        // Producer side, head seen last
+    const atomic_bool* stopped; // Set when the consumer gives up, it never
+                             // frees a slot then
+    atomic_int sleepers;     // Threads sleeping in ring_pause()
+    pthread_mutex_t lock;
+    pthread_cond_t wakeUp;
+    size_t batch;            // Elements written before they are published
+    size_t capacity;
+    size_t elemSize;
+    char* slots;
+} Ring;
+
+/// Part of the output of the writer thread, written to the file by the
+/// flusher thread
+typedef struct OutputBlock {
+    size_t size;
+    char data[];
+} OutputBlock;
+
+typedef struct Pipeline {
+    CodeWriter* cw;
+    char* const* fileNames;
+    size_t numFiles;
+    ReadAhead* readAhead;
+    Arena* inputArena;       // Files not read ahead, released after each one
+    Ring commands;           // Parser to writer. CMD_UNDEFINED ends the stream
+    Ring blocks;             // Writer to flusher, OutputBlock pointers. NULL
+                             // ends the stream
+    FILE* target;            // Where the flusher writes
+    atomic_bool writerStopped;  // The writer failed and takes no more commands
+    atomic_bool flusherStopped; // The flusher failed and takes no more blocks
+    ErrorCode writerError;
+    ErrorCode streamError;   // Set by the writer's stream, on the writer thread
+    ErrorCode flusherError;
+} Pipeline;
+
+// Local function prototypes
+static ErrorCode ring_new(Ring* ring, size_t capacity, size_t elemSize, size_t batch,
+                          const atomic_bool* stopped);
+static void ring_close(Ring* ring);
+static void* ring_reserve(Ring* ring);
+static void ring_commit(Ring* ring);
+static void ring_publish(Ring* ring);
+static size_t ring_wait(Ring* ring, size_t max);
+static void* ring_at(Ring* ring, size_t index);
+static void ring_release(Ring* ring, size_t count);
+static void ring_pause(Ring* ring, const atomic_size_t* index, size_t seen, long spins);
+static void ring_wake(Ring* ring);
+static ErrorCode pipeline_parse(Pipeline* p);
+static ErrorCode pipeline_parseFile(Pipeline* p, Parser* parser);
+static bool pipeline_send(Pipeline* p, const Command* cmd);
+static void* writer_run(void* arg);
+static ErrorCode writer_translate(Pipeline* p);
+static void* flusher_run(void* arg);
+static FILE* blockStream_open(Pipeline* p);
+static ssize_t blockStream_write(void* cookie, const char* data, size_t size);
+static int blockStream_close(void* cookie);
+
+// ---------------------------- PUBLIC FUNCTIONS --------------------------- //
+bool pipeline_isSupported(const Options* opts)
+{
+    return !optimizer_hasPasses(opts) && !opts->emitObject && !opts->emitBinary &&
+           opts->jobs == 0 && opts->profileGenerate == NULL;
+}
+
+ErrorCode pipeline_run(CodeWriter* cw, char* const* fileNames, size_t numFiles,
+                       ReadAhead* readAhead, Arena* inputArena)
+{
+    if (numFiles == 0) return OK;
+
+    Pipeline p = {
+        .cw = cw,
+        .fileNames = fileNames,
+        .numFiles = numFiles,
+        .readAhead = readAhead,
+        .inputArena = inputArena,
+        .writerError = OK,
+        .streamError = OK,
+        .flusherError = OK
+    };
+    atomic_init(&p.writerStopped, false);
+    atomic_init(&p.flusherStopped, false);
+    ErrorCode err = ring_new(&p.commands, COMMAND_RING_CAPACITY, sizeof(Command), COMMAND_BATCH,
+                             &p.writerStopped);
+    if (err == OK) {
+        err = ring_new(&p.blocks, BLOCK_RING_CAPACITY, sizeof(OutputBlock*), 1,
+                       &p.flusherStopped);
+    }
+    if (err != OK) {
+        ring_close(&p.commands);
+        return err;
+    }
+
+    // With -foutline the code is collected in memory, nothing to flush.
+    // Otherwise the writer gets a stream handing its full buffers over to
+    // the flusher thread, and writes to the file directly if it can't start
+    pthread_t flusher;
+    FILE* stream = NULL;
+    if (cw->targetFile == NULL) {
+        fflush(cw->outputFile);
+        p.target = cw->outputFile;
+        stream = blockStream_open(&p);
+        if (stream != NULL && pthread_create(&flusher, NULL, flusher_run, &p) != 0) {
+            fclose(stream);
+            stream = NULL;
+        }
+        if (stream != NULL) {
+            cw->outputFile = stream;
+        }
+    }
+
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, writer_run, &p) != 0) {
+        logError(ERR_PROG_OUT_OF_MEMORY, "Can't start the writer thread");
+        err = ERR_PROG_OUT_OF_MEMORY;
+    }
+    else {
+        err = pipeline_parse(&p);
+        pthread_join(writer, NULL);
+    }
+
+    // Closing the stream hands over the last block and the end of the stream
+    if (stream != NULL) {
+        fclose(stream);
+        pthread_join(flusher, NULL);
+        cw->outputFile = p.target;
+    }
+    ring_close(&p.commands);
+    ring_close(&p.blocks);
+
+    if (err != OK) return err;
+    if (p.writerError != OK) return p.writerError;
+    if (p.streamError != OK) return p.streamError;
+    return p.flusherError;
+}
+
+// -------------------------- PRIVATE FUNCTIONS ----------------------------- //
+static ErrorCode ring_new(Ring* ring, size_t capacity, size_t elemSize, size_t batch,
+                          const atomic_bool* stopped)
+{
+    memset(ring, 0, sizeof(Ring));
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->sleepers, 0);
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->wakeUp, NULL);
+    ring->stopped = stopped;
+    ring->batch = batch;
+    ring->capacity = capacity;
+    ring->elemSize = elemSize;
+    ring->slots = malloc(capacity * elemSize);
+    if (ring->slots == NULL) {
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+    return OK;
+}
+
+static void ring_close(Ring* ring)
+{
+    if (ring->stopped == NULL) return;
+    pthread_cond_destroy(&ring->wakeUp);
+    pthread_mutex_destroy(&ring->lock);
+    free(ring->slots);
+    ring->slots = NULL;
+}
+
+/// @brief Producer side. Waits for a free slot
+/// @return Slot of the next element, NULL when the consumer stopped, it
+/// never frees a slot then
+static void* ring_reserve(Ring* ring)
+{
+    for (long spins = 0; ring->written - ring->knownHead == ring->capacity; spins++) {
+        ring->knownHead = atomic_load(&ring->head);
+        if (ring->written - ring->knownHead < ring->capacity) break;
+
+        // The consumer may be waiting for the batch not published yet
+        ring_publish(ring);
+        if (atomic_load(ring->stopped)) return NULL;
+        ring_pause(ring, &ring->head, ring->knownHead, spins);
+    }
+    return ring->slots + (ring->written & (ring->capacity - 1)) * ring->elemSize;
+}
+
+/// @brief Producer side. Adds the element written in the reserved slot,
+/// publishing the batch once it is full
+static void ring_commit(Ring* ring)
+{
+    ring->written++;
+    if (ring->written - atomic_load_explicit(&ring->tail, memory_order_relaxed) >= ring->batch) {
+        ring_publish(ring);
+    }
+}
+
+static void ring_publish(Ring* ring)
+{
+    atomic_store(&ring->tail, ring->written);
+    ring_wake(ring);
+}
+
+/// @brief Consumer side. Waits for published elements. The producer always
+/// ends its stream with a marker element, so the wait is never endless
+/// @return Number of elements that can be taken, at most max
+static size_t ring_wait(Ring* ring, size_t max)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load(&ring->tail);
+    for (long spins = 0; tail == head; spins++) {
+        ring_pause(ring, &ring->tail, head, spins);
+        tail = atomic_load(&ring->tail);
+    }
+    return (tail - head < max) ? tail - head : max;
+}
+
+/// @brief Consumer side
+/// @return Element at the given position after the head
+static void* ring_at(Ring* ring, size_t index)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    return ring->slots + ((head + index) & (ring->capacity - 1)) * ring->elemSize;
+}
+
+/// @brief Consumer side. Gives the slots of the first elements back
+static void ring_release(Ring* ring, size_t count)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    atomic_store(&ring->head, head + count);
+    ring_wake(ring);
+}
+
+/// @brief Waits while the other side doesn't move the given index. The
+/// thread first yields, which is enough when the other side keeps up, and
+/// then sleeps until ring_wake(), so that a thread waiting long doesn't take
+/// processor time from the others
+/// @param spins Number of times the caller waited already
+static void ring_pause(Ring* ring, const atomic_size_t* index, size_t seen, long spins)
+{
+    if (spins < RING_SPIN_LIMIT) {
+        sched_yield();
+        return;
+    }
+    // The sleeper count is incremented before reading the index, and the
+    // other side reads the count after storing the index. Both sequentially
+    // consistent, so either this side sees the new index or the other one
+    // sees the sleeper, and it signals under the lock held until waiting
+    pthread_mutex_lock(&ring->lock);
+    atomic_fetch_add(&ring->sleepers, 1);
+    while (atomic_load(index) == seen && !atomic_load(ring->stopped)) {
+        pthread_cond_wait(&ring->wakeUp, &ring->lock);
+    }
+    atomic_fetch_sub(&ring->sleepers, 1);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/// @brief Wakes the other side if it sleeps in ring_pause(). Called after
+/// storing an index, or the stopped flag
+static void ring_wake(Ring* ring)
+{
+    if (atomic_load(&ring->sleepers) > 0) {
+        pthread_mutex_lock(&ring->lock);
+        pthread_cond_broadcast(&ring->wakeUp);
+        pthread_mutex_unlock(&ring->lock);
+    }
+}
+
+/// @brief Parses every file, sending the commands to the writer, and ends
+/// the stream, also after a parse error
+static ErrorCode pipeline_parse(Pipeline* p)
+{
+    ErrorCode err = OK;
+    for (size_t f = 0; f < p->numFiles && err == OK; f++) {
+        Parser parser;
+        memset(&parser, 0, sizeof(Parser));
+        err = readAhead_openParser(p->readAhead, &parser, p->fileNames[f], p->inputArena);
+        if (err == OK) {
+            err = pipeline_parseFile(p, &parser);
+            parser_close(&parser);
+        }
+        arena_reset(p->inputArena);
+    }
+
+    const Command endOfStream = { .type = CMD_UNDEFINED };
+    pipeline_send(p, &endOfStream);
+    ring_publish(&p->commands);
+    return err;
+}
+
+static ErrorCode pipeline_parseFile(Pipeline* p, Parser* parser)
+{
+    while (parser_hasMoreCommands(parser)) {
+        RETURN_ON_ERR(parser_advance(parser));
+        if (parser->currCmd.type != CMD_END && !pipeline_send(p, &parser->currCmd)) {
+            return OK;
+        }
+    }
+    const Command endOfFile = { .type = CMD_END };
+    pipeline_send(p, &endOfFile);
+    return OK;
+}
+
+/// @return false when the writer stopped, the rest of the input is useless
+static bool pipeline_send(Pipeline* p, const Command* cmd)
+{
+    Command* slot = ring_reserve(&p->commands);
+    if (slot == NULL) return false;
+    memcpy(slot, cmd, sizeof(Command));
+    ring_commit(&p->commands);
+    return true;
+}
+
+static void* writer_run(void* arg)
+{
+    Pipeline* p = arg;
+    p->writerError = writer_translate(p);
+    if (p->writerError != OK) {
+        atomic_store(&p->writerStopped, true);
+        ring_wake(&p->commands);
+    }
+    return NULL;
+}
+
+/// @brief Translates the commands received, switching to the next file
+/// after each CMD_END, until the end of the stream
+static ErrorCode writer_translate(Pipeline* p)
+{
+    size_t file = 0;
+    RETURN_ON_ERR(codeWriter_setCurrentFileName(p->cw, p->fileNames[file]));
+    while (true) {
+        size_t count = ring_wait(&p->commands, COMMAND_BATCH);
+        for (size_t i = 0; i < count; i++) {
+            const Command* cmd = ring_at(&p->commands, i);
+            if (cmd->type == CMD_UNDEFINED) return OK;
+
+            RETURN_ON_ERR(codeWriter_translateCmd(p->cw, cmd));
+            if (cmd->type == CMD_END && ++file < p->numFiles) {
+                RETURN_ON_ERR(codeWriter_setCurrentFileName(p->cw, p->fileNames[file]));
+            }
+        }
+        ring_release(&p->commands, count);
+    }
+}
+
+static void* flusher_run(void* arg)
+{
+    Pipeline* p = arg;
+    while (true) {
+        size_t count = ring_wait(&p->blocks, BLOCK_RING_CAPACITY);
+        for (size_t i = 0; i < count; i++) {
+            OutputBlock* block = *(OutputBlock**)ring_at(&p->blocks, i);
+            if (block == NULL) return NULL;
+
+            bool failed = (fwrite(block->data, 1, block->size, p->target) != block->size);
+            free(block);
+            if (failed) {
+                logError(ERR_CANT_OPEN_OUTFILE, NULL);
+                p->flusherError = ERR_CANT_OPEN_OUTFILE;
+                atomic_store(&p->flusherStopped, true);
+                ring_wake(&p->blocks);
+                return NULL;
+            }
+        }
+        ring_release(&p->blocks, count);
+    }
+}
+
+/// @return Stream whose full buffers are sent to the flusher, NULL if it
+/// can't be opened
+static FILE* blockStream_open(Pipeline* p)
+{
+    cookie_io_functions_t functions = {
+        .write = blockStream_write,
+        .close = blockStream_close
+    };
+    FILE* stream = fopencookie(p, "w", functions);
+    if (stream != NULL && setvbuf(stream, NULL, _IOFBF, OUTPUT_BLOCK_SIZE) != 0) {
+        fclose(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+static ssize_t blockStream_write(void* cookie, const char* data, size_t size)
+{
+    Pipeline* p = cookie;
+    OutputBlock** slot = ring_reserve(&p->blocks);
+    if (slot == NULL) {
+        // The flusher reports its own error
+        return 0;
+    }
+    OutputBlock* block = malloc(sizeof(OutputBlock) + size);
+    if (block == NULL) {
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        p->streamError = ERR_PROG_OUT_OF_MEMORY;
+        return 0;
+    }
+    block->size = size;
+    memcpy(block->data, data, size);
+    *slot = block;
+    ring_commit(&p->blocks);
+    return (ssize_t)size;
+}
+
+static int blockStream_close(void* cookie)
+{
+    Pipeline* p = cookie;
+    OutputBlock** slot = ring_reserve(&p->blocks);
+    if (slot != NULL) {
+        *slot = NULL;
+        ring_commit(&p->blocks);
+    }
+    return 0;
+}
@@ -0,0 +1,37 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "arena.h"
+#include "codeWriter.h"
+#include "errorHandler.h"
+#include "options.h"
+#include "readAhead.h"
+
+/// @return Whether the options let the files be translated while they are
+/// parsed. Optimization passes, -c, --emit-binary, -j and
+/// --profile-generate need the whole program before any code is written
+bool pipeline_isSupported(const Options* opts);
+
+/// @brief Parses and translates the given .vm files in order, like parsing
+/// them into a program and translating each command of it followed by a
+/// CMD_END at the end of each file. The calling thread parses and hands the
+/// commands, in batches, to a writer thread through a lock-free ring. Unless
+/// the code is collected in memory (-foutline), a third thread writes the
+/// output buffers of the writer to the file
+/// @param readAhead Where the parsers get the files, see readAhead_openParser()
+/// @param inputArena Where the files not read ahead are read, released after
+/// each one
+ErrorCode pipeline_run(CodeWriter* cw, char* const* fileNames, size_t numFiles,
+                       ReadAhead* readAhead, Arena* inputArena);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PIPELINE_H
@@ -0,0 +1,733 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+#include "errorHandler.h"
+#include "optimizer.h"
+#include "parser.h"
+#include "profile.h"
+#include "program.h"
+
+#define RETURN_ON_ERR(err)    ({ErrorCode e = err; if (e != OK) return (e);})
+
+#define PROFILE_KEY_SIZE        (sizeof("branch") + 3 * MAX_IDENTIFIER_LEN + 24)
+#define PROFILE_LINE_SIZE       (PROFILE_KEY_SIZE + 48)
+#define PROFILE_MAX_FIELDS      (6)
+
+// A function or call site is hot when it makes up at least 1/HOT_SHARE of
+// every call of the run, and cold below 1/COLD_SHARE
+#define HOT_SHARE               (100)
+#define COLD_SHARE              (1000)
+
+// Memory layout of the Hack platform
+#define RAM_SIZE                (32768)
+#define SP_ADDR                 (0)
+#define LCL_ADDR                (1)
+#define ARG_ADDR                (2)
+#define THIS_ADDR               (3)
+#define THAT_ADDR               (4)
+#define TEMP_ADDR               (5)
+#define STACK_BASE              (256)
+#define CALL_FRAME_SIZE         (5)
+
+#define NO_TARGET               SIZE_MAX
+#define BOOTSTRAP_RETURN        SIZE_MAX
+
+typedef enum {
+    SEGMENT_CONSTANT,
+    SEGMENT_LOCAL,
+    SEGMENT_ARGUMENT,
+    SEGMENT_THIS,
+    SEGMENT_THAT,
+    SEGMENT_POINTER,
+    SEGMENT_TEMP,
+    SEGMENT_STATIC,
+    SEGMENT_UNKNOWN
+} Segment;
+
+/// Command of the flattened program, with what running it needs decoded
+/// and the counts of the run
+typedef struct Step {
+    const Command* cmd;
+    Segment segment;         // Of push and pop
+    long value;              // Index of push and pop, argument count of
+                             // calls, local count of functions
+    size_t target;           // Step of the label or function jumped to,
+                             // NO_TARGET when the program doesn't define it
+    size_t file;             // Index in Program.files
+    size_t statics;          // Where the statics of the file start
+    uint64_t count;          // Entries, calls or taken branches
+    uint64_t notTaken;       // Branches falling through
+} Step;
+
+/// A run of the program on the VM emulator
+typedef struct Emulator {
+    Step* steps;
+    size_t numSteps;
+    uint16_t ram[RAM_SIZE];
+    uint16_t* statics;       // Static variables of every file
+    size_t* returns;         // Return steps of the active calls
+    size_t numReturns;
+    size_t returnsCapacity;
+    uint64_t executed;       // Commands run
+    bool running;
+    const char* stopReason;  // Why the run stopped before the program ended
+    const char* stopName;    // Name completing the reason, or NULL
+} Emulator;
+
+typedef struct LabelSlot {
+    const char* name;        // NULL for free slots
+    size_t step;
+} LabelSlot;
+
+// Local function prototypes
+static ErrorCode profile_add(Profile* profile, const char* key, uint64_t count,
+                             uint64_t notTaken);
+static ErrorCode profile_grow(Profile* profile);
+static ProfileEntry* profile_slot(ProfileEntry* entries, size_t capacity, const char* key);
+static ErrorCode profile_parseLine(Profile* profile, char* line, const char* fileName);
+static ProfileTemperature profile_temperature(const Profile* profile, uint64_t count);
+static void formatKey(char* key, const char* kind, const char* function, const char* target,
+                      size_t ordinal);
+static ErrorCode emulator_load(Emulator* em, const Program* prog);
+static ErrorCode emulator_resolveTargets(Emulator* em);
+static void emulator_run(Emulator* em, size_t entry);
+static void emulator_call(Emulator* em, size_t* pc, const Step* step);
+static void emulator_return(Emulator* em, size_t* pc);
+static uint16_t* emulator_segmentSlot(Emulator* em, const Step* step);
+static void emulator_push(Emulator* em, uint16_t value);
+static uint16_t emulator_pop(Emulator* em);
+static void emulator_stop(Emulator* em, const char* reason, const char* name);
+static void emulator_close(Emulator* em);
+static ErrorCode emulator_writeProfile(const Emulator* em, const char* fileName);
+static Segment decodeSegment(const char* name);
+static bool isBinaryArithmetic(const char* op);
+
+// ---------------------------- PUBLIC FUNCTIONS --------------------------- //
+void profile_new(Profile* profile)
+{
+    memset(profile, 0, sizeof(Profile));
+    arena_new(&profile->arena, DEFAULT_ARENA_BLOCK_SIZE);
+}
+
+void profile_close(Profile* profile)
+{
+    free(profile->entries);
+    arena_close(&profile->arena);
+    memset(profile, 0, sizeof(Profile));
+}
+
+ErrorCode profile_load(Profile* profile, const char* fileName)
+{
+    profile_new(profile);
+    FILE* file = fopen(fileName, "r");
+    if (file == NULL) {
+        logError(ERR_CANT_OPEN_INPUT_FILE, fileName);
+        return ERR_CANT_OPEN_INPUT_FILE;
+    }
+
+    ErrorCode err = OK;
+    char line[PROFILE_LINE_SIZE];
+    while (err == OK && fgets(line, sizeof(line), file) != NULL) {
+        if (strchr(line, '\n') == NULL && !feof(file)) {
+            logError(ERR_BAD_PROFILE_FILE, fileName);
+            err = ERR_BAD_PROFILE_FILE;
+            break;
+        }
+        err = profile_parseLine(profile, line, fileName);
+    }
+    fclose(file);
+    return err;
+}
+
+ErrorCode profile_generate(const Program* prog, const char* fileName, FILE* report)
+{
+    Emulator* em = calloc(1, sizeof(Emulator));
+    if (em == NULL) {
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+
+    ErrorCode err = emulator_load(em, prog);
+    size_t entry = NO_TARGET;
+    for (size_t i = 0; i < em->numSteps && err == OK && entry == NO_TARGET; i++) {
+        if (em->steps[i].cmd->type == CMD_FUNCTION &&
+            strcmp(em->steps[i].cmd->Arg1, "Sys.init") == 0) {
+            entry = i;
+        }
+    }
+    if (err == OK && entry == NO_TARGET) {
+        logError(ERR_PROFILE_RUN, "the program has no Sys.init");
+        err = ERR_PROFILE_RUN;
+    }
+
+    if (err == OK) {
+        emulator_run(em, entry);
+        if (report != NULL) {
+            fprintf(report, "Profiled %llu VM commands", (unsigned long long)em->executed);
+            if (em->stopReason != NULL) {
+                fprintf(report, ", stopped %s%s", em->stopReason,
+                        (em->stopName != NULL) ? em->stopName : "");
+            }
+            fprintf(report, "\n");
+        }
+        err = emulator_writeProfile(em, fileName);
+    }
+    emulator_close(em);
+    free(em);
+    return err;
+}
+
+const ProfileEntry* profile_find(const Profile* profile, const char* kind,
+                                 const char* function, const char* target, size_t ordinal)
+{
+    if (profile == NULL || profile->capacity == 0) {
+        return NULL;
+    }
+    char key[PROFILE_KEY_SIZE];
+    formatKey(key, kind, function, target, ordinal);
+    const ProfileEntry* entry = profile_slot(profile->entries, profile->capacity, key);
+    return (entry->key != NULL) ? entry : NULL;
+}
+
+ProfileTemperature profile_function(const Profile* profile, const char* function)
+{
+    const ProfileEntry* entry = profile_find(profile, "function", function, NULL, 0);
+    return (entry != NULL) ? profile_temperature(profile, entry->count) : PROFILE_UNKNOWN;
+}
+
+ProfileTemperature profile_callSite(const Profile* profile, const char* caller,
+                                   const char* callee, size_t ordinal)
+{
+    const ProfileEntry* entry = profile_find(profile, "call", caller, callee, ordinal);
+    return (entry != NULL) ? profile_temperature(profile, entry->count) : PROFILE_UNKNOWN;
+}
+
+void siteOrdinals_close(SiteOrdinals* ordinals)
+{
+    free(ordinals->targets);
+    free(ordinals->counts);
+    memset(ordinals, 0, sizeof(SiteOrdinals));
+}
+
+void siteOrdinals_reset(SiteOrdinals* ordinals)
+{
+    ordinals->numTargets = 0;
+}
+
+size_t siteOrdinals_next(SiteOrdinals* ordinals, const char* target)
+{
+    for (size_t i = 0; i < ordinals->numTargets; i++) {
+        if (strcmp(ordinals->targets[i], target) == 0) {
+            return ordinals->counts[i]++;
+        }
+    }
+
+    if (ordinals->numTargets == ordinals->capacity) {
+        size_t capacity = (ordinals->capacity == 0) ? 16 : 2 * ordinals->capacity;
+        const char** targets = realloc(ordinals->targets, capacity * sizeof(const char*));
+        if (targets != NULL) ordinals->targets = targets;
+        size_t* counts = realloc(ordinals->counts, capacity * sizeof(size_t));
+        if (counts != NULL) ordinals->counts = counts;
+        if (targets == NULL || counts == NULL) {
+            // Without a number the site is simply not found in the profile
+            return SIZE_MAX;
+        }
+        ordinals->capacity = capacity;
+    }
+    ordinals->targets[ordinals->numTargets] = target;
+    ordinals->counts[ordinals->numTargets] = 1;
+    ordinals->numTargets++;
+    return 0;
+}
+
+// -------------------------- PRIVATE FUNCTIONS ----------------------------- //
+static ErrorCode profile_add(Profile* profile, const char* key, uint64_t count,
+                             uint64_t notTaken)
+{
+    // Keep the load factor under one half
+    if (2 * (profile->numEntries + 1) > profile->capacity) {
+        RETURN_ON_ERR(profile_grow(profile));
+    }
+    ProfileEntry* entry = profile_slot(profile->entries, profile->capacity, key);
+    if (entry->key == NULL) {
+        entry->key = arena_strdup(&profile->arena, key);
+        if (entry->key == NULL) {
+            logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+            return ERR_PROG_OUT_OF_MEMORY;
+        }
+        profile->numEntries++;
+    }
+    entry->count += count;
+    entry->notTaken += notTaken;
+    return OK;
+}
+
+static ErrorCode profile_grow(Profile* profile)
+{
+    size_t capacity = (profile->capacity == 0) ? 256 : 2 * profile->capacity;
+    ProfileEntry* entries = calloc(capacity, sizeof(ProfileEntry));
+    if (entries == NULL) {
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+    for (size_t i = 0; i < profile->capacity; i++) {
+        if (profile->entries[i].key != NULL) {
+            *profile_slot(entries, capacity, profile->entries[i].key) = profile->entries[i];
+        }
+    }
+    free(profile->entries);
+    profile->entries = entries;
+    profile->capacity = capacity;
+    return OK;
+}
+
+/// @return The slot holding the key, or the free slot where it belongs
+static ProfileEntry* profile_slot(ProfileEntry* entries, size_t capacity, const char* key)
+{
+    size_t i = program_hashName(key) & (capacity - 1);
+    while (entries[i].key != NULL && strcmp(entries[i].key, key) != 0) {
+        i = (i + 1) & (capacity - 1);
+    }
+    return &entries[i];
+}
+
+/// @brief Adds one line of a profile file: a comment, or the counts of a
+/// function, call site or branch
+static ErrorCode profile_parseLine(Profile* profile, char* line, const char* fileName)
+{
+    line += strspn(line, " \t");
+    if (line[0] == '#') {
+        return OK;
+    }
+
+    char* fields[PROFILE_MAX_FIELDS];
+    size_t numFields = 0;
+    char* save = NULL;
+    for (char* field = strtok_r(line, " \t\r\n", &save); field != NULL;
+         field = strtok_r(NULL, " \t\r\n", &save)) {
+        if (numFields == PROFILE_MAX_FIELDS || strlen(field) >= MAX_IDENTIFIER_LEN) {
+            logError(ERR_BAD_PROFILE_FILE, fileName);
+            return ERR_BAD_PROFILE_FILE;
+        }
+        fields[numFields++] = field;
+    }
+    if (numFields == 0) {
+        return OK;
+    }
+
+    // Every field after the names is a number
+    size_t numNames = 0;
+    if (strcmp(fields[0], "function") == 0 && numFields == 3) numNames = 2;
+    else if (strcmp(fields[0], "call") == 0 && numFields == 5) numNames = 3;
+    else if (strcmp(fields[0], "branch") == 0 && numFields == 6) numNames = 3;
+    unsigned long long numbers[PROFILE_MAX_FIELDS] = { 0 };
+    bool valid = (numNames > 0);
+    for (size_t i = numNames; i < numFields && valid; i++) {
+        char* end = NULL;
+        numbers[i] = strtoull(fields[i], &end, 10);
+        valid = (*end == '\0') && (fields[i][0] != '-');
+    }
+    if (!valid) {
+        logError(ERR_BAD_PROFILE_FILE, fileName);
+        return ERR_BAD_PROFILE_FILE;
+    }
+
+    char key[PROFILE_KEY_SIZE];
+    if (numNames == 2) {
+        formatKey(key, fields[0], fields[1], NULL, 0);
+        profile->totalCalls += numbers[2];
+        return profile_add(profile, key, numbers[2], 0);
+    }
+    formatKey(key, fields[0], fields[1], fields[2], (size_t)numbers[3]);
+    return profile_add(profile, key, numbers[4], (numFields == 6) ? numbers[5] : 0);
+}
+
+static ProfileTemperature profile_temperature(const Profile* profile, uint64_t count)
+{
+    if (count * COLD_SHARE < profile->totalCalls || count == 0) {
+        return PROFILE_COLD;
+    }
+    if (count * HOT_SHARE >= profile->totalCalls) {
+        return PROFILE_HOT;
+    }
+    return PROFILE_WARM;
+}
+
+static void formatKey(char* key, const char* kind, const char* function, const char* target,
+                      size_t ordinal)
+{
+    if (target == NULL) {
+        snprintf(key, PROFILE_KEY_SIZE, "%s %s", kind, function);
+    }
+    else {
+        snprintf(key, PROFILE_KEY_SIZE, "%s %s %s %zu", kind, function, target, ordinal);
+    }
+}
+
+/// @brief Flattens the files of the program into steps, in the order their
+/// code is written, and gives the statics of every file their place
+static ErrorCode emulator_load(Emulator* em, const Program* prog)
+{
+    for (size_t f = 0; f < prog->numFiles; f++) {
+        em->numSteps += prog->files[f].numCmds;
+    }
+    em->steps = calloc(em->numSteps + 1, sizeof(Step));
+    if (em->steps == NULL) {
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+
+    size_t numStatics = 0;
+    size_t s = 0;
+    for (size_t f = 0; f < prog->numFiles; f++) {
+        const VmFile* file = &prog->files[f];
+        size_t fileStatics = 0;
+        for (size_t i = 0; i < file->numCmds; i++, s++) {
+            Step* step = &em->steps[s];
+            step->cmd = &file->cmds[i];
+            step->target = NO_TARGET;
+            step->file = f;
+            step->statics = numStatics;
+            if (step->cmd->type == CMD_PUSH || step->cmd->type == CMD_POP) {
+                step->segment = decodeSegment(step->cmd->Arg1);
+                step->value = atol(step->cmd->Arg2);
+                if (step->value < 0) step->segment = SEGMENT_UNKNOWN;
+                if (step->segment == SEGMENT_STATIC && (size_t)step->value >= fileStatics) {
+                    fileStatics = (size_t)step->value + 1;
+                }
+            }
+            else if (step->cmd->type == CMD_CALL || step->cmd->type == CMD_FUNCTION) {
+                step->value = atol(step->cmd->Arg2);
+            }
+        }
+        numStatics += fileStatics;
+    }
+
+    em->statics = calloc(numStatics + 1, sizeof(uint16_t));
+    if (em->statics == NULL) {
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+    return emulator_resolveTargets(em);
+}
+
+/// @brief Finds the label of every goto and if-goto and the function of
+/// every call. Labels are not scoped to functions, like in the assembly
+static ErrorCode emulator_resolveTargets(Emulator* em)
+{
+    size_t capacity = 64;
+    while (capacity < 2 * em->numSteps) {
+        capacity *= 2;
+    }
+    LabelSlot* slots = calloc(capacity, sizeof(LabelSlot));
+    if (slots == NULL) {
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+
+    // Functions and labels are assembler labels alike, the first one wins
+    for (size_t s = 0; s < em->numSteps; s++) {
+        CommandType type = em->steps[s].cmd->type;
+        if (type != CMD_LABEL && type != CMD_FUNCTION) continue;
+        const char* name = em->steps[s].cmd->Arg1;
+        size_t i = program_hashName(name) & (capacity - 1);
+        while (slots[i].name != NULL && strcmp(slots[i].name, name) != 0) {
+            i = (i + 1) & (capacity - 1);
+        }
+        if (slots[i].name == NULL) {
+            slots[i] = (LabelSlot) { name, s };
+        }
+    }
+
+    for (size_t s = 0; s < em->numSteps; s++) {
+        CommandType type = em->steps[s].cmd->type;
+        if (type != CMD_GOTO && type != CMD_IF && type != CMD_CALL) continue;
+        const char* name = em->steps[s].cmd->Arg1;
+        size_t i = program_hashName(name) & (capacity - 1);
+        while (slots[i].name != NULL && strcmp(slots[i].name, name) != 0) {
+            i = (i + 1) & (capacity - 1);
+        }
+        if (slots[i].name == NULL) continue;
+
+        // A call must reach a function, which the assembly would jump to
+        bool isFunction = (em->steps[slots[i].step].cmd->type == CMD_FUNCTION);
+        if (type != CMD_CALL || isFunction) {
+            em->steps[s].target = slots[i].step;
+        }
+    }
+    free(slots);
+    return OK;
+}
+
+/// @brief Runs the program from the call of the bootstrap code into the
+/// function at the given step
+static void emulator_run(Emulator* em, size_t entry)
+{
+    em->ram[SP_ADDR] = STACK_BASE;
+    em->running = true;
+    const Step bootstrap = { .value = 0, .target = entry };
+    size_t pc = BOOTSTRAP_RETURN;
+    emulator_call(em, &pc, &bootstrap);
+
+    while (em->running) {
+        if (pc >= em->numSteps) {
+            emulator_stop(em, "at the end of the code", NULL);
+            break;
+        }
+        if (em->executed == PROFILE_MAX_COMMANDS) {
+            emulator_stop(em, "at the command limit", NULL);
+            break;
+        }
+        em->executed++;
+
+        Step* step = &em->steps[pc];
+        const Command* cmd = step->cmd;
+        size_t next = pc + 1;
+        switch (cmd->type) {
+            case CMD_PUSH:
+            {
+                uint16_t* slot = emulator_segmentSlot(em, step);
+                emulator_push(em, (slot != NULL) ? *slot : (uint16_t)step->value);
+                break;
+            }
+            case CMD_POP:
+            {
+                uint16_t value = emulator_pop(em);
+                uint16_t* slot = emulator_segmentSlot(em, step);
+                if (slot != NULL) *slot = value;
+                break;
+            }
+            case CMD_ARITHMETIC:
+            {
+                int16_t y = (int16_t)emulator_pop(em);
+                int16_t x = isBinaryArithmetic(cmd->Arg1) ? (int16_t)emulator_pop(em) : 0;
+                int16_t result = 0;
+                if (!constantFolding_evaluate(cmd->Arg1, x, y, &result)) {
+                    emulator_stop(em, "at an unknown command ", cmd->Arg1);
+                }
+                emulator_push(em, (uint16_t)result);
+                break;
+            }
+            case CMD_GOTO:
+                // A goto to the label right before it is how programs end
+                if (step->target != NO_TARGET && step->target + 1 == pc) {
+                    emulator_stop(em, NULL, NULL);
+                }
+                next = step->target;
+                break;
+            case CMD_IF:
+                // if-goto jumps on a positive value, like the code writer's JGT
+                if ((int16_t)emulator_pop(em) > 0) {
+                    step->count++;
+                    next = step->target;
+                }
+                else {
+                    step->notTaken++;
+                }
+                break;
+            case CMD_FUNCTION:
+                step->count++;
+                for (long i = 0; i < step->value; i++) {
+                    emulator_push(em, 0);
+                }
+                break;
+            case CMD_CALL:
+                step->count++;
+                emulator_call(em, &next, step);
+                break;
+            case CMD_RETURN:
+                emulator_return(em, &next);
+                break;
+            default:
+                break;
+        }
+        if (next == NO_TARGET && em->running) {
+            emulator_stop(em, "at a jump to undefined ", cmd->Arg1);
+        }
+        pc = next;
+    }
+}
+
+/// @brief Pushes the frame of a call like the code writer and continues at
+/// the called function
+/// @param pc Step after the call, set to the first step of the function
+static void emulator_call(Emulator* em, size_t* pc, const Step* step)
+{
+    if (step->target == NO_TARGET) {
+        emulator_stop(em, "at a call of undefined ", step->cmd->Arg1);
+        return;
+    }
+    if (em->numReturns == em->returnsCapacity) {
+        size_t capacity = (em->returnsCapacity == 0) ? 256 : 2 * em->returnsCapacity;
+        // Deeper calls would have run out of RAM
+        size_t* returns = (capacity <= RAM_SIZE) ?
+                          realloc(em->returns, capacity * sizeof(size_t)) : NULL;
+        if (returns == NULL) {
+            emulator_stop(em, "as the calls nest too deep", NULL);
+            return;
+        }
+        em->returns = returns;
+        em->returnsCapacity = capacity;
+    }
+    em->returns[em->numReturns++] = *pc;
+
+    // The return address is pushed as the code writer would, the run keeps
+    // the real one aside
+    emulator_push(em, (uint16_t)*pc);
+    emulator_push(em, em->ram[LCL_ADDR]);
+    emulator_push(em, em->ram[ARG_ADDR]);
+    emulator_push(em, em->ram[THIS_ADDR]);
+    emulator_push(em, em->ram[THAT_ADDR]);
+    em->ram[ARG_ADDR] = (uint16_t)(em->ram[SP_ADDR] - CALL_FRAME_SIZE - step->value);
+    em->ram[LCL_ADDR] = em->ram[SP_ADDR];
+    *pc = step->target;
+}
+
+/// @brief Returns like the code writer: the return value goes to argument
+/// 0, then SP and the pointers of the caller are restored
+static void emulator_return(Emulator* em, size_t* pc)
+{
+    if (em->numReturns == 0) {
+        emulator_stop(em, "as a return has no call", NULL);
+        return;
+    }
+    size_t returnStep = em->returns[--em->numReturns];
+    if (returnStep == BOOTSTRAP_RETURN) {
+        emulator_stop(em, "as Sys.init returned", NULL);
+        return;
+    }
+
+    uint16_t frame = em->ram[LCL_ADDR];
+    uint16_t value = emulator_pop(em);
+    em->ram[em->ram[ARG_ADDR] & (RAM_SIZE - 1)] = value;
+    em->ram[SP_ADDR] = em->ram[ARG_ADDR] + 1;
+    em->ram[THAT_ADDR] = em->ram[(uint16_t)(frame - 1) & (RAM_SIZE - 1)];
+    em->ram[THIS_ADDR] = em->ram[(uint16_t)(frame - 2) & (RAM_SIZE - 1)];
+    em->ram[ARG_ADDR] = em->ram[(uint16_t)(frame - 3) & (RAM_SIZE - 1)];
+    em->ram[LCL_ADDR] = em->ram[(uint16_t)(frame - 4) & (RAM_SIZE - 1)];
+    *pc = returnStep;
+}
+
+/// @return The memory a push or pop reaches, NULL for constants
+static uint16_t* emulator_segmentSlot(Emulator* em, const Step* step)
+{
+    uint16_t index = (uint16_t)step->value;
+    uint16_t address = 0;
+    switch (step->segment) {
+        case SEGMENT_LOCAL:    address = em->ram[LCL_ADDR] + index; break;
+        case SEGMENT_ARGUMENT: address = em->ram[ARG_ADDR] + index; break;
+        case SEGMENT_THIS:     address = em->ram[THIS_ADDR] + index; break;
+        case SEGMENT_THAT:     address = em->ram[THAT_ADDR] + index; break;
+        case SEGMENT_POINTER:  address = THIS_ADDR + index; break;
+        case SEGMENT_TEMP:     address = TEMP_ADDR + index; break;
+        case SEGMENT_STATIC:   return &em->statics[step->statics + index];
+        default:               return NULL;
+    }
+    return &em->ram[address & (RAM_SIZE - 1)];
+}
+
+static void emulator_push(Emulator* em, uint16_t value)
+{
+    em->ram[em->ram[SP_ADDR] & (RAM_SIZE - 1)] = value;
+    em->ram[SP_ADDR]++;
+}
+
+static uint16_t emulator_pop(Emulator* em)
+{
+    em->ram[SP_ADDR]--;
+    return em->ram[em->ram[SP_ADDR] & (RAM_SIZE - 1)];
+}
+
+/// @param reason Why the run stopped early, NULL when the program ended
+static void emulator_stop(Emulator* em, const char* reason, const char* name)
+{
+    em->running = false;
+    em->stopReason = reason;
+    em->stopName = name;
+}
+
+static void emulator_close(Emulator* em)
+{
+    free(em->steps);
+    free(em->statics);
+    free(em->returns);
+}
+
+/// @brief Writes the counts of every function, call site and branch of the
+/// program, in the order of the code
+static ErrorCode emulator_writeProfile(const Emulator* em, const char* fileName)
+{
+    FILE* file = fopen(fileName, "w");
+    if (file == NULL) {
+        logError(ERR_CANT_OPEN_OUTFILE, fileName);
+        return ERR_CANT_OPEN_OUTFILE;
+    }
+    fprintf(file, "# Execution counts written by vm-translator --profile-generate\n");
+    fprintf(file, "# function <name> <entries>\n");
+    fprintf(file, "# call <caller> <callee> <site> <calls>\n");
+    fprintf(file, "# branch <function> <label> <site> <taken> <not taken>\n");
+
+    SiteOrdinals calls = { 0 };
+    SiteOrdinals branches = { 0 };
+    const char* function = NULL;
+    for (size_t s = 0; s < em->numSteps; s++) {
+        const Step* step = &em->steps[s];
+        const Command* cmd = step->cmd;
+
+        // Sites are numbered per function, which ends with its file
+        if (s > 0 && step->file != em->steps[s - 1].file) {
+            function = NULL;
+        }
+        if (cmd->type == CMD_FUNCTION) {
+            function = cmd->Arg1;
+            siteOrdinals_reset(&calls);
+            siteOrdinals_reset(&branches);
+            fprintf(file, "function %s %llu\n", function, (unsigned long long)step->count);
+        }
+        else if (cmd->type == CMD_CALL && function != NULL) {
+            fprintf(file, "call %s %s %zu %llu\n", function, cmd->Arg1,
+                    siteOrdinals_next(&calls, cmd->Arg1), (unsigned long long)step->count);
+        }
+        else if (cmd->type == CMD_IF && function != NULL) {
+            fprintf(file, "branch %s %s %zu %llu %llu\n", function, cmd->Arg1,
+                    siteOrdinals_next(&branches, cmd->Arg1), (unsigned long long)step->count,
+                    (unsigned long long)step->notTaken);
+        }
+    }
+    siteOrdinals_close(&calls);
+    siteOrdinals_close(&branches);
+
+    bool written = (ferror(file) == 0);
+    written = (fclose(file) == 0) && written;
+    if (!written) {
+        logError(ERR_CANT_OPEN_OUTFILE, fileName);
+        return ERR_CANT_OPEN_OUTFILE;
+    }
+    return OK;
+}
+
+static Segment decodeSegment(const char* name)
+{
+    static const char* const names[] = {
+        [SEGMENT_CONSTANT] = "constant",
+        [SEGMENT_LOCAL] = "local",
+        [SEGMENT_ARGUMENT] = "argument",
+        [SEGMENT_THIS] = "this",
+        [SEGMENT_THAT] = "that",
+        [SEGMENT_POINTER] = "pointer",
+        [SEGMENT_TEMP] = "temp",
+        [SEGMENT_STATIC] = "static"
+    };
+    for (int s = SEGMENT_CONSTANT; s < SEGMENT_UNKNOWN; s++) {
+        if (strcmp(name, names[s]) == 0) {
+            return (Segment)s;
+        }
+    }
+    return SEGMENT_UNKNOWN;
+}
+
+static bool isBinaryArithmetic(const char* op)
+{
+    return strcmp(op, "neg") != 0 && strcmp(op, "not") != 0;
+}
@@ -0,0 +1,97 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "arena.h"
+#include "errorHandler.h"
+#include "program.h"
+
+// A run executes at most this many VM commands, so that programs waiting
+// for input forever still leave a profile
+#define PROFILE_MAX_COMMANDS    (200000000ULL)
+
+/// Execution count of a function, call site or branch, named by its key:
+/// "function <name>", "call <caller> <callee> <n>" or "branch <function>
+/// <label> <n>", where n numbers the sites of the caller naming the same
+/// callee or label
+typedef struct ProfileEntry {
+    const char* key;         // NULL for free slots
+    uint64_t count;          // Entries, calls or taken branches
+    uint64_t notTaken;       // Branches falling through
+} ProfileEntry;
+
+/// Counts of a run of the program, with --profile-generate, or loaded from
+/// a profile file with --profile-use
+typedef struct Profile {
+    ProfileEntry* entries;   // Open addressing
+    size_t capacity;
+    size_t numEntries;
+    uint64_t totalCalls;     // Function entries over the whole run, which
+                             // the hot and cold thresholds are relative to
+    Arena arena;             // Keys
+} Profile;
+
+typedef enum {
+    PROFILE_UNKNOWN,         // Not in the profile, such as code changed since
+    PROFILE_COLD,            // Never or almost never run
+    PROFILE_WARM,
+    PROFILE_HOT              // A sizable share of every call
+} ProfileTemperature;
+
+/// Numbers the sites of a function naming the same callee or label, which is
+/// how the profile tells them apart. Passes that change calls or branches
+/// before a consumer runs must leave the sites of other targets in order
+typedef struct SiteOrdinals {
+    const char** targets;    // Point to the names of the walked commands
+    size_t* counts;
+    size_t numTargets;
+    size_t capacity;
+} SiteOrdinals;
+
+void profile_new(Profile* profile);
+void profile_close(Profile* profile);
+
+/// @brief Reads a profile written with --profile-generate
+ErrorCode profile_load(Profile* profile, const char* fileName);
+
+/// @brief Runs the program, as parsed, on a VM emulator with the memory
+/// layout of the Hack platform, from a call of Sys.init until it loops on a
+/// goto to itself, returns from Sys.init, calls a function it doesn't
+/// define or runs PROFILE_MAX_COMMANDS commands. The execution count of
+/// every function, call site and branch is written to the file
+/// @param report Where the number of executed commands is printed, NULL for
+/// nowhere
+ErrorCode profile_generate(const Program* prog, const char* fileName, FILE* report);
+
+/// @return The counts stored under the given key, NULL if there are none
+const ProfileEntry* profile_find(const Profile* profile, const char* kind,
+                                 const char* function, const char* target, size_t ordinal);
+
+/// @return How often a function was entered, relative to every call
+ProfileTemperature profile_function(const Profile* profile, const char* function);
+
+/// @return How often a call site was run, relative to every call
+ProfileTemperature profile_callSite(const Profile* profile, const char* caller,
+                                   const char* callee, size_t ordinal);
+
+void siteOrdinals_close(SiteOrdinals* ordinals);
+
+/// @brief Starts numbering the sites of the next function
+void siteOrdinals_reset(SiteOrdinals* ordinals);
+
+/// @return Number of the next site naming the given target in the current
+/// function, from 0. The name must stay valid until the next reset
+size_t siteOrdinals_next(SiteOrdinals* ordinals, const char* target);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PROFILE_H
@@ -0,0 +1,387 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "errorHandler.h"
+#include "parser.h"
+#include "program.h"
+
+#define INITIAL_FILES_CAPACITY       (8)
+#define INITIAL_COMMANDS_CAPACITY    (256)
+
+#define INITIAL_EDGES_CAPACITY       (16)
+
+/// Function in which a label is declared
+typedef struct LabelOwner {
+    const char* name;
+    size_t func;
+} LabelOwner;
+
+// Local function prototypes
+static ErrorCode functionTable_insert(FunctionTable* table, size_t funcIndex);
+static ErrorCode appendEdge(FunctionEdge** edges, size_t* numEdges, size_t* capacity,
+                            size_t from, size_t to);
+static bool endsFunctionBody(const Command* cmd);
+static int compareLabelOwners(const void* a, const void* b);
+static int compareNames(const void* a, const void* b);
+
+// ---------------------------- PUBLIC FUNCTIONS --------------------------- //
+void program_new(Program* prog)
+{
+    memset(prog, 0, sizeof(Program));
+}
+
+void program_close(Program* prog)
+{
+    for (size_t i = 0; i < prog->numFiles; i++) {
+        free(prog->files[i].fileName);
+        free(prog->files[i].cmds);
+    }
+    free(prog->files);
+    for (size_t i = 0; i < prog->external.numNames; i++) {
+        free(prog->external.names[i]);
+    }
+    free(prog->external.names);
+    memset(prog, 0, sizeof(Program));
+}
+
+ErrorCode program_addFile(Program* prog, const char* fileName)
+{
+    if (prog->numFiles == prog->capacity) {
+        size_t newCapacity = (prog->capacity == 0) ? INITIAL_FILES_CAPACITY : prog->capacity * 2;
+        VmFile* newFiles = realloc(prog->files, newCapacity * sizeof(VmFile));
+        if (newFiles == NULL) {
+            logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+            return ERR_PROG_OUT_OF_MEMORY;
+        }
+        prog->files = newFiles;
+        prog->capacity = newCapacity;
+    }
+
+    VmFile* file = &prog->files[prog->numFiles];
+    memset(file, 0, sizeof(VmFile));
+    file->fileName = strdup(fileName);
+    if (file->fileName == NULL) {
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+    prog->numFiles++;
+    return OK;
+}
+
+ErrorCode program_append(Program* prog, const Command* cmd)
+{
+    if (prog->numFiles == 0) {
+        return ERR_UNKNOWN;
+    }
+    return vmFile_append(&prog->files[prog->numFiles - 1], cmd);
+}
+
+ErrorCode vmFile_append(VmFile* file, const Command* cmd)
+{
+    if (file->numCmds == file->capacity) {
+        size_t newCapacity = (file->capacity == 0) ? INITIAL_COMMANDS_CAPACITY : file->capacity * 2;
+        Command* newCmds = realloc(file->cmds, newCapacity * sizeof(Command));
+        if (newCmds == NULL) {
+            logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+            return ERR_PROG_OUT_OF_MEMORY;
+        }
+        file->cmds = newCmds;
+        file->capacity = newCapacity;
+    }
+    file->cmds[file->numCmds++] = *cmd;
+    return OK;
+}
+
+ErrorCode vmFile_reserve(VmFile* file, size_t capacity)
+{
+    if (capacity <= file->capacity) {
+        return OK;
+    }
+    Command* newCmds = realloc(file->cmds, capacity * sizeof(Command));
+    if (newCmds == NULL) {
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+    file->cmds = newCmds;
+    file->capacity = capacity;
+    return OK;
+}
+
+void vmFile_replaceCommands(VmFile* file, VmFile* newCommands)
+{
+    free(file->cmds);
+    file->cmds = newCommands->cmds;
+    file->numCmds = newCommands->numCmds;
+    file->capacity = newCommands->capacity;
+    newCommands->cmds = NULL;
+    newCommands->numCmds = 0;
+    newCommands->capacity = 0;
+}
+
+ErrorCode program_buildFunctionTable(const Program* prog, FunctionTable* table)
+{
+    memset(table, 0, sizeof(FunctionTable));
+
+    size_t numFuncs = 0;
+    for (size_t f = 0; f < prog->numFiles; f++) {
+        for (size_t i = 0; i < prog->files[f].numCmds; i++) {
+            if (prog->files[f].cmds[i].type == CMD_FUNCTION) numFuncs++;
+        }
+    }
+
+    // Keep the load factor under one half
+    table->numBuckets = 16;
+    while (table->numBuckets < 2 * numFuncs) {
+        table->numBuckets *= 2;
+    }
+    table->funcs = calloc(numFuncs + 1, sizeof(VmFunction));
+    table->buckets = calloc(table->numBuckets, sizeof(size_t));
+    if (table->funcs == NULL || table->buckets == NULL) {
+        functionTable_close(table);
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+
+    VmFunction* current = NULL;
+    for (size_t f = 0; f < prog->numFiles; f++) {
+        const VmFile* file = &prog->files[f];
+        for (size_t i = 0; i < file->numCmds; i++) {
+            if (file->cmds[i].type != CMD_FUNCTION) continue;
+
+            if (current != NULL && current->file == f) {
+                current->end = i;
+            }
+            current = &table->funcs[table->numFuncs];
+            strcpy(current->name, file->cmds[i].Arg1);
+            current->file = f;
+            current->first = i;
+            current->end = file->numCmds;
+            current->nLocals = atol(file->cmds[i].Arg2);
+            current->nArgs = ARITY_UNKNOWN;
+            functionTable_insert(table, table->numFuncs);
+            table->numFuncs++;
+        }
+    }
+
+    // Arity is taken from the call sites, as function commands don't declare it
+    for (size_t f = 0; f < prog->numFiles; f++) {
+        const VmFile* file = &prog->files[f];
+        for (size_t i = 0; i < file->numCmds; i++) {
+            if (file->cmds[i].type != CMD_CALL) continue;
+
+            VmFunction* callee = (VmFunction*)functionTable_find(table, file->cmds[i].Arg1);
+            if (callee == NULL) continue;
+
+            long nArgs = atol(file->cmds[i].Arg2);
+            if (callee->numCallSites == 0) {
+                callee->nArgs = nArgs;
+            }
+            else if (callee->nArgs != nArgs) {
+                callee->nArgs = ARITY_UNKNOWN;
+            }
+            callee->numCallSites++;
+        }
+    }
+    return OK;
+}
+
+void functionTable_close(FunctionTable* table)
+{
+    free(table->funcs);
+    free(table->buckets);
+    memset(table, 0, sizeof(FunctionTable));
+}
+
+const VmFunction* functionTable_find(const FunctionTable* table, const char* name)
+{
+    if (table->numBuckets == 0) {
+        return NULL;
+    }
+    size_t mask = table->numBuckets - 1;
+    for (size_t b = program_hashName(name) & mask; table->buckets[b] != 0; b = (b + 1) & mask) {
+        const VmFunction* func = &table->funcs[table->buckets[b] - 1];
+        if (strcmp(func->name, name) == 0) {
+            return func;
+        }
+    }
+    return NULL;
+}
+
+size_t functionTable_indexOf(const FunctionTable* table, const char* name)
+{
+    const VmFunction* func = functionTable_find(table, name);
+    return (func != NULL) ? (size_t)(func - table->funcs) : NO_FUNCTION;
+}
+
+ErrorCode program_findSharedCode(const Program* prog, const FunctionTable* table,
+                                 FunctionEdge** edges, size_t* numEdges)
+{
+    size_t capacity = INITIAL_EDGES_CAPACITY;
+    *numEdges = 0;
+    *edges = malloc(capacity * sizeof(FunctionEdge));
+
+    size_t numLabels = 0;
+    for (size_t f = 0; f < prog->numFiles; f++) {
+        for (size_t i = 0; i < prog->files[f].numCmds; i++) {
+            if (prog->files[f].cmds[i].type == CMD_LABEL) numLabels++;
+        }
+    }
+    LabelOwner* labels = malloc((numLabels + 1) * sizeof(LabelOwner));
+    if (*edges == NULL || labels == NULL) {
+        free(*edges);
+        free(labels);
+        *edges = NULL;
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+
+    // Files are written one after the other, so the last function of a file
+    // falls through to the first one of the next file
+    ErrorCode err = OK;
+    size_t current = NO_FUNCTION;
+    const Command* last = NULL;
+    numLabels = 0;
+    for (size_t f = 0; f < prog->numFiles && err == OK; f++) {
+        const VmFile* file = &prog->files[f];
+        for (size_t i = 0; i < file->numCmds && err == OK; last = &file->cmds[i], i++) {
+            const Command* cmd = &file->cmds[i];
+            if (cmd->type == CMD_FUNCTION) {
+                size_t previous = current;
+                current = functionTable_indexOf(table, cmd->Arg1);
+                if (previous != NO_FUNCTION && !endsFunctionBody(last)) {
+                    err = appendEdge(edges, numEdges, &capacity, previous, current);
+                }
+            }
+            else if (cmd->type == CMD_LABEL) {
+                labels[numLabels].name = cmd->Arg1;
+                labels[numLabels].func = current;
+                numLabels++;
+            }
+        }
+    }
+    qsort(labels, numLabels, sizeof(LabelOwner), compareLabelOwners);
+
+    for (size_t f = 0; f < prog->numFiles && err == OK; f++) {
+        const VmFile* file = &prog->files[f];
+        current = NO_FUNCTION;
+        for (size_t i = 0; i < file->numCmds && err == OK; i++) {
+            const Command* cmd = &file->cmds[i];
+            if (cmd->type == CMD_FUNCTION) {
+                current = functionTable_indexOf(table, cmd->Arg1);
+                continue;
+            }
+            if (current == NO_FUNCTION ||
+                (cmd->type != CMD_GOTO && cmd->type != CMD_IF && cmd->type != CMD_IF_NOT)) {
+                continue;
+            }
+
+            LabelOwner key = { .name = cmd->Arg1 };
+            const LabelOwner* found = bsearch(&key, labels, numLabels, sizeof(LabelOwner),
+                                              compareLabelOwners);
+            if (found != NULL && found->func != current && found->func != NO_FUNCTION) {
+                err = appendEdge(edges, numEdges, &capacity, current, found->func);
+            }
+        }
+    }
+
+    free(labels);
+    if (err != OK) {
+        free(*edges);
+        *edges = NULL;
+        *numEdges = 0;
+    }
+    return err;
+}
+
+bool program_isCalledExternally(const Program* prog, const char* name)
+{
+    if (prog->external.everyFunction) {
+        return true;
+    }
+    return prog->external.numNames > 0 &&
+           bsearch(&name, prog->external.names, prog->external.numNames, sizeof(char*),
+                   compareNames) != NULL;
+}
+
+char* vmFile_staticPrefix(const char* fileName)
+{
+    char* prefix = malloc(strlen(fileName) + 1);
+    if (prefix == NULL) {
+        return NULL;
+    }
+    vmFile_formatStaticPrefix(prefix, fileName);
+    return prefix;
+}
+
+void vmFile_formatStaticPrefix(char* prefix, const char* fileName)
+{
+    size_t len = strlen(fileName);
+    len = (len > strlen(".vm")) ? len - strlen(".vm") : len;
+    for (size_t i = 0; i < len; i++) {
+        char c = fileName[i];
+        prefix[i] = (c == '/') ? '_' : (c == '.') ? 'x' : c;
+    }
+    prefix[len] = '\0';
+}
+
+uint32_t program_hashName(const char* name)
+{
+    uint32_t hash = 2166136261u;
+    for (; *name != '\0'; name++) {
+        hash = (hash ^ (uint8_t)*name) * 16777619u;
+    }
+    return hash;
+}
+
+// -------------------------- PRIVATE FUNCTIONS ----------------------------- //
+
+/// @brief Inserts a function in the hash buckets. When a function is
+/// defined twice the first definition is kept
+static ErrorCode functionTable_insert(FunctionTable* table, size_t funcIndex)
+{
+    const char* name = table->funcs[funcIndex].name;
+    size_t mask = table->numBuckets - 1;
+    size_t b = program_hashName(name) & mask;
+    for (; table->buckets[b] != 0; b = (b + 1) & mask) {
+        if (strcmp(table->funcs[table->buckets[b] - 1].name, name) == 0) {
+            return OK;
+        }
+    }
+    table->buckets[b] = funcIndex + 1;
+    return OK;
+}
+
+static ErrorCode appendEdge(FunctionEdge** edges, size_t* numEdges, size_t* capacity,
+                            size_t from, size_t to)
+{
+    if (*numEdges == *capacity) {
+        FunctionEdge* newEdges = realloc(*edges, 2 * *capacity * sizeof(FunctionEdge));
+        if (newEdges == NULL) {
+            logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+            return ERR_PROG_OUT_OF_MEMORY;
+        }
+        *edges = newEdges;
+        *capacity *= 2;
+    }
+    (*edges)[*numEdges].from = from;
+    (*edges)[*numEdges].to = to;
+    (*numEdges)++;
+    return OK;
+}
+
+/// @return Whether control never falls through past the command
+static bool endsFunctionBody(const Command* cmd)
+{
+    return cmd->type == CMD_RETURN || cmd->type == CMD_LIGHT_RETURN || cmd->type == CMD_GOTO ||
+           cmd->type == CMD_TAIL_CALL || cmd->type == CMD_TAIL_JUMP;
+}
+
+static int compareLabelOwners(const void* a, const void* b)
+{
+    return strcmp(((const LabelOwner*)a)->name, ((const LabelOwner*)b)->name);
+}
+
+static int compareNames(const void* a, const void* b)
+{
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
@@ -0,0 +1,131 @@
+#ifndef PROGRAM_H
+#define PROGRAM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "errorHandler.h"
+#include "parser.h"
+
+#define ARITY_UNKNOWN   (-1)
+#define NO_FUNCTION     SIZE_MAX
+
+/// Commands of one translated .vm file, in source order
+typedef struct VmFile {
+    char* fileName;          // Path of the .vm file, used for static symbols
+    Command* cmds;
+    size_t numCmds;
+    size_t capacity;
+} VmFile;
+
+/// What object modules linked with the program use of it, as the
+/// optimization passes only see the translated files
+typedef struct ExternalUses {
+    char** names;            // Symbols the modules reference, sorted with strcmp()
+    size_t numNames;
+    long numStatics;         // Static variables of the modules
+    bool everyFunction;      // Set when writing an object module, whose
+                             // functions may all be called by other modules
+} ExternalUses;
+
+/// Whole program view of every translated file, which optimization passes
+/// work on before any code is written
+typedef struct Program {
+    VmFile* files;
+    size_t numFiles;
+    size_t capacity;
+    ExternalUses external;
+} Program;
+
+/// Location and properties of a function in a Program. The pointers and
+/// indices are only valid until the program is modified
+typedef struct VmFunction {
+    char name[MAX_IDENTIFIER_LEN];
+    size_t file;             // Index in Program.files
+    size_t first;            // Index of the function command
+    size_t end;              // One past the last command of the function
+    long nLocals;
+    long nArgs;              // Arguments passed by every call site in the
+                             // program, ARITY_UNKNOWN if none or inconsistent
+    size_t numCallSites;     // Number of call commands naming the function
+} VmFunction;
+
+typedef struct FunctionTable {
+    VmFunction* funcs;
+    size_t numFuncs;
+    size_t* buckets;         // Index in funcs plus one, 0 for empty buckets
+    size_t numBuckets;
+} FunctionTable;
+
+/// Control passing from the code of one function into the code of another
+/// one without a call, so that both run on the same frame
+typedef struct FunctionEdge {
+    size_t from;             // Index in FunctionTable.funcs
+    size_t to;
+} FunctionEdge;
+
+void program_new(Program* prog);
+void program_close(Program* prog);
+
+/// @brief Adds an empty file to the program. Commands appended with
+/// program_append() go to the file added last
+ErrorCode program_addFile(Program* prog, const char* fileName);
+
+/// @brief Appends a command to the file added last
+ErrorCode program_append(Program* prog, const Command* cmd);
+
+/// @brief Appends a command to the given file
+ErrorCode vmFile_append(VmFile* file, const Command* cmd);
+
+/// @brief Grows the command array of a file to hold at least the given
+/// number of commands, so that they can be written in place
+ErrorCode vmFile_reserve(VmFile* file, size_t capacity);
+
+/// @brief Replaces the commands of a file with the ones of another file,
+/// taking ownership of them. Used by passes that rebuild a file
+void vmFile_replaceCommands(VmFile* file, VmFile* newCommands);
+
+/// @brief Indexes every function of the program by name
+ErrorCode program_buildFunctionTable(const Program* prog, FunctionTable* table);
+void functionTable_close(FunctionTable* table);
+
+/// @return The function with the given name, or NULL if it is not defined
+/// in the program
+const VmFunction* functionTable_find(const FunctionTable* table, const char* name);
+
+/// @return Index in table->funcs of the function with the given name, or
+/// NO_FUNCTION if it is not defined in the program
+size_t functionTable_indexOf(const FunctionTable* table, const char* name);
+
+/// @brief Finds where the code of a function continues into another function
+/// without a call: falling through into the next function, which may be in
+/// the next file, or jumping to a label declared in another function, as
+/// labels are not scoped to functions
+/// @param edges Set to an array allocated with malloc(), freed by the caller
+ErrorCode program_findSharedCode(const Program* prog, const FunctionTable* table,
+                                 FunctionEdge** edges, size_t* numEdges);
+
+/// @return Whether a function may be called from outside the program, by a
+/// linked object module or, when writing one, by the modules it is linked with
+bool program_isCalledExternally(const Program* prog, const char* name);
+
+/// @return Static symbol prefix of a .vm file: the path without extension,
+/// with '/' replaced by '_' and '.' by 'x'. Allocated with malloc()
+char* vmFile_staticPrefix(const char* fileName);
+
+/// @brief Writes the static symbol prefix of a .vm file into a buffer of at
+/// least strlen(fileName) + 1 chars
+void vmFile_formatStaticPrefix(char* prefix, const char* fileName);
+
+/// @brief FNV-1a hash of an identifier, used by the name tables
+uint32_t program_hashName(const char* name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PROGRAM_H
@@ -0,0 +1,173 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "errorHandler.h"
+#include "parser.h"
+#include "readAhead.h"
+
+// Local function prototypes
+static void* reader_run(void* arg);
+static bool reader_waitForRoom(ReadAhead* ra, size_t size);
+static char* readFile(int fd, size_t capacity, size_t* length);
+
+// ---------------------------- PUBLIC FUNCTIONS --------------------------- //
+ErrorCode readAhead_start(ReadAhead* ra, char* const* fileNames, size_t numFiles,
+                          long maxFiles, size_t maxBytes)
+{
+    memset(ra, 0, sizeof(ReadAhead));
+    ra->files = calloc(numFiles + 1, sizeof(ReadAheadFile));
+    if (ra->files == NULL) {
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+    for (size_t i = 0; i < numFiles; i++) {
+        const char* fileName = fileNames[i];
+        size_t length = strlen(fileName);
+        if (length >= strlen(".vm") && strcmp(fileName + length - strlen(".vm"), ".vm") == 0) {
+            ra->files[ra->numFiles++].fileName = fileName;
+        }
+    }
+    ra->maxFiles = maxFiles;
+    ra->maxBytes = maxBytes;
+
+    // Without a thread, every parser reads its file itself
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->changed, NULL);
+    ra->started = (ra->numFiles > 0 &&
+                   pthread_create(&ra->thread, NULL, reader_run, ra) == 0);
+    if (!ra->started) {
+        pthread_cond_destroy(&ra->changed);
+        pthread_mutex_destroy(&ra->lock);
+        free(ra->files);
+        ra->files = NULL;
+    }
+    return OK;
+}
+
+void readAhead_stop(ReadAhead* ra)
+{
+    if (!ra->started) return;
+
+    pthread_mutex_lock(&ra->lock);
+    ra->stopping = true;
+    pthread_cond_broadcast(&ra->changed);
+    pthread_mutex_unlock(&ra->lock);
+    pthread_join(ra->thread, NULL);
+
+    for (size_t i = ra->numTaken; i < ra->numRead; i++) {
+        free(ra->files[i].content);
+    }
+    free(ra->files);
+    ra->files = NULL;
+    pthread_cond_destroy(&ra->changed);
+    pthread_mutex_destroy(&ra->lock);
+    ra->started = false;
+}
+
+ErrorCode readAhead_openParser(ReadAhead* ra, Parser* p, const char* fileName, Arena* arena)
+{
+    if (!ra->started) {
+        return parser_newInArena(p, fileName, arena);
+    }
+
+    pthread_mutex_lock(&ra->lock);
+    if (ra->numTaken == ra->numFiles || strcmp(ra->files[ra->numTaken].fileName, fileName) != 0) {
+        pthread_mutex_unlock(&ra->lock);
+        return parser_newInArena(p, fileName, arena);
+    }
+    while (ra->numRead == ra->numTaken) {
+        pthread_cond_wait(&ra->changed, &ra->lock);
+    }
+    ReadAheadFile* file = &ra->files[ra->numTaken++];
+    char* content = file->content;
+    file->content = NULL;
+    ra->bufferedBytes -= file->size;
+    pthread_cond_broadcast(&ra->changed);
+    pthread_mutex_unlock(&ra->lock);
+
+    // The parser reports the file that could not be read
+    if (content == NULL) {
+        return parser_newInArena(p, fileName, arena);
+    }
+    parser_newFromBuffer(p, content);
+    return OK;
+}
+
+// -------------------------- PRIVATE FUNCTIONS ----------------------------- //
+static void* reader_run(void* arg)
+{
+    ReadAhead* ra = arg;
+    pthread_mutex_lock(&ra->lock);
+    while (!ra->stopping && ra->numRead < ra->numFiles) {
+        if (ra->numRead - ra->numTaken >= (size_t)ra->maxFiles) {
+            pthread_cond_wait(&ra->changed, &ra->lock);
+            continue;
+        }
+        ReadAheadFile* file = &ra->files[ra->numRead];
+        pthread_mutex_unlock(&ra->lock);
+
+        // The size is known before reading, so that the file waits for room
+        // in the budget instead of taking memory first
+        int fd = open(file->fileName, O_RDONLY);
+        struct stat s;
+        size_t size = (fd >= 0 && fstat(fd, &s) == 0) ? (size_t)s.st_size : 0;
+
+        pthread_mutex_lock(&ra->lock);
+        if (!reader_waitForRoom(ra, size)) {
+            if (fd >= 0) close(fd);
+            break;
+        }
+        ra->bufferedBytes += size;
+        pthread_mutex_unlock(&ra->lock);
+
+        size_t length = 0;
+        char* content = (fd >= 0) ? readFile(fd, size, &length) : NULL;
+        if (fd >= 0) close(fd);
+
+        pthread_mutex_lock(&ra->lock);
+        ra->bufferedBytes -= size;
+        file->content = content;
+        file->size = (content != NULL) ? length : 0;
+        ra->bufferedBytes += file->size;
+        ra->numRead++;
+        pthread_cond_broadcast(&ra->changed);
+    }
+    pthread_mutex_unlock(&ra->lock);
+    return NULL;
+}
+
+/// @brief Waits, with the lock held, until a file of the given size fits in
+/// the byte budget. A larger file is read once nothing else is buffered
+/// @return false when the read-ahead is stopping
+static bool reader_waitForRoom(ReadAhead* ra, size_t size)
+{
+    while (!ra->stopping && ra->bufferedBytes > 0 && ra->bufferedBytes + size > ra->maxBytes) {
+        pthread_cond_wait(&ra->changed, &ra->lock);
+    }
+    return !ra->stopping;
+}
+
+/// @param capacity Size of the file when it was opened
+/// @return NUL terminated content of the file, NULL if it can't be read
+static char* readFile(int fd, size_t capacity, size_t* length)
+{
+    char* buffer = malloc(capacity + 1);
+    if (buffer == NULL) return NULL;
+
+    *length = 0;
+    while (*length < capacity) {
+        ssize_t n = read(fd, buffer + *length, capacity - *length);
+        if (n < 0) {
+            free(buffer);
+            return NULL;
+        }
+        if (n == 0) break;
+        *length += (size_t)n;
+    }
+    buffer[*length] = '\0';
+    return buffer;
+}
@@ -0,0 +1,62 @@
+#ifndef READ_AHEAD_H
+#define READ_AHEAD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "arena.h"
+#include "errorHandler.h"
+#include "parser.h"
+
+typedef struct ReadAheadFile {
+    const char* fileName;
+    char* content;           // NUL terminated, NULL until read, once taken or
+                             // when it can't be read
+    size_t size;             // Bytes counted in the budget
+} ReadAheadFile;
+
+/// Reads the next .vm files of the input on a thread while the current one
+/// is parsed. Every file is read once, in order, and handed to the parser
+/// that opens it
+typedef struct ReadAhead {
+    ReadAheadFile* files;
+    size_t numFiles;
+    size_t numRead;          // Files read by the thread
+    size_t numTaken;         // Files handed to a parser
+    size_t bufferedBytes;    // Size of the files read and not taken yet
+    long maxFiles;           // Files read and not taken yet, at most
+    size_t maxBytes;         // Buffered bytes at most, unless a single file
+                             // is larger
+    bool stopping;
+    bool started;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t thread;
+} ReadAhead;
+
+/// @brief Starts reading the files ending in .vm of the given list in the
+/// background, keeping at most maxFiles of them, and maxBytes, in memory.
+/// Other files are left to their loader
+ErrorCode readAhead_start(ReadAhead* ra, char* const* fileNames, size_t numFiles,
+                          long maxFiles, size_t maxBytes);
+
+/// @brief Stops the thread and frees the files not taken. Does nothing if
+/// the read-ahead was never started
+void readAhead_stop(ReadAhead* ra);
+
+/// @brief Opens a parser on the given file. When it is the next file read
+/// ahead, the parser gets the content read by the thread, waiting for it if
+/// needed. Otherwise, and when the read-ahead is not started, the parser
+/// reads the file itself, into the given arena
+/// @param arena See parser_newInArena(). Files read ahead are not in it
+ErrorCode readAhead_openParser(ReadAhead* ra, Parser* p, const char* fileName, Arena* arena);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // READ_AHEAD_H
@@ -0,0 +1,448 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "errorHandler.h"
+#include "optimizer.h"
+#include "parser.h"
+#include "program.h"
+
+// Static frames are assembler variables, which share RAM[16..255] with the
+// static segments and the variables used by the generated code (retAddrVar
+// and the return address of outlined sequences)
+#define VARIABLE_RAM_WORDS      (240)
+#define CODE_WRITER_VARIABLES   (2)
+
+#define NO_SLOT                 (-1)
+
+/// Call graph in compressed rows: the callees of function f are
+/// callees[first[f]] to callees[first[f + 1] - 1]
+typedef struct CallGraph {
+    size_t* first;
+    size_t* callees;
+} CallGraph;
+
+/// Tarjan's strongly connected components. Components are completed callees
+/// first, members[] lists the functions of component c from
+/// members[componentStart[c]] to members[componentStart[c + 1] - 1]
+typedef struct Components {
+    size_t* index;
+    size_t* lowLink;
+    bool* onStack;
+    size_t* stack;
+    size_t stackSize;
+    size_t nextIndex;
+    size_t* members;
+    size_t numMembers;
+    size_t* componentStart;
+    size_t numComponents;
+} Components;
+
+typedef struct FrameLayout {
+    long nLocals;
+    long base;               // Lowest slot free of the frames of every caller
+    long slot;               // First slot of the static frame, NO_SLOT if the
+                             // locals stay on the stack
+    bool eligible;           // Locals only accessed within nLocals and a
+                             // single definition
+} FrameLayout;
+
+// Local function prototypes
+static ErrorCode buildCallGraph(const Program* prog, const FunctionTable* table, CallGraph* graph);
+static void findComponents(const CallGraph* graph, Components* comps, size_t func);
+static void checkEligibility(const Program* prog, const FunctionTable* table, FrameLayout* layouts);
+static void assignSlots(const CallGraph* graph, const Components* comps, FrameLayout* layouts,
+                        long budget);
+static ErrorCode staticFrames_rewrite(Program* prog, const FunctionTable* table,
+                                      const FrameLayout* layouts);
+static void staticFrames_report(const FunctionTable* table, const FrameLayout* layouts,
+                                FILE* report);
+static long countStaticVariables(const Program* prog);
+static bool isCall(const Command* cmd);
+static bool isLocalAccess(const Command* cmd);
+
+// ---------------------------- PUBLIC FUNCTIONS --------------------------- //
+ErrorCode staticFrames_optimize(Program* prog, FILE* report)
+{
+    // The frames of an object module would share their variables with the
+    // frames of the modules it is linked with
+    if (prog->external.everyFunction) {
+        return OK;
+    }
+
+    FunctionTable table;
+    ErrorCode err = program_buildFunctionTable(prog, &table);
+    if (err != OK) return err;
+
+    size_t n = table.numFuncs;
+    CallGraph graph = { 0 };
+    Components comps = { 0 };
+    FrameLayout* layouts = calloc(n + 1, sizeof(FrameLayout));
+    comps.index = calloc(n + 1, sizeof(size_t));
+    comps.lowLink = calloc(n + 1, sizeof(size_t));
+    comps.onStack = calloc(n + 1, sizeof(bool));
+    comps.stack = calloc(n + 1, sizeof(size_t));
+    comps.members = calloc(n + 1, sizeof(size_t));
+    comps.componentStart = calloc(n + 2, sizeof(size_t));
+    if (layouts == NULL || comps.index == NULL || comps.lowLink == NULL || comps.onStack == NULL ||
+        comps.stack == NULL || comps.members == NULL || comps.componentStart == NULL) {
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        err = ERR_PROG_OUT_OF_MEMORY;
+    }
+
+    if (err == OK) {
+        err = buildCallGraph(prog, &table, &graph);
+    }
+    if (err == OK) {
+        // Indices are stored plus one, so that 0 marks unvisited functions
+        for (size_t f = 0; f < n; f++) {
+            if (comps.index[f] == 0) {
+                findComponents(&graph, &comps, f);
+            }
+        }
+        comps.componentStart[comps.numComponents] = comps.numMembers;
+
+        checkEligibility(prog, &table, layouts);
+        long budget = VARIABLE_RAM_WORDS - CODE_WRITER_VARIABLES - countStaticVariables(prog) -
+                      prog->external.numStatics;
+        assignSlots(&graph, &comps, layouts, budget);
+        if (report != NULL) {
+            staticFrames_report(&table, layouts, report);
+        }
+        err = staticFrames_rewrite(prog, &table, layouts);
+    }
+
+    free(graph.first);
+    free(graph.callees);
+    free(comps.index);
+    free(comps.lowLink);
+    free(comps.onStack);
+    free(comps.stack);
+    free(comps.members);
+    free(comps.componentStart);
+    free(layouts);
+    functionTable_close(&table);
+    return err;
+}
+
+// -------------------------- PRIVATE FUNCTIONS ----------------------------- //
+/// @brief Builds the call graph, tail calls included. Code shared between
+/// functions by fall-through or jumps gets edges both ways, so that those
+/// functions end up in the same component and keep their locals on the stack.
+/// A call into a linked module may lead to any function the modules call, so
+/// the caller gets an edge to each of them
+static ErrorCode buildCallGraph(const Program* prog, const FunctionTable* table, CallGraph* graph)
+{
+    FunctionEdge* shared = NULL;
+    size_t numShared = 0;
+    ErrorCode err = program_findSharedCode(prog, table, &shared, &numShared);
+    if (err != OK) return err;
+
+    bool* callsOut = calloc(table->numFuncs + 1, sizeof(bool));
+    if (callsOut == NULL) {
+        free(shared);
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+    size_t numCallsOut = 0;
+    size_t numCalledIn = 0;
+    for (size_t f = 0; f < prog->numFiles; f++) {
+        size_t current = NO_FUNCTION;
+        for (size_t i = 0; i < prog->files[f].numCmds; i++) {
+            const Command* cmd = &prog->files[f].cmds[i];
+            if (cmd->type == CMD_FUNCTION) {
+                current = functionTable_indexOf(table, cmd->Arg1);
+            }
+            else if (isCall(cmd) && current != NO_FUNCTION && !callsOut[current] &&
+                     functionTable_indexOf(table, cmd->Arg1) == NO_FUNCTION) {
+                callsOut[current] = true;
+                numCallsOut++;
+            }
+        }
+    }
+    for (size_t f = 0; f < table->numFuncs; f++) {
+        if (program_isCalledExternally(prog, table->funcs[f].name)) numCalledIn++;
+    }
+
+    size_t numEdges = 2 * numShared + numCallsOut * numCalledIn;
+    for (size_t f = 0; f < prog->numFiles; f++) {
+        for (size_t i = 0; i < prog->files[f].numCmds; i++) {
+            if (isCall(&prog->files[f].cmds[i])) numEdges++;
+        }
+    }
+
+    graph->first = calloc(table->numFuncs + 1, sizeof(size_t));
+    graph->callees = malloc((numEdges + 1) * sizeof(size_t));
+    FunctionEdge* edges = malloc((numEdges + 1) * sizeof(FunctionEdge));
+    if (graph->first == NULL || graph->callees == NULL || edges == NULL) {
+        free(shared);
+        free(callsOut);
+        free(edges);
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+
+    numEdges = 0;
+    for (size_t e = 0; e < numShared; e++) {
+        edges[numEdges++] = shared[e];
+        edges[numEdges].from = shared[e].to;
+        edges[numEdges++].to = shared[e].from;
+    }
+    for (size_t f = 0; f < prog->numFiles; f++) {
+        size_t current = NO_FUNCTION;
+        for (size_t i = 0; i < prog->files[f].numCmds; i++) {
+            const Command* cmd = &prog->files[f].cmds[i];
+            if (cmd->type == CMD_FUNCTION) {
+                current = functionTable_indexOf(table, cmd->Arg1);
+            }
+            else if (isCall(cmd) && current != NO_FUNCTION) {
+                size_t callee = functionTable_indexOf(table, cmd->Arg1);
+                if (callee != NO_FUNCTION) {
+                    edges[numEdges].from = current;
+                    edges[numEdges++].to = callee;
+                }
+            }
+        }
+    }
+    for (size_t from = 0; from < table->numFuncs && numCalledIn > 0; from++) {
+        if (!callsOut[from]) continue;
+        for (size_t to = 0; to < table->numFuncs; to++) {
+            if (program_isCalledExternally(prog, table->funcs[to].name)) {
+                edges[numEdges].from = from;
+                edges[numEdges++].to = to;
+            }
+        }
+    }
+    free(callsOut);
+
+    // Counting sort of the edges by caller
+    for (size_t e = 0; e < numEdges; e++) {
+        graph->first[edges[e].from + 1]++;
+    }
+    for (size_t f = 0; f < table->numFuncs; f++) {
+        graph->first[f + 1] += graph->first[f];
+    }
+    size_t* fill = calloc(table->numFuncs + 1, sizeof(size_t));
+    if (fill == NULL) {
+        free(shared);
+        free(edges);
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+    for (size_t e = 0; e < numEdges; e++) {
+        size_t from = edges[e].from;
+        graph->callees[graph->first[from] + fill[from]++] = edges[e].to;
+    }
+
+    free(fill);
+    free(shared);
+    free(edges);
+    return OK;
+}
+
+static void findComponents(const CallGraph* graph, Components* comps, size_t func)
+{
+    comps->index[func] = ++comps->nextIndex;
+    comps->lowLink[func] = comps->index[func];
+    comps->stack[comps->stackSize++] = func;
+    comps->onStack[func] = true;
+
+    for (size_t e = graph->first[func]; e < graph->first[func + 1]; e++) {
+        size_t callee = graph->callees[e];
+        if (comps->index[callee] == 0) {
+            findComponents(graph, comps, callee);
+            if (comps->lowLink[callee] < comps->lowLink[func]) {
+                comps->lowLink[func] = comps->lowLink[callee];
+            }
+        }
+        else if (comps->onStack[callee] && comps->index[callee] < comps->lowLink[func]) {
+            comps->lowLink[func] = comps->index[callee];
+        }
+    }
+
+    if (comps->lowLink[func] == comps->index[func]) {
+        comps->componentStart[comps->numComponents++] = comps->numMembers;
+        size_t member;
+        do {
+            member = comps->stack[--comps->stackSize];
+            comps->onStack[member] = false;
+            comps->members[comps->numMembers++] = member;
+        } while (member != func);
+    }
+}
+
+/// @brief Functions defined twice, or accessing locals past the ones they
+/// declare, keep their locals on the stack
+static void checkEligibility(const Program* prog, const FunctionTable* table, FrameLayout* layouts)
+{
+    for (size_t f = 0; f < table->numFuncs; f++) {
+        size_t first = functionTable_indexOf(table, table->funcs[f].name);
+        if (first == f) {
+            layouts[f].nLocals = table->funcs[f].nLocals;
+            layouts[f].eligible = (layouts[f].nLocals > 0);
+        }
+        else {
+            layouts[first].eligible = false;
+        }
+    }
+
+    for (size_t f = 0; f < prog->numFiles; f++) {
+        size_t current = NO_FUNCTION;
+        for (size_t i = 0; i < prog->files[f].numCmds; i++) {
+            const Command* cmd = &prog->files[f].cmds[i];
+            if (cmd->type == CMD_FUNCTION) {
+                current = functionTable_indexOf(table, cmd->Arg1);
+            }
+            else if (current != NO_FUNCTION && isLocalAccess(cmd)) {
+                char* end = NULL;
+                long index = strtol(cmd->Arg2, &end, 10);
+                if (*end != '\0' || index < 0 || index >= layouts[current].nLocals) {
+                    layouts[current].eligible = false;
+                }
+            }
+        }
+    }
+}
+
+/// @brief Places the frame of every non-recursive function right above the
+/// highest frame of the functions that may be active when it is called.
+/// Functions never active at the same time share slots. Components are
+/// visited callers first, the reverse of the order they were completed in
+static void assignSlots(const CallGraph* graph, const Components* comps, FrameLayout* layouts,
+                        long budget)
+{
+    for (size_t c = comps->numComponents; c-- > 0;) {
+        size_t start = comps->componentStart[c];
+        size_t end = comps->componentStart[c + 1];
+
+        long base = 0;
+        bool recursive = (end - start > 1);
+        for (size_t m = start; m < end; m++) {
+            size_t func = comps->members[m];
+            if (layouts[func].base > base) base = layouts[func].base;
+            for (size_t e = graph->first[func]; e < graph->first[func + 1]; e++) {
+                if (graph->callees[e] == func) recursive = true;
+            }
+        }
+
+        for (size_t m = start; m < end; m++) {
+            size_t func = comps->members[m];
+            FrameLayout* layout = &layouts[func];
+            layout->base = base;
+            layout->slot = NO_SLOT;
+            long top = base;
+            if (!recursive && layout->eligible && base + layout->nLocals <= budget) {
+                layout->slot = base;
+                top = base + layout->nLocals;
+            }
+            for (size_t e = graph->first[func]; e < graph->first[func + 1]; e++) {
+                FrameLayout* callee = &layouts[graph->callees[e]];
+                if (callee->base < top) callee->base = top;
+            }
+        }
+    }
+}
+
+/// @brief Moves the locals of the functions given a slot to the frame
+/// segment. The function command no longer reserves them on the stack and
+/// is followed by a CMD_CLEAR_FRAME zeroing them instead
+static ErrorCode staticFrames_rewrite(Program* prog, const FunctionTable* table,
+                                      const FrameLayout* layouts)
+{
+    ErrorCode err = OK;
+    for (size_t f = 0; f < prog->numFiles && err == OK; f++) {
+        VmFile* file = &prog->files[f];
+        VmFile out = { 0 };
+        const FrameLayout* current = NULL;
+
+        for (size_t i = 0; i < file->numCmds && err == OK; i++) {
+            Command cmd = file->cmds[i];
+            if (cmd.type == CMD_FUNCTION) {
+                size_t func = functionTable_indexOf(table, cmd.Arg1);
+                current = (func != NO_FUNCTION && layouts[func].slot != NO_SLOT) ? &layouts[func] : NULL;
+                if (current != NULL) {
+                    strcpy(cmd.Arg2, "0");
+                    err = vmFile_append(&out, &cmd);
+                    Command clear = { .type = CMD_CLEAR_FRAME };
+                    snprintf(clear.Arg1, MAX_IDENTIFIER_LEN, "%ld", current->slot);
+                    snprintf(clear.Arg2, MAX_IDENTIFIER_LEN, "%ld", current->nLocals);
+                    if (err == OK) err = vmFile_append(&out, &clear);
+                    continue;
+                }
+            }
+            else if (current != NULL && isLocalAccess(&cmd)) {
+                strcpy(cmd.Arg1, "frame");
+                snprintf(cmd.Arg2, MAX_IDENTIFIER_LEN, "%ld", current->slot + atol(cmd.Arg2));
+            }
+            err = vmFile_append(&out, &cmd);
+        }
+
+        if (err == OK) {
+            vmFile_replaceCommands(file, &out);
+        }
+        free(out.cmds);
+    }
+    return err;
+}
+
+static void staticFrames_report(const FunctionTable* table, const FrameLayout* layouts,
+                                FILE* report)
+{
+    size_t numStatic = 0;
+    long words = 0;
+    for (size_t f = 0; f < table->numFuncs; f++) {
+        const FrameLayout* layout = &layouts[f];
+        if (layout->slot == NO_SLOT) continue;
+        fprintf(report, "Static frame of %s: %ld locals at slots %ld-%ld\n", table->funcs[f].name,
+                layout->nLocals, layout->slot, layout->slot + layout->nLocals - 1);
+        numStatic++;
+        if (layout->slot + layout->nLocals > words) words = layout->slot + layout->nLocals;
+    }
+    fprintf(report, "Static frames: %zu functions in %ld words\n", numStatic, words);
+}
+
+/// @return Number of distinct static variables, which the assembler places
+/// in the same RAM area as the static frames
+static long countStaticVariables(const Program* prog)
+{
+    long count = 0;
+    for (size_t f = 0; f < prog->numFiles; f++) {
+        const VmFile* file = &prog->files[f];
+        long maxIndex = -1;
+        for (size_t i = 0; i < file->numCmds; i++) {
+            const Command* cmd = &file->cmds[i];
+            if ((cmd->type == CMD_PUSH || cmd->type == CMD_POP) && strcmp(cmd->Arg1, "static") == 0 &&
+                atol(cmd->Arg2) > maxIndex) {
+                maxIndex = atol(cmd->Arg2);
+            }
+        }
+
+        bool* used = calloc(maxIndex + 2, sizeof(bool));
+        if (used == NULL) {
+            // Assume every index up to the largest one is used
+            count += maxIndex + 1;
+            continue;
+        }
+        for (size_t i = 0; i < file->numCmds; i++) {
+            const Command* cmd = &file->cmds[i];
+            if ((cmd->type == CMD_PUSH || cmd->type == CMD_POP) && strcmp(cmd->Arg1, "static") == 0 &&
+                atol(cmd->Arg2) >= 0 && !used[atol(cmd->Arg2)]) {
+                used[atol(cmd->Arg2)] = true;
+                count++;
+            }
+        }
+        free(used);
+    }
+    return count;
+}
+
+static bool isCall(const Command* cmd)
+{
+    return cmd->type == CMD_CALL || cmd->type == CMD_LIGHT_CALL ||
+           cmd->type == CMD_TAIL_CALL || cmd->type == CMD_TAIL_JUMP;
+}
+
+static bool isLocalAccess(const Command* cmd)
+{
+    return (cmd->type == CMD_PUSH || cmd->type == CMD_POP) && strcmp(cmd->Arg1, "local") == 0;
+}
@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "errorHandler.h"
+#include "optimizer.h"
+#include "parser.h"
+#include "program.h"
+
+// A CMD_TAIL_CALL pops every argument and steps each saved frame slot one
+// word at a time to its place, which costs more than the call and return it
+// replaces beyond this many pops and steps
+#define MAX_TAIL_CALL_MOVES     (5)
+
+// Local function prototypes
+static ErrorCode tailCalls_optimizeFile(VmFile* file, const FunctionTable* table);
+
+// ---------------------------- PUBLIC FUNCTIONS --------------------------- //
+ErrorCode tailCalls_optimize(Program* prog)
+{
+    FunctionTable table;
+    ErrorCode err = program_buildFunctionTable(prog, &table);
+    if (err != OK) return err;
+
+    for (size_t f = 0; f < prog->numFiles && err == OK; f++) {
+        err = tailCalls_optimizeFile(&prog->files[f], &table);
+    }
+
+    functionTable_close(&table);
+    return err;
+}
+
+// -------------------------- PRIVATE FUNCTIONS ----------------------------- //
+static ErrorCode tailCalls_optimizeFile(VmFile* file, const FunctionTable* table)
+{
+    ErrorCode err = OK;
+    VmFile out = { 0 };
+    const VmFunction* current = NULL;
+
+    for (size_t i = 0; i < file->numCmds && err == OK; i++) {
+        const Command* cmd = &file->cmds[i];
+        if (cmd->type == CMD_FUNCTION) {
+            current = functionTable_find(table, cmd->Arg1);
+        }
+
+        bool isTailCall = (cmd->type == CMD_CALL) && (i + 1 < file->numCmds) &&
+                          (file->cmds[i + 1].type == CMD_RETURN) && (current != NULL);
+        if (!isTailCall) {
+            err = vmFile_append(&out, cmd);
+            continue;
+        }
+
+        long nArgs = atol(cmd->Arg2);
+        if (current->nArgs == nArgs) {
+            // The callee takes as many arguments as the current function was
+            // given, so the frame stays where it is and only the argument
+            // values are replaced. The last argument is on top of the stack
+            for (long a = nArgs - 1; a >= 0 && err == OK; a--) {
+                Command pop = { .type = CMD_POP, .Arg1 = "argument" };
+                snprintf(pop.Arg2, MAX_IDENTIFIER_LEN, "%ld", a);
+                err = vmFile_append(&out, &pop);
+            }
+            Command jump = { .type = CMD_TAIL_JUMP };
+            strcpy(jump.Arg1, cmd->Arg1);
+            strcpy(jump.Arg2, cmd->Arg2);
+            if (err == OK) err = vmFile_append(&out, &jump);
+        }
+        else if (current->nArgs != ARITY_UNKNOWN &&
+                 nArgs + labs(nArgs - current->nArgs) <= MAX_TAIL_CALL_MOVES &&
+                 (nArgs < current->nArgs || nArgs - current->nArgs <= current->nLocals)) {
+            // The frame moves by a constant offset, see CMD_TAIL_CALL. A frame
+            // moving up further than the locals would land on the arguments
+            Command tailCall = *cmd;
+            tailCall.type = CMD_TAIL_CALL;
+            snprintf(tailCall.Arg2, MAX_IDENTIFIER_LEN, "%ld %ld", nArgs, current->nArgs);
+            err = vmFile_append(&out, &tailCall);
+        }
+        else {
+            // Moving the frame by an offset only known at run time, or by
+            // many steps, costs more than the call and return
+            err = vmFile_append(&out, cmd);
+            continue;
+        }
+        // The return is never reached anymore
+        i++;
+    }
+
+    if (err == OK) {
+        vmFile_replaceCommands(file, &out);
+    }
+    free(out.cmds);
+    return err;
+}
@@ -0,0 +1,147 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "errorHandler.h"
+#include "threadPool.h"
+
+/// Tasks not started yet of one thread. The owner takes them from the
+/// front and other threads steal them from the back
+typedef struct TaskQueue {
+    pthread_mutex_t lock;
+    size_t front;
+    size_t back;             // One past the last task
+} TaskQueue;
+
+typedef struct ThreadPool {
+    TaskQueue* queues;       // One per thread
+    size_t numThreads;
+    ThreadPoolTask task;
+    void* context;
+    pthread_mutex_t errorLock;
+    ErrorCode error;         // First error of a task
+} ThreadPool;
+
+typedef struct Worker {
+    ThreadPool* pool;
+    size_t index;            // Index of the queue of the thread
+} Worker;
+
+// Local function prototypes
+static void* worker_run(void* arg);
+static bool worker_nextTask(Worker* worker, size_t* task);
+static bool pool_failed(ThreadPool* pool);
+static void pool_setError(ThreadPool* pool, ErrorCode err);
+
+// ---------------------------- PUBLIC FUNCTIONS --------------------------- //
+ErrorCode threadPool_run(size_t numThreads, size_t numTasks, ThreadPoolTask task, void* context)
+{
+    if (numThreads > numTasks) numThreads = numTasks;
+    if (numThreads == 0) return OK;
+
+    ThreadPool pool = {
+        .queues = calloc(numThreads, sizeof(TaskQueue)),
+        .numThreads = numThreads,
+        .task = task,
+        .context = context,
+        .error = OK
+    };
+    Worker* workers = calloc(numThreads, sizeof(Worker));
+    pthread_t* threads = calloc(numThreads, sizeof(pthread_t));
+    bool* started = calloc(numThreads, sizeof(bool));
+    if (pool.queues == NULL || workers == NULL || threads == NULL || started == NULL) {
+        free(pool.queues);
+        free(workers);
+        free(threads);
+        free(started);
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+
+    pthread_mutex_init(&pool.errorLock, NULL);
+    for (size_t t = 0; t < numThreads; t++) {
+        pthread_mutex_init(&pool.queues[t].lock, NULL);
+        pool.queues[t].front = numTasks * t / numThreads;
+        pool.queues[t].back = numTasks * (t + 1) / numThreads;
+        workers[t].pool = &pool;
+        workers[t].index = t;
+    }
+
+    // The calling thread is worker 0. The tasks of a thread that could not
+    // be created are stolen by the others
+    for (size_t t = 1; t < numThreads; t++) {
+        started[t] = (pthread_create(&threads[t], NULL, worker_run, &workers[t]) == 0);
+    }
+    worker_run(&workers[0]);
+    for (size_t t = 1; t < numThreads; t++) {
+        if (started[t]) pthread_join(threads[t], NULL);
+    }
+
+    for (size_t t = 0; t < numThreads; t++) {
+        pthread_mutex_destroy(&pool.queues[t].lock);
+    }
+    pthread_mutex_destroy(&pool.errorLock);
+    free(started);
+    free(pool.queues);
+    free(workers);
+    free(threads);
+    return pool.error;
+}
+
+// -------------------------- PRIVATE FUNCTIONS ----------------------------- //
+static void* worker_run(void* arg)
+{
+    Worker* worker = arg;
+    ThreadPool* pool = worker->pool;
+    size_t task = 0;
+    while (!pool_failed(pool) && worker_nextTask(worker, &task)) {
+        ErrorCode err = pool->task(pool->context, task);
+        if (err != OK) {
+            pool_setError(pool, err);
+        }
+    }
+    return NULL;
+}
+
+/// @brief Takes the next task of the thread, or steals the last task of
+/// another thread, trying the following ones in turn
+/// @return false once every queue is empty. Tasks never add tasks, so the
+/// thread can stop then
+static bool worker_nextTask(Worker* worker, size_t* task)
+{
+    ThreadPool* pool = worker->pool;
+    TaskQueue* own = &pool->queues[worker->index];
+    pthread_mutex_lock(&own->lock);
+    bool found = (own->front < own->back);
+    if (found) {
+        *task = own->front++;
+    }
+    pthread_mutex_unlock(&own->lock);
+
+    for (size_t i = 1; i < pool->numThreads && !found; i++) {
+        TaskQueue* victim = &pool->queues[(worker->index + i) % pool->numThreads];
+        pthread_mutex_lock(&victim->lock);
+        found = (victim->front < victim->back);
+        if (found) {
+            *task = --victim->back;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return found;
+}
+
+static bool pool_failed(ThreadPool* pool)
+{
+    pthread_mutex_lock(&pool->errorLock);
+    bool failed = (pool->error != OK);
+    pthread_mutex_unlock(&pool->errorLock);
+    return failed;
+}
+
+static void pool_setError(ThreadPool* pool, ErrorCode err)
+{
+    pthread_mutex_lock(&pool->errorLock);
+    if (pool->error == OK) {
+        pool->error = err;
+    }
+    pthread_mutex_unlock(&pool->errorLock);
+}
@@ -0,0 +1,27 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include "errorHandler.h"
+
+/// @brief Runs one task of a thread pool
+/// @param context Pointer given to threadPool_run()
+/// @param task Index of the task, from 0 to numTasks - 1
+typedef ErrorCode (*ThreadPoolTask)(void* context, size_t task);
+
+/// @brief Runs tasks 0 to numTasks - 1 on numThreads threads, the calling
+/// thread included. Each thread starts with a contiguous share of the tasks
+/// and takes them in order; a thread left without tasks steals the last task
+/// of another thread. No new task is started once one has failed
+/// @return OK, or the error of the first task that failed
+ErrorCode threadPool_run(size_t numThreads, size_t numTasks, ThreadPoolTask task, void* context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // THREAD_POOL_H
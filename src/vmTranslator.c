@@ -0,0 +1,161 @@
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+#include "codeWriter.h"
+#include "errorHandler.h"
+#include "linker.h"
+#include "optimizer.h"
+#include "options.h"
+#include "parallel.h"
+#include "parser.h"
+#include "profile.h"
+#include "program.h"
+#include "vmTranslator.h"
+
+#define RETURN_ON_ERR(err)    ({ErrorCode e = err; if (e != OK) return (e);})
+
+// Local function prototypes
+static ErrorCode translateSources(CodeWriter* cw, Program* prog, Linker* linker,
+                                  const VmSource* sources, size_t numSources,
+                                  const Options* opts);
+static ErrorCode parseSource(Program* prog, const VmSource* source, const Options* opts,
+                             Arena* arena);
+static ErrorCode translateCommands(CodeWriter* cw, const Program* prog, const Options* opts);
+
+// ---------------------------- PUBLIC FUNCTIONS --------------------------- //
+ErrorCode vmTranslator_translate(const VmSource* sources, size_t numSources,
+                                 const Options* opts, char** output, size_t* outputSize)
+{
+    Options defaults;
+    if (opts == NULL) {
+        options_setDefaults(&defaults);
+        opts = &defaults;
+    }
+
+    // The memory stream updates these until the writer is closed
+    char* code = NULL;
+    size_t codeSize = 0;
+    CodeWriter cw;
+    Program prog;
+    Linker linker;
+    program_new(&prog);
+    linker_new(&linker);
+    ErrorCode err = codeWriter_newInMemory(&cw, &code, &codeSize, opts);
+    if (err == OK) {
+        err = translateSources(&cw, &prog, &linker, sources, numSources, opts);
+        codeWriter_close(&cw);
+    }
+    linker_close(&linker);
+    program_close(&prog);
+
+    if (err != OK) {
+        free(code);
+        code = NULL;
+        codeSize = 0;
+    }
+    *output = code;
+    *outputSize = codeSize;
+    return err;
+}
+
+ErrorCode vmTranslator_parseFile(Program* prog, Parser* p, const char* fileName,
+                                 const Options* opts)
+{
+    if (opts->jobs > 1) {
+        return parallel_parseFile(prog, fileName, p, opts->jobs);
+    }
+
+    RETURN_ON_ERR(program_addFile(prog, fileName));
+
+    while (parser_hasMoreCommands(p)) {
+        RETURN_ON_ERR(parser_advance(p));
+        if (p->currCmd.type != CMD_END) {
+            RETURN_ON_ERR(program_append(prog, &p->currCmd));
+        }
+    }
+    return OK;
+}
+
+ErrorCode vmTranslator_writeProgram(CodeWriter* cw, Program* prog, Linker* linker,
+                                    const Options* opts)
+{
+    // The binary form holds the parsed commands, so nothing is optimized
+    if (opts->emitBinary) {
+        return codeWriter_writeBytecode(cw, prog);
+    }
+
+    // The passes must leave alone what linked modules call, and with -c any
+    // function may be called by the modules the object is linked with
+    prog->external.everyFunction = opts->emitObject;
+    RETURN_ON_ERR(linker_exportUses(linker, prog));
+
+    // The profile counts the parsed program, which is what --profile-use
+    // finds the sites of the passes in
+    if (opts->profileGenerate != NULL) {
+        RETURN_ON_ERR(profile_generate(prog, opts->profileGenerate, opts->reportFile));
+    }
+    RETURN_ON_ERR(optimizer_run(prog, opts));
+
+    if (opts->emitObject) {
+        RETURN_ON_ERR(translateCommands(cw, prog, opts));
+        return codeWriter_writeObject(cw, prog);
+    }
+    RETURN_ON_ERR(codeWriter_writeStartupCode(cw));
+    RETURN_ON_ERR(translateCommands(cw, prog, opts));
+    RETURN_ON_ERR(codeWriter_writeModules(cw, linker, prog));
+    return codeWriter_finish(cw);
+}
+
+// -------------------------- PRIVATE FUNCTIONS ----------------------------- //
+static ErrorCode translateSources(CodeWriter* cw, Program* prog, Linker* linker,
+                                  const VmSource* sources, size_t numSources,
+                                  const Options* opts)
+{
+    Arena arena;
+    arena_new(&arena, DEFAULT_ARENA_BLOCK_SIZE);
+    ErrorCode err = OK;
+    for (size_t i = 0; i < numSources && err == OK; i++) {
+        err = parseSource(prog, &sources[i], opts, &arena);
+        arena_reset(&arena);
+    }
+    arena_close(&arena);
+    RETURN_ON_ERR(err);
+    return vmTranslator_writeProgram(cw, prog, linker, opts);
+}
+
+/// @brief The parser gets a NUL terminated copy of the text, in the arena
+static ErrorCode parseSource(Program* prog, const VmSource* source, const Options* opts,
+                             Arena* arena)
+{
+    char* content = arena_alloc(arena, source->length + 1);
+    if (content == NULL) {
+        logError(ERR_PROG_OUT_OF_MEMORY, NULL);
+        return ERR_PROG_OUT_OF_MEMORY;
+    }
+    memcpy(content, source->text, source->length);
+    content[source->length] = '\0';
+
+    Parser parser;
+    parser_newFromArena(&parser, content);
+    ErrorCode err = vmTranslator_parseFile(prog, &parser, source->name, opts);
+    parser_close(&parser);
+    return err;
+}
+
+static ErrorCode translateCommands(CodeWriter* cw, const Program* prog, const Options* opts)
+{
+    const Command endOfFile = { .type = CMD_END };
+    if (opts->jobs > 1) {
+        return parallel_translate(cw, prog, opts->jobs);
+    }
+
+    for (size_t f = 0; f < prog->numFiles; f++) {
+        const VmFile* file = &prog->files[f];
+        RETURN_ON_ERR(codeWriter_setCurrentFileName(cw, file->fileName));
+        for (size_t i = 0; i < file->numCmds; i++) {
+            RETURN_ON_ERR(codeWriter_translateCmd(cw, &file->cmds[i]));
+        }
+        RETURN_ON_ERR(codeWriter_translateCmd(cw, &endOfFile));
+    }
+    return OK;
+}
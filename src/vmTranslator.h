@@ -0,0 +1,50 @@
+#ifndef VM_TRANSLATOR_H
+#define VM_TRANSLATOR_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include "codeWriter.h"
+#include "errorHandler.h"
+#include "linker.h"
+#include "options.h"
+#include "parser.h"
+#include "program.h"
+
+/// VM code held in memory, translated like a .vm file of that name
+typedef struct VmSource {
+    const char* name;        // File name, such as "Main.vm", which names the
+                             // statics of the file
+    const char* text;        // Not NUL terminated
+    size_t length;
+} VmSource;
+
+/// @brief Translates the given sources, like a directory holding them in
+/// that order, into assembly in memory. Every state of the translation is
+/// owned by the call, so calls on different threads may run at once
+/// @param opts Code generation options, not changed. When NULL, the defaults
+/// are used. The input paths, -r and the read-ahead are ignored
+/// @param output Set to the code, NUL terminated, which the caller frees.
+/// NULL when the translation fails
+/// @param outputSize Set to the size of the code, without the NUL
+ErrorCode vmTranslator_translate(const VmSource* sources, size_t numSources,
+                                 const Options* opts, char** output, size_t* outputSize);
+
+/// @brief Parses the file opened by the given parser into the program, on
+/// several threads with -j. The parser is left open
+ErrorCode vmTranslator_parseFile(Program* prog, Parser* p, const char* fileName,
+                                 const Options* opts);
+
+/// @brief Writes the parsed program and the modules linked with it: the
+/// binary form with --emit-binary, the object module with -c, and the
+/// optimized assembly otherwise
+ErrorCode vmTranslator_writeProgram(CodeWriter* cw, Program* prog, Linker* linker,
+                                    const Options* opts);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // VM_TRANSLATOR_H
@@ -0,0 +1,136 @@
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include "bytecode.h"
+#include "errorHandler.h"
+#include "program.h"
+#include "testPrograms.h"
+
+static const char* mainVm =
+    "function Main.main 2\n"
+    "    push constant 32767\n"
+    "    pop local 1\n"
+    "    push argument 300\n"
+    "    push static 3\n"
+    "    sub\n"
+    "    neg\n"
+    "label Main.main$LOOP\n"
+    "    push local 1\n"
+    "    if-goto Main.main$LOOP\n"
+    "    goto Main.main$END\n"
+    "label Main.main$END\n"
+    "    call Math.twice 2\n"
+    "    pop that 0\n"
+    "    return\n";
+
+static const char* mathVm =
+    "function Math.twice 0\n"
+    "    push argument 0\n"
+    "    push argument 0\n"
+    "    add\n"
+    "    return\n";
+
+class BytecodeTests : public ::testing::Test
+{
+protected:
+    std::string fileName;
+    Program prog;
+
+    virtual void SetUp() {
+        char path[] = "/tmp/bytecode_test_XXXXXX";
+        int fd = mkstemp(path);
+        ASSERT_NE(fd, -1);
+        close(fd);
+        fileName = std::string(path) + ".vmb";
+        rename(path, fileName.c_str());
+        program_new(&prog);
+        ASSERT_EQ(addSource(&prog, "Main.vm", mainVm), OK);
+        ASSERT_EQ(addSource(&prog, "Math.vm", mathVm), OK);
+    }
+
+    virtual void TearDown() {
+        program_close(&prog);
+        remove(fileName.c_str());
+    }
+
+    std::vector<unsigned char> writeProgram() {
+        FILE* out = fopen(fileName.c_str(), "wb");
+        EXPECT_NE(out, nullptr);
+        EXPECT_EQ(bytecode_write(&prog, out), OK);
+        fclose(out);
+        return readFile();
+    }
+
+    std::vector<unsigned char> readFile() {
+        std::vector<unsigned char> bytes;
+        FILE* in = fopen(fileName.c_str(), "rb");
+        for (int c = fgetc(in); c != EOF; c = fgetc(in)) {
+            bytes.push_back((unsigned char)c);
+        }
+        fclose(in);
+        return bytes;
+    }
+
+    void replaceFile(const std::vector<unsigned char>& bytes, size_t size) {
+        FILE* out = fopen(fileName.c_str(), "wb");
+        fwrite(bytes.data(), 1, size, out);
+        fclose(out);
+    }
+};
+
+TEST_F(BytecodeTests, GivenWrittenProgramThenLoadingGivesTheSameCommands)
+{
+    writeProgram();
+    Program loaded;
+    program_new(&loaded);
+    ASSERT_EQ(bytecode_load(&loaded, fileName.c_str()), OK);
+    ASSERT_EQ(loaded.numFiles, prog.numFiles);
+    for (size_t f = 0; f < prog.numFiles; f++) {
+        EXPECT_STREQ(loaded.files[f].fileName, prog.files[f].fileName);
+        EXPECT_EQ(listCommands(&loaded.files[f]), listCommands(&prog.files[f]));
+    }
+    program_close(&loaded);
+}
+
+TEST_F(BytecodeTests, GivenTruncatedFileThenLoadingFails)
+{
+    std::vector<unsigned char> bytes = writeProgram();
+    std::vector<size_t> sizes = { bytes.size() - 1 };
+    for (size_t size = 0; size < bytes.size(); size += (size < 16) ? 1 : 7) {
+        sizes.push_back(size);
+    }
+    for (size_t size : sizes) {
+        replaceFile(bytes, size);
+        Program loaded;
+        program_new(&loaded);
+        EXPECT_NE(bytecode_load(&loaded, fileName.c_str()), OK) << "size " << size;
+        program_close(&loaded);
+    }
+}
+
+TEST_F(BytecodeTests, GivenCorruptHeaderThenLoadingFails)
+{
+    std::vector<unsigned char> bytes = writeProgram();
+
+    std::vector<unsigned char> badMagic = bytes;
+    badMagic[0] = 'X';
+    replaceFile(badMagic, badMagic.size());
+    Program loaded;
+    program_new(&loaded);
+    EXPECT_EQ(bytecode_load(&loaded, fileName.c_str()), ERR_BAD_BYTECODE_FILE);
+    program_close(&loaded);
+
+    // A huge string count, which must not be trusted for an allocation
+    std::vector<unsigned char> badCount(bytes.begin(), bytes.begin() + 5);
+    for (int i = 0; i < 9; i++) {
+        badCount.push_back(0xff);
+    }
+    badCount.push_back(0x01);
+    replaceFile(badCount, badCount.size());
+    program_new(&loaded);
+    EXPECT_NE(bytecode_load(&loaded, fileName.c_str()), OK);
+    program_close(&loaded);
+}
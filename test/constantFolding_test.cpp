@@ -0,0 +1,134 @@
+#include <gtest/gtest.h>
+#include <string>
+#include "errorHandler.h"
+#include "optimizer.h"
+#include "program.h"
+#include "testPrograms.h"
+
+/// @return The commands of the VM text after constant folding
+static std::string fold(const char* text)
+{
+    Program prog;
+    program_new(&prog);
+    EXPECT_EQ(addSource(&prog, "Main.vm", text), OK);
+    EXPECT_EQ(constantFolding_optimize(&prog), OK);
+    std::string cmds = listCommands(&prog.files[0]);
+    program_close(&prog);
+    return cmds;
+}
+
+TEST(ConstantFoldingTests, GivenConstantOperandsThenArithmeticIsFolded)
+{
+    EXPECT_EQ(fold("function Main.f 0\n"
+                   "    push constant 2\n"
+                   "    push constant 3\n"
+                   "    add\n"
+                   "    push constant 7\n"
+                   "    sub\n"
+                   "    neg\n"
+                   "    return\n"),
+              "function Main.f 0\n"
+              "push constant 2\n"
+              "return\n");
+}
+
+TEST(ConstantFoldingTests, GivenLabelBetweenOperandsThenNothingIsFolded)
+{
+    const char* text =
+        "function Main.f 0\n"
+        "    push constant 2\n"
+        "label Main.f$JOIN\n"
+        "    push constant 3\n"
+        "    add\n"
+        "    return\n";
+    EXPECT_EQ(fold(text),
+              "function Main.f 0\n"
+              "push constant 2\n"
+              "label Main.f$JOIN\n"
+              "push constant 3\n"
+              "add\n"
+              "return\n");
+}
+
+TEST(ConstantFoldingTests, GivenLabelAfterStoreThenTheStoredConstantIsForgotten)
+{
+    EXPECT_EQ(fold("function Main.f 1\n"
+                   "    push constant 7\n"
+                   "    pop local 0\n"
+                   "    push local 0\n"
+                   "label Main.f$LOOP\n"
+                   "    push local 0\n"
+                   "    return\n"),
+              "function Main.f 1\n"
+              "push constant 7\n"
+              "pop local 0\n"
+              "push constant 7\n"
+              "label Main.f$LOOP\n"
+              "push local 0\n"
+              "return\n");
+}
+
+TEST(ConstantFoldingTests, GivenIdentityOperandThenTheOperationIsDropped)
+{
+    for (const char* op : { "add", "sub", "or" }) {
+        std::string text = std::string("function Main.f 0\n"
+                                       "    push argument 0\n"
+                                       "    push constant 0\n    ") + op + "\n"
+                                       "    return\n";
+        EXPECT_EQ(fold(text.c_str()),
+                  "function Main.f 0\n"
+                  "push argument 0\n"
+                  "return\n") << op;
+    }
+
+    // -1 is pushed as a negated 1, which folds first
+    EXPECT_EQ(fold("function Main.f 0\n"
+                   "    push argument 0\n"
+                   "    push constant 1\n"
+                   "    neg\n"
+                   "    and\n"
+                   "    return\n"),
+              "function Main.f 0\n"
+              "push argument 0\n"
+              "return\n");
+
+    // Only the top of the stack is an identity, 0 - x is not x
+    EXPECT_EQ(fold("function Main.f 0\n"
+                   "    push constant 0\n"
+                   "    push argument 0\n"
+                   "    sub\n"
+                   "    return\n"),
+              "function Main.f 0\n"
+              "push constant 0\n"
+              "push argument 0\n"
+              "sub\n"
+              "return\n");
+}
+
+TEST(ConstantFoldingTests, GivenComparisonThenItFoldsToTheValuesOfTheTranslatedCode)
+{
+    // With x pushed first and y on top: eq gives y - x, which is 0 when
+    // they are equal, gt gives 1 when y - x <= 0 and lt when y - x > 0
+    struct Case { const char* x; const char* y; const char* op; const char* result; };
+    const Case cases[] = {
+        { "3", "3", "eq", "0" },
+        { "3", "5", "eq", "2" },
+        { "5", "3", "gt", "1" },
+        { "3", "5", "gt", "0" },
+        { "3", "3", "gt", "1" },
+        { "3", "5", "lt", "1" },
+        { "5", "3", "lt", "0" },
+        { "3", "3", "lt", "0" },
+    };
+    for (const Case& c : cases) {
+        std::string text = std::string("function Main.f 0\n") +
+                           "    push constant " + c.x + "\n" +
+                           "    push constant " + c.y + "\n" +
+                           "    " + c.op + "\n" +
+                           "    return\n";
+        EXPECT_EQ(fold(text.c_str()),
+                  std::string("function Main.f 0\n") +
+                  "push constant " + c.result + "\n" +
+                  "return\n") << c.x << " " << c.op << " " << c.y;
+    }
+}
@@ -0,0 +1,131 @@
+#include <gtest/gtest.h>
+#include <string>
+#include "errorHandler.h"
+#include "optimizer.h"
+#include "program.h"
+#include "testPrograms.h"
+
+/// @return The commands of the VM text after the control flow clean up
+static std::string cleanUp(const char* text)
+{
+    Program prog;
+    program_new(&prog);
+    EXPECT_EQ(addSource(&prog, "Main.vm", text), OK);
+    EXPECT_EQ(controlFlow_optimize(&prog, NULL), OK);
+    std::string cmds = listCommands(&prog.files[0]);
+    program_close(&prog);
+    return cmds;
+}
+
+TEST(ControlFlowTests, GivenJumpToGotoChainThenItJumpsToTheEndOfTheChain)
+{
+    EXPECT_EQ(cleanUp("function Main.f 0\n"
+                      "    push argument 0\n"
+                      "    if-goto A\n"
+                      "    push constant 1\n"
+                      "    return\n"
+                      "label A\n"
+                      "    goto B\n"
+                      "label C\n"
+                      "    push constant 2\n"
+                      "    return\n"
+                      "label B\n"
+                      "    goto C\n"),
+              "function Main.f 0\n"
+              "push argument 0\n"
+              "if-goto C\n"
+              "push constant 1\n"
+              "return\n"
+              "label C\n"
+              "push constant 2\n"
+              "return\n");
+}
+
+TEST(ControlFlowTests, GivenIfGotoOverGotoThenItBecomesOneInvertedBranch)
+{
+    EXPECT_EQ(cleanUp("function Main.f 0\n"
+                      "    push argument 0\n"
+                      "    if-goto X\n"
+                      "    goto Y\n"
+                      "label X\n"
+                      "    push constant 1\n"
+                      "    return\n"
+                      "label Y\n"
+                      "    push constant 2\n"
+                      "    return\n"),
+              "function Main.f 0\n"
+              "push argument 0\n"
+              "if-not Y\n"
+              "push constant 1\n"
+              "return\n"
+              "label Y\n"
+              "push constant 2\n"
+              "return\n");
+}
+
+TEST(ControlFlowTests, GivenWhileLoopThenTheConditionFollowsTheBody)
+{
+    EXPECT_EQ(cleanUp("function Main.f 1\n"
+                      "label WHILE\n"
+                      "    push local 0\n"
+                      "    push constant 10\n"
+                      "    lt\n"
+                      "    not\n"
+                      "    if-goto END\n"
+                      "    push local 0\n"
+                      "    push constant 1\n"
+                      "    add\n"
+                      "    pop local 0\n"
+                      "    goto WHILE\n"
+                      "label END\n"
+                      "    push local 0\n"
+                      "    return\n"),
+              "function Main.f 1\n"
+              "goto WHILE\n"
+              "label __LOOP_BODY_0\n"
+              "push local 0\n"
+              "push constant 1\n"
+              "add\n"
+              "pop local 0\n"
+              "label WHILE\n"
+              "push local 0\n"
+              "push constant 10\n"
+              "lt\n"
+              "not\n"
+              "if-not __LOOP_BODY_0\n"
+              "push local 0\n"
+              "return\n");
+}
+
+TEST(ControlFlowTests, GivenLabelTargetedFromAnotherFunctionThenItIsKept)
+{
+    const char* text =
+        "function Main.f 0\n"
+        "    push argument 0\n"
+        "    goto SHARED\n"
+        "label SHARED\n"
+        "    push constant 1\n"
+        "    return\n"
+        "function Main.g 0\n"
+        "    goto SHARED\n";
+    EXPECT_EQ(cleanUp(text),
+              "function Main.f 0\n"
+              "push argument 0\n"
+              "label SHARED\n"
+              "push constant 1\n"
+              "return\n"
+              "function Main.g 0\n"
+              "goto SHARED\n");
+
+    // Once nothing else jumps to it, the label goes with the goto
+    EXPECT_EQ(cleanUp("function Main.f 0\n"
+                      "    push argument 0\n"
+                      "    goto SHARED\n"
+                      "label SHARED\n"
+                      "    push constant 1\n"
+                      "    return\n"),
+              "function Main.f 0\n"
+              "push argument 0\n"
+              "push constant 1\n"
+              "return\n");
+}
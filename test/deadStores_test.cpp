@@ -0,0 +1,113 @@
+#include <gtest/gtest.h>
+#include <cstring>
+#include <string>
+#include "errorHandler.h"
+#include "optimizer.h"
+#include "program.h"
+#include "testPrograms.h"
+
+/// @return The commands of the VM text after dead store elimination
+static std::string removeDeadStores(const char* text)
+{
+    Program prog;
+    program_new(&prog);
+    EXPECT_EQ(addSource(&prog, "Main.vm", text), OK);
+    EXPECT_EQ(deadStores_optimize(&prog), OK);
+    std::string cmds = listCommands(&prog.files[0]);
+    program_close(&prog);
+    return cmds;
+}
+
+TEST(DeadStoresTests, GivenResultOfVoidCallPoppedToTempThenOnlyItsDiscardIsLeft)
+{
+    EXPECT_EQ(removeDeadStores("function Main.main 0\n"
+                               "    push constant 1\n"
+                               "    call Main.print 1\n"
+                               "    pop temp 0\n"
+                               "    push constant 0\n"
+                               "    return\n"
+                               "function Main.print 0\n"
+                               "    push constant 0\n"
+                               "    return\n"),
+              "function Main.main 0\n"
+              "push constant 1\n"
+              "call Main.print 1\n"
+              "discard 1\n"
+              "push constant 0\n"
+              "return\n"
+              "function Main.print 0\n"
+              "push constant 0\n"
+              "return\n");
+}
+
+TEST(DeadStoresTests, GivenTempEntryReadByCalleeThenItsStoreIsKept)
+{
+    std::string cmds = removeDeadStores("function Main.main 0\n"
+                                        "    push constant 5\n"
+                                        "    pop temp 1\n"
+                                        "    call Main.useTemp 0\n"
+                                        "    pop temp 0\n"
+                                        "    push constant 0\n"
+                                        "    return\n"
+                                        "function Main.useTemp 0\n"
+                                        "    push temp 1\n"
+                                        "    return\n");
+    EXPECT_NE(cmds.find("push constant 5\npop temp 1\ncall Main.useTemp 0\n"), std::string::npos)
+        << cmds;
+    EXPECT_EQ(cmds.find("pop temp 0"), std::string::npos) << cmds;
+}
+
+TEST(DeadStoresTests, GivenStoreReadAfterBranchBackThenItIsKept)
+{
+    const char* loop =
+        "function Main.loop 1\n"
+        "label Main.loop$TOP\n"
+        "    push local 0\n"
+        "    call Main.show 1\n"
+        "    pop temp 0\n"
+        "    push constant 1\n"
+        "    pop local 0\n"
+        "    push argument 0\n"
+        "    if-goto Main.loop$TOP\n"
+        "    push constant 0\n"
+        "    return\n"
+        "function Main.show 0\n"
+        "    push constant 0\n"
+        "    return\n";
+    std::string cmds = removeDeadStores(loop);
+    EXPECT_NE(cmds.find("push constant 1\npop local 0\n"), std::string::npos) << cmds;
+
+    // Branching forward instead, nothing reads the entry again
+    std::string forward = loop;
+    forward.replace(forward.find("if-goto Main.loop$TOP"), strlen("if-goto Main.loop$TOP"),
+                    "if-goto Main.loop$END\nlabel Main.loop$END");
+    cmds = removeDeadStores(forward.c_str());
+    EXPECT_EQ(cmds.find("pop local 0"), std::string::npos) << cmds;
+    EXPECT_EQ(cmds.find("push constant 1\n"), std::string::npos) << cmds;
+}
+
+TEST(DeadStoresTests, GivenDeadStoreOfComputedValueThenOnlyTheValueLeftOnTheStackIsDiscarded)
+{
+    EXPECT_EQ(removeDeadStores("function Main.main 1\n"
+                               "    push local 0\n"
+                               "    push constant 2\n"
+                               "    add\n"
+                               "    pop local 0\n"
+                               "    call Main.get 0\n"
+                               "    push constant 1\n"
+                               "    add\n"
+                               "    pop local 0\n"
+                               "    push constant 0\n"
+                               "    return\n"
+                               "function Main.get 0\n"
+                               "    push constant 3\n"
+                               "    return\n"),
+              "function Main.main 1\n"
+              "call Main.get 0\n"
+              "discard 1\n"
+              "push constant 0\n"
+              "return\n"
+              "function Main.get 0\n"
+              "push constant 3\n"
+              "return\n");
+}
@@ -0,0 +1,198 @@
+#include <gtest/gtest.h>
+#include <string>
+#include <utility>
+#include <vector>
+#include "errorHandler.h"
+#include "optimizer.h"
+#include "program.h"
+#include "testPrograms.h"
+
+typedef std::vector<std::pair<const char*, const char*>> Sources;
+
+/// @return The commands of every file after inlining, each file after its
+/// name in a comment
+static std::string inlineCalls(const Sources& sources, long limit)
+{
+    Program prog;
+    program_new(&prog);
+    for (const auto& source : sources) {
+        EXPECT_EQ(addSource(&prog, source.first, source.second), OK);
+    }
+    EXPECT_EQ(inliner_optimize(&prog, limit, NULL), OK);
+    std::string cmds;
+    for (size_t f = 0; f < prog.numFiles; f++) {
+        cmds += std::string("// ") + sources[f].first + "\n" + listCommands(&prog.files[f]);
+    }
+    program_close(&prog);
+    return cmds;
+}
+
+TEST(InlinerTests, GivenBodyUsingStaticsThenItIsOnlyInlinedInItsOwnFile)
+{
+    Sources sources = {
+        { "Lib.vm", "function Lib.next 0\n"
+                    "    push static 0\n"
+                    "    push constant 1\n"
+                    "    add\n"
+                    "    return\n"
+                    "function Lib.twice 0\n"
+                    "    call Lib.next 0\n"
+                    "    return\n" },
+        { "Main.vm", "function Main.main 0\n"
+                     "    call Lib.next 0\n"
+                     "    return\n" },
+    };
+    EXPECT_EQ(inlineCalls(sources, 10),
+              "// Lib.vm\n"
+              "function Lib.next 0\n"
+              "push static 0\n"
+              "push constant 1\n"
+              "add\n"
+              "return\n"
+              "function Lib.twice 0\n"
+              "push static 0\n"
+              "push constant 1\n"
+              "add\n"
+              "return\n"
+              "// Main.vm\n"
+              "function Main.main 0\n"
+              "call Lib.next 0\n"
+              "return\n");
+}
+
+TEST(InlinerTests, GivenBodyWritingThatThenItIsSavedAndRestoredAroundTheBody)
+{
+    Sources sources = {
+        { "Main.vm", "function Main.main 1\n"
+                     "    push constant 8000\n"
+                     "    call Main.get 1\n"
+                     "    return\n"
+                     "function Main.get 0\n"
+                     "    push argument 0\n"
+                     "    pop pointer 1\n"
+                     "    push that 0\n"
+                     "    return\n" },
+    };
+    // THAT goes to the first extra local, the argument to the next one. THIS
+    // is left alone
+    EXPECT_EQ(inlineCalls(sources, 10),
+              "// Main.vm\n"
+              "function Main.main 3\n"
+              "push constant 8000\n"
+              "push pointer 1\n"
+              "pop local 1\n"
+              "pop local 2\n"
+              "push local 2\n"
+              "pop pointer 1\n"
+              "push that 0\n"
+              "push local 1\n"
+              "pop pointer 1\n"
+              "return\n");
+}
+
+TEST(InlinerTests, GivenCalleeArgumentsAndLocalsThenTheyBecomeExtraLocalsOfTheCaller)
+{
+    const char* callee =
+        "function Main.mix 1\n"
+        "    push argument 0\n"
+        "    push argument 1\n"
+        "    sub\n"
+        "    pop local 0\n"
+        "    push local 0\n"
+        "    push local 0\n"
+        "    add\n"
+        "    return\n";
+    std::string main = std::string("function Main.main 2\n"
+                                   "    push constant 5\n"
+                                   "    push constant 3\n"
+                                   "    call Main.mix 2\n"
+                                   "    pop local 1\n"
+                                   "    push local 1\n"
+                                   "    return\n") + callee;
+    // The arguments follow the two locals of the caller and the local of the
+    // callee comes last, cleared as it is read
+    EXPECT_EQ(inlineCalls({ { "Main.vm", main.c_str() } }, 10),
+              "// Main.vm\n"
+              "function Main.main 5\n"
+              "push constant 5\n"
+              "push constant 3\n"
+              "pop local 3\n"
+              "pop local 2\n"
+              "push constant 0\n"
+              "pop local 4\n"
+              "push local 2\n"
+              "push local 3\n"
+              "sub\n"
+              "pop local 4\n"
+              "push local 4\n"
+              "push local 4\n"
+              "add\n"
+              "pop local 1\n"
+              "push local 1\n"
+              "return\n");
+
+    // A second site in the same function reuses the extra locals
+    std::string twice = std::string("function Main.main 0\n"
+                                    "    push constant 5\n"
+                                    "    push constant 3\n"
+                                    "    call Main.mix 2\n"
+                                    "    push constant 1\n"
+                                    "    call Main.mix 2\n"
+                                    "    return\n") + callee;
+    std::string cmds = inlineCalls({ { "Main.vm", twice.c_str() } }, 10);
+    EXPECT_EQ(cmds.find("// Main.vm\nfunction Main.main 3\n"), 0u) << cmds;
+    EXPECT_EQ(cmds.find("call"), std::string::npos) << cmds;
+}
+
+TEST(InlinerTests, GivenEveryCallSiteInlinedThenTheFunctionIsRemoved)
+{
+    Sources sources = {
+        { "Main.vm", "function Main.main 0\n"
+                     "    push constant 2\n"
+                     "    call Main.double 1\n"
+                     "    call Main.double 1\n"
+                     "    call Main.tooBig 1\n"
+                     "    return\n"
+                     "function Main.double 0\n"
+                     "    push argument 0\n"
+                     "    push argument 0\n"
+                     "    add\n"
+                     "    return\n"
+                     "function Main.tooBig 0\n"
+                     "    push argument 0\n"
+                     "    push argument 0\n"
+                     "    add\n"
+                     "    push argument 0\n"
+                     "    add\n"
+                     "    return\n" },
+    };
+    std::string cmds = inlineCalls(sources, 3);
+    EXPECT_EQ(cmds.find("Main.double"), std::string::npos) << cmds;
+    EXPECT_NE(cmds.find("call Main.tooBig 1\n"), std::string::npos) << cmds;
+    EXPECT_NE(cmds.find("function Main.tooBig 0\n"), std::string::npos) << cmds;
+
+    // Main.main has no call site at all and stays
+    EXPECT_NE(cmds.find("function Main.main 1\n"), std::string::npos) << cmds;
+}
+
+TEST(InlinerTests, GivenBodyAsLongAsTheLimitThenItIsInlined)
+{
+    // The body of Main.double is three commands, not counting the function
+    // and return commands
+    Sources sources = {
+        { "Main.vm", "function Main.main 0\n"
+                     "    push constant 2\n"
+                     "    call Main.double 1\n"
+                     "    return\n"
+                     "function Main.double 0\n"
+                     "    push argument 0\n"
+                     "    push argument 0\n"
+                     "    add\n"
+                     "    return\n" },
+    };
+    EXPECT_EQ(inlineCalls(sources, 3).find("call"), std::string::npos);
+
+    std::string cmds = inlineCalls(sources, 2);
+    EXPECT_NE(cmds.find("call Main.double 1\n"), std::string::npos) << cmds;
+    EXPECT_NE(cmds.find("function Main.double 0\n"), std::string::npos) << cmds;
+}
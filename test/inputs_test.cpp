@@ -0,0 +1,75 @@
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+#include "errorHandler.h"
+#include "inputs.h"
+
+// test/testFiles/tree holds .vm files at the top and in alpha, alpha/inner
+// and zeta, a directory without VM code (empty) and a symbolic link to
+// alpha (link)
+static const char* treeDir = "test/testFiles/tree";
+
+static std::vector<std::string> listPaths(char** paths, size_t count)
+{
+    return std::vector<std::string>(paths, paths + count);
+}
+
+TEST(InputsTests, GivenRecursiveScanThenProjectsAreInNameOrderDepthFirst)
+{
+    Inputs inputs;
+    inputs_new(&inputs);
+    ASSERT_EQ(inputs_add(&inputs, treeDir, true), OK);
+
+    std::vector<std::string> projects;
+    for (size_t i = 0; i < inputs.numProjects; i++) {
+        EXPECT_EQ(inputs.projects[i].type, FILE_DIR);
+        projects.push_back(inputs.projects[i].path);
+    }
+    std::vector<std::string> expected = {
+        "test/testFiles/tree",
+        "test/testFiles/tree/alpha",
+        "test/testFiles/tree/alpha/inner",
+        "test/testFiles/tree/zeta",
+    };
+    EXPECT_EQ(projects, expected);
+
+    ASSERT_EQ(inputs.numProjects, 4u);
+    std::vector<std::string> topFiles = {
+        "test/testFiles/tree/Array.vm",
+        "test/testFiles/tree/Main.vm",
+        "test/testFiles/tree/Sys.vm",
+    };
+    EXPECT_EQ(listPaths(inputs.projects[0].files, inputs.projects[0].numFiles), topFiles);
+    EXPECT_EQ(inputs.projects[0].numModules, 0u);
+
+    std::vector<std::string> alphaModules = { "test/testFiles/tree/alpha/Lib.vmo" };
+    EXPECT_EQ(listPaths(inputs.projects[1].modules, inputs.projects[1].numModules), alphaModules);
+    inputs_close(&inputs);
+}
+
+TEST(InputsTests, GivenRecursiveScanThenSymbolicLinksToDirectoriesAreNotFollowed)
+{
+    Inputs inputs;
+    inputs_new(&inputs);
+    ASSERT_EQ(inputs_add(&inputs, treeDir, true), OK);
+    for (size_t i = 0; i < inputs.numProjects; i++) {
+        std::string path = inputs.projects[i].path;
+        EXPECT_EQ(path.find("/link"), std::string::npos) << path;
+        EXPECT_EQ(path.find("/empty"), std::string::npos) << path;
+        for (size_t f = 0; f < inputs.projects[i].numFiles; f++) {
+            EXPECT_EQ(std::string(inputs.projects[i].files[f]).find("/link/"), std::string::npos);
+        }
+    }
+    inputs_close(&inputs);
+}
+
+TEST(InputsTests, GivenDirectoryWithoutRecursionThenItIsOneProject)
+{
+    Inputs inputs;
+    inputs_new(&inputs);
+    ASSERT_EQ(inputs_add(&inputs, treeDir, false), OK);
+    ASSERT_EQ(inputs.numProjects, 1u);
+    EXPECT_STREQ(inputs.projects[0].path, treeDir);
+    EXPECT_EQ(inputs.projects[0].numFiles, 3u);
+    inputs_close(&inputs);
+}
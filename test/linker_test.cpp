@@ -0,0 +1,170 @@
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <cstdlib>
+#include <set>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include "codeWriter.h"
+#include "errorHandler.h"
+#include "linker.h"
+#include "options.h"
+#include "program.h"
+#include "vmTranslator.h"
+#include "testPrograms.h"
+
+static const char* libVm =
+    "function Lib.used 0\n"
+    "    push argument 0\n"
+    "    push constant 1\n"
+    "    lt\n"
+    "    if-goto Lib.used$SMALL\n"
+    "    push argument 0\n"
+    "    call Main.helper 1\n"
+    "    call Lib.inner 1\n"
+    "    return\n"
+    "label Lib.used$SMALL\n"
+    "    push constant 0\n"
+    "    return\n"
+    "function Lib.inner 0\n"
+    "    push argument 0\n"
+    "    push constant 2\n"
+    "    gt\n"
+    "    return\n"
+    "function Lib.unused 0\n"
+    "    push constant 2\n"
+    "    push constant 3\n"
+    "    lt\n"
+    "    return\n";
+
+static const char* mainVm =
+    "function Sys.init 0\n"
+    "    push constant 5\n"
+    "    call Lib.used 1\n"
+    "    pop static 0\n"
+    "    push constant 1\n"
+    "    push constant 2\n"
+    "    lt\n"
+    "    pop static 1\n"
+    "    push constant 3\n"
+    "    call Main.helper 1\n"
+    "    pop static 2\n"
+    "    push constant 4\n"
+    "    call Main.other 1\n"
+    "    pop static 3\n"
+    "label Sys.init$HALT\n"
+    "    goto Sys.init$HALT\n"
+    "function Main.helper 0\n"
+    "    push argument 0\n"
+    "    push constant 1\n"
+    "    add\n"
+    "    return\n"
+    "function Main.other 0\n"
+    "    push argument 0\n"
+    "    push constant 2\n"
+    "    add\n"
+    "    return\n";
+
+class LinkerTests : public ::testing::Test
+{
+protected:
+    std::string dir;
+
+    virtual void SetUp() {
+        char path[] = "/tmp/linker_test_XXXXXX";
+        ASSERT_NE(mkdtemp(path), nullptr);
+        dir = path;
+    }
+
+    virtual void TearDown() {
+        remove((dir + "/Lib.vmo").c_str());
+        rmdir(dir.c_str());
+    }
+
+    /// Translates Lib.vm into <dir>/Lib.vmo
+    ErrorCode writeModule() {
+        Options opts;
+        options_setDefaults(&opts);
+        opts.emitObject = true;
+        Program prog;
+        program_new(&prog);
+        Linker linker;
+        linker_new(&linker);
+        CodeWriter cw;
+        ErrorCode err = addSource(&prog, "Lib.vm", libVm);
+        if (err == OK) err = codeWriter_new(&cw, (dir + "/Lib").c_str(), FILE_DIR, &opts);
+        if (err == OK) {
+            err = vmTranslator_writeProgram(&cw, &prog, &linker, &opts);
+            codeWriter_close(&cw);
+        }
+        linker_close(&linker);
+        program_close(&prog);
+        return err;
+    }
+
+    /// Translates Main.vm with -freduced-frames and links Lib.vmo after it
+    std::string link() {
+        Options opts;
+        options_setDefaults(&opts);
+        opts.reducedFrames = true;
+        Program prog;
+        program_new(&prog);
+        Linker linker;
+        linker_new(&linker);
+        CodeWriter cw;
+        char* code = NULL;
+        size_t codeSize = 0;
+        ErrorCode err = addSource(&prog, "Main.vm", mainVm);
+        if (err == OK) err = linker_addModule(&linker, (dir + "/Lib.vmo").c_str());
+        if (err == OK) err = codeWriter_newInMemory(&cw, &code, &codeSize, &opts);
+        if (err == OK) {
+            err = vmTranslator_writeProgram(&cw, &prog, &linker, &opts);
+            codeWriter_close(&cw);
+        }
+        linker_close(&linker);
+        program_close(&prog);
+        EXPECT_EQ(err, OK);
+        std::string asmCode = (code != NULL) ? std::string(code, codeSize) : std::string();
+        free(code);
+        return asmCode;
+    }
+};
+
+TEST_F(LinkerTests, GivenModuleThenOnlyFunctionsReachableFromSysInitAreLinked)
+{
+    ASSERT_EQ(writeModule(), OK);
+    std::string code = link();
+    EXPECT_NE(code.find("(Lib.used)"), std::string::npos);
+    EXPECT_NE(code.find("(Lib.inner)"), std::string::npos);
+    EXPECT_EQ(code.find("(Lib.unused)"), std::string::npos);
+}
+
+TEST_F(LinkerTests, GivenModuleWithGeneratedLabelsThenNoLabelIsDeclaredTwice)
+{
+    ASSERT_EQ(writeModule(), OK);
+    std::string code = link();
+    std::istringstream lines(code);
+    std::set<std::string> labels;
+    size_t numComparisonLabels = 0;
+    for (std::string line; std::getline(lines, line);) {
+        if (line.empty() || line[0] != '(') continue;
+        EXPECT_TRUE(labels.insert(line).second) << line << " declared twice";
+        if (line.find("__LT") != std::string::npos || line.find("__GT") != std::string::npos) {
+            numComparisonLabels++;
+        }
+    }
+    // The program and the module both number their comparison labels from 0
+    EXPECT_GE(numComparisonLabels, 4u);
+}
+
+TEST_F(LinkerTests, GivenFunctionsCalledByModuleThenTheyKeepTheFullFrame)
+{
+    ASSERT_EQ(writeModule(), OK);
+    std::string code = link();
+    EXPECT_NE(code.find("// call Lib.used 1\n"), std::string::npos);
+    EXPECT_NE(code.find("// call Main.helper 1\n"), std::string::npos);
+    EXPECT_EQ(code.find("// call Main.helper 1 (reduced frame)"), std::string::npos);
+
+    // Main.other is only called by the program, so it still gets a reduced frame
+    EXPECT_NE(code.find("// call Main.other 1 (reduced frame)"), std::string::npos);
+}
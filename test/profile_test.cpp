@@ -0,0 +1,115 @@
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <string>
+#include <unistd.h>
+#include "errorHandler.h"
+#include "profile.h"
+
+// 5022 function entries in all: Main.hot is hot, Main.warm is neither and
+// Main.cold and Main.never are cold
+static const char* wellFormed =
+    "# Profile of the test program\n"
+    "function Sys.init 1\n"
+    "function Main.hot 5000\n"
+    "function Main.warm 20\n"
+    "function Main.cold 1\n"
+    "function Main.never 0\n"
+    "\n"
+    "call Sys.init Main.hot 0 5000\n"
+    "call Main.hot Main.warm 1 20\n"
+    "   # indented comment\n"
+    "branch Main.hot Main.hot$LOOP 0 4999 1\n";
+
+class ProfileTests : public ::testing::Test
+{
+protected:
+    std::string fileName;
+    Profile profile;
+
+    virtual void SetUp() {
+        char path[] = "/tmp/profile_test_XXXXXX";
+        int fd = mkstemp(path);
+        ASSERT_NE(fd, -1);
+        close(fd);
+        fileName = path;
+        profile_new(&profile);
+    }
+
+    virtual void TearDown() {
+        profile_close(&profile);
+        remove(fileName.c_str());
+    }
+
+    ErrorCode load(const char* text) {
+        FILE* out = fopen(fileName.c_str(), "w");
+        EXPECT_NE(out, nullptr);
+        fputs(text, out);
+        fclose(out);
+        profile_close(&profile);
+        return profile_load(&profile, fileName.c_str());
+    }
+};
+
+TEST_F(ProfileTests, GivenWellFormedProfileThenCountsAreLoaded)
+{
+    ASSERT_EQ(load(wellFormed), OK);
+    EXPECT_EQ(profile.totalCalls, 5022u);
+
+    const ProfileEntry* entry = profile_find(&profile, "function", "Main.hot", NULL, 0);
+    ASSERT_NE(entry, nullptr);
+    EXPECT_EQ(entry->count, 5000u);
+
+    entry = profile_find(&profile, "call", "Main.hot", "Main.warm", 1);
+    ASSERT_NE(entry, nullptr);
+    EXPECT_EQ(entry->count, 20u);
+
+    entry = profile_find(&profile, "branch", "Main.hot", "Main.hot$LOOP", 0);
+    ASSERT_NE(entry, nullptr);
+    EXPECT_EQ(entry->count, 4999u);
+    EXPECT_EQ(entry->notTaken, 1u);
+}
+
+TEST_F(ProfileTests, GivenWellFormedProfileThenTemperaturesAreRelativeToEveryCall)
+{
+    ASSERT_EQ(load(wellFormed), OK);
+    EXPECT_EQ(profile_function(&profile, "Main.hot"), PROFILE_HOT);
+    EXPECT_EQ(profile_function(&profile, "Main.warm"), PROFILE_WARM);
+    EXPECT_EQ(profile_function(&profile, "Main.cold"), PROFILE_COLD);
+    EXPECT_EQ(profile_function(&profile, "Main.never"), PROFILE_COLD);
+    EXPECT_EQ(profile_callSite(&profile, "Sys.init", "Main.hot", 0), PROFILE_HOT);
+    EXPECT_EQ(profile_callSite(&profile, "Main.hot", "Main.warm", 1), PROFILE_WARM);
+}
+
+TEST_F(ProfileTests, GivenSitesMissingFromTheProfileThenTheyAreUnknown)
+{
+    ASSERT_EQ(load(wellFormed), OK);
+    EXPECT_EQ(profile_function(&profile, "Main.added"), PROFILE_UNKNOWN);
+    EXPECT_EQ(profile_callSite(&profile, "Main.hot", "Main.warm", 0), PROFILE_UNKNOWN);
+    EXPECT_EQ(profile_callSite(&profile, "Main.hot", "Main.added", 0), PROFILE_UNKNOWN);
+    EXPECT_EQ(profile_find(&profile, "branch", "Main.hot", "Main.hot$END", 0), nullptr);
+
+    // Without a profile every site is unknown
+    EXPECT_EQ(profile_find(NULL, "function", "Main.hot", NULL, 0), nullptr);
+    EXPECT_EQ(profile_function(NULL, "Main.hot"), PROFILE_UNKNOWN);
+}
+
+TEST_F(ProfileTests, GivenMalformedLineThenLoadingFails)
+{
+    const char* lines[] = {
+        "function Main.f\n",
+        "function Main.f -3\n",
+        "call Main.f Main.g first 3\n",
+        "branch Main.f Main.f$L 0 4\n",
+        "frequency Main.f 3\n",
+    };
+    for (const char* line : lines) {
+        std::string text = std::string("function Sys.init 1\n") + line;
+        EXPECT_EQ(load(text.c_str()), ERR_BAD_PROFILE_FILE) << line;
+    }
+}
+
+TEST_F(ProfileTests, GivenMissingFileThenLoadingFails)
+{
+    profile_close(&profile);
+    EXPECT_EQ(profile_load(&profile, "test/testFiles/missing.profile"), ERR_CANT_OPEN_INPUT_FILE);
+}
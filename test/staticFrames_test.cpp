@@ -0,0 +1,104 @@
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <cstdlib>
+#include <initializer_list>
+#include <string>
+#include "errorHandler.h"
+#include "optimizer.h"
+#include "program.h"
+#include "testPrograms.h"
+
+/// @return The report of the static frames given to the functions of the
+/// VM text
+/// @param cmds Returns the commands after the locals moved to their frames
+static std::string assignFrames(const char* text, std::string* cmds = nullptr)
+{
+    Program prog;
+    program_new(&prog);
+    EXPECT_EQ(addSource(&prog, "Main.vm", text), OK);
+
+    char* buffer = NULL;
+    size_t size = 0;
+    FILE* report = open_memstream(&buffer, &size);
+    EXPECT_EQ(staticFrames_optimize(&prog, report), OK);
+    fclose(report);
+    std::string printed = buffer;
+    free(buffer);
+
+    if (cmds != nullptr) *cmds = listCommands(&prog.files[0]);
+    program_close(&prog);
+    return printed;
+}
+
+/// @return VM text of a function with nLocals locals calling the callees,
+/// each with no arguments
+static std::string function(const char* name, int nLocals,
+                            std::initializer_list<const char*> callees = {})
+{
+    std::string text = std::string("function ") + name + " " + std::to_string(nLocals) + "\n";
+    for (const char* callee : callees) {
+        text += std::string("    call ") + callee + " 0\n    pop temp 0\n";
+    }
+    return text + "    push constant 0\n    return\n";
+}
+
+TEST(StaticFramesTests, GivenRecursiveFunctionsThenTheirLocalsStayOnTheStack)
+{
+    std::string text = function("Main.main", 1, { "Main.self", "Main.ping", "Main.x", "Main.leaf" }) +
+                       function("Main.self", 1, { "Main.self" }) +
+                       function("Main.ping", 1, { "Main.pong" }) +
+                       function("Main.pong", 1, { "Main.ping" }) +
+                       function("Main.x", 1, { "Main.y" }) +
+                       function("Main.y", 1, { "Main.z" }) +
+                       function("Main.z", 1, { "Main.x" }) +
+                       function("Main.leaf", 1);
+    EXPECT_EQ(assignFrames(text.c_str()),
+              "Static frame of Main.main: 1 locals at slots 0-0\n"
+              "Static frame of Main.leaf: 1 locals at slots 1-1\n"
+              "Static frames: 2 functions in 2 words\n");
+}
+
+TEST(StaticFramesTests, GivenSiblingCalleesThenTheyShareSlotsAboveTheCaller)
+{
+    std::string text = function("Main.main", 2, { "Main.a", "Main.b" }) +
+                       "function Main.a 3\n"
+                       "    push constant 7\n"
+                       "    pop local 2\n"
+                       "    push local 2\n"
+                       "    return\n" +
+                       function("Main.b", 2);
+    std::string cmds;
+    EXPECT_EQ(assignFrames(text.c_str(), &cmds),
+              "Static frame of Main.main: 2 locals at slots 0-1\n"
+              "Static frame of Main.a: 3 locals at slots 2-4\n"
+              "Static frame of Main.b: 2 locals at slots 2-3\n"
+              "Static frames: 3 functions in 5 words\n");
+    EXPECT_NE(cmds.find("function Main.a 0\n"
+                        "clear-frame 2 3\n"
+                        "push constant 7\n"
+                        "pop frame 4\n"
+                        "push frame 4\n"), std::string::npos) << cmds;
+}
+
+TEST(StaticFramesTests, GivenFramesPastTheRamBudgetThenTheirLocalsStayOnTheStack)
+{
+    // 238 words are left next to the variables of the generated code
+    std::string fits = function("Main.main", 100, { "Main.big" }) + function("Main.big", 138);
+    EXPECT_EQ(assignFrames(fits.c_str()),
+              "Static frame of Main.main: 100 locals at slots 0-99\n"
+              "Static frame of Main.big: 138 locals at slots 100-237\n"
+              "Static frames: 2 functions in 238 words\n");
+
+    std::string over = function("Main.main", 100, { "Main.big" }) + function("Main.big", 139);
+    EXPECT_EQ(assignFrames(over.c_str()),
+              "Static frame of Main.main: 100 locals at slots 0-99\n"
+              "Static frames: 1 functions in 100 words\n");
+
+    // Static variables take their words from the same area
+    std::string withStatic = fits + "function Main.count 0\n"
+                                    "    push static 0\n"
+                                    "    return\n";
+    EXPECT_EQ(assignFrames(withStatic.c_str()),
+              "Static frame of Main.main: 100 locals at slots 0-99\n"
+              "Static frames: 1 functions in 100 words\n");
+}
@@ -0,0 +1,48 @@
+#ifndef TEST_PROGRAMS_H
+#define TEST_PROGRAMS_H
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include "errorHandler.h"
+#include "options.h"
+#include "parser.h"
+#include "program.h"
+#include "vmTranslator.h"
+
+/// @brief Parses VM text into a new file of the program
+inline ErrorCode addSource(Program* prog, const char* fileName, const char* text)
+{
+    Options opts;
+    options_setDefaults(&opts);
+    Parser parser;
+    parser_newFromBuffer(&parser, strdup(text));
+    ErrorCode err = vmTranslator_parseFile(prog, &parser, fileName, &opts);
+    parser_close(&parser);
+    return err;
+}
+
+/// @return The commands of a file in VM syntax, one per line. The commands
+/// created by the passes get names of their own, such as "if-not"
+inline std::string listCommands(const VmFile* file)
+{
+    static const char* const names[CMD_MAX_COMMANDS] = {
+        "undefined", "", "push", "pop", "label", "goto", "if-goto", "function", "return",
+        "call", "tail-call", "tail-jump", "if-not", "intrinsic", "array-load", "array-store",
+        "light-call", "light-return", "clear-frame", "discard", "end"
+    };
+    std::string text;
+    for (size_t i = 0; i < file->numCmds; i++) {
+        const Command* cmd = &file->cmds[i];
+        std::string line = names[cmd->type];
+        for (const char* arg : { cmd->Arg1, cmd->Arg2 }) {
+            if (arg[0] != '\0') {
+                line += line.empty() ? arg : std::string(" ") + arg;
+            }
+        }
+        text += line + "\n";
+    }
+    return text;
+}
+
+#endif // TEST_PROGRAMS_H
@@ -0,0 +1,207 @@
+#include <gtest/gtest.h>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+#include "errorHandler.h"
+#include "options.h"
+#include "vmTranslator.h"
+
+static const char* mainVm =
+    "// Computes a few values with the helpers of Math.vm\n"
+    "function Main.main 2\n"
+    "    push constant 7\n"
+    "    pop static 0\n"
+    "    push constant 0\n"
+    "    pop local 0\n"
+    "label LOOP\n"
+    "    push local 0\n"
+    "    push constant 10\n"
+    "    lt\n"
+    "    not\n"
+    "    if-goto END\n"
+    "    push local 0\n"
+    "    push static 0\n"
+    "    call Math.twice 2\n"
+    "    pop local 1\n"
+    "    push local 0\n"
+    "    push constant 1\n"
+    "    add\n"
+    "    pop local 0\n"
+    "    goto LOOP\n"
+    "label END\n"
+    "    push local 1\n"
+    "    return\n";
+
+static const char* mathVm =
+    "function Math.twice 0\n"
+    "    push argument 0\n"
+    "    push argument 1\n"
+    "    gt\n"
+    "    if-goto BIGGER\n"
+    "    push argument 1\n"
+    "    push argument 1\n"
+    "    add\n"
+    "    return\n"
+    "label BIGGER\n"
+    "    push argument 0\n"
+    "    push static 0\n"
+    "    eq\n"
+    "    pop static 0\n"
+    "    push argument 0\n"
+    "    push argument 0\n"
+    "    add\n"
+    "    return\n";
+
+static const char* sysVm =
+    "function Sys.init 0\n"
+    "    call Main.main 0\n"
+    "    pop temp 0\n"
+    "label HALT\n"
+    "    goto HALT\n";
+
+static std::vector<VmSource> sources()
+{
+    return {
+        { "Main.vm", mainVm, strlen(mainVm) },
+        { "Math.vm", mathVm, strlen(mathVm) },
+        { "Sys.vm", sysVm, strlen(sysVm) }
+    };
+}
+
+static std::vector<Options> optionSets()
+{
+    std::vector<Options> sets(4);
+    for (Options& opts : sets) {
+        options_setDefaults(&opts);
+    }
+    sets[1].specializeSegmentOffsets = true;
+    sets[1].batchStackPointer = true;
+    sets[1].cacheTopOfStack = true;
+    sets[1].tailCalls = true;
+    sets[1].controlFlow = true;
+    sets[1].inlineFunctions = true;
+    sets[2].outline = true;
+    sets[2].costModel = COST_MODEL_SIZE;
+    sets[3].jobs = 2;
+
+    // Asked for, but printed nowhere without a report file
+    sets[1].stackReport = true;
+    sets[1].frameReport = true;
+    sets[1].passReport = true;
+    sets[2].outlineReport = true;
+    sets[3].stackReport = true;
+    return sets;
+}
+
+static std::string translate(const std::vector<VmSource>& vm, const Options* opts)
+{
+    char* output = NULL;
+    size_t outputSize = 0;
+    ErrorCode err = vmTranslator_translate(vm.data(), vm.size(), opts, &output, &outputSize);
+    EXPECT_EQ(err, OK);
+    std::string code = (output != NULL) ? std::string(output, outputSize) : std::string();
+    free(output);
+    return code;
+}
+
+TEST(TranslatorTests, GivenValidSourcesThenCodeIsWrittenIntoMemory)
+{
+    std::string code = translate(sources(), NULL);
+    EXPECT_NE(code.find("(Main.main)"), std::string::npos);
+    EXPECT_NE(code.find("@Main.0"), std::string::npos);
+    EXPECT_NE(code.find("@Math.0"), std::string::npos);
+}
+
+TEST(TranslatorTests, GivenInvalidSourceThenNoCodeIsReturned)
+{
+    ErrorCode err;
+    const char* text = "jump HOME\n";
+    VmSource source = { "Bad.vm", text, strlen(text) };
+    char* output = NULL;
+    size_t outputSize = 1;
+
+    err = vmTranslator_translate(&source, 1, NULL, &output, &outputSize);
+    EXPECT_NE(err, OK);
+    EXPECT_EQ(output, nullptr);
+    EXPECT_EQ(outputSize, 0u);
+}
+
+TEST(TranslatorTests, GivenConcurrentCallsThenEachGetsTheSameCodeAsAlone)
+{
+    const std::vector<VmSource> vm = sources();
+    const std::vector<Options> sets = optionSets();
+    testing::internal::CaptureStdout();
+    std::vector<std::string> expected;
+    for (const Options& opts : sets) {
+        expected.push_back(translate(vm, &opts));
+    }
+
+    const int numThreads = 8;
+    const int iterations = 25;
+    std::vector<int> mismatches(numThreads, 0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; t++) {
+        threads.emplace_back([&, t]() {
+            for (int i = 0; i < iterations; i++) {
+                size_t set = (t + i) % sets.size();
+                if (translate(vm, &sets[set]) != expected[set]) {
+                    mismatches[t]++;
+                }
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    // The library prints nothing unless it is given a file
+    EXPECT_EQ(testing::internal::GetCapturedStdout(), "");
+    for (int t = 0; t < numThreads; t++) {
+        EXPECT_EQ(mismatches[t], 0) << "thread " << t;
+    }
+}
+
+TEST(TranslatorTests, GivenManyFunctionsThenEveryNumberOfJobsGivesTheSameCode)
+{
+    // Large enough to be parsed in several chunks and translated in many
+    std::string text;
+    const int numFunctions = 400;
+    for (int f = 0; f < numFunctions; f++) {
+        std::string name = "Big.f" + std::to_string(f);
+        std::string next = "Big.f" + std::to_string((f + 1) % numFunctions);
+        text += "// Compares its argument with a static, then calls the next one\n"
+                "function " + name + " 1\n"
+                "    push argument 0\n"
+                "    push static " + std::to_string(f % 7) + "\n"
+                "    gt\n"
+                "    if-goto " + name + "$SKIP\n"
+                "    push argument 0\n"
+                "    push constant " + std::to_string(f) + "\n"
+                "    eq\n"
+                "    pop local 0\n"
+                "label " + name + "$SKIP\n"
+                "    push local 0\n"
+                "    push argument 0\n"
+                "    lt\n"
+                "    pop static " + std::to_string(f % 7) + "\n"
+                "    push argument 0\n"
+                "    push constant 1\n"
+                "    sub\n"
+                "    call " + next + " 1\n"
+                "    return\n";
+    }
+    std::vector<VmSource> vm = { { "Big.vm", text.c_str(), text.size() } };
+
+    for (OptLevel level : { OPT_LEVEL_0, OPT_LEVEL_2 }) {
+        Options single;
+        options_setDefaults(&single);
+        options_setLevel(&single, level);
+        single.jobs = 1;
+        Options parallel = single;
+        parallel.jobs = 4;
+
+        std::string expected = translate(vm, &single);
+        EXPECT_NE(expected.find("(Big.f399)"), std::string::npos);
+        EXPECT_TRUE(translate(vm, &parallel) == expected) << "level " << level;
+    }
+}